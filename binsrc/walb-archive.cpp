@@ -15,6 +15,7 @@
 #include "walb_util.hpp"
 #include "archive.hpp"
 #include "version.hpp"
+#include "aio_util.hpp"
 
 /* These should be defined in the parameter header. */
 const uint16_t DEFAULT_LISTEN_PORT = 5000;
@@ -30,6 +31,7 @@ struct Option
     std::string logFileStr;
     std::string discardTypeStr;
     bool isDebug;
+    std::string aioBackendStr;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -54,9 +56,14 @@ struct Option
         opt.appendBoolOpt(&a.doAutoResize, "autoresize", ": resize base image automatically if necessary");
         opt.appendBoolOpt(&a.keepOneColdSnapshot, "keep-one-cold-snap", ": keep just one cold snapshot per volume.");
         opt.appendOpt(&a.maxOpenDiffs, DEFAULT_MAX_OPEN_DIFFS, "maxopen", "NUM : max number of wdiff files to open together.");
+        opt.appendOpt(&a.maxMergeThreads, DEFAULT_MAX_MERGE_THREADS, "merge-threads", "NUM : max number of threads to apply/merge wdiffs.");
+        opt.appendOpt(&a.mergePrefetchThreads, DEFAULT_MERGE_PREFETCH_THREADS, "merge-prefetch", "NUM : number of threads to read ahead wdiffs to apply/merge for each merge thread (0: disabled).");
+        opt.appendOpt(&a.maxMergeMemoryMb, DEFAULT_MAX_MERGE_MEMORY_MB, "merge-mem", "SIZE_MB : memory budget to apply/merge wdiffs. IOs over it are spilled to temporary files. Prefetched packs and cached indexed diffs are not counted (default: 0, unlimited).");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&a.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
+        opt.appendOpt(&aioBackendStr, DEFAULT_AIO_BACKEND_STR, "aio"
+                      , "BACKEND : aio backend to read/write devices: auto/libaio/io_uring.");
         util::setKeepAliveOptions(opt, a.keepAliveParams);
 
         opt.appendHelp("h");
@@ -70,8 +77,10 @@ struct Option
         util::verifyNotZero(a.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(a.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(a.fsyncIntervalSize, "fsyncIntervalSize");
+        util::verifyNotZero(a.maxMergeThreads, "maxMergeThreads");
         a.discardType = parseDiscardType(discardTypeStr, __func__);
         a.keepAliveParams.verify();
+        cybozu::aio::setDefaultBackend(cybozu::aio::strToBackend(aioBackendStr));
     }
 };
 
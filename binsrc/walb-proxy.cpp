@@ -29,6 +29,7 @@ struct Option
     std::string logFileStr;
     bool isDebug;
     bool isStopped;
+    std::string wlogCmprAcceptStr;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -45,10 +46,18 @@ struct Option
         opt.appendOpt(&p.maxBackgroundTasks, DEFAULT_MAX_BACKGROUND_TASKS, "bg", "NUM : num of max concurrent background tasks.");
         opt.appendOpt(&p.maxWdiffSendMb, DEFAULT_MAX_WDIFF_SEND_MB, "wd", "SIZE : max size of wdiff files to send [MiB].");
         opt.appendOpt(&p.maxWdiffSendNr, DEFAULT_MAX_WDIFF_SEND_NR, "wn", "NUM : max number of wdiff files to send.");
+        opt.appendOpt(&p.wdiffCacheMb, DEFAULT_WDIFF_CACHE_MB, "wdiff-cache", "SIZE : max size of wdiff files to merge into a file kept for retries of wdiff-transfer [MiB] (0: disabled).");
+        opt.appendOpt(&p.wdiffCompactNr, DEFAULT_WDIFF_COMPACT_NR, "wdiff-compact", "NUM : pre-merge wdiff files in idle time if an archive has this number of them or more (0: disabled).");
         opt.appendOpt(&p.delaySecForRetry, DEFAULT_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : waiting time for next retry [sec].");
         opt.appendOpt(&p.retryTimeout, DEFAULT_RETRY_TIMEOUT_SEC, "rto", "PERIOD : retry timeout (total period) [sec].");
         opt.appendOpt(&p.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory");
         opt.appendOpt(&p.maxConversionMb, DEFAULT_MAX_CONVERSION_MB, "wl", "SIZE : max memory size of wlog-wdiff conversion [MiB].");
+        opt.appendOpt(&p.maxDedupNr, DEFAULT_MAX_DEDUP_NR, "dedup", "NUM : num of recent 4KiB blocks to deduplicate in each wdiff kept in the proxy (0: disabled). It saves disk space of the proxy and archives and network bandwidth from storages with wlog-offload. wdiffs are sent to archives as deduplicated indexed wdiffs instead of sorted ones compressed with the archive compression option, and they are expanded for archives of old versions.");
+        opt.appendOpt(&p.wlogConvThreads, DEFAULT_WLOG_CONV_THREADS, "wlog-conv-threads", "NUM : num of threads for each of decompression and compression in wlog-wdiff conversion (0: no pipelining).");
+        opt.appendOpt(&p.zstdDictKb, DEFAULT_ZSTD_DICT_KB, "zstd-dict", "SIZE : size of per-volume zstd dictionary for wdiff-transfer [KiB] (0: disabled).");
+        opt.appendOpt(&p.zstdDictRetrainSec, DEFAULT_ZSTD_DICT_RETRAIN_SEC, "zstd-dict-retrain", "PERIOD : interval to retrain zstd dictionaries [sec].");
+        opt.appendOpt(&wlogCmprAcceptStr, DEFAULT_WLOG_CMPR_ACCEPT_STR, "wlog-cmpr"
+                      , "TYPE,TYPE,... : compression types to accept for wlog-transfer. snappy is used for the others.");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&p.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&p.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : Socket timeout [sec].");
@@ -69,7 +78,17 @@ struct Option
         util::verifyNotZero(p.maxWdiffSendMb, "maxWdiffSendMb");
         util::verifyNotZero(p.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(p.maxConversionMb, "maxConversionMb");
+        if (p.zstdDictKb * KIBI > MAX_ZSTD_DICT_SIZE) {
+            throw cybozu::Exception("too large zstdDictKb") << p.zstdDictKb;
+        }
         p.keepAliveParams.verify();
+        for (const std::string &typeStr : cybozu::util::splitString(wlogCmprAcceptStr, ",")) {
+            const int type = parseCompressionType(typeStr);
+            if (type == ::WALB_DIFF_CMPR_AUTO) {
+                throw cybozu::Exception("auto is not supported for wlog-transfer");
+            }
+            p.wlogCmprTypeV.push_back(type);
+        }
     }
 };
 
@@ -18,6 +18,7 @@
 #include "fileio_serializer.hpp"
 #include "storage.hpp"
 #include "version.hpp"
+#include "aio_util.hpp"
 
 /* These should be defined in the parameter header. */
 const uint16_t DEFAULT_LISTEN_PORT = 5000;
@@ -33,7 +34,9 @@ struct Option
     std::string archiveDStr;
     std::string multiProxyDStr;
     bool isDebug;
+    std::string aioBackendStr;
     uint64_t defaultFullScanBytesPerSec;
+    std::string wlogCmprStr;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -49,10 +52,30 @@ struct Option
         opt.appendOpt(&s.maxConnections, DEFAULT_MAX_CONNECTIONS, "maxconn", "NUM : num of max connections.");
         opt.appendOpt(&s.maxForegroundTasks, DEFAULT_MAX_FOREGROUND_TASKS, "fg", "NUM : num of max concurrent foregroud tasks.");
         opt.appendOpt(&s.maxBackgroundTasks, DEFAULT_MAX_BACKGROUND_TASKS, "bg", "NUM : num of max concurrent background tasks.");
+        opt.appendOpt(&s.reservedBackgroundTasks, DEFAULT_RESERVED_BACKGROUND_TASKS, "bg-reserved"
+                      , "NUM : num of extra background tasks only for volumes at risk of log overflow.");
+        opt.appendOpt(&s.overflowRiskSec, DEFAULT_OVERFLOW_RISK_SEC, "overflow-risk"
+                      , "PERIOD : volumes predicted to overflow in this period are at risk [sec].");
         opt.appendOpt(&s.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory (full path)");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&s.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&s.maxWlogSendMb, DEFAULT_MAX_WLOG_SEND_MB, "wl", "SIZE : max wlog size to send at once [MiB].");
+        opt.appendOpt(&s.wlogCmprThreads, DEFAULT_WLOG_CMPR_THREADS, "wlcmpr"
+                      , "NUM : num of threads to compress wlogs to send. 0 means no extra thread.");
+        opt.appendOpt(&wlogCmprStr, DEFAULT_WLOG_CMPR_STR, "wlog-cmpr"
+                      , "TYPE:LEVEL : compression type and level to request for wlog-transfer.");
+        opt.appendOpt(&s.wlogBatchKb, DEFAULT_WLOG_BATCH_KB, "wlog-batch"
+                      , "SIZE : size of frames to batch IOs in wlog-transfer [KiB]. 0 means a frame per IO.");
+        opt.appendOpt(&s.maxWlogChunks, DEFAULT_MAX_WLOG_CHUNKS, "wlog-chunks"
+                      , "NUM : max number of wlog ranges sent in a wlog-transfer. Each range is sent without waiting for the ack of the previous one. 1 means no pipelining.");
+        opt.appendOpt(&s.wlogCoalesceMb, DEFAULT_WLOG_COALESCE_MB, "wlog-coalesce"
+                      , "SIZE : window to drop IOs overwritten later in the same window before wlog-transfer [MiB]. 0 means disabled.");
+        opt.appendBoolOpt(&s.isWlogOffload, "wlog-offload"
+                          , ": convert wlogs to wdiffs on this server instead of proxies in wlog-transfer.");
+        opt.appendOpt(&s.readAheadMb, DEFAULT_READ_AHEAD_MB, "read-ahead"
+                      , "SIZE : max read-ahead size to read wlogs and volumes [MiB].");
+        opt.appendOpt(&s.readAheadIoKb, DEFAULT_READ_AHEAD_IO_KB, "read-ahead-io"
+                      , "SIZE : max IO size to read wlogs and volumes [KiB]. It must be a multiple of 4.");
         opt.appendOpt(&s.implicitSnapshotIntervalSec, DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC, "snapintvl"
                       , "PERIOD : implicit snapshot interval [sec].");
         opt.appendOpt(&s.delaySecForRetry, DEFAULT_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : waiting time for next retry [sec].");
@@ -62,6 +85,8 @@ struct Option
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&s.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
+        opt.appendOpt(&aioBackendStr, DEFAULT_AIO_BACKEND_STR, "aio"
+                      , "BACKEND : aio backend to read/write devices: auto/libaio/io_uring.");
         util::setKeepAliveOptions(opt, s.keepAliveParams);
 
         opt.appendHelp("h");
@@ -74,11 +99,35 @@ struct Option
         util::verifyNotZero(s.maxBackgroundTasks, "maxBackgroundTasks");
         util::verifyNotZero(s.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(s.maxWlogSendMb, "maxWlogSendMb");
+        util::verifyNotZero(s.maxWlogChunks, "maxWlogChunks");
         util::verifyNotZero(s.implicitSnapshotIntervalSec, "implicitSnapshotIntervalSec");
         util::verifyNotZero(s.tsDeltaGetterIntervalSec, "tsDeltaGetterIntervalSec");
+        if (s.wlogBatchKb > MAX_WLOG_BATCH_KB) {
+            throw cybozu::Exception("too large wlogBatchKb") << s.wlogBatchKb;
+        }
+        util::verifyNotZero(s.readAheadMb, "readAheadMb");
+        util::verifyNotZero(s.readAheadIoKb, "readAheadIoKb");
+        if (s.readAheadIoKb % 4 != 0 || s.readAheadIoKb * KIBI > s.readAheadMb * MEBI) {
+            throw cybozu::Exception("bad readAheadIoKb") << s.readAheadIoKb << s.readAheadMb;
+        }
         s.keepAliveParams.verify();
+        cybozu::aio::setDefaultBackend(cybozu::aio::strToBackend(aioBackendStr));
+        parseWlogCmpr(s);
         s.fullScanLbPerSec = defaultFullScanBytesPerSec / LOGICAL_BLOCK_SIZE;
     }
+    void parseWlogCmpr(StorageSingleton &s) const {
+        const StrVec v = cybozu::util::splitString(wlogCmprStr, ":");
+        if (v.size() != 2) {
+            throw cybozu::Exception("bad wlog-cmpr") << wlogCmprStr;
+        }
+        const int type = parseCompressionType(v[0]);
+        const int level = cybozu::atoi(v[1]);
+        if (type == ::WALB_DIFF_CMPR_AUTO || level < 0 || level > 9) {
+            throw cybozu::Exception("bad wlog-cmpr") << wlogCmprStr;
+        }
+        s.wlogCmprType = type;
+        s.wlogCmprLevel = level;
+    }
 };
 
 struct StorageThreads {
@@ -99,7 +148,8 @@ struct StorageThreads {
             }
         }
 
-        g.dispatcher.reset(new DispatchTask<std::string, StorageWorker>(g.taskQueue, g.maxBackgroundTasks));
+        g.dispatcher.reset(new DispatchTask<std::string, StorageWorker>(
+                             g.taskQueue, g.maxBackgroundTasks, g.reservedBackgroundTasks));
         g.wdevMonitor.reset(new std::thread(wdevMonitorWorker));
         g.proxyMonitor.reset(new std::thread(proxyMonitorWorker));
         g.tsDeltaGetter.reset(new std::thread(tsDeltaGetterWorker));
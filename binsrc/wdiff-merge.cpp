@@ -9,6 +9,7 @@
 #include "util.hpp"
 #include "walb_diff_merge.hpp"
 #include "host_info.hpp"
+#include "file_path.hpp"
 
 using namespace walb;
 
@@ -18,6 +19,9 @@ struct Option : public cybozu::Option
     std::vector<std::string> inputWdiffs;
     std::string outputWdiff, cmprStr;
     bool doStat;
+    size_t threads;
+    size_t prefetch;
+    size_t memMb;
     CompressOpt cmpr;
 
     Option() {
@@ -27,6 +31,10 @@ struct Option : public cybozu::Option
         appendOpt(&outputWdiff, "-", "o", "WDIFF_PATH: output wdiff path (default: stdout).");
         appendBoolOpt(&doStat, "stat", ": put statistics.");
         appendOpt(&cmprStr, "snappy:0:1", "cmpr", "type:level:concurrency : compression for output (default: snappy:0:1)");
+        appendOpt(&threads, 1, "threads", "NUM : split address space into NUM shards and merge them in parallel (default: 1)."
+                  " concurrency of -cmpr is not used when NUM > 1.");
+        appendOpt(&prefetch, 0, "prefetch", "NUM : number of threads to read input wdiffs ahead for each shard (default: 0, disabled).");
+        appendOpt(&memMb, 0, "mem", "SIZE_MB : memory budget. IOs over it are spilled to temporary files (default: 0, unlimited).");
         appendHelp("h", ": put this message.");
     }
     uint32_t maxIoBlocks() const {
@@ -44,6 +52,10 @@ struct Option : public cybozu::Option
             goto error;
         }
         cmpr.parse(cmprStr);
+        if (threads == 0) {
+            ::fprintf(::stderr, "threads must not be 0.\n");
+            goto error;
+        }
         return true;
       error:
         usage();
@@ -51,22 +63,67 @@ struct Option : public cybozu::Option
     }
 };
 
+/**
+ * Temporary files of shards and spilled IOs will be put in the same directory as the output.
+ */
+std::string getTmpDir(const Option &opt)
+{
+    if (opt.outputWdiff == "-") {
+        const char *dir = ::getenv("TMPDIR");
+        return dir ? dir : "/tmp";
+    }
+    cybozu::FilePath dir = cybozu::FilePath(opt.outputWdiff).parent();
+    return dir.str().empty() ? "." : dir.str();
+}
+
+void openOutput(const Option &opt, cybozu::util::File &file)
+{
+    if (opt.outputWdiff == "-") {
+        file.setFd(1);
+    } else {
+        file.open(opt.outputWdiff, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+}
+
+void mergeInShards(const Option &opt)
+{
+    ShardedDiffMerger merger;
+    merger.addWdiffs(opt.inputWdiffs);
+    cybozu::util::File file;
+    openOutput(opt, file);
+    merger.setMaxIoBlocks(opt.maxIoBlocks());
+    merger.setShouldValidateUuid(false);
+    merger.setPrefetch(opt.prefetch);
+    merger.setMemoryBudget(opt.memMb * MEBI, getTmpDir(opt));
+    merger.prepare(opt.threads);
+    merger.mergeToFd(file.fd(), opt.cmpr, getTmpDir(opt));
+    file.close();
+    if (opt.doStat) {
+        std::cerr << "mergeIn  " << merger.statIn() << std::endl
+                  << "mergeOut " << merger.statOut() << std::endl
+                  << "mergeShards " << merger.getShardNr() << std::endl
+                  << "mergeMemUsage " << merger.memUsageStr() << std::endl;
+    }
+}
+
 int doMain(int argc, char *argv[])
 {
     Option opt;
     if (!opt.parse(argc, argv)) return 1;
+    if (opt.threads > 1) {
+        mergeInShards(opt);
+        return 0;
+    }
     DiffMerger merger;
     for (std::string &path : opt.inputWdiffs) {
         merger.addWdiff(path);
     }
     cybozu::util::File file;
-    if (opt.outputWdiff == "-") {
-        file.setFd(1);
-    } else {
-        file.open(opt.outputWdiff, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    }
+    openOutput(opt, file);
     merger.setMaxIoBlocks(opt.maxIoBlocks());
     merger.setShouldValidateUuid(false);
+    merger.setPrefetch(opt.prefetch);
+    merger.setMemoryBudget(opt.memMb * MEBI, getTmpDir(opt));
 #if 0
     merger.mergeToFd(file.fd());
 #else
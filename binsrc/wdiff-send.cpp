@@ -108,12 +108,13 @@ private:
 
 void runDummyProxy(const Option &opt)
 {
-    // connect.
+    // connect and 1st negotiation.
     cybozu::Socket sock;
-    util::connectWithTimeout(sock, cybozu::SocketAddr(opt.addr, opt.port), opt.timeoutSec);
-
-    // 1st negotiation.
-    const std::string serverId = protocol::run1stNegotiateAsClient(sock, opt.nodeId, wdiffTransferPN);
+    uint32_t version;
+    const std::string serverId = protocol::run1stNegotiateAsClient(
+        sock, [&](cybozu::Socket &s) {
+            util::connectWithTimeout(s, cybozu::SocketAddr(opt.addr, opt.port), opt.timeoutSec);
+        }, opt.nodeId, wdiffTransferPN, version);
     packet::Packet pkt(sock);
     ProtocolLogger logger(opt.nodeId, serverId);
 
@@ -137,6 +138,10 @@ void runDummyProxy(const Option &opt)
 
     // transfer diff data if necessary.
     if (res != msgAccept) return;
+    // The wdiff file may refer to a dictionary stored beside it.
+    std::string dirStr = cybozu::FilePath(opt.wdiffPath).dirName();
+    if (dirStr.empty()) dirStr = ".";
+    loadZstdDicts(dirStr);
     DiffMerger merger;
     merger.addWdiffs({opt.wdiffPath});
     merger.prepare();
@@ -144,7 +149,7 @@ void runDummyProxy(const Option &opt)
     std::atomic<int> stopState(NotStopping);
     ProcessStatus ps;
     DiffStatistics statOut;
-    if (!wdiffTransferClient(pkt, merger, cmpr, stopState, ps, statOut)) {
+    if (!wdiffTransferClient(pkt, version, merger, cmpr, stopState, ps, statOut)) {
         throw cybozu::Exception(__func__) << "wdiffTransferClient failed";
     }
     packet::Ack(sock).recv();
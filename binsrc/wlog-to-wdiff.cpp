@@ -11,6 +11,7 @@ using namespace walb;
 struct Option
 {
     uint32_t maxIoSize;
+    size_t dedupNr;
     bool isDebug, isIndexed;
     std::string input, output;
 
@@ -22,6 +23,7 @@ struct Option
         opt.appendOpt(&maxIoSize, DEFAULT_MAX_IO_LB * LBS
                       , "x", ": max IO size in the output wdiff (0 means unlimited) [byte].");
         opt.appendBoolOpt(&isIndexed, "indexed", ": use indexed format instead of sorted format.");
+        opt.appendOpt(&dedupNr, 0, "dedup", ": number of recent 4KiB blocks to deduplicate (0 means disabled). Only for indexed format.");
         opt.appendBoolOpt(&isDebug, "debug", ": put debug messages.");
         opt.appendHelp("h");
         if (!opt.parse(argc, argv)) {
@@ -44,9 +46,8 @@ void setupFile(cybozu::util::File &file, const std::string &path, bool isRead)
 
 
 template <typename Converter>
-void convert(const Option &opt)
+void convert(Converter &c, const Option &opt)
 {
-    Converter c;
     cybozu::util::File inFile, outFile;
     setupFile(inFile, opt.input, true);
     setupFile(outFile, opt.output, false);
@@ -61,9 +62,12 @@ int doMain(int argc, char *argv[])
     Option opt(argc, argv);
     util::setLogSetting("-", opt.isDebug);
     if (opt.isIndexed) {
-        convert<IndexedDiffConverter>(opt);
+        IndexedDiffConverter c;
+        c.setDedup(opt.dedupNr);
+        convert(c, opt);
     } else {
-        convert<DiffConverter>(opt);
+        DiffConverter c;
+        convert(c, opt);
     }
     return 0;
 }
@@ -20,6 +20,7 @@
 #include <cstdio>
 #include <cassert>
 #include <memory>
+#include <atomic>
 
 #include <unistd.h>
 #include <time.h>
@@ -35,10 +36,55 @@
 #include "util.hpp"
 #include "fileio.hpp"
 #include "memory_buffer.hpp"
+#include "io_uring_util.hpp"
 
 namespace cybozu {
 namespace aio {
 
+enum class Backend
+{
+    AUTO, /* io_uring if available, otherwise libaio. */
+    LIBAIO,
+    IO_URING,
+};
+
+inline std::atomic<int>& defaultBackendRef()
+{
+    static std::atomic<int> backend(static_cast<int>(Backend::AUTO));
+    return backend;
+}
+
+/**
+ * Process-wide backend used by Aio instances created after the call.
+ */
+inline void setDefaultBackend(Backend backend)
+{
+    defaultBackendRef().store(static_cast<int>(backend));
+}
+
+inline Backend getDefaultBackend()
+{
+    return static_cast<Backend>(defaultBackendRef().load());
+}
+
+inline const char *backendToStr(Backend backend)
+{
+    switch (backend) {
+    case Backend::AUTO: return "auto";
+    case Backend::LIBAIO: return "libaio";
+    case Backend::IO_URING: return "io_uring";
+    }
+    return "unknown";
+}
+
+inline Backend strToBackend(const std::string &str)
+{
+    for (Backend backend : {Backend::AUTO, Backend::LIBAIO, Backend::IO_URING}) {
+        if (str == backendToStr(backend)) return backend;
+    }
+    throw RT_ERR("bad aio backend: %s", str.c_str());
+}
+
 /**
  * Asynchronous IO wrapper.
  *
@@ -51,6 +97,12 @@ namespace aio {
  *
  * Do not use prepareFlush().
  * Currently aio flush is not supported by Linux kernel.
+ * (io_uring supports it.)
+ *
+ * The backend is io_uring or libaio.
+ * With io_uring, the file is registered as a fixed file and
+ * a buffer given by registerBuffer() is used as a fixed buffer.
+ * Cancel of submitted IOs is not supported with io_uring.
  *
  * Thrown EofError and LibcError in waitFor()/waitOne()/wait(),
  * you can use the Aio instance continuously,
@@ -95,6 +147,7 @@ private:
     const int fd_;
     const size_t queueSize_;
     io_context_t ctx_;
+    std::unique_ptr<IoUring> uring_; /* nullptr when libaio is used. */
 
     /*
      * submitQ_ contains prepared but not submitted IOs.
@@ -131,10 +184,13 @@ public:
      *   to work it really asynchronously.
      * @queueSize queue size for aio.
      * @isMeasureTime true if you want to measure IO begein/end time.
+     * @backend AUTO falls back to libaio if io_uring is not available.
      */
-    Aio(int fd, size_t queueSize)
+    Aio(int fd, size_t queueSize, Backend backend = getDefaultBackend())
         : fd_(fd)
         , queueSize_(std::min(MAX_AIO_REQ_NR(), queueSize))
+        , ctx_()
+        , uring_()
         , submitQ_()
         , pendingIOs_()
         , completedIOs_()
@@ -145,6 +201,14 @@ public:
         , key_(1) {
         assert(fd_ >= 0);
         assert(queueSize > 0);
+        if (backend != Backend::LIBAIO) {
+            try {
+                uring_.reset(new IoUring(fd_, queueSize_));
+                return;
+            } catch (std::exception &) {
+                if (backend == Backend::IO_URING) throw;
+            }
+        }
         const int err = ::io_queue_init(queueSize_, &ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_init failed.", -err);
@@ -156,6 +220,11 @@ public:
     }
     void release() {
         if (isReleased_) return;
+        if (uring_) {
+            uring_.reset();
+            isReleased_ = true;
+            return;
+        }
         int err = ::io_queue_release(ctx_);
         if (err < 0) {
             throwLibcErrorWithNo("Aio: io_queue_release failed.", -err);
@@ -172,6 +241,18 @@ public:
     size_t queueSize() const {
         return queueSize_;
     }
+    Backend backend() const {
+        return uring_ ? Backend::IO_URING : Backend::LIBAIO;
+    }
+    /**
+     * Register a buffer that will be used for IOs of this instance.
+     * It must live longer than the instance.
+     * RETURN:
+     *   true if registered. Only io_uring backend supports it.
+     */
+    bool registerBuffer(void *data, size_t size) {
+        return uring_ && uring_->registerBuffer(data, size);
+    }
     size_t queueUsage() const {
         return submitQ_.size() + pendingIOs_.size();
     }
@@ -239,7 +320,11 @@ public:
         for (size_t i = 0; i < nr; i++) {
             AioDataPtr iop = std::move(submitQ_.front());
             submitQ_.pop_front();
-            iocbs_[i] = &iop->iocb;
+            if (uring_) {
+                prepareUring(*iop);
+            } else {
+                iocbs_[i] = &iop->iocb;
+            }
             iop->beginTime = beginTime;
             const uint key = iop->key;
             assert(pendingIOs_.find(key) == pendingIOs_.end());
@@ -247,6 +332,10 @@ public:
         }
         assert(submitQ_.empty());
 
+        if (uring_) {
+            uring_->submit();
+            return;
+        }
         size_t done = 0;
         while (done < nr) {
             int err = ::io_submit(ctx_, nr - done, &iocbs_[done]);
@@ -281,6 +370,7 @@ public:
         {
             Umap::iterator it = pendingIOs_.find(key);
             if (it != pendingIOs_.end()) {
+                if (uring_) return false;
                 AioDataPtr& iop = it->second;
                 if (::io_cancel(ctx_, &iop->iocb, &ioEvents_[0]) == 0) {
                     pendingIOs_.erase(it);
@@ -361,7 +451,7 @@ public:
             } else if (iop->err < 0) {
                 isLibcError = true;
             }
-            assert(iop->iocb.u.c.nbytes == static_cast<uint>(iop->err));
+            assert(iop->err <= 0 || iop->size == static_cast<size_t>(iop->err));
             queue.push(iop->key);
             nr--;
         }
@@ -416,6 +506,7 @@ private:
      */
     size_t wait_(size_t minNr) {
         assert(minNr <= queueSize_);
+        if (uring_) return waitUring(minNr);
         const int nr = ::io_getevents(ctx_, minNr, queueSize_, &ioEvents_[0], NULL);
         if (nr < 0) {
             throwLibcErrorWithNo("Aio: io_getevents failed.", -nr);
@@ -438,6 +529,34 @@ private:
         }
         return nr;
     }
+    void prepareUring(const AioData &io) {
+        switch (io.type) {
+        case IOTYPE_READ:
+            uring_->prepRead(io.key, io.oft, io.size, io.buf);
+            break;
+        case IOTYPE_WRITE:
+            uring_->prepWrite(io.key, io.oft, io.size, io.buf);
+            break;
+        case IOTYPE_FLUSH:
+            uring_->prepFdsync(io.key);
+            break;
+        }
+    }
+    size_t waitUring(size_t minNr) {
+        uring_->wait(minNr);
+        double endTime = 0;
+        if (isMeasureTime_) endTime = util::getTime();
+        return uring_->reap([&](uint64_t userData, int res) {
+                const uint key = static_cast<uint>(userData);
+                Umap::iterator it = pendingIOs_.find(key);
+                assert(it != pendingIOs_.end());
+                AioDataPtr& iop = it->second;
+                iop->endTime = endTime;
+                iop->err = res;
+                completedIOs_.emplace(key, std::move(iop));
+                pendingIOs_.erase(it);
+            });
+    }
     static uint getKeyFromEvent(struct io_event &event) {
         struct iocb &iocb = *static_cast<struct iocb *>(event.obj);
         return static_cast<uint>(reinterpret_cast<uintptr_t>(iocb.data));
@@ -481,13 +600,14 @@ private:
         }
     }
     void verifyNoError(const AioData& io) const {
+        if (io.type == IOTYPE_FLUSH && io.err == 0) return;
         if (io.err == 0) {
             throw util::EofError();
         }
         if (io.err < 0) {
             throwLibcErrorWithNo("Aio: io failed.", -io.err);
         }
-        assert(io.iocb.u.c.nbytes == static_cast<uint>(io.err));
+        assert(io.size == static_cast<size_t>(io.err));
     }
 };
 
@@ -0,0 +1,302 @@
+#pragma once
+/**
+ * @file
+ * @brief Minimal io_uring wrapper using raw system calls.
+ *
+ * liburing is not required.
+ */
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "util.hpp"
+
+namespace cybozu {
+namespace aio {
+
+/**
+ * A ring for one file descriptor.
+ * The file is registered as a fixed file if possible.
+ * A memory area can be registered as a fixed buffer,
+ * then IOs inside it use READ_FIXED/WRITE_FIXED.
+ *
+ * (1) call prepXXX() up to sqSpace() times.
+ * (2) call submit().
+ * (3) call wait() and reap().
+ *
+ * This is not thread-safe.
+ */
+class IoUring
+{
+    int ringFd_;
+    const int fd_;
+    bool isFixedFile_;
+
+    void *sqPtr_;
+    size_t sqMapSize_;
+    void *cqPtr_;
+    size_t cqMapSize_;
+    struct io_uring_sqe *sqes_;
+    size_t sqesMapSize_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned *sqArray_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    /* SQEs filled but not passed to the kernel yet. */
+    unsigned sqLocalTail_;
+    /* iovec for each SQE slot. The kernel copies it at submission. */
+    std::vector<struct iovec> iovV_;
+
+    const char *bufBegin_;
+    const char *bufEnd_;
+
+public:
+    /**
+     * @fd opened file descriptor.
+     * @entries minimum number of submission queue entries.
+     *
+     * EXCEPTION:
+     *   LibcError if io_uring is not available.
+     */
+    IoUring(int fd, size_t entries)
+        : ringFd_(-1), fd_(fd), isFixedFile_(false)
+        , sqPtr_(MAP_FAILED), sqMapSize_(0)
+        , cqPtr_(MAP_FAILED), cqMapSize_(0)
+        , sqes_(nullptr), sqesMapSize_(0)
+        , sqHead_(nullptr), sqTail_(nullptr), sqMask_(0), sqEntries_(0), sqArray_(nullptr)
+        , cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr)
+        , sqLocalTail_(0), iovV_()
+        , bufBegin_(nullptr), bufEnd_(nullptr) {
+        assert(fd >= 0);
+        assert(entries > 0);
+        struct io_uring_params p;
+        ::memset(&p, 0, sizeof(p));
+        ringFd_ = sysSetup(entries, &p);
+        if (ringFd_ < 0) {
+            throwLibcErrorWithNo("IoUring: io_uring_setup failed.", errno);
+        }
+        try {
+            if ((p.features & IORING_FEAT_SUBMIT_STABLE) == 0) {
+                throwLibcErrorWithNo("IoUring: too old kernel.", ENOSYS);
+            }
+            mapRings(p);
+        } catch (...) {
+            release();
+            throw;
+        }
+        isFixedFile_ = sysRegister(IORING_REGISTER_FILES, &fd_, 1) == 0;
+    }
+    ~IoUring() noexcept {
+        release();
+    }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    /**
+     * Register a memory area as a fixed buffer.
+     * Only one area can be registered.
+     * RETURN:
+     *   false if the kernel refused it (e.g. RLIMIT_MEMLOCK).
+     *   IOs still work without fixed buffers.
+     */
+    bool registerBuffer(void *data, size_t size) {
+        if (bufBegin_ != nullptr) return false;
+        struct iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = size;
+        if (sysRegister(IORING_REGISTER_BUFFERS, &iov, 1) != 0) return false;
+        bufBegin_ = static_cast<const char *>(data);
+        bufEnd_ = bufBegin_ + size;
+        return true;
+    }
+    bool isFixedFile() const { return isFixedFile_; }
+    bool hasFixedBuffer() const { return bufBegin_ != nullptr; }
+    size_t sqSpace() const {
+        const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        return sqEntries_ - (sqLocalTail_ - head);
+    }
+    void prepRead(uint64_t userData, off_t oft, size_t size, char *buf) {
+        prepRw(IORING_OP_READ_FIXED, IORING_OP_READV, userData, oft, size, buf);
+    }
+    void prepWrite(uint64_t userData, off_t oft, size_t size, const char *buf) {
+        prepRw(IORING_OP_WRITE_FIXED, IORING_OP_WRITEV, userData, oft, size, buf);
+    }
+    void prepFdsync(uint64_t userData) {
+        struct io_uring_sqe &sqe = getSqe();
+        sqe.opcode = IORING_OP_FSYNC;
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        setFile(sqe);
+        sqe.user_data = userData;
+    }
+    /**
+     * Pass all prepared SQEs to the kernel.
+     * RETURN:
+     *   number of submitted SQEs.
+     */
+    size_t submit() {
+        const unsigned tail = *sqTail_;
+        const unsigned nr = sqLocalTail_ - tail;
+        if (nr == 0) return 0;
+        __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+        unsigned done = 0;
+        while (done < nr) {
+            const int ret = sysEnter(nr - done, 0, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                throwLibcErrorWithNo("IoUring: io_uring_enter failed.", errno);
+            }
+            done += ret;
+        }
+        return nr;
+    }
+    /**
+     * Wait until at least minNr CQEs are ready.
+     */
+    void wait(size_t minNr) {
+        while (cqReady() < minNr) {
+            const int ret = sysEnter(0, minNr, IORING_ENTER_GETEVENTS);
+            if (ret < 0 && errno != EINTR) {
+                throwLibcErrorWithNo("IoUring: io_uring_enter failed.", errno);
+            }
+        }
+    }
+    /**
+     * Consume all ready CQEs.
+     * @f void(uint64_t userData, int res)
+     * RETURN:
+     *   number of consumed CQEs.
+     */
+    template <typename Func>
+    size_t reap(Func&& f) {
+        unsigned head = *cqHead_;
+        const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        size_t nr = 0;
+        while (head != tail) {
+            const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+            f(cqe.user_data, cqe.res);
+            head++;
+            nr++;
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        return nr;
+    }
+private:
+    size_t cqReady() const {
+        return __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - *cqHead_;
+    }
+    struct io_uring_sqe &getSqe(unsigned *idxP = nullptr) {
+        if (sqSpace() == 0) throw RT_ERR("IoUring: submission queue is full.");
+        const unsigned idx = sqLocalTail_ & sqMask_;
+        if (idxP) *idxP = idx;
+        sqArray_[idx] = idx;
+        sqLocalTail_++;
+        struct io_uring_sqe &sqe = sqes_[idx];
+        ::memset(&sqe, 0, sizeof(sqe));
+        return sqe;
+    }
+    void setFile(struct io_uring_sqe &sqe) const {
+        if (isFixedFile_) {
+            sqe.fd = 0;
+            sqe.flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe.fd = fd_;
+        }
+    }
+    void prepRw(uint8_t fixedOp, uint8_t vecOp, uint64_t userData, off_t oft, size_t size, const char *buf) {
+        unsigned idx;
+        struct io_uring_sqe &sqe = getSqe(&idx);
+        setFile(sqe);
+        sqe.off = oft;
+        sqe.user_data = userData;
+        if (bufBegin_ <= buf && buf + size <= bufEnd_) {
+            sqe.opcode = fixedOp;
+            sqe.addr = reinterpret_cast<uintptr_t>(buf);
+            sqe.len = size;
+            sqe.buf_index = 0;
+        } else {
+            /* IORING_OP_READ/WRITE are not available before linux 5.6. */
+            struct iovec *iov = &iovV_[idx];
+            iov->iov_base = const_cast<char *>(buf);
+            iov->iov_len = size;
+            sqe.opcode = vecOp;
+            sqe.addr = reinterpret_cast<uintptr_t>(iov);
+            sqe.len = 1;
+        }
+    }
+    void mapRings(const struct io_uring_params &p) {
+        sqMapSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqMapSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        const bool isSingleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (isSingleMmap) {
+            sqMapSize_ = std::max(sqMapSize_, cqMapSize_);
+            cqMapSize_ = 0;
+        }
+        sqPtr_ = mmapRing(sqMapSize_, IORING_OFF_SQ_RING);
+        cqPtr_ = isSingleMmap ? sqPtr_ : mmapRing(cqMapSize_, IORING_OFF_CQ_RING);
+        sqesMapSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe *>(mmapRing(sqesMapSize_, IORING_OFF_SQES));
+
+        char *sq = static_cast<char *>(sqPtr_);
+        sqHead_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sqEntries_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_entries);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        sqLocalTail_ = *sqTail_;
+        iovV_.resize(sqEntries_);
+
+        char *cq = static_cast<char *>(cqPtr_);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    }
+    void *mmapRing(size_t size, off_t offset) {
+        void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, offset);
+        if (p == MAP_FAILED) {
+            throwLibcErrorWithNo("IoUring: mmap failed.", errno);
+        }
+        return p;
+    }
+    void release() noexcept {
+        if (sqes_ != nullptr) ::munmap(sqes_, sqesMapSize_);
+        if (cqPtr_ != MAP_FAILED && cqPtr_ != sqPtr_) ::munmap(cqPtr_, cqMapSize_);
+        if (sqPtr_ != MAP_FAILED) ::munmap(sqPtr_, sqMapSize_);
+        sqes_ = nullptr;
+        cqPtr_ = MAP_FAILED;
+        sqPtr_ = MAP_FAILED;
+        if (ringFd_ >= 0) ::close(ringFd_);
+        ringFd_ = -1;
+    }
+#ifdef __NR_io_uring_setup
+    static int sysSetup(unsigned entries, struct io_uring_params *p) {
+        return ::syscall(__NR_io_uring_setup, entries, p);
+    }
+    int sysEnter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return ::syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, nullptr, 0);
+    }
+    int sysRegister(unsigned opcode, const void *arg, unsigned nrArgs) {
+        return ::syscall(__NR_io_uring_register, ringFd_, opcode, arg, nrArgs);
+    }
+#else
+    static int sysSetup(unsigned, struct io_uring_params *) { errno = ENOSYS; return -1; }
+    int sysEnter(unsigned, unsigned, unsigned) { errno = ENOSYS; return -1; }
+    int sysRegister(unsigned, const void *, unsigned) { errno = ENOSYS; return -1; }
+#endif
+};
+
+}} // namespace cybozu::aio
@@ -0,0 +1,135 @@
+/**
+ * Benchmark of DiffMemory against the std::map based implementation.
+ *
+ * Usage: bench_diff_mem [-n NR] [-r RANGE] [-data]
+ */
+#include "cybozu/option.hpp"
+#include "walb_diff_mem.hpp"
+#include "random.hpp"
+#include "time.hpp"
+#include <map>
+#include <cstdio>
+#include <cinttypes>
+
+using namespace walb;
+
+/**
+ * The std::map based DiffMemory::add() as a reference.
+ */
+class MapDiffMemory
+{
+public:
+    using Map = std::map<uint64_t, DiffRecIo>;
+private:
+    Map map_;
+    uint64_t nIos_;
+public:
+    MapDiffMemory() : map_(), nIos_(0) {}
+    void add(const DiffRecord& rec, AlignedArray &&buf) {
+        const uint64_t addr0 = rec.io_address;
+        auto it = map_.lower_bound(addr0);
+        if (it == map_.end()) {
+            if (!map_.empty()) --it;
+        } else {
+            if (addr0 < it->first && it != map_.begin()) --it;
+        }
+        const uint64_t addr1 = rec.endIoAddress();
+        std::queue<DiffRecIo> q;
+        while (it != map_.end() && it->first < addr1) {
+            DiffRecIo &r = it->second;
+            if (r.record().isOverlapped(rec)) {
+                nIos_--;
+                q.push(std::move(r));
+                it = map_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        DiffRecIo r0(rec, std::move(buf));
+        while (!q.empty()) {
+            for (DiffRecIo &r : q.front().minus(r0)) {
+                nIos_++;
+                map_.emplace(r.record().io_address, std::move(r));
+            }
+            q.pop();
+        }
+        nIos_++;
+        std::vector<DiffRecIo> rv;
+        rv.push_back(std::move(r0));
+        for (DiffRecIo &r : rv) {
+            map_.emplace(r.record().io_address, std::move(r));
+        }
+    }
+    Map& getMap() { return map_; }
+    uint64_t getNIos() const { return nIos_; }
+};
+
+struct Option : cybozu::Option
+{
+    size_t nr;
+    uint64_t range;
+    bool withData;
+    Option() {
+        appendOpt(&nr, 1000000, "n", ": number of records (default: 1M).");
+        appendOpt(&range, 64 * MEBI, "r", ": address range [logical block] (default: 64Mi = 32GiB).");
+        appendBoolOpt(&withData, "data", ": records have 4KiB IO data (otherwise all-zero records).");
+        appendHelp("h");
+    }
+};
+
+std::vector<DiffRecord> generateRecords(const Option &opt)
+{
+    cybozu::util::Xoroshiro128Plus rand(::time(0));
+    const uint32_t ioBlocks = 4 * KIBI / LOGICAL_BLOCK_SIZE;
+    std::vector<DiffRecord> recV(opt.nr);
+    for (DiffRecord &rec : recV) {
+        rec.io_address = rand() % (opt.range - ioBlocks);
+        rec.io_blocks = ioBlocks;
+        if (opt.withData) {
+            rec.setNormal();
+            rec.data_size = ioBlocks * LOGICAL_BLOCK_SIZE;
+        } else {
+            rec.setAllZero();
+        }
+    }
+    return recV;
+}
+
+template <typename Mem>
+void bench(const char *name, const std::vector<DiffRecord> &recV)
+{
+    Mem mem;
+    cybozu::Stopwatch sw;
+    for (const DiffRecord &rec : recV) {
+        AlignedArray buf;
+        if (rec.isNormal()) buf.resize(rec.data_size, false);
+        mem.add(rec, std::move(buf));
+    }
+    const double addSec = sw.get();
+    size_t nr = 0;
+    uint64_t blks = 0;
+    for (const auto &pair : mem.getMap()) {
+        nr++;
+        blks += pair.second.record().io_blocks;
+    }
+    const double scanSec = sw.get();
+    ::printf("%-8s add %.3f sec (%.1f ns/rec) scan %.3f sec nrIos %" PRIu64 " %zu blks %" PRIu64 "\n"
+             , name, addSec, addSec * 1e9 / recV.size(), scanSec, mem.getNIos(), nr, blks);
+}
+
+int main(int argc, char *argv[]) try
+{
+    Option opt;
+    if (!opt.parse(argc, argv)) {
+        opt.usage();
+        return 1;
+    }
+    const std::vector<DiffRecord> recV = generateRecords(opt);
+    for (size_t i = 0; i < 3; i++) {
+        bench<MapDiffMemory>("map", recV);
+        bench<DiffMemory>("btree", recV);
+    }
+} catch (std::exception &e) {
+    ::fprintf(::stderr, "error: %s\n", e.what());
+    return 1;
+}
@@ -350,6 +350,7 @@ CMPR_GZIP = 2
 CMPR_LZMA = 3
 CMPR_LZ4 = 4
 CMPR_ZSTD = 5
+CMPR_AUTO = 255  # choose one of the above for each pack.
 
 
 def printL(ls):
@@ -361,7 +362,7 @@ def verify_compress_kind(kind):
     kind :: int - CMPR_XXX.
     return :: None
     '''
-    if kind not in [CMPR_NONE, CMPR_SNAPPY, CMPR_GZIP, CMPR_LZMA, CMPR_LZ4, CMPR_ZSTD]:
+    if kind not in [CMPR_NONE, CMPR_SNAPPY, CMPR_GZIP, CMPR_LZMA, CMPR_LZ4, CMPR_ZSTD, CMPR_AUTO]:
         raise Exception('verify_compress_kind: bad value', kind)
 
 
@@ -372,7 +373,7 @@ def compress_kind_to_str(kind):
     '''
     verify_compress_kind(kind)
     m = {CMPR_NONE: 'none', CMPR_SNAPPY: 'snappy', CMPR_GZIP: 'gzip', CMPR_LZMA: 'lzma',
-         CMPR_LZ4: 'lz4', CMPR_ZSTD: 'zstd'}
+         CMPR_LZ4: 'lz4', CMPR_ZSTD: 'zstd', CMPR_AUTO: 'auto'}
     assert kind in m
     return m[kind]
 
@@ -384,7 +385,7 @@ def compress_str_to_kind(s):
     '''
     verify_type(s, str)
     m = {'none': CMPR_NONE, 'snappy': CMPR_SNAPPY, 'gzip': CMPR_GZIP, 'lzma': CMPR_LZMA,
-         'lz4': CMPR_LZ4, 'zstd': CMPR_ZSTD}
+         'lz4': CMPR_LZ4, 'zstd': CMPR_ZSTD, 'auto': CMPR_AUTO}
     if s not in m:
         raise Exception('compress_str_to_kind: bad kind', s)
     return m[s]
@@ -67,27 +67,27 @@ void verifyApplicable(const std::string& volId, uint64_t gid)
     }
 }
 
-bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
-                      const std::atomic<int>& stopState,
-                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr)
+/**
+ * Write the IOs of a prepared merger to the volume.
+ * RETURN:
+ *   false if force stopped.
+ */
+static bool applyMergedIos(DiffMerger& merger, const cybozu::lvm::Lv& lv,
+                           const std::atomic<int>& stopState, size_t shardIdx, DiffStatistics& stat)
 {
     const char *const FUNC = __func__;
-    statOut.clear();
-    DiffMerger merger;
-    merger.addWdiffs(std::move(fileV));
-    merger.prepare();
-    DiffRecIo recIo;
     const std::string lvPathStr = lv.path().str();
+    const uint64_t lvSnapSizeLb = lv.sizeLb();
     cybozu::util::File file(lvPathStr, O_RDWR);
     AlignedArray zero;
-    const uint64_t lvSnapSizeLb = lv.sizeLb();
+    DiffRecIo recIo;
     double t0 = cybozu::util::getTime();
     while (merger.getAndRemove(recIo)) {
         if (stopState == ForceStopping || ga.ps.isForceShutdown()) {
             return false;
         }
         const DiffRecord& rec = recIo.record();
-        statOut.update(rec);
+        stat.update(rec);
         assert(!rec.isCompressed());
         const uint64_t ioAddress = rec.io_address;
         const uint64_t ioBlocks = rec.io_blocks;
@@ -99,17 +99,48 @@ bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv&
 
         const double t1 = cybozu::util::getTime();
         if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
-            LOGs.info() << FUNC << "progress" << lvPathStr
+            LOGs.info() << FUNC << "progress" << lvPathStr << shardIdx
                         << cybozu::util::formatString("%" PRIu64 "/%" PRIu64 "", ioAddress, lvSnapSizeLb);
             t0 = t1;
         }
     }
     file.fdatasync();
     file.close();
-    statIn = merger.statIn();
+    return true;
+}
+
+bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
+                      const std::atomic<int>& stopState, const std::string& tmpDir,
+                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr)
+{
+    statOut.clear();
+    if (ga.maxMergeThreads <= 1) {
+        // Sharding needs to scan all the wdiffs in advance. It does not pay for one thread.
+        DiffMerger merger;
+        merger.addWdiffs(std::move(fileV));
+        merger.setPrefetch(ga.mergePrefetchThreads);
+        merger.setMemoryBudget(ga.maxMergeMemoryMb * MEBI, tmpDir);
+        merger.prepare();
+        if (!applyMergedIos(merger, lv, stopState, 0, statOut)) return false;
+        statIn = merger.statIn();
+        memUsageStr = merger.memUsageStr();
+    } else {
+        ShardedDiffMerger merger;
+        merger.addWdiffs(std::move(fileV));
+        merger.setPrefetch(ga.mergePrefetchThreads);
+        merger.setMemoryBudget(ga.maxMergeMemoryMb * MEBI, tmpDir);
+        merger.prepare(ga.maxMergeThreads);
+        std::vector<DiffStatistics> statV(merger.getShardNr());
+        const bool ret = merger.run([&](size_t shardIdx, DiffMerger& shardMerger) {
+                return applyMergedIos(shardMerger, lv, stopState, shardIdx, statV[shardIdx]);
+            });
+        if (!ret) return false;
+        statIn = merger.statIn();
+        for (const DiffStatistics& stat : statV) statOut.update(stat);
+        memUsageStr = merger.memUsageStr();
+    }
     statOut.wdiffNr = -1;
     statOut.dataSize = -1;
-    memUsageStr = merger.memUsageStr();
     return true;
 }
 
@@ -141,7 +172,7 @@ static ApplyState applyDiffsToVolumeOnce(const std::string& volId, const MetaSta
     cybozu::lvm::Lv lv = lvC.getLv(); // base image.
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), lv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    if (!applyOpenedDiffs(std::move(fileV), lv, volSt.stopState, volInfo.volDir.str(), statIn, statOut, memUsageStr)) {
         return ApplyState::FAILURE;
     }
     st1 = endApplying(st01, diffV);
@@ -188,6 +219,7 @@ bool applyDiffsToVolume(const std::string& volId, uint64_t gid)
         const ApplyState ret = applyDiffsToVolumeOnce(volId, st0, gid, st1);
         switch (ret) {
         case ApplyState::DONE:
+            gcZstdDicts(volId);
             return true;
         case ApplyState::FAILURE:
             return false;
@@ -253,37 +285,69 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     LOGs.debug() << "merge-diffs" << mergedDiff << diffV;
     const cybozu::FilePath diffPath = volInfo.getDiffPath(mergedDiff);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    DiffMerger merger;
-    merger.addWdiffs(std::move(fileV));
-    merger.prepare();
-
-    SortedDiffWriter writer;
-    writer.setFd(tmpFile.fd());
-    DiffFileHeader wdiffH = merger.header();
-    writer.writeHeader(wdiffH);
-    DiffRecIo recIo;
-    while (merger.getAndRemove(recIo)) {
-        if (volSt.stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
+    auto shouldContinue = [&]() {
+        return volSt.stopState != ForceStopping && !ga.ps.isForceShutdown();
+    };
+    DiffStatistics statIn, statOut;
+    std::string memUsageStr;
+    if (ga.maxMergeThreads <= 1) {
+        DiffMerger merger;
+        merger.addWdiffs(std::move(fileV));
+        merger.setPrefetch(ga.mergePrefetchThreads);
+        merger.setMemoryBudget(ga.maxMergeMemoryMb * MEBI, volInfo.volDir.str());
+        if (!merger.mergeToFd(tmpFile.fd(), shouldContinue)) return false;
+        statIn = merger.statIn();
+        statOut = merger.statOut();
+        memUsageStr = merger.memUsageStr();
+    } else {
+        ShardedDiffMerger merger;
+        merger.addWdiffs(std::move(fileV));
+        merger.setPrefetch(ga.mergePrefetchThreads);
+        merger.setMemoryBudget(ga.maxMergeMemoryMb * MEBI, volInfo.volDir.str());
+        merger.prepare(ga.maxMergeThreads);
         // TODO: currently we can use snappy only.
-        writer.compressAndWriteDiff(recIo.record(), recIo.io().data());
+        const CompressOpt cmpr;
+        if (!merger.mergeToFd(tmpFile.fd(), cmpr, volInfo.volDir.str(), shouldContinue)) return false;
+        statIn = merger.statIn();
+        statOut = merger.statOut();
+        memUsageStr = merger.memUsageStr();
     }
-    writer.close();
 
     mergedDiff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
     tmpFile.save(diffPath.str());
     mgr.add(mergedDiff);
     volInfo.removeDiffs(diffV);
+    gcZstdDicts(volId);
 
-    LOGs.info() << "merge-mergeIn " << volId << merger.statIn();
-    LOGs.info() << "merge-mergeOut" << volId << writer.getStat();
-    LOGs.info() << "merge-mergeMemUsage" << volId << merger.memUsageStr();
+    LOGs.info() << "merge-mergeIn " << volId << statIn;
+    LOGs.info() << "merge-mergeOut" << volId << statOut;
+    LOGs.info() << "merge-mergeMemUsage" << volId << memUsageStr;
     LOGs.info() << "merged" << volId << diffV.size() << mergedDiff;
     return true;
 }
 
 
+void gcZstdDicts(const std::string &volId)
+{
+    ArchiveVolState &volSt = getArchiveVolState(volId);
+    // This excludes wdiff-transfer saving dictionaries.
+    UniqueLock ul(volSt.mu);
+    ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
+    // A partial wdiff needs no dictionary kept because the client sends it again to resume.
+    const std::set<uint32_t> keptIdSet(volSt.recvDictIdSet.begin(), volSt.recvDictIdSet.end());
+    const std::vector<uint32_t> idV = volInfo.gcZstdDicts(keptIdSet);
+    if (idV.empty()) return;
+    const StrVec volIdV = getVolIdList();
+    for (const uint32_t id : idV) {
+        const bool isUsed = std::any_of(volIdV.begin(), volIdV.end(), [&](const std::string &v) {
+                return existsZstdDict((cybozu::FilePath(ga.baseDirStr) + v).str(), id);
+            });
+        if (!isUsed) getZstdDictRegistry().remove(id);
+    }
+    LOGs.info() << volId << "garbage collected zstd dictionaries" << idV.size();
+}
+
+
 struct TmpSnapshotDeleter
 {
     std::string vgName;
@@ -347,7 +411,7 @@ static bool applyDiffsToRestore(
     LOGs.debug() << "restore-diffs" << volId << st0 << diffV;
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, volInfo.volDir.str(), statIn, statOut, memUsageStr)) {
         return false;
     }
     st1 = apply(st0, diffV);
@@ -705,9 +769,9 @@ bool runFullReplClient(
     pkt.read(startLb);
     logger.info() << "full-repl-client startLb" << startLb;
 
-    const std::string lvPath = lv.path().str();
     const std::atomic<uint64_t> fullScanLbPerSec(0);
-    if (!dirtyFullSyncClient(pkt, lvPath, startLb, sizeLb, bulkLb, volSt.stopState, ga.ps, fullScanLbPerSec)) {
+    AsyncBdevReader reader(lv.path().str(), startLb);
+    if (!dirtyFullSyncClient(pkt, reader, startLb, sizeLb, bulkLb, volSt.stopState, ga.ps, fullScanLbPerSec)) {
         logger.warn() << "full-repl-client force-stopped" << volId;
         return false;
     }
@@ -880,7 +944,7 @@ bool runHashReplServer(
 
 bool runNoMergeDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, Logger &logger)
+    packet::Packet &pkt, uint32_t version, const MetaSnap &srvLatestSnap, Logger &logger)
 {
     const char *const FUNC = __func__;
     MetaState st0 = volInfo.getMetaState();
@@ -915,7 +979,7 @@ bool runNoMergeDiffReplClient(
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
 
-    if (!wdiffTransferNoMergeClient(pkt, fileR, fileH, volSt.stopState, ga.ps)) {
+    if (!wdiffTransferNoMergeClient(pkt, version, fileR, fileH, volSt.stopState, ga.ps)) {
         logger.warn() << "diff-repl-nomerge-client force-stopped" << volId;
         return false;
     }
@@ -931,7 +995,7 @@ bool runNoMergeDiffReplClient(
 
 bool runDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger)
+    packet::Packet &pkt, uint32_t version, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger)
 {
     const char *const FUNC = __func__;
     MetaState st0 = volInfo.getMetaState();
@@ -963,7 +1027,7 @@ bool runDiffReplClient(
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
 
     DiffStatistics statOut;
-    if (!wdiffTransferClient(pkt, merger, cmpr, volSt.stopState, ga.ps, statOut)) {
+    if (!wdiffTransferClient(pkt, version, merger, cmpr, volSt.stopState, ga.ps, statOut)) {
         logger.warn() << "diff-repl-client force-stopped" << volId;
         return false;
     }
@@ -980,9 +1044,110 @@ bool runDiffReplClient(
 }
 
 
+/**
+ * Register and save a dictionary received by wdiff-transfer.
+ * gcZstdDicts() keeps it while this is alive.
+ */
+class ReceivedZstdDict
+{
+    ArchiveVolState &volSt_;
+    uint32_t id_;
+public:
+    ReceivedZstdDict(ArchiveVolState &volSt, const ArchiveVolInfo &volInfo, const ZstdDictPtr &dict)
+        : volSt_(volSt), id_(dict ? dict->getId() : 0) {
+        if (id_ == 0) return;
+        UniqueLock ul(volSt_.mu);
+        getZstdDictRegistry().add(dict);
+        saveZstdDict(volInfo.volDir.str(), *dict);
+        volSt_.recvDictIdSet.insert(id_);
+    }
+    ~ReceivedZstdDict() noexcept {
+        if (id_ == 0) return;
+        UniqueLock ul(volSt_.mu);
+        volSt_.recvDictIdSet.erase(volSt_.recvDictIdSet.find(id_));
+    }
+    uint32_t getId() const { return id_; }
+};
+
+
+bool recvWdiffResumably(
+    const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    packet::Packet &pkt, uint32_t version, const cybozu::Uuid &uuid, MetaDiff &diff, Logger &logger)
+{
+    const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
+    // It must be kept until the wdiff is saved.
+    const ReceivedZstdDict recvDict(volSt, volInfo, wdiffTransferRecvDict(pkt, version));
+    const uint32_t dictId = recvDict.getId();
+    const bool isIndexed = wdiffTransferRecvIsIndexed(pkt, version);
+    const std::string key = cybozu::util::formatString(
+        "%s %s %u", uuid.str().c_str(), createDiffFileName(diff).c_str(), dictId);
+    cybozu::util::File partial;
+    uint64_t resumeAddr = 0, validSize = 0;
+    SortedDiffIndexMem indexMem;
+    // Clients of version 1 and indexed wdiffs can not resume.
+    if (version >= 2 && !isIndexed && volInfo.openWdiffPartial(key, partial)) {
+        DiffFileHeader fileH;
+        fileH.readFrom(partial);
+        resumeAddr = wdiffTransferScanPartial(partial, validSize, indexMem);
+    }
+    const uint64_t bgnAddr = wdiffTransferNegotiateResume(pkt, version, resumeAddr);
+    cybozu::TmpFile tmpFile;
+    if (bgnAddr == 0) {
+        partial.close();
+        volInfo.removeWdiffPartial();
+        tmpFile.prepare(volInfo.volDir.str());
+        if (!isIndexed) {
+            cybozu::util::File fileW(tmpFile.fd());
+            writeDiffFileHeader(fileW, uuid, dictId);
+        }
+    } else {
+        logger.info() << "wdiff-transfer resumed" << volId << diff << bgnAddr << validSize;
+        partial.ftruncate(validSize);
+        partial.lseek(validSize);
+    }
+    const int fd = bgnAddr == 0 ? tmpFile.fd() : partial.fd();
+    auto keepPartial = [&]() {
+        if (isIndexed) return;
+        try {
+            if (bgnAddr == 0) {
+                volInfo.saveWdiffPartial(tmpFile, key);
+            } else {
+                partial.fdatasync();
+            }
+        } catch (std::exception &e) {
+            logger.warn() << "keep partial wdiff failed" << volId << diff << e.what();
+        }
+    };
+    bool isDone;
+    try {
+        if (isIndexed) {
+            // Deduplicated IOs are stored as they are.
+            isDone = wdiffTransferIndexedServer(pkt, fd, uuid, dictId, volSt.stopState, ga.ps, ga.fsyncIntervalSize);
+        } else {
+            isDone = wdiffTransferServer(pkt, fd, volSt.stopState, ga.ps, ga.fsyncIntervalSize,
+                                         bgnAddr == 0 ? SortedDiffIndexMem() : indexMem);
+        }
+    } catch (...) {
+        keepPartial();
+        throw;
+    }
+    if (!isDone) {
+        keepPartial();
+        return false;
+    }
+    diff.dataSize = cybozu::FileStat(fd).size();
+    if (bgnAddr == 0) {
+        tmpFile.save(fPath.str());
+    } else {
+        volInfo.saveWdiffPartialAs(partial, fPath);
+    }
+    return true;
+}
+
+
 bool runDiffReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger)
+    packet::Packet &pkt, uint32_t version, UniqueLock &ul, const MetaState &metaSt, Logger &logger)
 {
     const char *const FUNC = __func__;
     uint64_t sizeLb;
@@ -1010,16 +1175,10 @@ bool runDiffReplServer(
     cybozu::Stopwatch stopwatch;
     StateMachineTransaction tran(volSt.sm, aArchived, atReplSync, FUNC);
     ul.unlock();
-    const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
-    cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    cybozu::util::File fileW(tmpFile.fd());
-    writeDiffFileHeader(fileW, uuid);
-    if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
+    if (!recvWdiffResumably(volId, volSt, volInfo, pkt, version, uuid, diff, logger)) {
         logger.warn() << "diff-repl-server force-stopped" << volId;
         return false;
     }
-    diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
-    tmpFile.save(fPath.str());
     volSt.diffMgr.add(diff);
     volSt.setLatestMetaState(apply(metaSt, diff));
     dbgVerifyLatestMetaState(volId);
@@ -1149,7 +1308,7 @@ bool runResyncReplServer(
 }
 
 
-bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
+bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, uint32_t version, const HostInfoForRepl &hostInfo,
                        bool isSize, uint64_t param, const std::string &dstId, Logger &logger)
 {
     const char *const FUNC = __func__;
@@ -1216,10 +1375,10 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
         } else {
             if (hostInfo.dontMerge) {
                 if (!runNoMergeDiffReplClient(
-                        volId, volSt, volInfo, dstId, pkt, srvLatestSnap, logger)) return false;
+                        volId, volSt, volInfo, dstId, pkt, version, srvLatestSnap, logger)) return false;
             } else {
                 if (!runDiffReplClient(
-                        volId, volSt, volInfo, dstId, pkt, srvLatestSnap,
+                        volId, volSt, volInfo, dstId, pkt, version, srvLatestSnap,
                         hostInfo.cmpr, hostInfo.maxWdiffMergeSize, logger)) return false;
             }
         }
@@ -1236,7 +1395,7 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
 /**
  * ul is locked at the function beginning.
  */
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger)
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, uint32_t version, UniqueLock &ul, Logger &logger)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -1295,7 +1454,7 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
         if (repl == ArchiveVolInfo::DO_HASH_REPL) {
             if (!runHashReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, logger)) return false;
         } else {
-            if (!runDiffReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, logger)) return false;
+            if (!runDiffReplServer(volId, volSt, volInfo, pkt, version, ul, latestMetaSt, logger)) return false;
         }
     }
     packet::Ack(sock).sendFin();
@@ -1833,6 +1992,8 @@ void ArchiveVolState::initInner(const std::string& volId)
         sm.set(st);
         WalbDiffFiles wdiffs(diffMgr, volInfo.volDir.str());
         wdiffs.reload();
+        // Compressed IOs in the wdiffs may refer to them.
+        loadZstdDicts(volInfo.volDir.str());
         if (isStateIn(st, aActiveOrStopped)) {
             latestMetaSt = volInfo.getLatestState();
         }
@@ -1903,6 +2064,7 @@ void gcArchiveVol(const std::string& volId)
     if (nrDiffs > 0) {
         LOGs.info() << volId << "garbage collected tmp files" << nrTmps;
     }
+    archive_local::gcZstdDicts(volId);
 }
 
 
@@ -2271,16 +2433,10 @@ void p2aWdiffTransferServer(protocol::ServerParams &p)
         logger.debug() << "wdiff-transfer started" << volId;
         cybozu::Stopwatch stopwatch;
 
-        const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
-        cybozu::TmpFile tmpFile(volInfo.volDir.str());
-        cybozu::util::File fileW(tmpFile.fd());
-        writeDiffFileHeader(fileW, uuid);
-        if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
+        if (!archive_local::recvWdiffResumably(volId, volSt, volInfo, pkt, p.version, uuid, diff, logger)) {
             logger.warn() << FUNC << "force stopped" << volId;
             return;
         }
-        diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
-        tmpFile.save(fPath.str());
 
         ul.lock();
         volSt.diffMgr.add(diff);
@@ -2333,12 +2489,13 @@ void c2aReplicateServer(protocol::ServerParams &p)
         ul.unlock();
         cybozu::Socket aSock;
         std::string dstId;
-        archive_local::runReplSync1stNegotiation(volId, hostInfo.addrPort, aSock, dstId);
+        uint32_t version;
+        archive_local::runReplSync1stNegotiation(volId, hostInfo.addrPort, aSock, dstId, version);
         pkt.writeFin(msgAccept);
         sendErr = false;
         logger.info() << "replication as client started"
                       << volId << param.isSize << param.param2 << hostInfo;
-        if (!archive_local::runReplSyncClient(volId, aSock, hostInfo, isSize, param2, dstId, logger)) {
+        if (!archive_local::runReplSyncClient(volId, aSock, version, hostInfo, isSize, param2, dstId, logger)) {
             logger.warn() << FUNC << "replication as client force stopped" << volId << hostInfo;
             return;
         }
@@ -2376,7 +2533,7 @@ void a2aReplSyncServer(protocol::ServerParams &p)
 
         logger.info() << "replication as server started" << volId;
         cybozu::Stopwatch stopwatch;
-        if (!archive_local::runReplSyncServer(volId, p.sock, ul, logger)) {
+        if (!archive_local::runReplSyncServer(volId, p.sock, p.version, ul, logger)) {
             logger.warn() << FUNC << "replication as server force stopped" << volId;
             return;
         }
@@ -2766,6 +2923,7 @@ void c2aGarbageCollectDiffServer(protocol::ServerParams &p)
 
         // Do not unlock volSt due to this command will not change the state.
         const size_t num = volInfo.gcDiffs();
+        archive_local::gcZstdDicts(volId);
 
         ul.unlock();
         pkt.writeFin(msgOk);
@@ -2,6 +2,7 @@
 #include "protocol.hpp"
 #include "archive_vol_info.hpp"
 #include <algorithm>
+#include <set>
 #include <snappy.h>
 #include "linux/walb/block_size.h"
 #include "walb_diff_virt.hpp"
@@ -52,6 +53,12 @@ struct ArchiveVolState
      * 0 means no diff was received after the daemon started.
      */
     uint64_t lastWdiffReceivedTime;
+    /**
+     * Ids of the zstd dictionaries received by running wdiff-transfer.
+     * Their files are kept until the wdiffs referring to them are saved.
+     * Lock of mu is required to access this variable.
+     */
+    std::multiset<uint32_t> recvDictIdSet;
 
 private:
     /**
@@ -68,7 +75,8 @@ public:
         , lvCache()
         , progressLb(0)
         , lastSyncTime(0)
-        , lastWdiffReceivedTime(0) {
+        , lastWdiffReceivedTime(0)
+        , recvDictIdSet() {
         sm.init(statePairTbl);
         initInner(volId);
     }
@@ -155,6 +163,9 @@ struct ArchiveSingleton
     bool doAutoResize;
     bool keepOneColdSnapshot;
     size_t maxOpenDiffs; // 0 means unlimited.
+    size_t maxMergeThreads; // for apply and merge of wdiffs.
+    size_t mergePrefetchThreads; // per shard. 0 means no prefetch.
+    size_t maxMergeMemoryMb; // for apply and merge of wdiffs. 0 means unlimited.
     bool allowExec;
 
     /**
@@ -241,12 +252,18 @@ void prepareVirtualFullScanner(
     ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap);
 void verifyApplicable(const std::string& volId, uint64_t gid);
 bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
-                      const std::atomic<int>& stopState,
+                      const std::atomic<int>& stopState, const std::string& tmpDir,
                       DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr);
 bool applyDiffsToVolume(const std::string& volId, uint64_t gid);
 void verifyNotApplying(const std::string &volId);
 void verifyMergeable(const std::string &volId, uint64_t gid);
 bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t param3);
+/**
+ * Remove the zstd dictionaries that no wdiff of the volume refers to,
+ * and unregister them unless other volumes have them.
+ * Call this after wdiffs are removed.
+ */
+void gcZstdDicts(const std::string &volId);
 
 
 inline void removeLv(const std::string& vgName, const std::string& name)
@@ -294,12 +311,14 @@ void backupServer(protocol::ServerParams &p, bool isFull);
 void delSnapshotServer(protocol::ServerParams &p, bool isCold);
 
 
-inline void runReplSync1stNegotiation(const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId)
+inline void runReplSync1stNegotiation(const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId, uint32_t &version)
 {
     const cybozu::SocketAddr server = addrPort.getSocketAddr();
-    util::connectWithTimeout(sock, server, ga.socketTimeout);
-    ga.setSocketParams(sock);
-    dstId = protocol::run1stNegotiateAsClient(sock, ga.nodeId, replSyncPN);
+    dstId = protocol::run1stNegotiateAsClient(
+        sock, [&](cybozu::Socket &s) {
+            util::connectWithTimeout(s, server, ga.socketTimeout);
+            ga.setSocketParams(s);
+        }, ga.nodeId, replSyncPN, version);
     protocol::sendStrVec(sock, {volId}, 1, __func__, msgAccept);
 }
 
@@ -328,13 +347,24 @@ bool runHashReplServer(
     packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger);
 bool runNoMergeDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, Logger &logger);
+    packet::Packet &pkt, uint32_t version, const MetaSnap &srvLatestSnap, Logger &logger);
 bool runDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger);
+    packet::Packet &pkt, uint32_t version, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger);
+/**
+ * Receive a wdiff by wdiff-transfer and save it as the diff. diff.dataSize will be set.
+ * A partially received wdiff is kept on failure,
+ * and the next transfer of the same diff resumes from its last durable pack.
+ * An indexed wdiff sent as it is is received from the beginning always.
+ * RETURN:
+ *   false if force stopped.
+ */
+bool recvWdiffResumably(
+    const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    packet::Packet &pkt, uint32_t version, const cybozu::Uuid &uuid, MetaDiff &diff, Logger &logger);
 bool runDiffReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger);
+    packet::Packet &pkt, uint32_t version, UniqueLock &ul, const MetaState &metaSt, Logger &logger);
 bool runResyncReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
     packet::Packet &pkt, uint64_t bulkLb, Logger &logger);
@@ -348,9 +378,9 @@ enum {
     DO_HASH_OR_DIFF_SYNC = 2,
 };
 
-bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
+bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, uint32_t version, const HostInfoForRepl &hostInfo,
                        bool isSize, uint64_t param, const std::string &dstId, Logger &logger);
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger);
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, uint32_t version, UniqueLock &ul, Logger &logger);
 
 StrVec getAllStatusAsStrVec();
 StrVec getVolStatusAsStrVec(const std::string &volId);
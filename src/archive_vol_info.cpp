@@ -353,6 +353,55 @@ uint64_t ArchiveVolInfo::initFullReplResume(
 }
 
 
+void ArchiveVolInfo::saveWdiffPartial(cybozu::TmpFile &tmpFile, const std::string &key)
+{
+    removeWdiffPartial();
+    tmpFile.save(getWdiffPartialPath().str());
+    // The key is saved last so that a partially saved file will never be used.
+    util::saveFile(volDir, "wdiff-partial-key", key);
+}
+
+
+bool ArchiveVolInfo::openWdiffPartial(const std::string &key, cybozu::util::File &file)
+{
+    if (!(volDir + "wdiff-partial-key").stat().isFile()) return false;
+    std::string savedKey;
+    util::loadFile(volDir, "wdiff-partial-key", savedKey);
+    if (savedKey != key) {
+        removeWdiffPartial();
+        return false;
+    }
+    return file.open(getWdiffPartialPath().str(), O_RDWR);
+}
+
+
+void ArchiveVolInfo::saveWdiffPartialAs(cybozu::util::File &file, const cybozu::FilePath &path)
+{
+    file.fdatasync();
+    file.close();
+    if (!getWdiffPartialPath().rename(path)) {
+        throw cybozu::Exception("ArchiveVolInfo::saveWdiffPartialAs:rename failed")
+            << path.str() << cybozu::ErrorNo();
+    }
+    cybozu::util::File dir(volDir.str(), O_RDONLY | O_DIRECTORY);
+    dir.fdatasync();
+    // The key left without the file will be ignored.
+    removeWdiffPartial();
+}
+
+
+void ArchiveVolInfo::removeWdiffPartial()
+{
+    for (const cybozu::FilePath &path : {volDir + "wdiff-partial-key", getWdiffPartialPath()}) {
+        int err;
+        if (!path.unlink(&err) && err != ENOENT) {
+            throw cybozu::Exception("ArchiveVolInfo::removeWdiffPartial:unlink failed")
+                << path.str() << cybozu::ErrorNo(err);
+        }
+    }
+}
+
+
 void ArchiveVolInfo::createLv(uint64_t sizeLb)
 {
     if (sizeLb == 0) {
@@ -361,6 +361,26 @@ public:
     }
     uint64_t initFullReplResume(uint64_t sizeLb, const cybozu::Uuid& archiveUuid,
                                 const MetaState& metaSt, FullReplState& fullReplSt);
+    /**
+     * A wdiff partially received by wdiff-transfer is kept for the next transfer to resume.
+     * The key identifies the wdiff and the dictionary its IOs refer to.
+     */
+    cybozu::FilePath getWdiffPartialPath() const {
+        return volDir + "wdiff-partial";
+    }
+    void saveWdiffPartial(cybozu::TmpFile &tmpFile, const std::string &key);
+    /**
+     * The file will be opened to be appended.
+     * RETURN:
+     *   false if there is no partial wdiff with the key.
+     *   A partial wdiff with another key will be removed.
+     */
+    bool openWdiffPartial(const std::string &key, cybozu::util::File &file);
+    /**
+     * Save the partial wdiff completed in the file as path.
+     */
+    void saveWdiffPartialAs(cybozu::util::File &file, const cybozu::FilePath &path);
+    void removeWdiffPartial();
     bool existsVolDir() const {
         return volDir.stat().isDirectory();
     }
@@ -460,6 +480,9 @@ public:
     size_t gcDiffsRange(uint64_t gidB, uint64_t gidE) {
         return wdiffs_.gcRange(gidB, gidE);
     }
+    std::vector<uint32_t> gcZstdDicts(const std::set<uint32_t> &keptIdSet) const {
+        return wdiffs_.gcZstdDicts(keptIdSet);
+    }
     size_t gcTmpFiles() {
         return cybozu::removeAllTmpFiles(volDir.str());
     }
@@ -60,7 +60,10 @@ bool AsyncBdevReader::prepareAheadIo()
     const uint32_t aioKey = aio_.prepareRead(devOffset_, ioSize, ptr);
     assert(aioKey > 0);
     devOffset_ += ioSize;
-    ioQ_.push({aioKey, ioSize});
+    const ReadAheadTuner::TimePoint now = ReadAheadTuner::Clock::now();
+    ioQ_.push({aioKey, ioSize, now});
+    aheadSize_ += ioSize;
+    tuner_.submitted(ioQ_.size(), now);
     return true;
 }
 
@@ -69,7 +72,14 @@ size_t AsyncBdevReader::waitForIo()
     assert(!ioQ_.empty());
     const Io io = ioQ_.front();
     ioQ_.pop();
+    aheadSize_ -= io.size;
+    const ReadAheadTuner::TimePoint ts = ReadAheadTuner::Clock::now();
     aio_.waitFor(io.key);
+    const ReadAheadTuner::TimePoint now = ReadAheadTuner::Clock::now();
+    if (tuner_.completed(io.size, ReadAheadTuner::elapsedUs(io.ts, now),
+                         ReadAheadTuner::elapsedUs(ts, now), now) && monitor_) {
+        monitor_->set(tuner_.getStat(now));
+    }
     return io.size;
 }
 
@@ -85,11 +95,16 @@ void AsyncBdevReader::prepareAvailableData()
 
 size_t AsyncBdevReader::decideIoSize() const
 {
-    if (ringBuf_.getFreeSize() < maxIoSize_) {
+    const size_t ioSize = tuner_.ioSize();
+    if (aheadSize_ + ioSize > tuner_.windowSize()) {
+        /* Enough IOs are in flight. */
+        return 0;
+    }
+    if (ringBuf_.getFreeSize() < ioSize) {
         /* There is not enough buffer size. */
         return 0;
     }
-    uint64_t s = maxIoSize_;
+    uint64_t s = ioSize;
     /* Available size in ring buffer. */
     s = std::min<uint64_t>(s, ringBuf_.getAvailableSize());
     /* Block device remaining size. */
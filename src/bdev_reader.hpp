@@ -3,6 +3,7 @@
 #include "fileio.hpp"
 #include "walb_types.hpp"
 #include "bdev_util.hpp"
+#include "read_ahead.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -64,6 +65,11 @@ public:
         readableSize_ = 0;
     }
     size_t getFreeSize() const;
+    /**
+     * The whole buffer area to register it to an aio instance.
+     */
+    char *data() { return buf_.data(); }
+    size_t capacity() const { return buf_.size(); }
 
     /**
      * Max size of the next contiguous memory.
@@ -96,6 +102,7 @@ private:
 /**
  * Asynchronous sequential reader of block device using O_DIRECT.
  * Minimum IO size is physical block size.
+ * The IO size and the read-ahead size are decided by ReadAheadTuner within the caps.
  */
 class AsyncBdevReader
 {
@@ -104,14 +111,17 @@ private:
     size_t pbs_;
     uint64_t devOffset_;
     uint64_t devTotal_;
-    size_t maxIoSize_;
     RingBufferForSeqRead ringBuf_;
     cybozu::aio::Aio aio_;
     struct Io {
         uint32_t key;
         size_t size;
+        ReadAheadTuner::TimePoint ts; // submitted time.
     };
     std::queue<Io> ioQ_;
+    size_t aheadSize_; // total size of ioQ_.
+    ReadAheadTuner tuner_;
+    ReadAheadMonitor *monitor_;
 
     static constexpr size_t DEFAULT_BUFFER_SIZE = 4U << 20; /* 4MiB */
     static constexpr size_t DEFAULT_MAX_IO_SIZE = 64U << 10; /* 64KiB. */
@@ -120,7 +130,7 @@ public:
     /**
      * @bdevPath block device path.
      * @offsetLb start offset [logical block]
-     * @bufferSize buffer size to read ahead [byte].
+     * @bufferSize max size to read ahead [byte].
      * @maxIoSize max IO size [byte].
      *   maxioSize <= bufferSize must be satisfied.
      */
@@ -132,18 +142,17 @@ public:
         , pbs_(cybozu::util::getPhysicalBlockSize(file_.fd()))
         , devOffset_(offsetLb * LOGICAL_BLOCK_SIZE)
         , devTotal_(cybozu::util::getBlockDeviceSize(file_.fd()))
-        , maxIoSize_(maxIoSize)
         , ringBuf_()
-        , aio_(file_.fd(), bufferSize / pbs_)
-        , ioQ_() {
-        if (bufferSize < maxIoSize) {
-            throw cybozu::Exception(NAME())
-                << "bufferSize must be >= maxIoSize" << bufferSize << maxIoSize;
-        }
+        , aio_(file_.fd(), ReadAheadTuner::getMaxQueueDepth(bufferSize, maxIoSize, pbs_))
+        , ioQ_()
+        , aheadSize_(0)
+        , tuner_(verifyBufferSize(bufferSize, maxIoSize), maxIoSize, pbs_)
+        , monitor_(nullptr) {
         verifyMultiple(devTotal_, pbs_, "bad device size");
-        verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
+        verifyMultiple(maxIoSize, pbs_, "bad maxIoSize");
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.data(), ringBuf_.capacity());
         readAhead();
     }
     ~AsyncBdevReader() noexcept {
@@ -153,13 +162,26 @@ public:
             } catch (...) {
             }
         }
+        if (monitor_) monitor_->set(tuner_.getStat());
     }
     /**
      * @data buffer to store read data.
      * @size read size [byte].
      */
     void read(void *data, size_t size);
+    /**
+     * The statistics will be set to the monitor periodically.
+     */
+    void setMonitor(ReadAheadMonitor *monitor) { monitor_ = monitor; }
+    ReadAheadStat getStat() const { return tuner_.getStat(); }
 private:
+    size_t verifyBufferSize(size_t bufferSize, size_t maxIoSize) const {
+        if (bufferSize < maxIoSize) {
+            throw cybozu::Exception(NAME())
+                << "bufferSize must be >= maxIoSize" << bufferSize << maxIoSize;
+        }
+        return bufferSize;
+    }
     void verifyMultiple(uint64_t size, size_t pbs, const char *msg) const {
         assert(pbs != 0);
         if (size == 0 || size % pbs != 0) {
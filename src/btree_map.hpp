@@ -0,0 +1,426 @@
+#pragma once
+/**
+ * @file
+ * @brief Sorted map implemented as a B+tree with chunked leaves.
+ *
+ * (C) 2013 Cybozu Labs, Inc.
+ */
+#include <vector>
+#include <memory>
+#include <utility>
+#include <tuple>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+
+namespace walb {
+
+/**
+ * Sorted map like std::map implemented as a B+tree.
+ *
+ * Each leaf is a sorted vector of at most LeafSize items and leaves are linked.
+ * Inner nodes have at most InnerSize children.
+ * Compared with std::map, inserting/erasing an item does not allocate/free a node
+ * in most cases, and scanning items does not chase pointers.
+ *
+ * Nodes are not merged when they become small. Empty ones are removed.
+ * Iterators are invalidated by any insertion or erasure.
+ * T must be nothrow move constructible/assignable.
+ */
+template <typename Key, typename T, size_t LeafSize = 64, size_t InnerSize = 64>
+class BtreeMap
+{
+    static_assert(LeafSize >= 2, "LeafSize must be >= 2.");
+    static_assert(InnerSize >= 3, "InnerSize must be >= 3.");
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<Key, T>; // key must not be changed by the user.
+private:
+    struct Node
+    {
+        const bool isLeaf;
+        /*
+         * For inner nodes.
+         * keys[i] <= all the keys in children[i]
+         * and keys[i] > all the keys in children[i - 1] for i > 0.
+         * keys[0] is not used for search.
+         */
+        std::vector<Key> keys;
+        std::vector<std::unique_ptr<Node> > children;
+        /*
+         * For leaf nodes.
+         */
+        std::vector<value_type> items;
+        Node *prev;
+        Node *next;
+
+        explicit Node(bool isLeaf)
+            : isLeaf(isLeaf), keys(), children(), items(), prev(nullptr), next(nullptr) {
+            if (isLeaf) {
+                items.reserve(LeafSize + 1);
+            } else {
+                keys.reserve(InnerSize + 1);
+                children.reserve(InnerSize + 1);
+            }
+        }
+        size_t childIndex(const Key &key) const {
+            assert(!isLeaf && !keys.empty());
+            return std::upper_bound(keys.begin() + 1, keys.end(), key) - keys.begin() - 1;
+        }
+        typename std::vector<value_type>::iterator lowerBound(const Key &key) {
+            return std::lower_bound(
+                items.begin(), items.end(), key,
+                [](const value_type &v, const Key &k) { return v.first < k; });
+        }
+    };
+
+    std::unique_ptr<Node> root_;
+    Node *first_; // the first leaf.
+    Node *last_; // the last leaf.
+    size_t size_;
+
+    template <typename Map, typename Value>
+    class IteratorT
+    {
+    private:
+        friend class BtreeMap;
+        Map *map_;
+        Node *leaf_; // nullptr means end.
+        size_t pos_; // position in the leaf.
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = typename BtreeMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value *;
+        using reference = Value &;
+
+        IteratorT() : map_(nullptr), leaf_(nullptr), pos_(0) {}
+        IteratorT(Map *map, Node *leaf, size_t pos) : map_(map), leaf_(leaf), pos_(pos) {}
+        template <typename Map2, typename Value2>
+        IteratorT(const IteratorT<Map2, Value2> &rhs) : map_(rhs.map_), leaf_(rhs.leaf_), pos_(rhs.pos_) {}
+
+        reference operator*() const { return leaf_->items[pos_]; }
+        pointer operator->() const { return &leaf_->items[pos_]; }
+        IteratorT &operator++() {
+            assert(leaf_);
+            pos_++;
+            if (pos_ == leaf_->items.size()) {
+                leaf_ = leaf_->next;
+                pos_ = 0;
+            }
+            return *this;
+        }
+        IteratorT operator++(int) {
+            IteratorT ret = *this;
+            ++*this;
+            return ret;
+        }
+        IteratorT &operator--() {
+            if (leaf_ == nullptr) {
+                leaf_ = map_->last_;
+                pos_ = leaf_->items.size();
+            } else if (pos_ == 0) {
+                leaf_ = leaf_->prev;
+                pos_ = leaf_->items.size();
+            }
+            assert(leaf_);
+            pos_--;
+            return *this;
+        }
+        IteratorT operator--(int) {
+            IteratorT ret = *this;
+            --*this;
+            return ret;
+        }
+        template <typename Map2, typename Value2>
+        bool operator==(const IteratorT<Map2, Value2> &rhs) const {
+            return leaf_ == rhs.leaf_ && pos_ == rhs.pos_;
+        }
+        template <typename Map2, typename Value2>
+        bool operator!=(const IteratorT<Map2, Value2> &rhs) const {
+            return !(*this == rhs);
+        }
+        template <typename, typename> friend class IteratorT;
+    };
+
+public:
+    using iterator = IteratorT<BtreeMap, value_type>;
+    using const_iterator = IteratorT<const BtreeMap, const value_type>;
+
+    BtreeMap() : root_(), first_(nullptr), last_(nullptr), size_(0) {}
+    BtreeMap(const BtreeMap &) = delete;
+    BtreeMap &operator=(const BtreeMap &) = delete;
+    BtreeMap(BtreeMap &&rhs) noexcept : BtreeMap() {
+        swap(rhs);
+    }
+    BtreeMap &operator=(BtreeMap &&rhs) noexcept {
+        clear();
+        swap(rhs);
+        return *this;
+    }
+    void swap(BtreeMap &rhs) noexcept {
+        std::swap(root_, rhs.root_);
+        std::swap(first_, rhs.first_);
+        std::swap(last_, rhs.last_);
+        std::swap(size_, rhs.size_);
+    }
+
+    iterator begin() { return iterator(this, first_, 0); }
+    iterator end() { return iterator(this, nullptr, 0); }
+    const_iterator begin() const { return const_iterator(this, first_, 0); }
+    const_iterator end() const { return const_iterator(this, nullptr, 0); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() {
+        root_.reset();
+        first_ = nullptr;
+        last_ = nullptr;
+        size_ = 0;
+    }
+
+    /**
+     * RETURN:
+     *   iterator of the first item whose key is not less than the key.
+     */
+    iterator lower_bound(const Key &key) {
+        if (!root_) return end();
+        Node *leaf = findLeaf(key);
+        const size_t pos = leaf->lowerBound(key) - leaf->items.begin();
+        if (pos == leaf->items.size()) return iterator(this, leaf->next, 0);
+        return iterator(this, leaf, pos);
+    }
+    const_iterator lower_bound(const Key &key) const {
+        return const_cast<BtreeMap *>(this)->lower_bound(key);
+    }
+    iterator find(const Key &key) {
+        iterator it = lower_bound(key);
+        if (it != end() && !(key < it->first)) return it;
+        return end();
+    }
+
+    /**
+     * Insert an item if the key does not exist.
+     * RETURN:
+     *   (iterator of the item with the key, inserted or not).
+     */
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(const Key &key, Args&&... args) {
+        if (!root_) {
+            root_.reset(new Node(true));
+            first_ = last_ = root_.get();
+        }
+        iterator ret;
+        bool inserted = false;
+        Key sepKey;
+        std::unique_ptr<Node> sibling = insertRec(*root_, key, ret, inserted, sepKey, std::forward<Args>(args)...);
+        if (sibling) {
+            // Split the root.
+            std::unique_ptr<Node> root(new Node(false));
+            root->keys.push_back(Key());
+            root->keys.push_back(sepKey);
+            root->children.push_back(std::move(root_));
+            root->children.push_back(std::move(sibling));
+            root_ = std::move(root);
+        }
+        return {ret, inserted};
+    }
+
+    /**
+     * RETURN:
+     *   iterator of the item next to the erased one.
+     */
+    iterator erase(iterator it) {
+        iterator next = it;
+        ++next;
+        return erase(it, next);
+    }
+    /**
+     * Erase items in [first, last).
+     * RETURN:
+     *   iterator of the item pointed by last before erasure.
+     */
+    iterator erase(iterator first, iterator last) {
+        assert(first.map_ == this && last.map_ == this);
+        while (first != last) {
+            Node *leaf = first.leaf_;
+            assert(leaf);
+            std::vector<value_type> &items = leaf->items;
+            const size_t endPos = (last.leaf_ == leaf) ? last.pos_ : items.size();
+            assert(first.pos_ < endPos);
+            const Key key = items[first.pos_].first;
+            items.erase(items.begin() + first.pos_, items.begin() + endPos);
+            size_ -= endPos - first.pos_;
+            if (items.empty()) {
+                assert(last.leaf_ != leaf);
+                Node *next = leaf->next;
+                removeLeaf(leaf, key);
+                first = iterator(this, next, 0);
+            } else if (last.leaf_ == leaf) {
+                return iterator(this, leaf, first.pos_);
+            } else {
+                first = iterator(this, leaf->next, 0);
+            }
+        }
+        return last;
+    }
+
+    /**
+     * For debug and test.
+     */
+    bool isValid() const {
+        if (!root_) return size_ == 0 && first_ == nullptr && last_ == nullptr;
+        const value_type *prev = nullptr;
+        size_t total = 0;
+        const Node *prevLeaf = nullptr;
+        for (const Node *leaf = first_; leaf; leaf = leaf->next) {
+            if (leaf->items.empty() || leaf->items.size() > LeafSize) return false;
+            if (leaf->prev != prevLeaf) return false;
+            for (const value_type &v : leaf->items) {
+                if (prev && !(prev->first < v.first)) return false;
+                prev = &v;
+            }
+            total += leaf->items.size();
+            prevLeaf = leaf;
+        }
+        if (prevLeaf != last_ || total != size_) return false;
+        return isValidNode(*root_, nullptr, nullptr);
+    }
+private:
+    Node *findLeaf(const Key &key) const {
+        Node *node = root_.get();
+        while (!node->isLeaf) {
+            node = node->children[node->childIndex(key)].get();
+        }
+        return node;
+    }
+    /**
+     * RETURN:
+     *   right half of the node if the node has been split, otherwise nullptr.
+     *   sepKey will be set to the first key of the right half.
+     */
+    template <typename... Args>
+    std::unique_ptr<Node> insertRec(Node &node, const Key &key, iterator &ret, bool &inserted, Key &sepKey, Args&&... args) {
+        if (node.isLeaf) {
+            typename std::vector<value_type>::iterator it = node.lowerBound(key);
+            const size_t pos = it - node.items.begin();
+            if (it != node.items.end() && !(key < it->first)) {
+                ret = iterator(this, &node, pos);
+                return nullptr;
+            }
+            node.items.emplace(it, std::piecewise_construct,
+                               std::forward_as_tuple(key),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
+            size_++;
+            inserted = true;
+            if (node.items.size() <= LeafSize) {
+                ret = iterator(this, &node, pos);
+                return nullptr;
+            }
+            std::unique_ptr<Node> sibling = splitLeaf(node);
+            sepKey = sibling->items.front().first;
+            const size_t half = node.items.size();
+            if (pos < half) {
+                ret = iterator(this, &node, pos);
+            } else {
+                ret = iterator(this, sibling.get(), pos - half);
+            }
+            return sibling;
+        }
+        const size_t idx = node.childIndex(key);
+        Key childSepKey;
+        std::unique_ptr<Node> child = insertRec(*node.children[idx], key, ret, inserted, childSepKey, std::forward<Args>(args)...);
+        if (!child) return nullptr;
+        node.keys.insert(node.keys.begin() + idx + 1, childSepKey);
+        node.children.insert(node.children.begin() + idx + 1, std::move(child));
+        if (node.children.size() <= InnerSize) return nullptr;
+
+        // Split the inner node.
+        std::unique_ptr<Node> sibling(new Node(false));
+        const size_t half = node.children.size() / 2;
+        std::move(node.keys.begin() + half, node.keys.end(), std::back_inserter(sibling->keys));
+        std::move(node.children.begin() + half, node.children.end(), std::back_inserter(sibling->children));
+        node.keys.resize(half);
+        node.children.resize(half);
+        sepKey = sibling->keys.front();
+        return sibling;
+    }
+    std::unique_ptr<Node> splitLeaf(Node &leaf) {
+        std::unique_ptr<Node> sibling(new Node(true));
+        const size_t half = leaf.items.size() / 2;
+        std::move(leaf.items.begin() + half, leaf.items.end(), std::back_inserter(sibling->items));
+        leaf.items.erase(leaf.items.begin() + half, leaf.items.end());
+        sibling->prev = &leaf;
+        sibling->next = leaf.next;
+        if (leaf.next) {
+            leaf.next->prev = sibling.get();
+        } else {
+            last_ = sibling.get();
+        }
+        leaf.next = sibling.get();
+        return sibling;
+    }
+    /**
+     * Remove an empty leaf from the tree.
+     * key must be one of the keys the leaf had.
+     */
+    void removeLeaf(Node *leaf, const Key &key) {
+        assert(leaf->items.empty());
+        if (leaf->prev) {
+            leaf->prev->next = leaf->next;
+        } else {
+            first_ = leaf->next;
+        }
+        if (leaf->next) {
+            leaf->next->prev = leaf->prev;
+        } else {
+            last_ = leaf->prev;
+        }
+        if (root_.get() == leaf) {
+            root_.reset();
+            return;
+        }
+        removeRec(*root_, leaf, key);
+        if (root_->children.empty()) {
+            root_.reset();
+        } else if (root_->children.size() == 1) {
+            std::unique_ptr<Node> child = std::move(root_->children.front());
+            root_ = std::move(child);
+        }
+    }
+    void removeRec(Node &node, Node *leaf, const Key &key) {
+        assert(!node.isLeaf);
+        const size_t idx = node.childIndex(key);
+        Node &child = *node.children[idx];
+        if (&child != leaf) {
+            removeRec(child, leaf, key);
+            if (!child.children.empty()) return;
+        }
+        node.keys.erase(node.keys.begin() + idx);
+        node.children.erase(node.children.begin() + idx);
+    }
+    /**
+     * All the keys in the node must be in [*bgn, *end).
+     * nullptr means no limit.
+     */
+    bool isValidNode(const Node &node, const Key *bgn, const Key *end) const {
+        if (node.isLeaf) {
+            if (bgn && node.items.front().first < *bgn) return false;
+            if (end && !(node.items.back().first < *end)) return false;
+            return true;
+        }
+        const size_t n = node.children.size();
+        if (n == 0 || n > InnerSize || node.keys.size() != n) return false;
+        for (size_t i = 0; i < n; i++) {
+            const Key *b = (i == 0) ? bgn : &node.keys[i];
+            const Key *e = (i + 1 == n) ? end : &node.keys[i + 1];
+            if (!isValidNode(*node.children[i], b, e)) return false;
+        }
+        return true;
+    }
+};
+
+} // namespace walb
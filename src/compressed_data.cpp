@@ -4,11 +4,24 @@ namespace walb {
 
 namespace cmpr_local {
 
-bool compressToVec(const void *data, size_t size, AlignedArray &outV)
+bool compressToVec(const void *data, size_t size, AlignedArray &outV, int type, size_t level)
 {
+    if (type == WALB_DIFF_CMPR_NONE) {
+        outV.resize(size);
+        ::memcpy(outV.data(), data, size);
+        return false;
+    }
     outV.resize(size * 2); // margin to encode
     size_t outSize;
-    if (getSnappyCompressor().run(outV.data(), &outSize, outV.size(), data, size) && outSize < size) {
+    bool ret;
+    if (type == WALB_DIFF_CMPR_SNAPPY) {
+        ret = getSnappyCompressor().run(outV.data(), &outSize, outV.size(), data, size);
+    } else {
+        // Compressors without dictionaries are cheap to create.
+        Compressor cmpr(type, level);
+        ret = cmpr.run(outV.data(), &outSize, outV.size(), data, size);
+    }
+    if (ret && outSize < size) {
         outV.resize(outSize);
         return true;
     } else {
@@ -18,10 +31,16 @@ bool compressToVec(const void *data, size_t size, AlignedArray &outV)
     }
 }
 
-void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize)
+void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize, int type)
 {
     outV.resize(outSize);
-    const size_t s = getSnappyUncompressor().run(&outV[0], outV.size(), data, size);
+    size_t s;
+    if (type == WALB_DIFF_CMPR_SNAPPY) {
+        s = getSnappyUncompressor().run(&outV[0], outV.size(), data, size);
+    } else {
+        Uncompressor uncmpr(type);
+        s = uncmpr.run(&outV[0], outV.size(), data, size);
+    }
     if (s != outSize) throw cybozu::Exception(__func__) << "invalid outSize" << outSize << s;
 }
 
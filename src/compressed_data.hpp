@@ -33,34 +33,49 @@ inline Uncompressor &getSnappyUncompressor() {
  * RETURN:
  *   true when successfully compressed, false when copied.
  */
-bool compressToVec(const void *data, size_t size, AlignedArray &outV);
+bool compressToVec(const void *data, size_t size, AlignedArray &outV,
+                   int type = WALB_DIFF_CMPR_SNAPPY, size_t level = 0);
 
 /**
  * Assume uncompressed size must be outSize.
  */
-void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize);
+void uncompressToVec(const void *data, size_t size, AlignedArray &outV, size_t outSize,
+                     int type = WALB_DIFF_CMPR_SNAPPY);
+
+/**
+ * Set to the compressed size field on the wire
+ * when the codec id follows the size fields.
+ * Snappy data are sent without it as old versions do.
+ */
+const uint32_t CMPR_TYPE_FOLLOWS = 0x80000000U;
 
 } // namespace cmpr_local
 
 /**
  * Compressed and uncompressed data.
- * This uses snappy only.
+ * Snappy is used by default. The codec id is carried with compressed data.
  */
 class CompressedData
 {
 private:
     uint32_t cmpSize_; /* compressed size [byte]. 0 means not compressed. */
     uint32_t orgSize_; /* original size [byte]. must not be 0. */
+    uint8_t cmprType_; /* codec of the compressed data. */
     AlignedArray data_;
 public:
+    CompressedData()
+        : cmpSize_(0), orgSize_(0), cmprType_(::WALB_DIFF_CMPR_SNAPPY), data_() {
+    }
     const char *rawData() const { return &data_[0]; }
     size_t rawSize() const { return data_.size(); }
     bool isCompressed() const { return cmpSize_ != 0; }
     size_t originalSize() const { return orgSize_; }
+    int cmprType() const { return cmprType_; }
     void swap(CompressedData& rhs) noexcept
     {
         std::swap(cmpSize_, rhs.cmpSize_);
         std::swap(orgSize_, rhs.orgSize_);
+        std::swap(cmprType_, rhs.cmprType_);
         data_.swap(rhs.data_);
     }
     /**
@@ -68,8 +83,14 @@ public:
      */
     void send(packet::Packet &packet) const {
         verify();
-        packet.write(cmpSize_);
-        packet.write(orgSize_);
+        if (isCompressed() && cmprType_ != ::WALB_DIFF_CMPR_SNAPPY) {
+            packet.write(cmpSize_ | cmpr_local::CMPR_TYPE_FOLLOWS);
+            packet.write(orgSize_);
+            packet.write(cmprType_);
+        } else {
+            packet.write(cmpSize_);
+            packet.write(orgSize_);
+        }
         packet.write(&data_[0], data_.size());
     }
     /**
@@ -78,6 +99,12 @@ public:
     void recv(packet::Packet &packet) {
         packet.read(cmpSize_);
         packet.read(orgSize_);
+        if ((cmpSize_ & cmpr_local::CMPR_TYPE_FOLLOWS) != 0) {
+            cmpSize_ &= ~cmpr_local::CMPR_TYPE_FOLLOWS;
+            packet.read(cmprType_);
+        } else {
+            cmprType_ = ::WALB_DIFF_CMPR_SNAPPY;
+        }
         data_.resize(dataSize());
         packet.read(&data_[0], data_.size());
         verify();
@@ -95,9 +122,15 @@ public:
         ::memcpy(&data_[0], data, size);
         verify();
     }
-    void compressFrom(const void *data, uint32_t size) {
-        if (cmpr_local::compressToVec(data, size, data_)) {
+    /**
+     * type: WALB_DIFF_CMPR_XXX except for WALB_DIFF_CMPR_AUTO.
+     * level: compression level for the codec.
+     */
+    void compressFrom(const void *data, uint32_t size,
+                      int type = ::WALB_DIFF_CMPR_SNAPPY, size_t level = 0) {
+        if (cmpr_local::compressToVec(data, size, data_, type, level)) {
             setSizes(data_.size(), size);
+            cmprType_ = type;
         } else {
             setSizes(0, size);
         }
@@ -105,16 +138,16 @@ public:
     }
     void getUncompressed(AlignedArray &outV) const {
         if (isCompressed()) {
-            cmpr_local::uncompressToVec(&data_[0], data_.size(), outV, orgSize_);
+            cmpr_local::uncompressToVec(&data_[0], data_.size(), outV, orgSize_, cmprType_);
         } else {
             outV.resize(data_.size());
             ::memcpy(&outV[0], &data_[0], outV.size());
         }
     }
-    void compress() {
+    void compress(int type = ::WALB_DIFF_CMPR_SNAPPY, size_t level = 0) {
         if (isCompressed()) return;
         CompressedData tmp;
-        tmp.compressFrom(&data_[0], data_.size());
+        tmp.compressFrom(&data_[0], data_.size(), type, level);
         swap(tmp);
     }
     void uncompress() {
@@ -129,6 +162,9 @@ public:
 private:
     void verify() const {
         if (orgSize_ == 0) throw RT_ERR("orgSize must not be 0.");
+        if ((cmpSize_ & cmpr_local::CMPR_TYPE_FOLLOWS) != 0) {
+            throw RT_ERR("too large compressed size %u.", cmpSize_);
+        }
         if (dataSize() != data_.size()) {
             throw RT_ERR("data size must be %zu but really %zu."
                          , dataSize(), data_.size());
@@ -20,6 +20,7 @@ static const Pair compressionTypeTable[] = {
     { "lzma", ::WALB_DIFF_CMPR_LZMA },
     { "lz4", ::WALB_DIFF_CMPR_LZ4 },
     { "zstd", ::WALB_DIFF_CMPR_ZSTD },
+    { "auto", ::WALB_DIFF_CMPR_AUTO },
 };
 
 } // namespace compression_type_local
@@ -1,20 +1,38 @@
 #pragma once
 #include "zstd.h"
+#include "zstd_dict.hpp"
 #include "walb_logger.hpp"
 
 struct CompressorZstd : walb::compressor_local::CompressorIF
 {
     constexpr static const char *NAME() { return "CompressorZstd"; };
     size_t level_;
-    CompressorZstd(size_t level) : level_(level == 0 ? 3 : level) {
+    walb::ZstdDictPtr dict_;
+    ::ZSTD_CCtx *cctx_;
+    /**
+     * dict: may be null.
+     */
+    CompressorZstd(size_t level, const walb::ZstdDictPtr &dict = nullptr)
+        : level_(level == 0 ? 1 : level), dict_(dict), cctx_(nullptr) {
         if (level >= 20) {
             throw cybozu::Exception(NAME()) << "bad compression level" << level;
         }
+        if (dict_) {
+            cctx_ = ::ZSTD_createCCtx();
+            if (cctx_ == nullptr) throw cybozu::Exception(NAME()) << "ZSTD_createCCtx failed";
+        }
+    }
+    ~CompressorZstd() noexcept {
+        ::ZSTD_freeCCtx(cctx_);
     }
     bool run(void *out, size_t *outSize, size_t maxOutSize, const void *in, size_t inSize) {
         assert(outSize != nullptr);
-        const int level = 1;
-        const size_t ret = ::ZSTD_compress(out, maxOutSize, in, inSize, level);
+        size_t ret;
+        if (dict_) {
+            ret = ::ZSTD_compress_usingCDict(cctx_, out, maxOutSize, in, inSize, dict_->cdict());
+        } else {
+            ret = ::ZSTD_compress(out, maxOutSize, in, inSize, level_);
+        }
         if (::ZSTD_isError(ret)) {
             LOGs.warn() << NAME() << ::ZSTD_getErrorName(ret);
             return false;
@@ -27,9 +45,25 @@ struct CompressorZstd : walb::compressor_local::CompressorIF
 struct UncompressorZstd : walb::compressor_local::UncompressorIF
 {
     constexpr static const char *NAME() { return "UncompressorZstd"; }
-    UncompressorZstd(size_t) {}
+    ::ZSTD_DCtx *dctx_;
+    UncompressorZstd(size_t) : dctx_(nullptr) {}
+    ~UncompressorZstd() noexcept {
+        ::ZSTD_freeDCtx(dctx_);
+    }
     size_t run(void *out, size_t maxOutSize, const void *in, size_t inSize) {
-        const size_t ret = ::ZSTD_decompress(out, maxOutSize, in, inSize);
+        size_t ret;
+        // Frames compressed with a dictionary tell its id.
+        const uint32_t dictId = walb::getZstdFrameDictId(in, inSize);
+        if (dictId != 0) {
+            const walb::ZstdDictPtr dict = walb::getZstdDictRegistry().getOrThrow(dictId);
+            if (dctx_ == nullptr) {
+                dctx_ = ::ZSTD_createDCtx();
+                if (dctx_ == nullptr) throw cybozu::Exception(NAME()) << "ZSTD_createDCtx failed";
+            }
+            ret = ::ZSTD_decompress_usingDDict(dctx_, out, maxOutSize, in, inSize, dict->ddict());
+        } else {
+            ret = ::ZSTD_decompress(out, maxOutSize, in, inSize);
+        }
         if (::ZSTD_isError(ret)) {
             throw cybozu::Exception(NAME()) << "ZSTD_decompress failed" << ::ZSTD_getErrorName(ret);
         }
@@ -7,6 +7,9 @@
  * (C) 2013 Cybozu Labs, Inc.
  */
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
 #include <cybozu/exception.hpp>
 #include "walb_diff.h"
 
@@ -45,10 +48,14 @@ public:
      * @param compressionLevel [in] compression level
      *                  not used for AsIs, Snappy, Lz4
      *                  [0, 9] (default 6) for Zlib, Xz
+     * @param dict [in] zstd dictionary (may be null). used for Zstd only.
      */
-    explicit Compressor(int mode, size_t compressionLevel = 0)
+    explicit Compressor(int mode, size_t compressionLevel = 0, const ZstdDictPtr &dict = nullptr)
         : engine_(nullptr)
     {
+        if (dict && mode != WALB_DIFF_CMPR_ZSTD) {
+            throw cybozu::Exception("Compressor:dictionary is not supported") << mode;
+        }
         switch (mode) {
         case WALB_DIFF_CMPR_NONE:
             engine_ = new CompressorAsIs(compressionLevel);
@@ -66,7 +73,7 @@ public:
             engine_ = new CompressorLz4(compressionLevel);
             break;
         case WALB_DIFF_CMPR_ZSTD:
-            engine_ = new CompressorZstd(compressionLevel);
+            engine_ = new CompressorZstd(compressionLevel, dict);
             break;
         default:
             throw cybozu::Exception("Compressor:invalid mode") << mode;
@@ -96,6 +103,105 @@ private:
     compressor_local::CompressorIF *engine_;
 };
 
+/**
+ * Compression type selector for WALB_DIFF_CMPR_AUTO.
+ * It trial-compresses small slices of the data with fast codecs
+ * and estimates their entropy,
+ * so that incompressible data is stored as is without a full compression attempt.
+ */
+class CompressionSelector
+{
+public:
+    static const size_t MAX_SAMPLE_SIZE = 16 * 1024;
+    static const size_t MAX_SLICE_SIZE = 4 * 1024;
+    /* Data is incompressible if lz4 can not shrink samples under this ratio [%]. */
+    static const size_t INCOMPRESSIBLE_PCT = 90;
+    /* zstd is chosen if it shrinks samples under this ratio of lz4 [%]. */
+    static const size_t ZSTD_GAIN_PCT = 90;
+    static const size_t DEFAULT_BUDGET = 5;
+
+    /**
+     * @param budget [in] CPU budget in [0, 9]. 0 means DEFAULT_BUDGET.
+     *                  [1, 3] lz4 only.
+     *                  [4, 6] lz4 or zstd level 1.
+     *                  [7, 9] lz4 or zstd level 3, 6, 9.
+     */
+    explicit CompressionSelector(size_t budget = 0)
+        : budget_(budget == 0 ? DEFAULT_BUDGET : budget)
+        , lz4_(WALB_DIFF_CMPR_LZ4), zstd_(WALB_DIFF_CMPR_ZSTD, 1)
+        , sample_(), out_()
+    {
+        if (budget_ > 9) {
+            throw cybozu::Exception("CompressionSelector:invalid budget") << budget;
+        }
+    }
+    void clear() { sample_.clear(); }
+    /**
+     * Add data to be compressed.
+     * Only a slice from the middle of it is sampled.
+     */
+    void add(const void *data, size_t size)
+    {
+        size_t sliceSize = std::min(size, MAX_SAMPLE_SIZE - sample_.size());
+        if (sliceSize > MAX_SLICE_SIZE) sliceSize = MAX_SLICE_SIZE;
+        if (sliceSize == 0) return;
+        const char *p = static_cast<const char *>(data) + (size - sliceSize) / 2;
+        sample_.insert(sample_.end(), p, p + sliceSize);
+    }
+    /**
+     * Choose a compression type for the data added since the last clear().
+     * @param level [out] compression level for the chosen type.
+     * @return WALB_DIFF_CMPR_{NONE,LZ4,ZSTD}
+     */
+    int choose(size_t *level)
+    {
+        assert(level != nullptr);
+        *level = 0;
+        if (sample_.empty()) return WALB_DIFF_CMPR_NONE;
+        const size_t inSize = sample_.size();
+        out_.resize(inSize + 4096);
+        size_t lz4Size;
+        const bool lz4Ok = lz4_.run(out_.data(), &lz4Size, out_.size(), sample_.data(), inSize)
+            && lz4Size * 100 < inSize * INCOMPRESSIBLE_PCT;
+        if (budget_ <= 3) return lz4Ok ? WALB_DIFF_CMPR_LZ4 : WALB_DIFF_CMPR_NONE;
+        /*
+         * lz4 finds repeated strings only.
+         * Data with few kinds of bytes may still be shrunk by entropy coding of zstd.
+         */
+        if (!lz4Ok && calcEntropy() * 100 >= 8 * INCOMPRESSIBLE_PCT) return WALB_DIFF_CMPR_NONE;
+        size_t zstdSize;
+        const bool zstdOk = zstd_.run(out_.data(), &zstdSize, out_.size(), sample_.data(), inSize)
+            && zstdSize * 100 < inSize * INCOMPRESSIBLE_PCT;
+        if (!zstdOk || (lz4Ok && zstdSize * 100 >= lz4Size * ZSTD_GAIN_PCT)) {
+            return lz4Ok ? WALB_DIFF_CMPR_LZ4 : WALB_DIFF_CMPR_NONE;
+        }
+        *level = budget_ <= 6 ? 1 : (budget_ - 6) * 3;
+        return WALB_DIFF_CMPR_ZSTD;
+    }
+    /**
+     * @return order-0 entropy of the samples [bit/byte].
+     */
+    double calcEntropy() const
+    {
+        if (sample_.empty()) return 0;
+        size_t histo[256] = {};
+        for (char c : sample_) histo[uint8_t(c)]++;
+        double e = 0;
+        for (size_t n : histo) {
+            if (n == 0) continue;
+            const double p = double(n) / sample_.size();
+            e -= p * std::log2(p);
+        }
+        return e;
+    }
+private:
+    size_t budget_;
+    Compressor lz4_;
+    Compressor zstd_;
+    std::vector<char> sample_;
+    std::vector<char> out_;
+};
+
 /**
  * uncompression class
  */
@@ -19,14 +19,34 @@ const size_t DEFAULT_TIMEOUT_SEC = 60;
 const size_t DEFAULT_MAX_CONNECTIONS = 10;
 const size_t DEFAULT_MAX_FOREGROUND_TASKS = 2;
 const size_t DEFAULT_MAX_BACKGROUND_TASKS = 1;
+const size_t DEFAULT_RESERVED_BACKGROUND_TASKS = 1; // for volumes at risk of log overflow.
+const size_t DEFAULT_OVERFLOW_RISK_SEC = 600;
 const size_t DEFAULT_MAX_WDIFF_SEND_MB = 128;
 const size_t DEFAULT_MAX_WDIFF_SEND_NR = 1000;
 const size_t DEFAULT_MAX_WDIFF_MERGE_MB = 1024;
+const size_t DEFAULT_WDIFF_CACHE_MB = 1024; // 0 means disabled.
+const size_t DEFAULT_WDIFF_COMPACT_NR = 0; // 0 means disabled.
 const size_t DEFAULT_MAX_WLOG_SEND_MB = 128;
+const size_t DEFAULT_WLOG_CMPR_THREADS = 2;
+const char DEFAULT_WLOG_CMPR_STR[] = "snappy:0";
+const char DEFAULT_WLOG_CMPR_ACCEPT_STR[] = "none,snappy,gzip,lzma,lz4,zstd";
+const size_t DEFAULT_WLOG_BATCH_KB = 256; // 0 means a frame per IO.
+const size_t MAX_WLOG_BATCH_KB = 16 * 1024;
+const size_t DEFAULT_MAX_WLOG_CHUNKS = 8; // 1 means no pipelining.
+const size_t DEFAULT_WLOG_COALESCE_MB = 0; // 0 means disabled.
+const size_t DEFAULT_READ_AHEAD_MB = 16;
+const size_t DEFAULT_READ_AHEAD_IO_KB = 1024;
 const size_t DEFAULT_MAX_CONVERSION_MB = 1024;
+const size_t DEFAULT_MAX_DEDUP_NR = 0; // 0 means disabled.
+const size_t DEFAULT_WLOG_CONV_THREADS = 2; // 0 means no pipelining.
+const size_t DEFAULT_ZSTD_DICT_KB = 0; // 0 means disabled.
+const size_t DEFAULT_ZSTD_DICT_RETRAIN_SEC = 86400;
 const size_t DEFAULT_DELAY_SEC_FOR_RETRY = 20;
 const size_t DEFAULT_RETRY_TIMEOUT_SEC = 1800;
 const size_t DEFAULT_MAX_OPEN_DIFFS = 0; // 0 means unlimited.
+const size_t DEFAULT_MAX_MERGE_THREADS = 1;
+const size_t DEFAULT_MERGE_PREFETCH_THREADS = 0; // 0 means no prefetch.
+const size_t DEFAULT_MAX_MERGE_MEMORY_MB = 0; // 0 means unlimited.
 
 const size_t PROXY_HEARTBEAT_INTERVAL_SEC = 10;
 const size_t PROXY_HEARTBEAT_SOCKET_TIMEOUT_SEC = 3; // seconds.
@@ -37,8 +57,10 @@ const uint64_t DEFAULT_FULL_SCAN_BYTES_PER_SEC = 0; // unlimited.
 
 const uint64_t DEFAULT_FSYNC_INTERVAL_SIZE = 128 * MEBI;
 const size_t DEFAULT_MERGE_BUFFER_LB = 4 * MEBI / LBS;
+const size_t DEFAULT_MERGE_PREFETCH_PACKS = 2; // per input wdiff.
 
 const char DEFAULT_DISCARD_TYPE_STR[] = "ignore";
+const char DEFAULT_AIO_BACKEND_STR[] = "auto";
 
 const uint64_t DIRTY_HASH_SYNC_READ_AHEAD_LB = 256 * MEBI / LBS;
 const uint64_t DIRTY_HASH_SYNC_MAX_PACK_AREA_LB = 256 * MEBI / LBS;
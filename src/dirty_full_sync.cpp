@@ -3,16 +3,17 @@
 namespace walb {
 
 bool dirtyFullSyncClient(
-    packet::Packet &pkt, const std::string &bdevPath,
+    packet::Packet &pkt, AsyncBdevReader &reader,
     uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
     const std::atomic<uint64_t>& maxLbPerSec)
 {
     assert(startLb <= sizeLb);
     AlignedArray buf(bulkLb * LOGICAL_BLOCK_SIZE);
-    AsyncBdevReader reader(bdevPath, startLb);
     std::string encBuf;
     ThroughputStabilizer thStab;
+    packet::SocketBuffer sockBuf(pkt.sock());
+    packet::Packet bufPkt(sockBuf);
 
     uint64_t c = 0;
     uint64_t remainingLb = sizeLb - startLb;
@@ -24,18 +25,18 @@ bool dirtyFullSyncClient(
         const size_t size = lb * LOGICAL_BLOCK_SIZE;
         reader.read(&buf[0], size);
         if (cybozu::util::isAllZero(buf.data(), buf.size())) {
-            pkt.write(0);
+            bufPkt.write(0);
         } else {
             compressSnappy(buf, encBuf);
-            pkt.write(encBuf.size());
-            pkt.write(encBuf.data(), encBuf.size());
+            bufPkt.write(encBuf.size());
+            bufPkt.write(encBuf.data(), encBuf.size());
         }
         remainingLb -= lb;
         c++;
         thStab.setMaxLbPerSec(maxLbPerSec.load());
         thStab.addAndSleepIfNecessary(lb, 10, 100);
     }
-    pkt.flush();
+    bufPkt.flush();
     packet::Ack(pkt.sock()).recv();
     LOGs.debug() << "number of sent packets" << c;
     return true;
@@ -62,6 +63,10 @@ bool dirtyFullSyncServer(
     const AlignedArray zeroBuf(bulkLb * LOGICAL_BLOCK_SIZE, true);
     AlignedArray buf(bulkLb * LOGICAL_BLOCK_SIZE);
     AlignedArray encBuf;
+    // Clients send nothing after the data until they receive an ack,
+    // so reading ahead is safe.
+    packet::SocketBuffer sockBuf(pkt.sock(), 0, packet::DEFAULT_READ_BUFFER_SIZE);
+    packet::Packet bufPkt(sockBuf);
 
     progressLb = startLb;
     uint64_t c = 0;
@@ -74,7 +79,7 @@ bool dirtyFullSyncServer(
         const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
         const size_t size = lb * LOGICAL_BLOCK_SIZE;
         size_t encSize;
-        pkt.read(encSize);
+        bufPkt.read(encSize);
         if (encSize == 0) {
             if (skipZero) {
                 file.lseek(size, SEEK_CUR);
@@ -83,7 +88,7 @@ bool dirtyFullSyncServer(
             }
         } else {
             encBuf.resize(encSize);
-            pkt.read(&encBuf[0], encSize);
+            bufPkt.read(&encBuf[0], encSize);
             buf.resize(size);
             uncompressSnappy(encBuf, buf, FUNC);
             file.write(&buf[0], size);
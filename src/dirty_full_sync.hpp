@@ -18,12 +18,13 @@ namespace walb {
 
 /**
  * sizeLb is total size.
+ * reader must start at startLb.
  *
  * RETURN:
  *   false if force stopped.
  */
 bool dirtyFullSyncClient(
-    packet::Packet &pkt, const std::string &bdevPath,
+    packet::Packet &pkt, AsyncBdevReader &reader,
     uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
     const std::atomic<uint64_t>& maxLbPerSec);
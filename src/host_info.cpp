@@ -16,7 +16,7 @@ void AddrPort::verify() const
 void CompressOpt::verify() const
 {
     const char *const msg = "CompressOpt::verify";
-    if (type >= ::WALB_DIFF_CMPR_MAX) {
+    if (type >= ::WALB_DIFF_CMPR_MAX && type != ::WALB_DIFF_CMPR_AUTO) {
         throw cybozu::Exception(msg)
             << "invalid type" << type;
     }
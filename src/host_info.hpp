@@ -58,7 +58,7 @@ struct AddrPort
 struct CompressOpt
 {
     uint8_t type; /* wdiff compression type. */
-    uint8_t level; /* wdiff compression level. */
+    uint8_t level; /* wdiff compression level. CPU budget for WALB_DIFF_CMPR_AUTO. */
     uint8_t numCpu; /* number of compression threads. */
 
     explicit CompressOpt(uint8_t type = ::WALB_DIFF_CMPR_SNAPPY, uint8_t level = 0, uint8_t numCpu = 1)
@@ -0,0 +1,144 @@
+#pragma once
+/**
+ * @file
+ * @brief Estimate when a walb log device will overflow.
+ */
+#include <mutex>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cinttypes>
+#include "task_queue.hpp"
+
+namespace walb {
+
+/**
+ * Log usage of a walb device and its fill rate.
+ * The fill rate is an exponentially weighted moving average
+ * of the growth of the latest lsid, which is not reduced by wlog transfers.
+ * This is thread-safe.
+ */
+class LogFillStat
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+    /**
+     * Time constant of the moving average [sec].
+     */
+    static constexpr double RATE_TAU_SEC = 60.0;
+    /**
+     * Minimum interval between samples [msec].
+     */
+    static constexpr int64_t SAMPLE_INTERVAL_MS = 1000;
+    /**
+     * Volumes using more than this of their log capacity are at risk.
+     */
+    static constexpr uint64_t RISK_USAGE_PERMILLE = 900;
+
+private:
+    using AutoLock = std::lock_guard<std::mutex>;
+
+    mutable std::mutex mu_;
+    bool hasSample_;
+    TimePoint ts_;
+    uint64_t latestLsid_;
+    uint64_t usagePb_;
+    uint64_t capacityPb_;
+    double pbPerSec_;
+
+public:
+    LogFillStat()
+        : mu_(), hasSample_(false), ts_(), latestLsid_(0)
+        , usagePb_(0), capacityPb_(0), pbPerSec_(0) {
+    }
+    /**
+     * RETURN:
+     *   true if update() should be called to keep the estimation fresh.
+     */
+    bool needsSample(TimePoint now = Clock::now()) const {
+        AutoLock lk(mu_);
+        return !hasSample_ || elapsedMs(now) >= SAMPLE_INTERVAL_MS;
+    }
+    void update(uint64_t latestLsid, uint64_t usagePb, uint64_t capacityPb,
+                TimePoint now = Clock::now()) {
+        AutoLock lk(mu_);
+        usagePb_ = usagePb;
+        capacityPb_ = capacityPb;
+        if (!hasSample_ || latestLsid < latestLsid_) {
+            // The first sample or the log has been reset.
+            hasSample_ = true;
+            ts_ = now;
+            latestLsid_ = latestLsid;
+            pbPerSec_ = 0;
+            return;
+        }
+        const int64_t ms = elapsedMs(now);
+        if (ms < SAMPLE_INTERVAL_MS) return; // too short to estimate the rate.
+        const double sec = ms / 1000.0;
+        const double rate = (latestLsid - latestLsid_) / sec;
+        const double alpha = 1.0 - std::exp(-sec / RATE_TAU_SEC);
+        pbPerSec_ += alpha * (rate - pbPerSec_);
+        ts_ = now;
+        latestLsid_ = latestLsid;
+    }
+    double getPbPerSec() const {
+        AutoLock lk(mu_);
+        return pbPerSec_;
+    }
+    /**
+     * RETURN:
+     *   predicted seconds until the log device overflows.
+     *   -1 means it will not overflow at the current rate, or unknown.
+     */
+    int64_t getSecToOverflow() const {
+        AutoLock lk(mu_);
+        return getSecToOverflowNolock();
+    }
+    bool isAtRisk(size_t riskSec) const {
+        AutoLock lk(mu_);
+        return getUrgencyNolock(riskSec) > 0;
+    }
+    /**
+     * Task priority of the volume.
+     * RETURN:
+     *   0 if it is not at risk, or URGENT_TASK_PRIORITY or more.
+     *   The closer to overflow, the larger.
+     */
+    int getPriority(size_t riskSec) const {
+        AutoLock lk(mu_);
+        const uint64_t urgency = getUrgencyNolock(riskSec);
+        if (urgency == 0) return 0;
+        return URGENT_TASK_PRIORITY + int(urgency);
+    }
+private:
+    int64_t elapsedMs(TimePoint now) const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now - ts_).count();
+    }
+    int64_t getSecToOverflowNolock() const {
+        if (!hasSample_ || capacityPb_ == 0) return -1;
+        if (usagePb_ >= capacityPb_) return 0;
+        if (pbPerSec_ <= 0) return -1;
+        return int64_t((capacityPb_ - usagePb_) / pbPerSec_);
+    }
+    /**
+     * RETURN:
+     *   0 if not at risk, or permille in (0, 1000]
+     *   that is the larger of log usage and consumed part of the risk window.
+     */
+    uint64_t getUrgencyNolock(size_t riskSec) const {
+        if (!hasSample_ || capacityPb_ == 0) return 0;
+        uint64_t urgency = 0;
+        const uint64_t usagePermille = std::min<uint64_t>(usagePb_ * 1000 / capacityPb_, 1000);
+        if (usagePermille >= RISK_USAGE_PERMILLE) urgency = usagePermille;
+        const int64_t sec = getSecToOverflowNolock();
+        if (sec >= 0 && uint64_t(sec) <= riskSec) {
+            const uint64_t windowPermille = riskSec == 0 ? 1000 : (riskSec - sec) * 1000 / riskSec;
+            urgency = std::max(urgency, std::max<uint64_t>(windowPermille, 1));
+        }
+        return urgency;
+    }
+};
+
+} // namespace walb
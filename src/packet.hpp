@@ -6,6 +6,10 @@
  *
  * (C) 2013 Cybozu Labs, Inc.
  */
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <netinet/tcp.h>
 #include "cybozu/socket.hpp"
 #include "cybozu/serializer.hpp"
 #include "util.hpp"
@@ -15,7 +19,17 @@
 namespace walb {
 namespace packet {
 
-const uint32_t VERSION = 1;
+/**
+ * Protocol version.
+ * A server accepts clients of MIN_VERSION or later,
+ * and a connection uses the older version of the two sides.
+ *   1: the original.
+ *   2: the server replies its version to the client after the 1st negotiation.
+ *      Protocols may have optional steps for version 2 or later.
+ *      See protocol::run1stNegotiateAsClient().
+ */
+const uint32_t VERSION = 2;
+const uint32_t MIN_VERSION = 1;
 const uint32_t ACK_MSG = 0x626c6177; /* "walb" (little endian). */
 
 
@@ -30,46 +44,200 @@ inline void flushSocket(cybozu::Socket &sock, bool isCork = false)
     }
 }
 
+const size_t DEFAULT_WRITE_BUFFER_SIZE = 64 * 1024;
+const size_t DEFAULT_READ_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * Userspace I/O buffer of a socket without changing the data on the wire.
+ *
+ * writeBufSize 0 means no write buffering. readBufSize 0 means no read buffering.
+ * Small writes are gathered in the write buffer, and they are sent by flush()
+ * or when the buffer becomes full.
+ * Large data are not copied. They are sent just after the gathered data with TCP_CORK,
+ * so that they are packed into full-sized segments until flush().
+ * Reading data flushes the written data before waiting for the socket.
+ *
+ * The read buffer is optional. It reads ahead data from the socket.
+ * Use it only when the peer sends nothing after the data to read through it
+ * until it receives a reply, or all the reads on the socket go through it.
+ *
+ * All the writes to the socket must go through it until flush().
+ */
+class SocketBuffer
+{
+private:
+    cybozu::Socket &sock_;
+    std::vector<char> wBuf_;
+    size_t wSize_;
+    bool isCorked_;
+    std::vector<char> rBuf_;
+    size_t rBgn_, rEnd_;
+
+public:
+    explicit SocketBuffer(cybozu::Socket &sock,
+                          size_t writeBufSize = DEFAULT_WRITE_BUFFER_SIZE, size_t readBufSize = 0)
+        : sock_(sock), wBuf_(writeBufSize), wSize_(0), isCorked_(false)
+        , rBuf_(readBufSize), rBgn_(0), rEnd_(0) {
+    }
+    /**
+     * Remaining written data are sent for compatibility with unbuffered packets.
+     */
+    ~SocketBuffer() noexcept {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+    SocketBuffer(const SocketBuffer&) = delete;
+    SocketBuffer& operator=(const SocketBuffer&) = delete;
+
+    cybozu::Socket &sock() { return sock_; }
+
+    void write(const void *data, size_t size) {
+        if (wBuf_.empty()) {
+            sock_.write(data, size);
+            return;
+        }
+        if (size <= wBuf_.size() - wSize_) {
+            append(data, size);
+            return;
+        }
+        if (size < wBuf_.size()) {
+            sendPending();
+            append(data, size);
+            return;
+        }
+        if (!isCorked_) {
+            sock_.setSocketOption(TCP_CORK, 1, IPPROTO_TCP);
+            isCorked_ = true;
+        }
+        sendPending();
+        sock_.write(data, size);
+    }
+    size_t readSome(void *data, size_t size) {
+        if (rBgn_ == rEnd_) {
+            flush();
+            if (size >= rBuf_.size()) return sock_.readSome(data, size);
+            rBgn_ = 0;
+            rEnd_ = sock_.readSome(rBuf_.data(), rBuf_.size());
+        }
+        const size_t s = std::min(size, rEnd_ - rBgn_);
+        ::memcpy(data, &rBuf_[rBgn_], s);
+        rBgn_ += s;
+        return s;
+    }
+    void read(void *data, size_t size) {
+        char *p = (char *)data;
+        while (size > 0) {
+            const size_t s = readSome(p, size);
+            if (s == 0) throw cybozu::Exception("SocketBuffer:read:readSize is zero");
+            p += s;
+            size -= s;
+        }
+    }
+    /**
+     * Send all the written data immediately.
+     */
+    void flush() {
+        const bool hasData = wSize_ > 0 || isCorked_;
+        sendPending();
+        if (isCorked_) {
+            sock_.setSocketOption(TCP_CORK, 0, IPPROTO_TCP);
+            isCorked_ = false;
+        }
+        if (hasData) flushSocket(sock_);
+    }
+private:
+    void append(const void *data, size_t size) {
+        ::memcpy(&wBuf_[wSize_], data, size);
+        wSize_ += size;
+    }
+    void sendPending() {
+        if (wSize_ == 0) return;
+        sock_.write(wBuf_.data(), wSize_);
+        wSize_ = 0;
+    }
+};
+
 /**
  * Base class for client/server communication.
  *
  * (1) send byte array.
  * (2) send objects using serializer.
+ *
+ * If a SocketBuffer is given, all the I/O go through it.
+ * Packet objects for a socket must share the same buffer.
  */
 class Packet
 {
 private:
     cybozu::Socket &sock_;
+    SocketBuffer *buf_;
 
 public:
-    explicit Packet(cybozu::Socket &sock) : sock_(sock) {}
+    explicit Packet(cybozu::Socket &sock, SocketBuffer *buf = nullptr) : sock_(sock), buf_(buf) {}
+    explicit Packet(SocketBuffer &buf) : sock_(buf.sock()), buf_(&buf) {}
     virtual ~Packet() noexcept = default;
 
     const cybozu::Socket &sock() const { return sock_; }
     cybozu::Socket &sock() { return sock_; }
+    SocketBuffer *buffer() { return buf_; }
 
     /**
      * Byte-array read/write.
      */
-    size_t readSome(void *data, size_t size) { return sock_.readSome(data, size); }
-    void read(void *data, size_t size) { sock_.read(data, size); }
-    void write(const void *data, size_t size) { sock_.write(data, size); }
+    size_t readSome(void *data, size_t size) {
+        return buf_ ? buf_->readSome(data, size) : sock_.readSome(data, size);
+    }
+    void read(void *data, size_t size) {
+        if (buf_) {
+            buf_->read(data, size);
+        } else {
+            sock_.read(data, size);
+        }
+    }
+    void write(const void *data, size_t size) {
+        if (buf_) {
+            buf_->write(data, size);
+        } else {
+            sock_.write(data, size);
+        }
+    }
 
     /**
      * Serializer.
      */
     template <typename T>
-    void read(T &t) { cybozu::load(t, sock_); }
+    void read(T &t) {
+        if (buf_) {
+            cybozu::load(t, *buf_);
+        } else {
+            cybozu::load(t, sock_);
+        }
+    }
     template <typename T>
-    void write(const T &t) { cybozu::save(sock_, t); }
+    void write(const T &t) {
+        if (buf_) {
+            cybozu::save(*buf_, t);
+        } else {
+            cybozu::save(sock_, t);
+        }
+    }
 
     template <typename T>
     void writeFin(const T &t) {
         write(t);
+        if (buf_) buf_->flush();
         sock_.waitForClose();
         sock_.close();
     }
-    void flush() { flushSocket(sock_); }
+    void flush() {
+        if (buf_) {
+            buf_->flush();
+        } else {
+            flushSocket(sock_);
+        }
+    }
 
 #ifdef PACKET_DEBUG
     void sendDebugMsg(const std::string &msg) {
@@ -95,6 +263,7 @@ class Ack : public Packet
 {
 public:
     using Packet :: Packet;
+    explicit Ack(Packet &pkt) : Packet(pkt.sock(), pkt.buffer()) {}
     void send() {
         sendDebugMsg("ACK");
         write(ACK_MSG);
@@ -121,20 +290,24 @@ private:
 public:
     using Packet :: Packet;
     Version(cybozu::Socket &sock) : Packet(sock), version_(UINT32_MAX) {}
-    void send() {
+    void send(uint32_t version = VERSION) {
         sendDebugMsg("VERSION");
-        write(VERSION);
+        write(version);
     }
+    /**
+     * RETURN:
+     *   true if the received version is supported.
+     */
     bool recv() {
         recvDebugMsg("VERSION");
         read(version_);
 #if 0
-        if (version_ != VERSION) {
-            throw RT_ERR("Version number differ: required: %" PRIu32 " received %" PRIu32 "."
-                         , VERSION, version_);
+        if (version_ < MIN_VERSION) {
+            throw RT_ERR("Version number too old: required: %" PRIu32 " received %" PRIu32 "."
+                         , MIN_VERSION, version_);
         }
 #endif
-        return version_ == VERSION;
+        return MIN_VERSION <= version_;
     }
     uint32_t get() const { return version_; }
 };
@@ -151,6 +324,11 @@ private:
 public:
     explicit StreamControl(cybozu::Socket &sock)
         : Packet(sock), received_(false), msg_(Msg::Next) {}
+    /**
+     * Share the buffer of pkt if any.
+     */
+    explicit StreamControl(Packet &pkt)
+        : Packet(pkt.sock(), pkt.buffer()), received_(false), msg_(Msg::Next) {}
     /**
      * For sender.
      */
@@ -197,6 +375,11 @@ private:
 public:
     explicit StreamControl2(cybozu::Socket &sock)
         : pkt_(sock), msg_(Msg::Error) {}
+    /**
+     * Share the buffer of pkt if any.
+     */
+    explicit StreamControl2(Packet &pkt)
+        : pkt_(pkt.sock(), pkt.buffer()), msg_(Msg::Error) {}
 
     /* Send */
     void sendNext() { pkt_.write(uint8_t(Msg::Next));}
@@ -27,30 +27,77 @@ std::vector<cybozu::SocketAddr> parseMultiSocketAddr(const std::string &multiAdd
 namespace protocol {
 
 
-std::string run1stNegotiateAsClient(
-    cybozu::Socket &sock,
-    const std::string &clientId, const std::string &protocolName)
+/**
+ * RETURN:
+ *   false if the server rejected the version.
+ */
+static bool run1stNegotiateAsClientDetail(
+    cybozu::Socket &sock, const std::string &clientId, const std::string &protocolName,
+    uint32_t &version, std::string &serverId)
 {
+    const char *const FUNC = "run1stNegotiateAsClient";
     packet::Packet pkt(sock);
     pkt.write(clientId);
     pkt.write(protocolName);
     packet::Version ver(sock);
-    ver.send();
+    ver.send(version);
     pkt.flush();
-    std::string serverId;
     pkt.read(serverId);
 
     ProtocolLogger logger(clientId, serverId);
     std::string msg;
     pkt.read(msg);
-    if (msg != msgOk) throw cybozu::Exception(__func__) << msg;
+    if (msg != msgOk) {
+        // Servers older than the version reply this.
+        if (version > packet::MIN_VERSION && msg.find("version differ") != std::string::npos) {
+            logger.debug() << FUNC << "version rejected" << protocolName << version << msg;
+            return false;
+        }
+        throw cybozu::Exception(FUNC) << msg;
+    }
+    if (version >= 2) {
+        uint32_t serverVersion;
+        pkt.read(serverVersion);
+        version = std::min(version, serverVersion);
+    }
+    return true;
+}
+
+
+std::string run1stNegotiateAsClient(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName)
+{
+    uint32_t version = packet::MIN_VERSION;
+    std::string serverId;
+    run1stNegotiateAsClientDetail(sock, clientId, protocolName, version, serverId);
+    return serverId;
+}
+
+
+std::string run1stNegotiateAsClient(
+    cybozu::Socket &sock, const std::function<void(cybozu::Socket &)> &connect,
+    const std::string &clientId, const std::string &protocolName, uint32_t &version)
+{
+    std::string serverId;
+    connect(sock);
+    version = packet::VERSION;
+    if (run1stNegotiateAsClientDetail(sock, clientId, protocolName, version, serverId)) {
+        return serverId;
+    }
+    sock.close();
+    connect(sock);
+    version = packet::MIN_VERSION;
+    if (!run1stNegotiateAsClientDetail(sock, clientId, protocolName, version, serverId)) {
+        throw cybozu::Exception(__func__) << "version rejected" << protocolName << version;
+    }
     return serverId;
 }
 
 
 void run1stNegotiateAsServer(
     cybozu::Socket &sock, const std::string &serverId,
-    std::string &protocolName, std::string &clientId)
+    std::string &protocolName, std::string &clientId, uint32_t &version)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -58,13 +105,14 @@ void run1stNegotiateAsServer(
     pkt.read(clientId);
     pkt.read(protocolName);
     packet::Version ver(sock);
-    const bool isVersionSame = ver.recv();
+    const bool isVersionSupported = ver.recv();
     pkt.write(serverId);
     LOGs.debug() << FUNC << clientId << protocolName << ver.get();
 
-    if (!isVersionSame) {
+    if (!isVersionSupported) {
         throw cybozu::Exception(FUNC) << "version differ c/s" << ver.get() << packet::VERSION;
     }
+    version = std::min(ver.get(), packet::VERSION);
     ProtocolLogger logger(serverId, clientId);
     logger.debug() << "initial negotiation succeeded" << protocolName;
 }
@@ -154,13 +202,15 @@ void RequestWorker::operator()() noexcept
 #endif
     try {
         std::string clientId, protocolName;
+        uint32_t version;
         packet::Packet pkt(sock);
         bool sendErr = true;
         try {
-            run1stNegotiateAsServer(sock, nodeId, protocolName, clientId);
+            run1stNegotiateAsServer(sock, nodeId, protocolName, clientId, version);
             ServerHandler handler = findServerHandler(handlers, protocolName);
-            ServerParams serverParams(sock, clientId, ps);
+            ServerParams serverParams(sock, clientId, ps, version);
             pkt.write(msgOk);
+            if (version >= 2) pkt.write(packet::VERSION);
             pkt.flush();
             sendErr = false;
 #ifdef DEBUG_HANDLER
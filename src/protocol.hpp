@@ -9,6 +9,7 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <functional>
 #include <unordered_map>
 #include "cybozu/socket.hpp"
 #include "packet.hpp"
@@ -142,6 +143,21 @@ std::string run1stNegotiateAsClient(
     cybozu::Socket &sock,
     const std::string &clientId, const std::string &protocolName);
 
+/**
+ * Connect to a server and negotiate the newest version both sides support.
+ * The function above always uses packet::MIN_VERSION.
+ * A server older than packet::VERSION rejects it,
+ * so the socket is connected again to use packet::MIN_VERSION.
+ *
+ * @connect connect the socket. It may be called twice.
+ * @version will be the version of the connection.
+ * RETURN:
+ *   Server ID.
+ */
+std::string run1stNegotiateAsClient(
+    cybozu::Socket &sock, const std::function<void(cybozu::Socket &)> &connect,
+    const std::string &clientId, const std::string &protocolName, uint32_t &version);
+
 /**
  * Parameters for commands as a client.
  */
@@ -170,12 +186,13 @@ using ClientHandler = void (*)(ClientParams &);
  * @sock socket for the connection.
  * @protocolName will be set.
  * @clientId will be set.
+ * @version will be set to the version of the connection.
  *
  * This function will do only the common negotiation.
  */
 void run1stNegotiateAsServer(
     cybozu::Socket &sock, const std::string &serverId,
-    std::string &protocolName, std::string &clientId);
+    std::string &protocolName, std::string &clientId, uint32_t &version);
 
 /**
  * Parameters for commands as a server.
@@ -185,14 +202,17 @@ struct ServerParams
     cybozu::Socket &sock;
     const std::string& clientId;
     walb::ProcessStatus &ps;
+    uint32_t version; // version of the connection.
 
     ServerParams(
         cybozu::Socket &sock,
         const std::string &clientId,
-        walb::ProcessStatus &ps)
+        walb::ProcessStatus &ps,
+        uint32_t version = packet::MIN_VERSION)
         : sock(sock)
         , clientId(clientId)
-        , ps(ps) {
+        , ps(ps)
+        , version(version) {
     }
 };
 
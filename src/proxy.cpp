@@ -240,10 +240,22 @@ void c2pClearVolServer(protocol::ServerParams &p)
  *     pbs (uint32_t)
  *     salt (uint32_t)
  *     sizeLb (uint64_t)
+ *     maxLogSizePb (uint64_t)
+ *     request of WlogTransferOpt (if version >= 2)
+ *       cmprType (uint8_t)
+ *       cmprLevel (uint8_t)
+ *       batchKb (uint32_t)
+ *       maxChunks (uint32_t)
+ *       offload (bool)
  *   send "ok" or error message.
- *   recv wlog data
- *   recv diff (walb::MetaDiff)
- *   send ack.
+ *   send agreed WlogTransferOpt if ok (if version >= 2).
+ *     the request fields and maxDedupNr (uint64_t).
+ *   for each chunk:
+ *     recv wlog data, or wdiff data converted by the client if offload.
+ *     recv diff (walb::MetaDiff)
+ *     send ack.
+ *     recv hasNext (bool) if the agreed maxChunks > 1.
+ *       The client sends it and the next chunk without waiting for the ack.
  *
  * State transition: Started --> WlogRecv --> Started
  */
@@ -255,6 +267,7 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     cybozu::Uuid uuid;
     uint32_t pbs, salt;
     uint64_t volSizeLb, maxLogSizePb;
+    WlogTransferOpt opt;
 
     packet::Packet pkt(p.sock);
     pkt.read(volId);
@@ -263,7 +276,10 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     pkt.read(salt);
     pkt.read(volSizeLb);
     pkt.read(maxLogSizePb);
-    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+    opt.loadRequest(pkt, p.version);
+    LOGs.debug() << "recv" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb
+                 << p.version << int(opt.cmprType) << int(opt.cmprLevel) << opt.batchKb << opt.maxChunks
+                 << opt.isOffload;
 
     /* Decide to receive ok or not. */
     ProxyVolState &volSt = getProxyVolState(volId);
@@ -284,6 +300,13 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
         return;
     }
     pkt.write(msgAccept);
+    if (WlogTransferOpt::isExchanged(p.version)) {
+        std::tie(opt.cmprType, opt.cmprLevel) = decideWlogCmpr(opt.cmprType, opt.cmprLevel, gp.wlogCmprTypeV);
+        opt.batchKb = std::min<uint32_t>(opt.batchKb, MAX_WLOG_BATCH_KB);
+        opt.maxChunks = std::max<uint32_t>(opt.maxChunks, 1);
+        opt.maxDedupNr = gp.maxDedupNr;
+    }
+    opt.saveReply(pkt, p.version);
     pkt.flush();
 
     StateMachineTransaction tran(volSt.sm, pStarted, ptWlogRecv);
@@ -291,21 +314,53 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
 
     cybozu::Stopwatch stopwatch;
     ProxyVolInfo volInfo = getProxyVolInfo(volId);
+    for (uint32_t i = 0; i < opt.maxChunks; i++) {
+        if (i > 0) proxy_local::verifyDiskSpaceAvailable(maxLogSizeMb, FUNC);
+        if (!proxy_local::recvWlogChunk(p.sock, volId, uuid, pbs, salt, volSizeLb, opt.batchKb > 0,
+                                        opt.isOffload, opt.maxChunks == 1, logger)) {
+            logger.warn() << FUNC << "force stopped wlog receiving" << volId;
+            return;
+        }
+        bool hasNext = false;
+        if (opt.maxChunks > 1) pkt.read(hasNext);
+        if (!hasNext) break;
+        if (i + 1 == opt.maxChunks) {
+            throw cybozu::Exception(FUNC) << "too many chunks" << volId << opt.maxChunks;
+        }
+    }
+    ul.lock();
+    tran.commit(pStarted);
+    const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
+    logger.debug() << "wlog-transfer succeeded" << volId << elapsed;
+}
+
+
+namespace proxy_local {
+
+bool recvWlogChunk(cybozu::Socket &sock, const std::string &volId, const cybozu::Uuid &uuid,
+                   uint32_t pbs, uint32_t salt, uint64_t volSizeLb, bool isBatched, bool isOffload,
+                   bool isLast, Logger &logger)
+{
+    const char *const FUNC = __func__;
+    packet::Packet pkt(sock);
+    ProxyVolState &volSt = getProxyVolState(volId);
+    UniqueLock ul(volSt.mu, std::defer_lock);
+    ProxyVolInfo volInfo = getProxyVolInfo(volId);
     cybozu::TmpFile tmpFile(volInfo.getReceivedDir().str());
     cybozu::TmpFile wlogTmpFile;
     const bool savesWlog = false; // for DEBUG.
     if (savesWlog) wlogTmpFile.prepare(volInfo.getReceivedDir().str());
 #if 0 /* deprecated */
-    const bool ret = proxy_local::recvWlogAndWriteDiff(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+    const bool ret = recvWlogAndWriteDiff(
+        sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
 #else /* QQQ */
-    const bool ret = proxy_local::recvWlogAndWriteDiff2(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+    const bool ret = isOffload
+        ? recvWdiffAndVerify(sock, tmpFile.fd(), uuid, volSizeLb, volSt.stopState, gp.ps)
+        : recvWlogAndWriteDiff2(
+            sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd(), gp.maxDedupNr,
+            isBatched, gp.wlogConvThreads);
 #endif
-    if (!ret) {
-        logger.warn() << FUNC << "force stopped wlog receiving" << volId;
-        return;
-    }
+    if (!ret) return false;
     MetaDiff diff;
     pkt.read(diff);
     if (!diff.isClean()) {
@@ -323,7 +378,13 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     ul.lock();
     volInfo.addDiffToReceivedDir(diff);
     ul.unlock();
-    packet::Ack(p.sock).sendFin();
+    if (isLast) {
+        packet::Ack(sock).sendFin();
+    } else {
+        packet::Ack ack(sock);
+        ack.send();
+        ack.flush();
+    }
 
     ul.lock();
     volSt.actionState.clearAll();
@@ -335,17 +396,20 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
         getProxyGlobal().taskQueue.push(task, hi.wdiffSendDelaySec * 1000);
         logger.debug() << "task pushed" << task;
     }
+    if (shouldCompactWdiffs(volSt)) {
+        getProxyGlobal().taskQueue.push(ProxyTask(volId, ""), 0, IDLE_TASK_PRIORITY);
+    }
     const uint64_t realSizeLb = volInfo.getSizeLb();
     if (realSizeLb < volSizeLb) {
         logger.info() << "detect volume grow" << volId << realSizeLb << volSizeLb;
         volInfo.setSizeLb(volSizeLb);
     }
     volSt.lastWlogReceivedTime = ::time(0);
-    tran.commit(pStarted);
-    const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
-    logger.debug() << "wlog-transfer succeeded" << volId << elapsed;
+    return true;
 }
 
+} // namespace proxy_local
+
 
 void ProxyWorker::setupMerger(DiffMerger& merger, MetaDiffVec& diffV, MetaDiff& mergedDiff,
                               const ProxyVolInfo& volInfo, const std::string& archiveName)
@@ -437,12 +501,44 @@ int ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOpt)
         LOGs.debug() << FUNC << "another task is running" << volId << archiveName;
         return DONT_SEND;
     }
+    // A merged wdiff kept by a failed attempt for the same wdiffs is sent as it is.
+    const std::string cacheKey = proxy_local::makeWdiffCacheKey(hi.cmpr, diffV);
+    cybozu::util::File cacheFile;
+    DiffFileHeader cacheH;
+    const bool useCache = proxy_local::openWdiffCache(volInfo, archiveName, cacheKey, cacheFile, cacheH);
+    // With deduplication, the wdiffs are merged into a deduplicated indexed wdiff
+    // and it is sent as it is, so that the archive keeps it deduplicated.
+    const bool sendsIndexed = !useCache && gp.maxDedupNr > 0;
+    ZstdDictPtr zstdDict;
+    std::unique_ptr<ZstdDictTrainer> trainer;
+    if (!useCache && !sendsIndexed && gp.zstdDictKb > 0 && hi.cmpr.type == ::WALB_DIFF_CMPR_ZSTD) {
+        zstdDict = volSt.zstdDict;
+        if (!zstdDict || volSt.zstdDictTime + gp.zstdDictRetrainSec <= uint64_t(::time(0))) {
+            trainer.reset(new ZstdDictTrainer(gp.zstdDictKb * KIBI));
+        }
+    }
+    // Other archives waiting for the same wdiffs share the merge and compression.
+    std::vector<proxy_local::WdiffSendCompanionPtr> companionV;
+    if (!useCache && !sendsIndexed) {
+        companionV = proxy_local::findWdiffSendCompanions(volId, volSt, volInfo, archiveName, hi.cmpr, diffV);
+    }
 
     ul.unlock();
+    // Temporary files in the received directory will be removed at startup.
+    std::unique_ptr<cybozu::TmpFile> indexedTmp;
+    if (sendsIndexed) {
+        // This is done before connecting not to keep the archive waiting.
+        indexedTmp.reset(new cybozu::TmpFile(volInfo.getReceivedDir().str()));
+        const uint64_t dedupLb = merger.mergeToIndexedFd(indexedTmp->fd(), gp.maxDedupNr);
+        LOGs.debug() << FUNC << "dedup" << volId << dedupLb;
+    }
     cybozu::Socket sock;
-    util::connectWithTimeout(sock, hi.addrPort.getSocketAddr(), gp.socketTimeout);
-    gp.setSocketParams(sock);
-    const std::string serverId = protocol::run1stNegotiateAsClient(sock, gp.nodeId, wdiffTransferPN);
+    uint32_t version;
+    const std::string serverId = protocol::run1stNegotiateAsClient(
+        sock, [&](cybozu::Socket &s) {
+            util::connectWithTimeout(s, hi.addrPort.getSocketAddr(), gp.socketTimeout);
+            gp.setSocketParams(s);
+        }, gp.nodeId, wdiffTransferPN, version);
     ProtocolLogger logger(gp.nodeId, serverId);
 
     const DiffFileHeader& fileH = merger.header();
@@ -464,14 +560,79 @@ int ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOpt)
     pkt.read(res);
     if (res == msgAccept) {
         DiffStatistics statOut;
-        if (!wdiffTransferClient(pkt, merger, hi.cmpr, volSt.stopState, gp.ps, statOut)) {
+        std::unique_ptr<cybozu::TmpFile> cacheTmp;
+        std::exception_ptr ep;
+        bool isDone;
+        if (useCache) {
+            logger.info() << FUNC << "send the merged wdiff kept for retries" << volId << mergedDiff;
+            try {
+                isDone = wdiffTransferNoMergeClient(pkt, version, cacheFile, cacheH, volSt.stopState, gp.ps);
+            } catch (...) {
+                // It may be broken. Merge the wdiffs again next time.
+                volInfo.removeWdiffCache(archiveName);
+                throw;
+            }
+        } else if (indexedTmp) {
+            // The merged wdiff is kept for retries like the cache of sorted ones.
+            if (proxy_local::shouldCacheWdiffs(diffV)) cacheTmp = std::move(indexedTmp);
+            cybozu::TmpFile &tmpFile = cacheTmp ? *cacheTmp : *indexedTmp;
+            cybozu::util::File fileR(tmpFile.path(), O_RDONLY);
+            DiffFileHeader indexedH;
+            indexedH.readFrom(fileR);
+            try {
+                isDone = wdiffTransferNoMergeClient(pkt, version, fileR, indexedH, volSt.stopState, gp.ps);
+            } catch (...) {
+                if (cacheTmp) proxy_local::saveWdiffCache(volInfo, archiveName, *cacheTmp, cacheKey);
+                throw;
+            }
+            statOut = merger.statOut();
+        } else {
+            proxy_local::startWdiffSendToCompanions(
+                companionV, fileH.getUuid(), volInfo.getSizeLb(), mergedDiff);
+            if (proxy_local::shouldCacheWdiffs(diffV)) {
+                // Temporary files in the received directory will be removed at startup.
+                cacheTmp.reset(new cybozu::TmpFile(volInfo.getReceivedDir().str()));
+            }
+            if (companionV.empty() && !cacheTmp) {
+                isDone = wdiffTransferClient(pkt, version, merger, hi.cmpr, volSt.stopState, gp.ps, statOut,
+                                             zstdDict, trainer.get());
+            } else {
+                std::vector<packet::Packet *> pktV = {&pkt};
+                std::vector<uint32_t> versionV = {version};
+                for (proxy_local::WdiffSendCompanionPtr &cp : companionV) {
+                    pktV.push_back(cp->pkt.get());
+                    versionV.push_back(cp->version);
+                }
+                std::vector<std::exception_ptr> epV;
+                cybozu::util::File cacheW(cacheTmp ? cacheTmp->fd() : -1);
+                isDone = wdiffTransferMultiClient(pktV, versionV, merger, hi.cmpr, volSt.stopState, gp.ps, statOut,
+                                                  epV, zstdDict, trainer.get(), cacheTmp ? &cacheW : nullptr);
+                if (isDone) {
+                    proxy_local::finishWdiffSendToCompanions(companionV, &epV[1], volInfo, diffV);
+                    ep = epV[0];
+                    if (cacheTmp && epV.back()) cacheTmp.reset();
+                }
+            }
+        }
+        if (!isDone) {
             logger.warn() << FUNC << "force stopped wdiff sending" << volId;
             return DONT_SEND;
         }
-        packet::Ack(pkt.sock()).recv();
-        logger.debug() << "mergeIn " << volId << merger.statIn();
-        logger.debug() << "mergeOut" << volId << statOut;
-        logger.debug() << "mergeMemUsage" << volId << merger.memUsageStr();
+        try {
+            if (ep) std::rethrow_exception(ep);
+            packet::Ack(pkt.sock()).recv();
+        } catch (...) {
+            if (cacheTmp) proxy_local::saveWdiffCache(volInfo, archiveName, *cacheTmp, cacheKey);
+            throw;
+        }
+        if (useCache) {
+            volInfo.removeWdiffCache(archiveName);
+        } else {
+            if (trainer) proxy_local::updateZstdDict(volSt, *trainer, logger);
+            logger.debug() << "mergeIn " << volId << merger.statIn();
+            logger.debug() << "mergeOut" << volId << statOut;
+            logger.debug() << "mergeMemUsage" << volId << merger.memUsageStr();
+        }
         ul.lock();
         volSt.lastWdiffSentTimeMap[archiveName] = ::time(0);
         ul.unlock();
@@ -518,6 +679,14 @@ void ProxyWorker::operator()()
 {
     const char *const FUNC = __func__;
     TaskQueue<ProxyTask> &q = getProxyGlobal().taskQueue;
+    if (task_.archiveName.empty()) {
+        try {
+            proxy_local::compactWdiffs(task_.volId);
+        } catch (std::exception &e) {
+            LOGs.error() << FUNC << task_.volId << e.what();
+        }
+        return;
+    }
     try {
         PushOpt opt;
         const int ret = transferWdiffIfNecessary(opt);
@@ -669,12 +838,23 @@ StrVec getAllStatusAsStrVec()
     ret.push_back(fmt("nodeId %s", gp.nodeId.c_str()));
     ret.push_back(fmt("baseDir %s", gp.baseDirStr.c_str()));
     ret.push_back(fmt("maxWdiffSendMb %zu", gp.maxWdiffSendMb));
+    ret.push_back(fmt("wdiffCacheMb %zu", gp.wdiffCacheMb));
+    ret.push_back(fmt("wdiffCompactNr %zu", gp.wdiffCompactNr));
     ret.push_back(fmt("delaySecForRetry %zu", gp.delaySecForRetry));
     ret.push_back(fmt("retryTimeout %zu", gp.retryTimeout));
     ret.push_back(fmt("maxConnections %zu", gp.maxConnections));
     ret.push_back(fmt("maxForegroundTasks %zu", gp.maxForegroundTasks));
     ret.push_back(fmt("maxBackgroundTasks %zu", gp.maxBackgroundTasks));
     ret.push_back(fmt("maxConversionMb %zu", gp.maxConversionMb));
+    ret.push_back(fmt("maxDedupNr %zu", gp.maxDedupNr));
+    ret.push_back(fmt("wlogConvThreads %zu", gp.wlogConvThreads));
+    ret.push_back(fmt("zstdDictKb %zu", gp.zstdDictKb));
+    ret.push_back(fmt("zstdDictRetrainSec %zu", gp.zstdDictRetrainSec));
+    {
+        StrVec v;
+        for (int type : gp.wlogCmprTypeV) v.push_back(compressionTypeToStr(type));
+        ret.push_back(fmt("wlogCmprAccept %s", cybozu::util::concat(v, ",").c_str()));
+    }
     ret.push_back(fmt("socketTimeout %zu", gp.socketTimeout));
     ret.push_back(fmt("keepAlive %s", gp.keepAliveParams.toStr().c_str()));
 
@@ -1028,20 +1208,34 @@ bool recvWlogAndWriteDiff(
  */
 bool recvWlogAndWriteDiff2(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd, size_t maxDedupNr,
+    bool isBatched, size_t convThreads)
 {
     unusedVar(wlogFd);
 
     IndexedDiffWriter writer;
     writer.setFd(fd);
+    writer.setDedup(maxDedupNr);
 
     DiffFileHeader header;
     header.setUuid(uuid);
     header.type = WALB_DIFF_TYPE_INDEXED;
     writer.writeHeader(header);
 
+    if (convThreads > 0) {
+        WlogFrameReceiver frameR(sock);
+        const bool ret = recvWlogAndWriteDiffInPipeline(
+            [&](CompressedData &cd) { return frameR.recv(cd); }, writer,
+            pbs, salt, isBatched, convThreads, [&]() {
+                return stopState == ForceStopping || ps.isForceShutdown();
+            });
+        if (!ret) return false;
+        writer.finalize();
+        return true;
+    }
+
     LogPackHeader packH(pbs, salt);
-    WlogReceiver receiver(sock, pbs, salt);
+    WlogReceiver receiver(sock, pbs, salt, isBatched);
 
     while (receiver.popHeader(packH)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -1061,6 +1255,54 @@ bool recvWlogAndWriteDiff2(
     return true;
 }
 
+/**
+ * The wdiff is verified entirely before being registered
+ * because it has been made by the client.
+ */
+bool recvWdiffAndVerify(
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint64_t volSizeLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps)
+{
+    const char *const FUNC = __func__;
+    cybozu::util::File file(fd);
+    const bool ret = recvWdiffStream(sock, file, [&]() {
+            return stopState == ForceStopping || ps.isForceShutdown();
+        });
+    if (!ret) return false;
+
+    IndexedDiffCache cache;
+    IndexedDiffReader reader;
+    reader.setFile(cybozu::util::File(fd), cache);
+    if (reader.header().getUuid() != uuid) {
+        throw cybozu::Exception(FUNC) << "uuid differs" << reader.header().getUuid() << uuid;
+    }
+    IndexedDiffRecord rec;
+    while (reader.readDiffRecord(rec, true)) {
+        if (volSizeLb < rec.endIoAddress()) {
+            throw cybozu::Exception(FUNC) << "IO out of volume" << rec << volSizeLb;
+        }
+        reader.verifyIo(rec);
+    }
+    return true;
+}
+
+
+void updateZstdDict(ProxyVolState &volSt, const ZstdDictTrainer &trainer, Logger &logger)
+{
+    const ZstdDictPtr dict = trainer.train();
+    if (!dict) {
+        logger.debug() << "zstd dictionary training skipped"
+                       << trainer.getSamplesNr() << trainer.getSamplesSize();
+        return;
+    }
+    UniqueLock ul(volSt.mu);
+    volSt.zstdDict = dict;
+    volSt.zstdDictTime = ::time(0);
+    ul.unlock();
+    logger.info() << "zstd dictionary trained" << dict->getId() << dict->data().size()
+                  << trainer.getSamplesNr() << trainer.getSamplesSize();
+}
+
 
 void isWdiffSendError(protocol::GetCommandParams &p)
 {
@@ -1161,6 +1403,278 @@ void getProxyDiffList(protocol::GetCommandParams &p)
     protocol::sendValueAndFin(p, v);
 }
 
+std::vector<WdiffSendCompanionPtr> findWdiffSendCompanions(
+    const std::string &volId, ProxyVolState &volSt, const ProxyVolInfo &volInfo,
+    const std::string &archiveName, const CompressOpt &cmpr, const MetaDiffVec &diffV)
+{
+    std::vector<WdiffSendCompanionPtr> ret;
+    for (const std::string &name : volSt.archiveSet) {
+        if (name == archiveName || volSt.actionState.get(name)) continue;
+        HostInfoForBkp hi = volInfo.getArchiveInfo(name);
+        if (hi.cmpr != cmpr) continue;
+        const MetaDiffVec v = volInfo.getDiffListToSend(name, gp.maxWdiffSendMb * MEBI, gp.maxWdiffSendNr);
+        if (v.size() < diffV.size() || !std::equal(diffV.begin(), diffV.end(), v.begin())) continue;
+        std::unique_ptr<ActionCounterTransaction> trans(new ActionCounterTransaction(volSt.ac, name));
+        if (trans->count() > 0) continue;
+        WdiffSendCompanionPtr cp(new WdiffSendCompanion());
+        cp->volId = volId;
+        cp->archiveName = name;
+        cp->hi = std::move(hi);
+        cp->trans = std::move(trans);
+        ret.push_back(std::move(cp));
+    }
+    return ret;
+}
+
+void startWdiffSendToCompanions(
+    std::vector<WdiffSendCompanionPtr> &companionV, const cybozu::Uuid &uuid,
+    uint64_t sizeLb, const MetaDiff &mergedDiff)
+{
+    const char *const FUNC = __func__;
+    std::vector<WdiffSendCompanionPtr> v;
+    for (WdiffSendCompanionPtr &cp : companionV) {
+        try {
+            const std::string serverId = protocol::run1stNegotiateAsClient(
+                cp->sock, [&](cybozu::Socket &s) {
+                    util::connectWithTimeout(s, cp->hi.addrPort.getSocketAddr(), gp.socketTimeout);
+                    gp.setSocketParams(s);
+                }, gp.nodeId, wdiffTransferPN, cp->version);
+            cp->logger.reset(new ProtocolLogger(gp.nodeId, serverId));
+            cp->pkt.reset(new packet::Packet(cp->sock));
+            packet::Packet &pkt = *cp->pkt;
+            pkt.write(cp->volId);
+            pkt.write(proxyHT);
+            pkt.write(uuid);
+            const uint32_t maxIoBlocks = 0; // unused
+            pkt.write(maxIoBlocks);
+            pkt.write(sizeLb);
+            pkt.write(mergedDiff);
+            pkt.flush();
+            std::string res;
+            pkt.read(res);
+            if (res == msgAccept) {
+                v.push_back(std::move(cp));
+            } else {
+                // Its own task will deal with the response.
+                cp->logger->debug() << FUNC << res << cp->volId << cp->archiveName << mergedDiff;
+            }
+        } catch (std::exception &e) {
+            LOGs.warn() << FUNC << cp->volId << cp->archiveName << e.what();
+            cp->delaySec = gp.delaySecForRetry;
+        }
+    }
+    companionV = std::move(v);
+}
+
+void finishWdiffSendToCompanions(
+    std::vector<WdiffSendCompanionPtr> &companionV, const std::exception_ptr *epV,
+    ProxyVolInfo &volInfo, const MetaDiffVec &diffV)
+{
+    const char *const FUNC = __func__;
+    for (size_t i = 0; i < companionV.size(); i++) {
+        WdiffSendCompanion &cp = *companionV[i];
+        try {
+            if (epV[i]) std::rethrow_exception(epV[i]);
+            packet::Ack(cp.sock).recv();
+            ProxyVolState &volSt = getProxyVolState(cp.volId);
+            UniqueLock ul(volSt.mu);
+            volSt.lastWdiffSentTimeMap[cp.archiveName] = ::time(0);
+            ul.unlock();
+            volInfo.deleteDiffs(diffV, cp.archiveName);
+            volInfo.removeWdiffCache(cp.archiveName);
+            cp.logger->debug() << FUNC << "wdiffs sent" << cp.volId << cp.archiveName << diffV.size();
+        } catch (std::exception &e) {
+            cp.logger->warn() << FUNC << cp.volId << cp.archiveName << e.what();
+            cp.delaySec = gp.delaySecForRetry;
+        }
+    }
+    companionV.clear();
+}
+
+std::string makeWdiffCacheKey(const CompressOpt &cmpr, const MetaDiffVec &diffV)
+{
+    std::string key = cybozu::util::formatString("%d %d", cmpr.type, cmpr.level);
+    for (const MetaDiff &diff : diffV) {
+        key += ' ';
+        key += createDiffFileName(diff);
+    }
+    return key;
+}
+
+bool shouldCacheWdiffs(const MetaDiffVec &diffV)
+{
+    uint64_t total = 0;
+    for (const MetaDiff &diff : diffV) total += diff.dataSize;
+    return gp.wdiffCacheMb > 0 && total <= gp.wdiffCacheMb * MEBI;
+}
+
+bool openWdiffCache(ProxyVolInfo &volInfo, const std::string &archiveName, const std::string &key,
+                    cybozu::util::File &file, DiffFileHeader &fileH)
+{
+    const char *const FUNC = __func__;
+    try {
+        if (!volInfo.openWdiffCache(archiveName, key, file)) return false;
+        fileH.readFrom(file);
+        const uint32_t dictId = fileH.getDictId();
+        if (dictId == 0 || getZstdDictRegistry().get(dictId)) return true;
+        LOGs.info() << FUNC << "dictionary not found" << volInfo.volId << archiveName << dictId;
+    } catch (std::exception &e) {
+        LOGs.warn() << FUNC << volInfo.volId << archiveName << e.what();
+    }
+    volInfo.removeWdiffCache(archiveName);
+    return false;
+}
+
+void saveWdiffCache(ProxyVolInfo &volInfo, const std::string &archiveName,
+                    cybozu::TmpFile &tmpFile, const std::string &key) noexcept
+{
+    const char *const FUNC = __func__;
+    try {
+        volInfo.saveWdiffCache(archiveName, tmpFile, key);
+        LOGs.info() << FUNC << "merged wdiff kept for retries" << volInfo.volId << archiveName;
+    } catch (std::exception &e) {
+        LOGs.warn() << FUNC << volInfo.volId << archiveName << e.what();
+    }
+}
+
+bool shouldCompactWdiffs(ProxyVolState &volSt)
+{
+    if (gp.wdiffCompactNr == 0) return false;
+    for (const std::string &archiveName : volSt.archiveSet) {
+        if (volSt.diffMgrMap.get(archiveName).size() >= gp.wdiffCompactNr) return true;
+    }
+    return false;
+}
+
+/**
+ * Merge diffV into a wdiff, and replace them by it in the archives.
+ * diffV will be truncated at an uuid change.
+ * RETURN:
+ *   false if there is nothing to merge.
+ */
+static bool mergeWdiffRun(ProxyVolInfo &volInfo, MetaDiffVec &diffV, const StrVec &archiveV)
+{
+    const char *const FUNC = __func__;
+    std::vector<cybozu::util::File> fileV;
+    cybozu::Uuid uuid;
+    for (const MetaDiff &diff : diffV) {
+        cybozu::util::File file(volInfo.getDiffPath(diff, archiveV[0]).str(), O_RDONLY);
+        DiffFileHeader header;
+        header.readFrom(file);
+        if (fileV.empty()) {
+            uuid = header.getUuid();
+        } else if (uuid != header.getUuid()) {
+            diffV.resize(fileV.size());
+            break;
+        }
+        file.lseek(0, SEEK_SET);
+        fileV.push_back(std::move(file));
+    }
+    if (fileV.size() < 2) return false;
+
+    MetaDiff mergedDiff = merge(diffV);
+    // Temporary files in the received directory will be removed at startup.
+    cybozu::TmpFile tmpFile(volInfo.getReceivedDir().str());
+    DiffMerger merger;
+    merger.setMaxCacheSize(INDEXED_DIFF_CACHE_SIZE);
+    merger.addWdiffs(std::move(fileV));
+    if (gp.maxDedupNr > 0) {
+        // Keep the wdiffs deduplicated while they stay in the proxy.
+        const uint64_t dedupLb = merger.mergeToIndexedFd(tmpFile.fd(), gp.maxDedupNr);
+        LOGs.debug() << FUNC << "dedup" << volInfo.volId << dedupLb;
+    } else {
+        merger.mergeToFd(tmpFile.fd());
+    }
+    mergedDiff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
+    const cybozu::FilePath path = volInfo.getDiffPath(mergedDiff, archiveV[0]);
+    tmpFile.save(path.str());
+    for (const std::string &archiveName : archiveV) {
+        const cybozu::FilePath linkPath = volInfo.getDiffPath(mergedDiff, archiveName);
+        int err;
+        if (linkPath != path && !path.link(linkPath, &err) && err != EEXIST) {
+            throw cybozu::Exception(FUNC) << "link failed" << linkPath.str() << cybozu::ErrorNo(err);
+        }
+        volInfo.addDiffToSendtoDir(mergedDiff, archiveName);
+        volInfo.deleteDiffs(diffV, archiveName);
+    }
+    LOGs.debug() << FUNC << "mergeIn " << volInfo.volId << merger.statIn();
+    LOGs.debug() << FUNC << "mergeOut" << volInfo.volId << merger.statOut();
+    LOGs.info() << FUNC << "pre-merged" << volInfo.volId << diffV.size() << mergedDiff << cybozu::util::concat(archiveV, ",");
+    return true;
+}
+
+size_t compactWdiffs(const std::string &volId)
+{
+    const char *const FUNC = __func__;
+    ProxyVolState &volSt = getProxyVolState(volId);
+    TaskQueue<ProxyTask> &q = getProxyGlobal().taskQueue;
+    UniqueLock ul(volSt.mu);
+    if (volSt.stopState != NotStopping || !isStateIn(volSt.sm.get(), pAcceptForWdiffSend)) return 0;
+    ProxyVolInfo volInfo = getProxyVolInfo(volId);
+
+    std::vector<std::unique_ptr<ActionCounterTransaction> > transV;
+    StrVec heldV;
+    std::map<std::string, StrVec> archivesOf; // key: wdiff file name.
+    MetaDiffVec allV;
+    for (const std::string &archiveName : volSt.archiveSet) {
+        std::unique_ptr<ActionCounterTransaction> trans(new ActionCounterTransaction(volSt.ac, archiveName));
+        if (trans->count() > 0 || volInfo.existsWdiffCache(archiveName)) continue;
+        for (const MetaDiff &diff : volInfo.getAllDiffsInSendtoDir(archiveName)) {
+            StrVec &v = archivesOf[createDiffFileName(diff)];
+            if (v.empty()) allV.push_back(diff);
+            v.push_back(archiveName);
+        }
+        transV.push_back(std::move(trans));
+        if (!volSt.actionState.get(archiveName)) heldV.push_back(archiveName);
+    }
+    ul.unlock();
+    std::sort(allV.begin(), allV.end(), [](const MetaDiff &lhs, const MetaDiff &rhs) {
+            return std::make_pair(lhs.snapB.gidB, lhs.snapE.gidB) < std::make_pair(rhs.snapB.gidB, rhs.snapE.gidB);
+        });
+
+    size_t nrMerged = 0;
+    size_t i = 0;
+    while (i < allV.size()) {
+        if (volSt.stopState != NotStopping || gp.ps.isForceShutdown()) break;
+        if (q.hasReadyTask(0)) {
+            // Let the other tasks run first.
+            q.push(ProxyTask(volId, ""), 0, IDLE_TASK_PRIORITY);
+            break;
+        }
+        MetaDiffVec diffV = {allV[i]};
+        const StrVec &archiveV = archivesOf[createDiffFileName(allV[i])];
+        MetaDiff mergedDiff = allV[i];
+        uint64_t totalSize = allV[i].dataSize;
+        const size_t bgn = i;
+        i++;
+        if (!mergedDiff.isClean() || mergedDiff.isCompDiff) continue;
+        while (i < allV.size() && diffV.size() < gp.maxWdiffSendNr) {
+            const MetaDiff &diff = allV[i];
+            if (!diff.isClean() || !canMerge(mergedDiff, diff)) break;
+            if (archivesOf[createDiffFileName(diff)] != archiveV) break;
+            if (totalSize + diff.dataSize > gp.maxWdiffSendMb * MEBI) break;
+            mergedDiff.merge(diff);
+            totalSize += diff.dataSize;
+            diffV.push_back(diff);
+            i++;
+        }
+        if (diffV.size() < 2) continue;
+        try {
+            if (mergeWdiffRun(volInfo, diffV, archiveV)) nrMerged += diffV.size();
+            // The rest after an uuid change will be the next run.
+            i = bgn + diffV.size();
+        } catch (std::exception &e) {
+            LOGs.warn() << FUNC << volId << e.what();
+        }
+    }
+
+    // Tasks of the archives may have been skipped while they were held.
+    // Those that stopped by errors are left as they are.
+    transV.clear();
+    for (const std::string &archiveName : heldV) q.push(ProxyTask(volId, archiveName));
+    return nrMerged;
+}
+
 } // namespace proxy_local
 
 } // namespace walb
@@ -79,11 +79,19 @@ struct ProxyVolState
      * Key is archiveName, value is the corresponding timestamp.
      */
     std::map<std::string, uint64_t> lastWdiffSentTimeMap;
+    /**
+     * Zstd dictionary trained from wdiffs recently sent, and its trained time.
+     * Lock of mu is required to access these.
+     * The dictionary is not persistent and it will be trained again after restart.
+     */
+    ZstdDictPtr zstdDict;
+    uint64_t zstdDictTime;
 
     explicit ProxyVolState(const std::string &volId)
         : stopState(NotStopping), sm(mu), ac(mu), actionState(mu)
         , diffMgr(), diffMgrMap(), archiveSet()
-        , lastWlogReceivedTime(0), lastWdiffSentTimeMap() {
+        , lastWlogReceivedTime(0), lastWdiffSentTimeMap()
+        , zstdDict(), zstdDictTime(0) {
         sm.init(statePairTbl);
         initInner(volId);
     }
@@ -91,6 +99,10 @@ private:
     void initInner(const std::string &volId);
 };
 
+/**
+ * A task to send wdiffs of a volume to an archive.
+ * A task with empty archiveName pre-merges wdiffs of the volume instead.
+ */
 struct ProxyTask
 {
     std::string volId;
@@ -156,12 +168,19 @@ struct ProxySingleton
     std::string baseDirStr;
     size_t maxWdiffSendMb;
     size_t maxWdiffSendNr;
+    size_t wdiffCacheMb; // merged wdiffs kept for retries of wdiff-transfer. 0 means disabled.
+    size_t wdiffCompactNr; // pre-merge wdiffs if an archive has this number of them. 0 means disabled.
     size_t delaySecForRetry;
     size_t retryTimeout;
     size_t maxConnections;
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
     size_t maxConversionMb;
+    size_t maxDedupNr; // for wlog-wdiff conversion, pre-merge, and wdiff-transfer. 0 means disabled.
+    size_t wlogConvThreads; // for wlog-wdiff conversion. 0 means no pipelining.
+    size_t zstdDictKb; // per-volume zstd dictionary for wdiff-transfer. 0 means disabled.
+    size_t zstdDictRetrainSec;
+    std::vector<int> wlogCmprTypeV; // compression types accepted for wlog-transfer.
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     bool allowExec;
@@ -233,6 +252,88 @@ inline void verifyDiskSpaceAvailable(uint64_t maxLogSizeMb, const char *msg)
     }
 }
 
+/**
+ * Another archive that receives the same wdiffs in a wdiff-transfer task of an archive.
+ * Its task is regarded as running while this exists,
+ * and it is pushed again at the end because it may have been skipped meanwhile.
+ */
+struct WdiffSendCompanion
+{
+    std::string volId;
+    std::string archiveName;
+    HostInfoForBkp hi;
+    std::unique_ptr<ActionCounterTransaction> trans;
+    cybozu::Socket sock;
+    uint32_t version; // of the connection.
+    std::unique_ptr<packet::Packet> pkt;
+    std::unique_ptr<ProtocolLogger> logger;
+    size_t delaySec; // to push its task.
+
+    WdiffSendCompanion() : version(packet::MIN_VERSION), delaySec(0) {}
+    ~WdiffSendCompanion() noexcept try {
+        if (!trans) return;
+        trans->close();
+        getProxyGlobal().taskQueue.push(ProxyTask(volId, archiveName), delaySec * 1000);
+    } catch (...) {
+    }
+};
+using WdiffSendCompanionPtr = std::unique_ptr<WdiffSendCompanion>;
+
+/**
+ * Find archives whose wdiffs to send start with diffV and whose compression options are cmpr.
+ * volSt.mu must be held.
+ */
+std::vector<WdiffSendCompanionPtr> findWdiffSendCompanions(
+    const std::string &volId, ProxyVolState &volSt, const ProxyVolInfo &volInfo,
+    const std::string &archiveName, const CompressOpt &cmpr, const MetaDiffVec &diffV);
+/**
+ * Start wdiff-transfer to the companions.
+ * Those that failed or did not accept are removed from companionV.
+ */
+void startWdiffSendToCompanions(
+    std::vector<WdiffSendCompanionPtr> &companionV, const cybozu::Uuid &uuid,
+    uint64_t sizeLb, const MetaDiff &mergedDiff);
+/**
+ * Settle the companions after wdiffTransferMultiClient().
+ * epV[i] must be the error of companionV[i].
+ */
+void finishWdiffSendToCompanions(
+    std::vector<WdiffSendCompanionPtr> &companionV, const std::exception_ptr *epV,
+    ProxyVolInfo &volInfo, const MetaDiffVec &diffV);
+
+/**
+ * A merged wdiff is kept for retries of wdiff-transfer to an archive
+ * until the wdiffs to send or the compression options change.
+ */
+std::string makeWdiffCacheKey(const CompressOpt &cmpr, const MetaDiffVec &diffV);
+bool shouldCacheWdiffs(const MetaDiffVec &diffV);
+/**
+ * Open the merged wdiff for the key and read its header.
+ * RETURN:
+ *   false if it is not available. A broken one will be removed.
+ */
+bool openWdiffCache(ProxyVolInfo &volInfo, const std::string &archiveName, const std::string &key,
+                    cybozu::util::File &file, DiffFileHeader &fileH);
+void saveWdiffCache(ProxyVolInfo &volInfo, const std::string &archiveName,
+                    cybozu::TmpFile &tmpFile, const std::string &key) noexcept;
+
+/**
+ * Whether an archive has enough wdiffs to pre-merge.
+ * volSt.mu must be held.
+ */
+bool shouldCompactWdiffs(ProxyVolState &volSt);
+/**
+ * Pre-merge runs of adjacent clean wdiffs pending for the archives of a volume.
+ * A run does not cross a snapshot boundary nor the first wdiff of any archive,
+ * so each archive has all or none of it. The merged wdiff is hard-linked
+ * into the sendto directories of the archives having the run.
+ * Archives under wdiff-transfer or keeping a merged wdiff for retries are skipped.
+ * It stops when another task gets ready, and pushes itself again.
+ * RETURN:
+ *   number of wdiffs merged.
+ */
+size_t compactWdiffs(const std::string &volId);
+
 StrVec getAllStatusAsStrVec();
 StrVec getVolStatusAsStrVec(const std::string &volId);
 void pushAllTasksForVol(const std::string &volId, Logger *loggerP = nullptr);
@@ -271,12 +372,39 @@ void addArchiveInfo(const std::string &volId, const std::string &archiveName, co
                     bool ensureNotExistance);
 void deleteArchiveInfo(const std::string &volId, const std::string &archiveName);
 
+/**
+ * Receive a chunk of wlog-transfer and register the converted diff.
+ * @isOffload the client sends a wdiff converted by itself instead of wlogs.
+ * @isLast the ack is sent with fin if true.
+ * RETURN:
+ *   false if force stopped.
+ */
+bool recvWlogChunk(cybozu::Socket &sock, const std::string &volId, const cybozu::Uuid &uuid,
+                   uint32_t pbs, uint32_t salt, uint64_t volSizeLb, bool isBatched, bool isOffload,
+                   bool isLast, Logger &logger);
 bool recvWlogAndWriteDiff(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
     const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+/**
+ * @convThreads number of threads for each of decompression and compression
+ *   in a pipeline. 0 means converting on the caller thread.
+ */
 bool recvWlogAndWriteDiff2(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd, size_t maxDedupNr = 0,
+    bool isBatched = false, size_t convThreads = 0);
+/**
+ * Receive an indexed wdiff made by a storage server and verify it.
+ */
+bool recvWdiffAndVerify(
+    cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint64_t volSizeLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps);
+
+/**
+ * Replace the zstd dictionary of a volume with one trained from the samples.
+ * It keeps the current one if training fails.
+ */
+void updateZstdDict(ProxyVolState &volSt, const ZstdDictTrainer &trainer, Logger &logger);
 
 
 inline void getState(protocol::GetCommandParams &p)
@@ -50,6 +50,8 @@ const struct StateMachine::Pair statePairTbl[] = {
 
 const char *const ArchiveSuffix = ".archive";
 const char *const ArchiveExtension = "archive";
+const char *const WdiffCacheName = "wdiff-cache";
+const char *const WdiffCacheKeyName = "wdiff-cache-key";
 
 const StrVec pAcceptForWdiffSend = { pStarted, ptWlogRecv, ptWaitForEmpty };
 
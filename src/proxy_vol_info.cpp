@@ -66,6 +66,44 @@ cybozu::FilePath ProxyVolInfo::getDiffPath(const MetaDiff &diff, const std::stri
 }
 
 
+void ProxyVolInfo::saveWdiffCache(const std::string &archiveName, cybozu::TmpFile &tmpFile, const std::string &key)
+{
+    const cybozu::FilePath dir = getSendtoDir(archiveName);
+    removeWdiffCache(archiveName);
+    tmpFile.save((dir + WdiffCacheName).str());
+    // The key is saved last so that a partially saved cache will never be used.
+    util::saveFile(dir, WdiffCacheKeyName, key);
+}
+
+
+bool ProxyVolInfo::openWdiffCache(const std::string &archiveName, const std::string &key, cybozu::util::File &file)
+{
+    const cybozu::FilePath dir = getSendtoDir(archiveName);
+    if (!(dir + WdiffCacheKeyName).stat().isFile()) return false;
+    std::string savedKey;
+    util::loadFile(dir, WdiffCacheKeyName, savedKey);
+    if (savedKey != key) {
+        removeWdiffCache(archiveName);
+        return false;
+    }
+    return file.open((dir + WdiffCacheName).str(), O_RDONLY);
+}
+
+
+void ProxyVolInfo::removeWdiffCache(const std::string &archiveName)
+{
+    const cybozu::FilePath dir = getSendtoDir(archiveName);
+    for (const char *name : {WdiffCacheKeyName, WdiffCacheName}) {
+        const cybozu::FilePath path = dir + name;
+        int err;
+        if (!path.unlink(&err) && err != ENOENT) {
+            throw cybozu::Exception("ProxyVolInfo::removeWdiffCache:unlink failed")
+                << path.str() << cybozu::ErrorNo(err);
+        }
+    }
+}
+
+
 StrVec ProxyVolInfo::getArchiveNameList() const
 {
     StrVec bnameV, fnameV;
@@ -130,6 +130,18 @@ public:
             diffMgr_.add(diff);
         }
     }
+    /**
+     * Call this after settle the corresponding wdiff file in the sendto directory.
+     */
+    void addDiffToSendtoDir(const MetaDiff &diff, const std::string &archiveName) {
+        MetaDiffManager &mgr = diffMgrMap_.get(archiveName);
+        if (!mgr.exists(diff)) {
+            mgr.add(diff);
+        }
+    }
+    MetaDiffVec getAllDiffsInSendtoDir(const std::string &archiveName) const {
+        return diffMgrMap_.get(archiveName).getAll();
+    }
     MetaDiffVec tryToMakeHardlinkInSendtoDir();
     /**
      * Try make a hard link of a diff file in all the archive directories.
@@ -156,6 +168,21 @@ public:
         WalbDiffFiles wdiffs(mgr, isReceived ? getReceivedDir().str() : getSendtoDir(archiveName).str());
         wdiffs.removeDiffs(diffV);
     }
+    /**
+     * A merged wdiff file is kept in the sendto directory for retries of wdiff-transfer.
+     * The key identifies the wdiffs merged into it and how it was compressed.
+     */
+    void saveWdiffCache(const std::string &archiveName, cybozu::TmpFile &tmpFile, const std::string &key);
+    /**
+     * RETURN:
+     *   false if there is no cache with the key.
+     *   A cache with another key will be removed.
+     */
+    bool openWdiffCache(const std::string &archiveName, const std::string &key, cybozu::util::File &file);
+    void removeWdiffCache(const std::string &archiveName);
+    bool existsWdiffCache(const std::string &archiveName) const {
+        return (getSendtoDir(archiveName) + WdiffCacheKeyName).stat().isFile();
+    }
     cybozu::FilePath getReceivedDir() const {
         return volDir + "received";
     }
@@ -0,0 +1,254 @@
+#pragma once
+/**
+ * @file
+ * @brief Adaptive read-ahead for sequential readers.
+ */
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <cinttypes>
+#include "util.hpp"
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * Statistics of a sequential reader.
+ */
+struct ReadAheadStat
+{
+    uint64_t ioNr;
+    uint64_t bytes;
+    uint64_t elapsedUs; // since the first IO.
+    uint64_t latencyUs; // sum of the latency of the IOs.
+    uint64_t qdSum; // sum of the queue depth at each submission.
+    size_t ioSize; // current IO size [byte].
+    size_t windowSize; // current read-ahead size [byte].
+
+    ReadAheadStat()
+        : ioNr(0), bytes(0), elapsedUs(0), latencyUs(0), qdSum(0)
+        , ioSize(0), windowSize(0) {
+    }
+    double getIops() const {
+        return elapsedUs == 0 ? 0 : ioNr * 1000000.0 / elapsedUs;
+    }
+    double getMbPerSec() const {
+        return elapsedUs == 0 ? 0 : bytes / double(1U << 20) * 1000000.0 / elapsedUs;
+    }
+    double getAvgQueueDepth() const {
+        return ioNr == 0 ? 0 : qdSum / double(ioNr);
+    }
+    double getAvgLatencyUs() const {
+        return ioNr == 0 ? 0 : latencyUs / double(ioNr);
+    }
+    std::string toStr() const {
+        return cybozu::util::formatString(
+            "iops %.0f mbps %.1f qd %.1f latencyUs %.0f ioKb %zu windowKb %zu"
+            , getIops(), getMbPerSec(), getAvgQueueDepth(), getAvgLatencyUs()
+            , ioSize >> 10, windowSize >> 10);
+    }
+};
+
+/**
+ * Decide the IO size and the read-ahead size (that is the queue depth multiplied by the IO size)
+ * of a sequential reader within the caps.
+ *
+ * It starts with small sizes and grows one of them at a time
+ * while the reader is waiting for IOs to complete, that is the device is the bottleneck.
+ * A step is undone if it did not improve the throughput,
+ * and the sizes are kept for a while after no more step helps.
+ */
+class ReadAheadTuner
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = Clock::time_point;
+
+    static constexpr size_t INITIAL_IO_SIZE = 64U << 10; /* 64KiB */
+    static constexpr size_t INITIAL_WINDOW_SIZE = 4U << 20; /* 4MiB */
+    /**
+     * A period to measure the throughput spans this number of windows at least,
+     * and MIN_PERIOD_MS.
+     */
+    static constexpr size_t PERIOD_WINDOWS = 4;
+    static constexpr uint64_t MIN_PERIOD_MS = 100;
+    /**
+     * Grow the sizes if the reader waits for IOs longer than this in a period.
+     */
+    static constexpr uint64_t STALL_PERMILLE = 200;
+    /**
+     * A step must improve the throughput by this.
+     */
+    static constexpr uint64_t GAIN_PERMILLE = 50;
+    /**
+     * Number of periods to keep the sizes after no step helps.
+     */
+    static constexpr size_t HOLD_PERIODS = 64;
+
+private:
+    enum Step { NONE, GROW_IO, GROW_WINDOW };
+
+    size_t maxIoSize_;
+    size_t maxWindowSize_;
+    size_t ioSize_;
+    size_t windowSize_;
+
+    Step lastStep_;
+    size_t prevIoSize_;
+    size_t prevWindowSize_;
+    bool isIoSettled_;
+    bool isWindowSettled_;
+    size_t holdPeriods_;
+    double lastBytesPerSec_;
+
+    bool isStarted_;
+    TimePoint bgnTs_;
+    TimePoint periodTs_;
+    uint64_t periodBytes_;
+    uint64_t periodStallUs_;
+    ReadAheadStat stat_;
+
+public:
+    static constexpr const char *NAME() { return "ReadAheadTuner"; }
+    /**
+     * @maxWindowSize max read-ahead size [byte].
+     * @maxIoSize max IO size [byte].
+     *   Both must be multiples of pbs.
+     */
+    ReadAheadTuner(size_t maxWindowSize, size_t maxIoSize, size_t pbs)
+        : maxIoSize_(std::min(maxIoSize, maxWindowSize))
+        , maxWindowSize_(maxWindowSize)
+        , ioSize_(), windowSize_()
+        , lastStep_(NONE), prevIoSize_(0), prevWindowSize_(0)
+        , isIoSettled_(false), isWindowSettled_(false), holdPeriods_(0), lastBytesPerSec_(0)
+        , isStarted_(false), bgnTs_(), periodTs_(), periodBytes_(0), periodStallUs_(0), stat_() {
+        if (pbs == 0 || maxIoSize_ == 0 || maxIoSize_ % pbs != 0 || maxWindowSize_ % pbs != 0) {
+            throw cybozu::Exception(NAME()) << "bad sizes" << maxWindowSize << maxIoSize << pbs;
+        }
+        ioSize_ = getInitialIoSize(maxWindowSize, maxIoSize, pbs);
+        windowSize_ = std::min(std::max(INITIAL_WINDOW_SIZE, ioSize_), maxWindowSize_);
+        stat_.ioSize = ioSize_;
+        stat_.windowSize = windowSize_;
+    }
+    /**
+     * The IO size never gets smaller than this.
+     */
+    static size_t getInitialIoSize(size_t maxWindowSize, size_t maxIoSize, size_t pbs) {
+        if (pbs == 0) return 0;
+        const size_t s = std::max(INITIAL_IO_SIZE / pbs * pbs, pbs);
+        return std::min(s, std::min(maxIoSize, maxWindowSize));
+    }
+    /**
+     * Max number of IOs in flight.
+     * Two more IOs for those split at the edges of ring buffers.
+     */
+    static size_t getMaxQueueDepth(size_t maxWindowSize, size_t maxIoSize, size_t pbs) {
+        const size_t s = getInitialIoSize(maxWindowSize, maxIoSize, pbs);
+        return (s == 0 ? 0 : maxWindowSize / s) + 2;
+    }
+    size_t ioSize() const { return ioSize_; }
+    size_t windowSize() const { return windowSize_; }
+    /**
+     * @queueDepth number of IOs in flight including the submitted one.
+     */
+    void submitted(size_t queueDepth, TimePoint now = Clock::now()) {
+        if (!isStarted_) {
+            isStarted_ = true;
+            bgnTs_ = now;
+            periodTs_ = now;
+        }
+        stat_.qdSum += queueDepth;
+    }
+    /**
+     * @size IO size [byte].
+     * @latencyUs time from the submission to the completion seen by the reader.
+     * @stallUs time the reader waited for the IO.
+     * RETURN:
+     *   true if a period finished. The sizes may have changed.
+     */
+    bool completed(size_t size, uint64_t latencyUs, uint64_t stallUs, TimePoint now = Clock::now()) {
+        stat_.ioNr++;
+        stat_.bytes += size;
+        stat_.latencyUs += latencyUs;
+        periodBytes_ += size;
+        periodStallUs_ += stallUs;
+        const uint64_t us = elapsedUs(periodTs_, now);
+        if (periodBytes_ < PERIOD_WINDOWS * windowSize_ || us < MIN_PERIOD_MS * 1000) return false;
+        tune(periodBytes_ * 1000000.0 / us, periodStallUs_ * 1000 >= us * STALL_PERMILLE);
+        periodTs_ = now;
+        periodBytes_ = 0;
+        periodStallUs_ = 0;
+        return true;
+    }
+    ReadAheadStat getStat(TimePoint now = Clock::now()) const {
+        ReadAheadStat stat = stat_;
+        stat.elapsedUs = isStarted_ ? elapsedUs(bgnTs_, now) : 0;
+        stat.ioSize = ioSize_;
+        stat.windowSize = windowSize_;
+        return stat;
+    }
+    static uint64_t elapsedUs(TimePoint bgn, TimePoint end) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - bgn).count();
+    }
+private:
+    void tune(double bytesPerSec, bool isStalled) {
+        const Step step = lastStep_;
+        lastStep_ = NONE;
+        if (step != NONE && bytesPerSec * 1000 < lastBytesPerSec_ * (1000 + GAIN_PERMILLE)) {
+            // The last step did not pay.
+            ioSize_ = prevIoSize_;
+            windowSize_ = prevWindowSize_;
+            if (step == GROW_IO) {
+                isIoSettled_ = true;
+            } else {
+                isWindowSettled_ = true;
+            }
+        } else if (holdPeriods_ > 0) {
+            holdPeriods_--;
+            if (holdPeriods_ == 0) {
+                // Device conditions may have changed.
+                isIoSettled_ = false;
+                isWindowSettled_ = false;
+            }
+        } else if (isStalled) {
+            grow();
+        }
+        lastBytesPerSec_ = bytesPerSec;
+    }
+    void grow() {
+        prevIoSize_ = ioSize_;
+        prevWindowSize_ = windowSize_;
+        if (!isIoSettled_ && ioSize_ < maxIoSize_) {
+            ioSize_ = std::min(ioSize_ * 2, maxIoSize_);
+            windowSize_ = std::max(windowSize_, ioSize_);
+            lastStep_ = GROW_IO;
+        } else if (!isWindowSettled_ && windowSize_ < maxWindowSize_) {
+            windowSize_ = std::min(windowSize_ * 2, maxWindowSize_);
+            lastStep_ = GROW_WINDOW;
+        } else {
+            holdPeriods_ = HOLD_PERIODS;
+        }
+    }
+};
+
+/**
+ * Latest statistics of a reader for status output.
+ * This is thread-safe.
+ */
+class ReadAheadMonitor
+{
+    mutable std::mutex mu_;
+    ReadAheadStat stat_;
+public:
+    void set(const ReadAheadStat &stat) {
+        std::lock_guard<std::mutex> lk(mu_);
+        stat_ = stat;
+    }
+    ReadAheadStat get() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return stat_;
+    }
+};
+
+} // namespace walb
@@ -134,6 +134,8 @@ void waitUntil(Mutex &mu, Pred pred, const char *msg, size_t timeout = DEFAULT_T
  * run them using a thread pool.
  * Number of concurrent running tasks will be limited by
  * maxBackgroundTasks parameter.
+ * Additional reservedTasks slots are used only by urgent tasks,
+ * whose priority is not less than URGENT_TASK_PRIORITY.
  *
  * User can specify Task data and Worker function object.
  *
@@ -150,16 +152,18 @@ private:
     std::atomic<bool> shouldStop;
     TaskQueue<Task> &tq;
     size_t maxBackgroundTasks;
+    size_t reservedTasks;
     std::thread th;
 
     static const size_t SLEEP_MS = 1000;
 
 public:
     DispatchTask(TaskQueue<Task> &tq,
-                 size_t maxBackgroundTasks)
+                 size_t maxBackgroundTasks, size_t reservedTasks = 0)
         : shouldStop(false)
         , tq(tq)
         , maxBackgroundTasks(maxBackgroundTasks)
+        , reservedTasks(reservedTasks)
         , th(std::ref(*this)) {
     }
     ~DispatchTask() noexcept {
@@ -174,14 +178,21 @@ public:
     void operator()() noexcept try {
         LOGs.info() << "dispatchTask begin";
         cybozu::thread::ThreadRunnerFixedPool pool;
-        pool.start(maxBackgroundTasks);
+        pool.start(maxBackgroundTasks + reservedTasks);
         std::queue<Task> taskQ;
         while (!shouldStop) {
-            LOGs.debug() << "dispatchTask nrRunning" << pool.nrRunning();
+            const size_t nrRunning = pool.nrRunning();
+            LOGs.debug() << "dispatchTask nrRunning" << nrRunning;
             logErrors(pool.gc());
             if (taskQ.empty()) {
+                if (nrRunning >= maxBackgroundTasks + reservedTasks) {
+                    util::sleepMs(SLEEP_MS);
+                    continue;
+                }
+                const int minPriority = nrRunning < maxBackgroundTasks
+                    ? std::numeric_limits<int>::min() : URGENT_TASK_PRIORITY;
                 Task task;
-                if (!tq.pop(task, SLEEP_MS)) continue;
+                if (!tq.pop(task, SLEEP_MS, minPriority)) continue;
                 LOGs.debug() << "dispatchTask pop" << task;
                 taskQ.push(task);
             }
@@ -278,6 +278,7 @@ void StorageWorker::operator()()
     try {
         const bool isRemaining = storage_local::extractAndSendAndDeleteWlog(volId);
         tran.close();
+        storage_local::updateLogFillStat(volId, wdevPath);
         if (isRemaining) pushTask(volId);
     } catch (...) {
         pushTaskForce(volId, gs.delaySecForRetry * 1000);
@@ -299,6 +300,9 @@ void wdevMonitorWorker() noexcept
             for (const std::string& wdevName : v) {
                 LOGs.debug() << FUNC << wdevName;
                 const std::string volId = g.getVolIdFromWdevName(wdevName);
+                if (getStorageVolState(volId).logFillStat.needsSample()) {
+                    storage_local::updateLogFillStat(volId, device::getWdevPathFromWdevName(wdevName));
+                }
                 // There is an delay to transfer wlogs in bulk.
                 pushTask(volId, delayMs);
             }
@@ -545,6 +549,7 @@ void startMonitoring(const std::string& wdevPath, const std::string& volId)
     if (!g.logDevMonitor.add(wdevName)) {
         throw cybozu::Exception(FUNC) << "failed to add" << volId << wdevName;
     }
+    updateLogFillStat(volId, wdevPath);
     pushTask(volId);
 }
 
@@ -561,6 +566,15 @@ void stopMonitoring(const std::string& wdevPath, const std::string& volId)
 }
 
 
+void updateLogFillStat(const std::string& volId, const std::string& wdevPath)
+{
+    const uint64_t latestLsid = device::getLatestLsid(wdevPath);
+    const uint64_t logUsagePb = device::getLogUsagePb(wdevPath);
+    const uint64_t logCapacityPb = device::getLogCapacityPb(wdevPath);
+    getStorageVolState(volId).logFillStat.update(latestLsid, logUsagePb, logCapacityPb);
+}
+
+
 StrVec getAllStatusAsStrVec()
 {
     StrVec v;
@@ -570,10 +584,20 @@ StrVec getAllStatusAsStrVec()
     v.push_back(fmt("nodeId %s", gs.nodeId.c_str()));
     v.push_back(fmt("baseDir %s", gs.baseDirStr.c_str()));
     v.push_back(fmt("maxWlogSendMb %" PRIu64, gs.maxWlogSendMb));
+    v.push_back(fmt("wlogCmprThreads %zu", gs.wlogCmprThreads));
+    v.push_back(fmt("wlogCmpr %s:%u", compressionTypeToStr(gs.wlogCmprType).c_str(), gs.wlogCmprLevel));
+    v.push_back(fmt("wlogBatchKb %u", gs.wlogBatchKb));
+    v.push_back(fmt("maxWlogChunks %u", gs.maxWlogChunks));
+    v.push_back(fmt("wlogCoalesceMb %" PRIu64, gs.wlogCoalesceMb));
+    v.push_back(fmt("isWlogOffload %d", gs.isWlogOffload));
+    v.push_back(fmt("readAheadMb %zu", gs.readAheadMb));
+    v.push_back(fmt("readAheadIoKb %zu", gs.readAheadIoKb));
     v.push_back(fmt("delaySecForRetry %zu", gs.delaySecForRetry));
     v.push_back(fmt("maxConnections %zu", gs.maxConnections));
     v.push_back(fmt("maxForegroundTasks %zu", gs.maxForegroundTasks));
     v.push_back(fmt("maxBackgroundTasks %zu", gs.maxBackgroundTasks));
+    v.push_back(fmt("reservedBackgroundTasks %zu", gs.reservedBackgroundTasks));
+    v.push_back(fmt("overflowRiskSec %zu", gs.overflowRiskSec));
     v.push_back(fmt("socketTimeout %zu", gs.socketTimeout));
     v.push_back(fmt("keepAlive %s", gs.keepAliveParams.toStr().c_str()));
 
@@ -589,7 +613,8 @@ StrVec getAllStatusAsStrVec()
     for (const auto &pair : gs.taskQueue.getAll()) {
         const std::string &volId = pair.first;
         const int64_t &timeDiffMs = pair.second;
-        v.push_back(fmt("volume %s timeDiffMs %" PRIi64 "", volId.c_str(), timeDiffMs));
+        v.push_back(fmt("volume %s timeDiffMs %" PRIi64 " priority %d"
+                        , volId.c_str(), timeDiffMs, gs.taskQueue.getPriority(volId)));
     }
 
     v.push_back("-----Volume-----");
@@ -608,15 +633,28 @@ StrVec getAllStatusAsStrVec()
         std::tie(oldestGid, latestGid) = volInfo.getGidRange();
         const uint64_t oldestLsid = device::getOldestLsid(wdevPath);
         const uint64_t permanentLsid = device::getPermanentLsid(wdevPath);
+        const uint64_t latestLsid = device::getLatestLsid(wdevPath);
+        volSt.logFillStat.update(latestLsid, logUsagePb, logCapacityPb);
+        const int64_t overflowSec = volSt.logFillStat.getSecToOverflow();
 
         const std::string volStStr = fmt(
             "volume %s state %s logUsagePb %" PRIu64 " logCapacityPb %" PRIu64 ""
             " oldestGid %" PRIu64 " latestGid %" PRIu64 ""
             " oldestLsid %" PRIu64 " permanentLsid %" PRIu64 ""
+            " overflowSec %" PRIi64 ""
             , volId.c_str(), state.c_str()
             , logUsagePb, logCapacityPb
-            , oldestGid, latestGid, oldestLsid, permanentLsid);
+            , oldestGid, latestGid, oldestLsid, permanentLsid
+            , overflowSec);
         v.push_back(volStStr);
+        const std::pair<const char *, const ReadAheadMonitor *> readMonV[] = {
+            {"wlog", &volSt.wlogReadMon}, {"bdev", &volSt.bdevReadMon},
+        };
+        for (const auto &pair : readMonV) {
+            const ReadAheadStat stat = pair.second->get();
+            if (stat.ioNr == 0) continue;
+            v.push_back(fmt("volume %s reader %s %s", volId.c_str(), pair.first, stat.toStr().c_str()));
+        }
     }
     return v;
 }
@@ -726,14 +764,16 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN)
                       << "started" << volId << archiveId;
         if (isFull) {
-            const std::string bdevPath = volInfo.getWdevPath();
-            if (!dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+            AsyncBdevReader reader(volInfo.getWdevPath(), 0, gs.readAheadMb * MEBI, gs.readAheadIoKb * KIBI);
+            reader.setMonitor(&volSt.bdevReadMon);
+            if (!dirtyFullSyncClient(aPkt, reader, 0, sizeLb, bulkLb, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
         } else {
             const uint32_t hashSeed = curTime;
-            AsyncBdevReader reader(volInfo.getWdevPath());
+            AsyncBdevReader reader(volInfo.getWdevPath(), 0, gs.readAheadMb * MEBI, gs.readAheadIoKb * KIBI);
+            reader.setMonitor(&volSt.bdevReadMon);
             if (!dirtyHashSyncClient(aPkt, reader, sizeLb, bulkLb, hashSeed, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
@@ -805,6 +845,106 @@ void dumpLogPackHeader(const std::string &volId, uint64_t lsid, const LogPackHea
 }
 
 
+namespace {
+
+/**
+ * A lsid range of wlogs to transfer.
+ */
+struct WlogRange
+{
+    MetaLsidGid recB;
+    MetaLsidGid recE;
+    uint64_t lsidLimit; // do not send logpacks which lsid >= lsidLimit.
+    uint64_t lsidE; // end of the sent logpacks.
+};
+
+} // namespace
+
+
+/**
+ * Send logpacks in a range and its diff.
+ * Sender is WlogSender, or WlogDiffSender in offload mode.
+ * range.lsidE will be set.
+ */
+template <typename Sender>
+void sendWlogRange(const std::string &volId, StorageVolInfo &volInfo, device::AsyncWldevReader &reader,
+                   Sender &sender, packet::Packet &pkt, WlogRange &range)
+{
+    const char *const FUNC = __func__;
+    StorageVolState &volSt = getStorageVolState(volId);
+    const uint32_t pbs = reader.super().getPhysicalBlockSize();
+    const uint32_t salt = reader.super().getLogChecksumSalt();
+    const uint64_t maxWlogSendPb = gs.maxWlogSendMb * MEBI / pbs;
+    const uint64_t lsidB = range.recB.lsid;
+    const uint64_t lsidLimit = range.lsidLimit;
+
+    LogPackHeader packH(pbs, salt);
+    reader.reset(lsidB, lsidLimit - lsidB);
+
+    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidLimit;
+    /*
+     * A range is converted into one diff, so IOs overwritten in the range
+     * need not be sent. The coalescing window never exceeds the range.
+     */
+    const uint64_t coalescePb = gs.wlogCoalesceMb * MEBI / pbs;
+    WlogCoalescer coalescer;
+    auto pushPack = [&](const LogPackHeader &h, const std::vector<AlignedArray> &ioV) {
+        sender.pushHeader(h);
+        for (size_t i = 0; i < h.header().n_records; i++) {
+            sender.pushIo(h, i, ioV[i].data());
+        }
+    };
+    AlignedArray buf;
+    uint64_t lsid = lsidB;
+    try {
+        for (;;) {
+            if (volSt.stopState == ForceStopping || gs.ps.isForceShutdown()) {
+                throw cybozu::Exception(FUNC) << "force stopped" << volId;
+            }
+            if (lsid == lsidLimit) break;
+            if (!readLogPackHeader(reader, packH, lsid)) {
+                dumpLogPackHeader(volId, lsid, packH); // for analysis.
+                throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
+            }
+            verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
+            const uint64_t nextLsid =  packH.nextLogpackLsid();
+            if (lsidLimit < nextLsid) break;
+            if (coalescePb == 0) {
+                sender.pushHeader(packH);
+            }
+            std::vector<AlignedArray> ioV;
+            for (size_t i = 0; i < packH.header().n_records; i++) {
+                if (!readLogIo(reader, packH, i, buf)) {
+                    throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << lsid << i;
+                }
+                if (coalescePb == 0) {
+                    sender.pushIo(packH, i, buf.data());
+                    buf.clear();
+                } else {
+                    ioV.push_back(std::move(buf));
+                }
+            }
+            if (coalescePb > 0) {
+                coalescer.push(packH, std::move(ioV));
+                if (coalescer.getBufferedPb() >= coalescePb) coalescer.flush(pushPack);
+            }
+            lsid = nextLsid;
+        }
+        coalescer.flush(pushPack);
+    } catch (...) {
+        LOGs.info() << FUNC << volId << lsidB << lsid << lsidLimit;
+        throw;
+    }
+    sender.sync();
+    if (coalescer.getCoalescedPb() > 0) {
+        LOGs.debug() << FUNC << "coalesced" << volId << lsidB << lsid << coalescer.getCoalescedPb();
+    }
+    range.lsidE = lsid;
+    pkt.write(volInfo.getTransferDiff(range.recB, range.recE, range.lsidE));
+    pkt.flush();
+}
+
+
 /**
  * RETURN:
  *   true if there is remaining to send or delete.
@@ -821,10 +961,9 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
         return isRemainingGarbage || volInfo.isWlogTransferRequiredLater();
     }
 
-    MetaLsidGid rec0, rec1;
-    uint64_t lsidLimit;
+    WlogRange range;
     bool doLater;
-    std::tie(rec0, rec1, lsidLimit, doLater) =
+    std::tie(range.recB, range.recE, range.lsidLimit, doLater) =
         volInfo.prepareWlogTransfer(gs.maxWlogSendMb, gs.implicitSnapshotIntervalSec);
     if (doLater) {
         LOGs.debug() << FUNC << "wait a bit for wlogs to be permanent" << volId;
@@ -833,35 +972,53 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     const std::string wdevPath = volInfo.getWdevPath();
     const std::string wdevName = device::getWdevNameFromWdevPath(wdevPath);
     const std::string wldevPath = device::getWldevPathFromWdevName(wdevName);
-    device::AsyncWldevReader reader(wldevPath);
+    device::AsyncWldevReader reader(wldevPath, gs.readAheadMb * MEBI, gs.readAheadIoKb * KIBI);
+    reader.setMonitor(&volSt.wlogReadMon);
     const uint32_t pbs = reader.super().getPhysicalBlockSize();
     const uint32_t salt = reader.super().getLogChecksumSalt();
-    const uint64_t maxWlogSendPb = gs.maxWlogSendMb * MEBI / pbs;
-    const uint64_t lsidB = rec0.lsid;
+    const uint64_t lsidB = range.recB.lsid;
     const cybozu::Uuid uuid = volInfo.getUuid();
     const uint64_t volSizeLb = device::getSizeLb(wdevPath);
-    const uint64_t maxLogSizePb = lsidLimit - lsidB;
+    uint64_t maxLogSizePb;
 
     cybozu::Socket sock;
     packet::Packet pkt(sock);
     std::string serverId;
+    uint32_t version;
+    WlogTransferOpt opt;
     bool isAvailable = false;
     for (const cybozu::SocketAddr &proxy : gs.proxyManager.getAvailableList()) {
         try {
-            util::connectWithTimeout(sock, proxy, gs.socketTimeout);
-            gs.setSocketParams(sock);
-            serverId = protocol::run1stNegotiateAsClient(sock, gs.nodeId, wlogTransferPN);
+            serverId = protocol::run1stNegotiateAsClient(
+                sock, [&](cybozu::Socket &s) {
+                    util::connectWithTimeout(s, proxy, gs.socketTimeout);
+                    gs.setSocketParams(s);
+                }, gs.nodeId, wlogTransferPN, version);
+            opt.cmprType = gs.wlogCmprType;
+            opt.cmprLevel = gs.wlogCmprLevel;
+            opt.batchKb = gs.wlogBatchKb;
+            opt.maxChunks = WlogTransferOpt::isExchanged(version) ? gs.maxWlogChunks : 1;
+            opt.isOffload = gs.isWlogOffload;
+            maxLogSizePb = range.lsidLimit - lsidB;
+            if (opt.maxChunks > 1) {
+                /* Following ranges may be larger than the first one. */
+                maxLogSizePb = std::max<uint64_t>(maxLogSizePb, gs.maxWlogSendMb * MEBI / pbs);
+            }
             pkt.write(volId);
             pkt.write(uuid);
             pkt.write(pbs);
             pkt.write(salt);
             pkt.write(volSizeLb);
             pkt.write(maxLogSizePb);
+            opt.saveRequest(pkt, version);
             pkt.flush();
-            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb;
+            LOGs.debug() << "send" << volId << uuid << pbs << salt << volSizeLb << maxLogSizePb
+                         << version << int(opt.cmprType) << int(opt.cmprLevel) << opt.batchKb
+                         << opt.maxChunks << opt.isOffload;
             std::string res;
             pkt.read(res);
             if (res == msgAccept) {
+                opt.loadReply(pkt, version);
                 isAvailable = true;
                 break;
             }
@@ -875,50 +1032,70 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     }
 
     ProtocolLogger logger(gs.nodeId, serverId);
-    WlogSender sender(sock, logger, pbs, salt);
-
-    LogPackHeader packH(pbs, salt);
-    reader.reset(lsidB, maxLogSizePb);
+    if (opt.cmprType != gs.wlogCmprType || opt.cmprLevel != gs.wlogCmprLevel) {
+        logger.info() << FUNC << "wlog compression falls back" << volId << version
+                      << compressionTypeToStr(opt.cmprType) << int(opt.cmprLevel);
+    }
 
-    LOGs.debug() << FUNC << "start" << volId << lsidB << lsidLimit;
-    AlignedArray buf;
-    uint64_t lsid = lsidB;
+    /*
+     * Acks are received by another thread,
+     * so the next range is sent while the previous one is being acknowledged.
+     * Wlogs are deleted up to the acknowledged lsid only.
+     */
+    const bool isPipelined = opt.maxChunks > 1;
+    bool isRemainingData = false;
+    cybozu::thread::BoundedQueue<WlogRange> ackQ(2);
+    cybozu::thread::ThreadRunner ackTh([&]() {
+            try {
+                WlogRange r;
+                while (ackQ.pop(r)) {
+                    packet::Ack(sock).recv();
+                    isRemainingData = volInfo.finishWlogTransfer(r.recB, r.recE, r.lsidE);
+                    volInfo.deleteGarbageWlogs();
+                    LOGs.debug() << FUNC << "end  " << volId << r.recB.lsid << r.lsidE;
+                }
+            } catch (...) {
+                ackQ.fail();
+                throw;
+            }
+        });
+    ackTh.start();
+    size_t nrChunks = 0;
     try {
         for (;;) {
-            if (volSt.stopState == ForceStopping || gs.ps.isForceShutdown()) {
-                throw cybozu::Exception(FUNC) << "force stopped" << volId;
+            if (opt.isOffload) {
+                WlogDiffSender sender(sock, logger, pbs, salt, uuid, opt.maxDedupNr);
+                sendWlogRange(volId, volInfo, reader, sender, pkt, range);
+            } else {
+                WlogSender sender(sock, logger, pbs, salt, opt.cmprType, opt.cmprLevel, gs.wlogCmprThreads, opt.batchKb * KIBI);
+                sendWlogRange(volId, volInfo, reader, sender, pkt, range);
             }
-            if (lsid == lsidLimit) break;
-            if (!readLogPackHeader(reader, packH, lsid)) {
-                dumpLogPackHeader(volId, lsid, packH); // for analysis.
-                throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
+            nrChunks++;
+            const MetaLsidGid recS = volInfo.getTransferDoneRecord(range.recB, range.recE, range.lsidE);
+            ackQ.push(range);
+            if (!isPipelined) break;
+            bool hasNext = nrChunks < opt.maxChunks && volSt.stopState == NotStopping && gs.ps.isRunning();
+            if (hasNext) {
+                std::tie(range.recB, range.recE, range.lsidLimit, doLater) =
+                    volInfo.prepareWlogTransfer(gs.maxWlogSendMb, gs.implicitSnapshotIntervalSec, &recS);
+                hasNext = !doLater && range.lsidLimit - recS.lsid <= maxLogSizePb;
             }
-            verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
-            const uint64_t nextLsid =  packH.nextLogpackLsid();
-            if (lsidLimit < nextLsid) break;
-            sender.pushHeader(packH);
-            for (size_t i = 0; i < packH.header().n_records; i++) {
-                if (!readLogIo(reader, packH, i, buf)) {
-                    throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << lsid << i;
-                }
-                sender.pushIo(packH, i, buf.data());
-                buf.clear();
-            }
-            lsid = nextLsid;
+            pkt.write(hasNext);
+            pkt.flush();
+            if (!hasNext) break;
         }
+        ackQ.sync();
     } catch (...) {
-        LOGs.info() << FUNC << volId << lsidB << lsid << lsidLimit;
+        try {
+            ackQ.sync();
+        } catch (...) {}
+        std::exception_ptr ep = ackTh.joinNoThrow();
+        if (ep) std::rethrow_exception(ep); // The main thread failed due to it.
         throw;
     }
-    sender.sync();
-    const uint64_t lsidE = lsid;
-    const MetaDiff diff = volInfo.getTransferDiff(rec0, rec1, lsidE);
-    pkt.write(diff);
-    pkt.flush();
-    packet::Ack(sock).recv();
-    const bool isRemainingData = volInfo.finishWlogTransfer(rec0, rec1, lsidE);
+    ackTh.join();
+    if (nrChunks > 1) logger.debug() << FUNC << "pipelined" << volId << nrChunks;
     isRemainingGarbage = volInfo.deleteGarbageWlogs();
-    LOGs.debug() << FUNC << "end  " << volId << lsidB << lsidE;
     return isRemainingData || isRemainingGarbage || volInfo.isWlogTransferRequiredLater();
 }
 
@@ -8,9 +8,11 @@
 #include "log_dev_monitor.hpp"
 #include "wdev_util.hpp"
 #include "walb_log_net.hpp"
+#include "walb_log_coalescer.hpp"
 #include "action_counter.hpp"
 #include "walb_diff_pack.hpp"
 #include "walb_diff_compressor.hpp"
+#include "compression_type.hpp"
 #include "murmurhash3.hpp"
 #include "dirty_full_sync.hpp"
 #include "dirty_hash_sync.hpp"
@@ -19,6 +21,8 @@
 #include "command_param_parser.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "log_fill_stat.hpp"
+#include "read_ahead.hpp"
 
 namespace walb {
 
@@ -27,6 +31,9 @@ struct StorageVolState {
     std::atomic<int> stopState;
     StateMachine sm;
     ActionCounters ac; // key is action identifier.
+    LogFillStat logFillStat; // used for task priority.
+    ReadAheadMonitor wlogReadMon; // of the latest wlog reader.
+    ReadAheadMonitor bdevReadMon; // of the latest volume reader.
 
     explicit StorageVolState(const std::string& volId)
         : stopState(NotStopping), sm(mu), ac(mu) {
@@ -172,11 +179,22 @@ struct StorageSingleton
     std::string nodeId;
     std::string baseDirStr;
     uint64_t maxWlogSendMb;
+    size_t wlogCmprThreads;
+    uint8_t wlogCmprType; // requested to proxies.
+    uint8_t wlogCmprLevel;
+    uint32_t wlogBatchKb; // requested to proxies. 0 means a frame per IO.
+    uint32_t maxWlogChunks; // ranges sent in a wlog-transfer. 1 means no pipelining.
+    uint64_t wlogCoalesceMb; // window to drop overwritten IOs in wlog-transfer. 0 means disabled.
+    bool isWlogOffload; // make wdiffs from wlogs by itself instead of proxies.
+    size_t readAheadMb; // max read-ahead size of wlog and volume readers.
+    size_t readAheadIoKb; // max IO size of wlog and volume readers.
+    size_t overflowRiskSec; // volumes that will overflow in this period are urgent.
     size_t implicitSnapshotIntervalSec;
     size_t delaySecForRetry;
     size_t maxConnections;
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
+    size_t reservedBackgroundTasks; // only for urgent tasks.
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     size_t tsDeltaGetterIntervalSec;
@@ -247,16 +265,31 @@ inline StorageSingleton& getStorageGlobal()
 static const StorageSingleton& gs = getStorageGlobal();
 
 
+inline StorageVolState &getStorageVolState(const std::string &volId)
+{
+    return getStorageGlobal().stMap.get(volId);
+}
+
+/**
+ * Tasks of volumes at risk of log overflow are prioritized.
+ */
+inline int getTaskPriority(const std::string &volId)
+{
+    return getStorageVolState(volId).logFillStat.getPriority(gs.overflowRiskSec);
+}
+
 inline void pushTask(const std::string &volId, size_t delayMs = 0)
 {
-    LOGs.debug() << __func__ << volId << delayMs;
-    getStorageGlobal().taskQueue.push(volId, delayMs);
+    const int priority = getTaskPriority(volId);
+    LOGs.debug() << __func__ << volId << delayMs << priority;
+    getStorageGlobal().taskQueue.push(volId, delayMs, priority);
 }
 
 inline void pushTaskForce(const std::string &volId, size_t delayMs)
 {
-    LOGs.debug() << __func__ << volId << delayMs;
-    getStorageGlobal().taskQueue.pushForce(volId, delayMs);
+    const int priority = getTaskPriority(volId);
+    LOGs.debug() << __func__ << volId << delayMs << priority;
+    getStorageGlobal().taskQueue.pushForce(volId, delayMs, priority);
 }
 
 namespace storage_local {
@@ -265,6 +298,11 @@ void startMonitoring(const std::string& wdevPath, const std::string& volId);
 void stopMonitoring(const std::string& wdevPath, const std::string& volId);
 
 
+/**
+ * Sample the log usage and the latest lsid of a volume for its task priority.
+ */
+void updateLogFillStat(const std::string& volId, const std::string& wdevPath);
+
 inline bool isUnderMonitoring(const std::string& wdevPath)
 {
     return gs.logDevMonitor.exists(device::getWdevNameFromWdevPath(wdevPath));;
@@ -299,12 +337,6 @@ public:
 
 } // namespace storage_local
 
-
-inline StorageVolState &getStorageVolState(const std::string &volId)
-{
-    return getStorageGlobal().stMap.get(volId);
-}
-
 namespace storage_local {
 
 StrVec getAllStatusAsStrVec();
@@ -126,11 +126,11 @@ void StorageVolInfo::deleteAllWlogs()
 
 
 std::tuple<MetaLsidGid, MetaLsidGid, uint64_t, bool> StorageVolInfo::prepareWlogTransfer(
-    uint64_t maxWlogSendMb, size_t intervalSec) {
+    uint64_t maxWlogSendMb, size_t intervalSec, const MetaLsidGid *recBp) {
     const char *const FUNC = __func__;
     QFile qf(queuePath().str(), O_RDWR);
-    const MetaLsidGid recB = getDoneRecord(); // begin
-    removeOldRecordsFromQueueFile(qf, recB);
+    const MetaLsidGid recB = recBp ? *recBp : getDoneRecord(); // begin
+    if (!recBp) removeOldRecordsFromQueueFile(qf, recB);
     /* Take a implicit snapshot if necessary. */
     device::LsidSet lsids;
     device::getLsidSet(getWdevName(), lsids);
@@ -139,6 +139,9 @@ std::tuple<MetaLsidGid, MetaLsidGid, uint64_t, bool> StorageVolInfo::prepareWlog
     if (!qf.empty()) qf.front(recE);
     if (qf.empty() || (recE.lsid < lsids.latest && recE.timestamp + intervalSec <= uint64_t(::time(0)))) {
         takeSnapshotDetail(maxWlogSendPb, true, qf, lsids.latest);
+    } else if (isOldRecord(recE, recB)) {
+        /* Nothing to send after recB for now. */
+        return std::make_tuple(recB, recB, recB.lsid, true);
     }
     /* Get the end of the target range. */
     uint64_t lsidLimit;
@@ -164,21 +167,9 @@ MetaDiff StorageVolInfo::getTransferDiff(const MetaLsidGid &recB, const MetaLsid
 }
 
 
-bool StorageVolInfo::finishWlogTransfer(const MetaLsidGid &recB, const MetaLsidGid &recE, uint64_t lsidE)
+MetaLsidGid StorageVolInfo::getTransferDoneRecord(const MetaLsidGid &recB, const MetaLsidGid &recE, uint64_t lsidE) const
 {
-    const char *const FUNC = __func__;
-    const MetaLsidGid recBx = getDoneRecord();
-    verifyMetaLsidGidEquality(recB, recBx, FUNC);
-    QFile qf(queuePath().str(), O_RDWR);
-    if (qf.empty()) {
-        throw cybozu::Exception(FUNC)
-            << "Maybe BUG: queue must have at lease one record.";
-    }
-    MetaLsidGid recEx;
-    qf.back(recEx);
-    verifyMetaLsidGidEquality(recE, recEx, FUNC);
     assert(recB.lsid <= lsidE && lsidE <= recE.lsid);
-
     MetaLsidGid recS;
     recS.lsid = lsidE;
     if (lsidE == recE.lsid) {
@@ -192,6 +183,25 @@ bool StorageVolInfo::finishWlogTransfer(const MetaLsidGid &recB, const MetaLsidG
         // gid is progressed while timestamp is not progressed.
         recS.timestamp = recB.timestamp;
     }
+    return recS;
+}
+
+
+bool StorageVolInfo::finishWlogTransfer(const MetaLsidGid &recB, const MetaLsidGid &recE, uint64_t lsidE)
+{
+    const char *const FUNC = __func__;
+    const MetaLsidGid recBx = getDoneRecord();
+    verifyMetaLsidGidEquality(recB, recBx, FUNC);
+    QFile qf(queuePath().str(), O_RDWR);
+    if (qf.empty()) {
+        throw cybozu::Exception(FUNC)
+            << "Maybe BUG: queue must have at lease one record.";
+    }
+    MetaLsidGid recEx;
+    qf.back(recEx);
+    verifyMetaLsidGidEquality(recE, recEx, FUNC);
+
+    const MetaLsidGid recS = getTransferDoneRecord(recB, recE, lsidE);
     setDoneRecord(recS);
     removeOldRecordsFromQueueFile(qf, recS);
     return !qf.empty();
@@ -292,6 +302,14 @@ std::pair<MetaLsidGid, uint64_t> StorageVolInfo::getEndSnapshot(
     --it;
     MetaLsidGid recE;
     it.get(recE);
+    /* Records up to recB remain until the previous range is acknowledged. */
+    while (isOldRecord(recE, recB)) {
+        if (it == qf.cbegin()) {
+            throw cybozu::Exception(__func__) << "no record after" << recB;
+        }
+        --it;
+        it.get(recE);
+    }
     size_t nr = 1;
     while (it != qf.cbegin() && recE.isMergeable) {
         --it;
@@ -326,9 +344,7 @@ void StorageVolInfo::removeOldRecordsFromQueueFile(QFile &qf, const MetaLsidGid
     MetaLsidGid rec;
     while (!qf.empty()) {
         qf.back(rec);
-        const bool isOld0 = rec.lsid < recB.lsid;
-        const bool isOld1 = rec.lsid == recB.lsid && rec.gid <= recB.gid;
-        if (isOld0 || isOld1) {
+        if (isOldRecord(rec, recB)) {
             qf.popBack();
         } else {
             break;
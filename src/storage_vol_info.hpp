@@ -133,6 +133,9 @@ public:
      *   (5) finishWlogTransfer()
      *   (6) deleteGarbageWlogs()
      *
+     * To pipeline ranges, (3) and (4) for the next range can be called
+     * with getTransferDoneRecord() of the previous range before (5) of it.
+     * (5) must be called in the order of the ranges.
      */
     bool mayWlogTransferBeRequiredNow() {
         return isWlogTransferRequiredDetail(false);
@@ -145,6 +148,10 @@ public:
      *   maximum transferring size per once [MiB].
      * @intervalSec
      *   implicit snapshot interval [sec].
+     * @recBp
+     *   begin of the range. nullptr means the done record.
+     *   Specify the end of the previous range that has been sent
+     *   but not acknowledged yet to prepare the next range.
      *
      * RETURN:
      *   target lsid/gid range by two MetaLsidGids: recB and recE,
@@ -152,12 +159,19 @@ public:
      *   and boolean value which is true if we must pospone the wlog-transfer.
      *   Do not transfer logpacks which lsid >= lsidLimit.
      */
-    std::tuple<MetaLsidGid, MetaLsidGid, uint64_t, bool> prepareWlogTransfer(uint64_t maxWlogSendMb, size_t intervalSec);
+    std::tuple<MetaLsidGid, MetaLsidGid, uint64_t, bool> prepareWlogTransfer(
+        uint64_t maxWlogSendMb, size_t intervalSec, const MetaLsidGid *recBp = nullptr);
     /**
      * RETURN:
      *   generated diff will be transferred to a proxy daemon.
      */
     MetaDiff getTransferDiff(const MetaLsidGid &recB, const MetaLsidGid &recE, uint64_t lsidE) const;
+    /**
+     * RETURN:
+     *   done record after the range is transferred.
+     *   It is the begin of the next range.
+     */
+    MetaLsidGid getTransferDoneRecord(const MetaLsidGid &recB, const MetaLsidGid &recE, uint64_t lsidE) const;
     /**
      * recB and recE must not be changed between calling
      * prepareWlogTransfer() and finishWlogTransfer().
@@ -238,6 +252,9 @@ private:
     std::pair<MetaLsidGid, uint64_t> getEndSnapshot(
         QFile &qf, const MetaLsidGid &recB, uint64_t maxWlogSendPb, uint64_t permanentLsid);
     void removeOldRecordsFromQueueFile(QFile &qf, const MetaLsidGid &recB);
+    static bool isOldRecord(const MetaLsidGid &rec, const MetaLsidGid &recB) {
+        return rec.lsid < recB.lsid || (rec.lsid == recB.lsid && rec.gid <= recB.gid);
+    }
 };
 
 } //namespace walb
@@ -5,12 +5,26 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <limits>
 #include <cassert>
 
 namespace walb {
 
+/**
+ * Tasks with priority not less than this are urgent.
+ * DispatchTask runs them in reserved slots.
+ */
+const int URGENT_TASK_PRIORITY = 1;
+/**
+ * Tasks with this priority run only when no other task is ready.
+ */
+const int IDLE_TASK_PRIORITY = -1;
+
 /**
  * Task must be copyable and have operators "==" and "<".
+ * Each task has a priority (0 by default).
+ * Among tasks that are ready to run, the one with the highest priority
+ * is popped first, and the oldest one among the same priority.
  */
 template <typename Task>
 class TaskQueue
@@ -22,7 +36,11 @@ private:
     using AutoLock = std::lock_guard<std::mutex>;
     using UniqueLock = std::unique_lock<std::mutex>;
 
-    using Map = std::map<Task, TimePoint>;
+    struct Entry {
+        TimePoint ts;
+        int priority;
+    };
+    using Map = std::map<Task, Entry>;
     using Rmap = std::multimap<TimePoint, Task>;
 
     mutable std::mutex mu_;
@@ -38,60 +56,97 @@ public:
     /**
      * Push a task with current time (or with a delay).
      * If the same task already exists in the queue,
-     * it will do nothing.
+     * only its priority will be updated.
      * After quit, it always do nothing.
      */
-    void push(const Task &task, size_t delayMs = 0) {
+    void push(const Task &task, size_t delayMs = 0, int priority = 0) {
         AutoLock lk(mu_);
         if (isStopped_) return;
         TimePoint ts = Clock::now() + MilliSeconds(delayMs);
         typename Map::iterator itr;
         bool maked;
-        std::tie(itr, maked) = map_.insert(std::make_pair(task, ts));
-        if (maked) rmap_.insert(std::make_pair(ts, task));
+        std::tie(itr, maked) = map_.insert(std::make_pair(task, Entry{ts, priority}));
+        if (maked) {
+            rmap_.insert(std::make_pair(ts, task));
+        } else {
+            itr->second.priority = priority;
+        }
         assert(map_.size() == rmap_.size());
         cv_.notify_all();
     }
     /**
      * Push a task with a delay.
      * If the smae task already exists,
-     * it will be overwritten by the new timestamp.
+     * it will be overwritten by the new timestamp and priority.
      * After quit, it always do nothing.
      */
-    void pushForce(const Task &task, size_t delayMs) {
+    void pushForce(const Task &task, size_t delayMs, int priority = 0) {
         AutoLock lk(mu_);
         if (isStopped_) return;
         TimePoint ts = Clock::now() + MilliSeconds(delayMs);
         typename Map::iterator itr = map_.find(task);
         if (itr != map_.end()) {
-            eraseFromRmap(task, itr->second);
-            itr->second = ts;
+            eraseFromRmap(task, itr->second.ts);
+            itr->second = Entry{ts, priority};
         } else {
-            map_[task] = ts;
+            map_[task] = Entry{ts, priority};
         }
         rmap_.insert(std::make_pair(ts, task));
         assert(map_.size() == rmap_.size());
         cv_.notify_all();
     }
     /**
-     * Pop a task with the oldest timestamp and the timestamp
-     * is not greater than now.
+     * Pop a task whose timestamp is not greater than now
+     * and whose priority is not less than minPriority.
+     * The highest priority one is chosen, then the oldest one.
      * RETURN:
      *   false if there is no task satisfying the condition.
      */
-    bool pop(Task &task, size_t timeoutMs=0) {
+    bool pop(Task &task, size_t timeoutMs = 0, int minPriority = std::numeric_limits<int>::min()) {
         UniqueLock lk(mu_);
         cv_.wait_for(lk, std::chrono::milliseconds(timeoutMs));
 
-        typename Rmap::iterator itr = rmap_.begin();
-        if (itr == rmap_.end()) return false;
-        if (!isStopped_ && Clock::now() < itr->first) return false;
-        task = itr->second;
-        rmap_.erase(itr);
+        const TimePoint now = Clock::now();
+        typename Rmap::iterator best = rmap_.end();
+        int bestPriority = minPriority;
+        for (typename Rmap::iterator itr = rmap_.begin(); itr != rmap_.end(); ++itr) {
+            if (!isStopped_ && now < itr->first) break;
+            const int priority = map_.find(itr->second)->second.priority;
+            if (priority < bestPriority) continue;
+            if (best != rmap_.end() && priority == bestPriority) continue;
+            best = itr;
+            bestPriority = priority;
+        }
+        if (best == rmap_.end()) return false;
+        task = best->second;
+        rmap_.erase(best);
         map_.erase(task);
         assert(map_.size() == rmap_.size());
         return true;
     }
+    /**
+     * RETURN:
+     *   true if a task whose priority is not less than minPriority is ready to run.
+     */
+    bool hasReadyTask(int minPriority) const {
+        AutoLock lk(mu_);
+        const TimePoint now = Clock::now();
+        for (typename Rmap::const_iterator itr = rmap_.begin(); itr != rmap_.end(); ++itr) {
+            if (now < itr->first) break;
+            if (map_.find(itr->second)->second.priority >= minPriority) return true;
+        }
+        return false;
+    }
+    /**
+     * RETURN:
+     *   priority of a task in the queue, or 0 if not found.
+     */
+    int getPriority(const Task &task) const {
+        AutoLock lk(mu_);
+        typename Map::const_iterator itr = map_.find(task);
+        if (itr == map_.end()) return 0;
+        return itr->second.priority;
+    }
     /**
      * Push will do nothing after quit.
      */
@@ -109,7 +164,7 @@ public:
         typename Map::iterator itr = map_.begin();
         while (itr != map_.end()) {
             const Task &task = itr->first;
-            TimePoint ts = itr->second;
+            TimePoint ts = itr->second.ts;
             if (pred(task)) {
                 eraseFromRmap(task, ts);
                 itr = map_.erase(itr);
@@ -130,7 +185,7 @@ public:
         AutoLock lk(mu_);
         std::vector<std::pair<Task, int64_t> > ret;
         for (const typename Map::value_type &pair : map_) {
-            const int64_t diff = std::chrono::duration_cast<MilliSeconds>(pair.second - now).count();
+            const int64_t diff = std::chrono::duration_cast<MilliSeconds>(pair.second.ts - now).count();
             ret.push_back(std::make_pair(pair.first, diff));
         }
         return ret;
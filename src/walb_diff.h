@@ -77,6 +77,15 @@ enum {
     WALB_DIFF_CMPR_MAX
 };
 
+/**
+ * Not a record compression type.
+ * Compressors given this choose one of the types above for each pack.
+ * The value is fixed because it is saved in the compression option.
+ */
+enum {
+    WALB_DIFF_CMPR_AUTO = 255
+};
+
 
 /**
  * Walb diff file header.
@@ -87,7 +96,7 @@ struct walb_diff_file_header
     uint16_t version;        /* WalB diff version */
     uint8_t type;            /* WALB_DIFF_TYPE_XXX */
     uint8_t reserved1;
-    uint32_t reserved2;
+    uint32_t dict_id;        /* zstd dictionary id used to compress IOs. 0 means none. */
     uint32_t reserved3;
     uint8_t uuid[UUID_SIZE]; /* Identifier of the target block device. */
 } __attribute__((packed, aligned(8)));
@@ -177,6 +186,44 @@ struct walb_diff_index_super
 } __attribute__((packed, aligned(8)));
 
 
+/**
+ * Optional pack index of sorted wdiff files.
+ * It follows the end pack so readers that do not know it stop before it.
+ * The file ends with walb_diff_sorted_index_super,
+ * which follows n_packs walb_diff_sorted_index_record items.
+ */
+#define WALB_DIFF_SORTED_INDEX_MAGIC 0x7769736bU
+
+struct walb_diff_sorted_index_record
+{
+    uint64_t pack_offset; /* [byte] in the whole file. */
+    uint64_t io_address; /* [logical block] begin address of the first record in the pack. */
+    uint64_t end_address; /* [logical block] max end address of the records in the pack. */
+    uint64_t normal_blocks; /* [logical block] total size of the normal IOs in the pack. */
+    uint32_t n_records; /* number of records in the pack. */
+    uint32_t reserved1;
+} __attribute__((packed, aligned(8)));
+
+struct walb_diff_sorted_index_super
+{
+    uint64_t index_offset; /* [byte] in the whole file. */
+
+    /* Statistics of all the records in the file. */
+    uint64_t normal_nr;
+    uint64_t allzero_nr;
+    uint64_t discard_nr;
+    uint64_t normal_lb; /* [logical block] */
+    uint64_t allzero_lb; /* [logical block] */
+    uint64_t discard_lb; /* [logical block] */
+    uint64_t data_size; /* [byte] total size of the IO data. */
+
+    uint32_t n_packs; /* number of index records. */
+    uint32_t magic; /* WALB_DIFF_SORTED_INDEX_MAGIC. */
+    uint32_t index_checksum; /* checksum of the index records with salt 0. */
+    uint32_t checksum; /* self checksum */
+} __attribute__((packed, aligned(8)));
+
+
 #ifdef __cplusplus
 }
 #endif
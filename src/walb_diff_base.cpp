@@ -105,6 +105,18 @@ std::vector<AlignedArray> splitIoDataAll(const AlignedArray &buf, uint32_t ioBlo
 int compressData(const char *inData, size_t inSize,
                  AlignedArray &outData, size_t &outSize, int type, int level)
 {
+    if (type == ::WALB_DIFF_CMPR_AUTO) {
+        CompressionSelector selector(level);
+        selector.add(inData, inSize);
+        size_t lv;
+        type = selector.choose(&lv);
+        level = lv;
+    }
+    if (type == ::WALB_DIFF_CMPR_NONE) {
+        outSize = inSize;
+        util::assignAlignedArray(outData, inData, inSize);
+        return type;
+    }
     outData.resize(inSize + 4096); // margin to reduce malloc at compression.
     walb::Compressor enc(type, level);
     if (enc.run(outData.data(), &outSize, outData.size(), inData, inSize) && outSize < inSize) {
@@ -145,6 +157,24 @@ void compressDiffIo(
     outRec.checksum = calcDiffIoChecksum(outData);
 }
 
+void compressDiffIo(
+    const IndexedDiffRecord &inRec, const char *inData,
+    IndexedDiffRecord &outRec, AlignedArray &outData, int type, int level)
+{
+    assert(inRec.isNormal());
+    assert(!inRec.isCompressed());
+    assert(inData != nullptr);
+
+    const size_t inSize = inRec.io_blocks * LOGICAL_BLOCK_SIZE;
+    size_t outSize = 0;
+    type = compressData(inData, inSize, outData, outSize, type, level);
+
+    outRec = inRec;
+    outRec.compression_type = type;
+    outRec.data_size = outSize;
+    outRec.io_checksum = calcDiffIoChecksum(outData);
+}
+
 void uncompressDiffIo(
     const DiffRecord &inRec, const char *inData,
     DiffRecord &outRec, AlignedArray &outData, bool calcChecksum)
@@ -200,6 +200,14 @@ private:
 };
 
 
+/**
+ * outRec.io_checksum will be set. outRec may be the same as inRec.
+ */
+void compressDiffIo(
+    const IndexedDiffRecord &inRec, const char *inData,
+    IndexedDiffRecord &outRec, AlignedArray &outData, int type = ::WALB_DIFF_CMPR_SNAPPY, int level = 0);
+
+
 /**
  * sizeof(DiffIndexedSuper) == sizeof(walb_diff_index_super)
  */
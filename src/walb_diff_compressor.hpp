@@ -87,19 +87,63 @@ struct PackCompressorBase {
 
 class PackCompressor : public compressor::PackCompressorBase {
     int type_;
-    walb::Compressor c_;
+    ZstdDictPtr dict_;
+    std::unique_ptr<walb::Compressor> c_;
+    int cType_; // type of c_.
+    size_t cLevel_;
+    std::unique_ptr<CompressionSelector> selector_; // for WALB_DIFF_CMPR_AUTO.
+
+    void setCompressor(int type, size_t level) {
+        if (c_ && type == cType_ && level == cLevel_) return;
+        c_.reset(new walb::Compressor(type, level, type == WALB_DIFF_CMPR_ZSTD ? dict_ : nullptr));
+        cType_ = type;
+        cLevel_ = level;
+    }
+    void selectCompressor(const char *inPackTop) {
+        const DiffPackHeader& inPack = *reinterpret_cast<const DiffPackHeader*>(inPackTop);
+        const char *in = inPackTop + WALB_DIFF_PACK_SIZE;
+        selector_->clear();
+        for (size_t i = 0; i < inPack.n_records; i++) {
+            const DiffRecord& rec = inPack[i];
+            if (rec.isNormal() && !rec.isCompressed()) selector_->add(in, rec.data_size);
+            in += rec.data_size;
+        }
+        size_t level;
+        const int type = selector_->choose(&level);
+        setCompressor(type, level);
+    }
 public:
-    PackCompressor(int type, size_t compressionLevel = 0)
-        : type_(type), c_(type, compressionLevel)
+    /**
+     * type: WALB_DIFF_CMPR_AUTO chooses a type for each pack,
+     *   and compressionLevel is used as its CPU budget.
+     * dict: zstd dictionary. It may be null.
+     */
+    PackCompressor(int type, size_t compressionLevel = 0, const ZstdDictPtr &dict = nullptr)
+        : type_(type), dict_(dict), c_(), cType_(), cLevel_(), selector_()
     {
+        if (type == WALB_DIFF_CMPR_AUTO) {
+            selector_.reset(new CompressionSelector(compressionLevel));
+        } else {
+            if (dict && type != WALB_DIFF_CMPR_ZSTD) {
+                throw cybozu::Exception("PackCompressor:dictionary is not supported") << type;
+            }
+            setCompressor(type, compressionLevel);
+        }
     }
     void convertRecord(char *out, size_t maxOutSize, walb_diff_record& outRecord, const char *in, const walb_diff_record& inRecord)
     {
         outRecord = inRecord;
         const size_t inSize = inRecord.data_size;
+        if (inRecord.compression_type != WALB_DIFF_CMPR_NONE) {
+            // already compressed: pass through with its checksum.
+            if (inSize > maxOutSize) throw cybozu::Exception("PackCompressor:convertRecord:small maxOutSize") << inSize << maxOutSize;
+            ::memcpy(out, in, inSize);
+            return;
+        }
         size_t encSize;
-        if (c_.run(out, &encSize, maxOutSize, in, inSize) && encSize < inSize) {
-            outRecord.compression_type = type_;
+        if (cType_ != WALB_DIFF_CMPR_NONE
+            && c_->run(out, &encSize, maxOutSize, in, inSize) && encSize < inSize) {
+            outRecord.compression_type = cType_;
             outRecord.data_size = encSize;
         } else {
             // not compress
@@ -116,6 +160,7 @@ public:
     compressor::Buffer convert(const char *inPackTop)
     {
         const walb_diff_pack& inPack = *reinterpret_cast<const walb_diff_pack*>(inPackTop);
+        if (selector_) selectCompressor(inPackTop);
         const size_t margin = 4096;
         return compressor::g_convert(*this, inPackTop, inPack.total_size + margin);
     }
@@ -123,11 +168,22 @@ public:
 
 class PackUncompressor : public compressor::PackCompressorBase {
     int type_;
-    walb::Uncompressor d_;
+    size_t para_;
+    std::unique_ptr<walb::Uncompressor> dV_[WALB_DIFF_CMPR_MAX];
+
+    walb::Uncompressor& getUncompressor(int type) {
+        std::unique_ptr<walb::Uncompressor> &d = dV_[type];
+        if (!d) d.reset(new walb::Uncompressor(type, para_));
+        return *d;
+    }
 public:
+    /**
+     * type: WALB_DIFF_CMPR_AUTO accepts records of any type.
+     */
     PackUncompressor(int type, size_t para = 0)
-        : type_(type), d_(type, para)
+        : type_(type), para_(para), dV_()
     {
+        if (type != WALB_DIFF_CMPR_AUTO) getUncompressor(type);
     }
     void convertRecord(char *out, size_t maxOutSize, walb_diff_record& outRecord, const char *in, const walb_diff_record& inRecord)
     {
@@ -137,10 +193,12 @@ public:
             if (inSize > maxOutSize) throw cybozu::Exception("PackUncompressor:convertRecord:small maxOutSize") << inSize << maxOutSize;
             ::memcpy(out, in, inSize);
             return;
-        } else if (inRecord.compression_type != type_) {
+        } else if (type_ != WALB_DIFF_CMPR_AUTO && inRecord.compression_type != type_) {
             throw cybozu::Exception("PackUncompressor:convertRecord:type mismatch") << inRecord.compression_type << type_;
+        } else if (inRecord.compression_type >= WALB_DIFF_CMPR_MAX) {
+            throw cybozu::Exception("PackUncompressor:convertRecord:invalid type") << inRecord.compression_type;
         }
-        size_t decSize = d_.run(out, maxOutSize, in, inSize);
+        size_t decSize = getUncompressor(inRecord.compression_type).run(out, maxOutSize, in, inSize);
         outRecord.compression_type = WALB_DIFF_CMPR_NONE;
         outRecord.data_size = decSize;
         assert(decSize == outRecord.io_blocks * 512);
@@ -190,7 +248,7 @@ class ConverterQueueT
         std::unique_ptr<compressor::PackCompressorBase> e_;
 
         static constexpr const char* NAME() { return "ConverterQueue::Engine"; }
-        void init(bool doCompress, int type, size_t para,
+        void init(bool doCompress, int type, size_t para, const ZstdDictPtr &dict,
                   std::mutex* m, const bool* quit, std::deque<Task*>* readyQ,
                   std::condition_variable* ready, std::condition_variable* avail) {
             m_ = m;
@@ -199,7 +257,7 @@ class ConverterQueueT
             ready_ = ready;
             avail_ = avail;
             if (doCompress) {
-                e_.reset(new Conv(type, para));
+                e_.reset(new Conv(type, para, dict));
             } else {
                 e_.reset(new UnConv(type, para));
             }
@@ -247,7 +305,11 @@ class ConverterQueueT
 
 public:
     static constexpr const char* NAME() { return "ConverterQueue"; }
-    ConverterQueueT(size_t maxQueueNum, size_t threadNum, bool doCompress, int type, size_t para = 0)
+    /**
+     * dict: zstd dictionary for compression. It may be null.
+     */
+    ConverterQueueT(size_t maxQueueNum, size_t threadNum, bool doCompress, int type, size_t para = 0,
+                    const ZstdDictPtr &dict = nullptr)
         : maxQueueSize_(maxQueueNum)
         , m_()
         , quit_(false)
@@ -260,7 +322,7 @@ public:
         , joined_(false) {
 
         for (Engine& e : enginePool_) {
-            e.init(doCompress, type, para, &m_, &quit_, &readyQ_, &ready_, &avail_);
+            e.init(doCompress, type, para, dict, &m_, &quit_, &readyQ_, &ready_, &avail_);
         }
     }
     ~ConverterQueueT() noexcept {
@@ -128,6 +128,7 @@ void IndexedDiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t m
     IndexedDiffWriter writer;
     writer.setFd(outputWdiffFd);
     writer.setMaxIoBlocks(maxIoBlocks);
+    writer.setDedup(maxDedupNr_);
     DiffFileHeader wdiffH;
 
     /* Loop */
@@ -148,8 +149,9 @@ void IndexedDiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t m
     /* Get statistics */
     LOGd_("\n"
           "Written blocks: %" PRIu64 "\n"
+          "Deduplicated blocks: %" PRIu64 "\n"
           "lsid: %" PRIu64 "\n",
-          writtenBlocks, lsid);
+          writtenBlocks, writer.getDedupLb(), lsid);
 
     writer.finalize();
 }
@@ -63,7 +63,14 @@ bool convertLogToDiff(const WlogRecord &lrec, const void *data, IndexedDiffRecor
 
 class IndexedDiffConverter /* final */
 {
+private:
+    size_t maxDedupNr_;
 public:
+    IndexedDiffConverter() : maxDedupNr_(0) {}
+    /**
+     * See IndexedDiffWriter::setDedup().
+     */
+    void setDedup(size_t maxNr) { maxDedupNr_ = maxNr; }
     void convert(int inputLogFd, int outputWdiffFd,
                  uint32_t maxIoBlocks = DEFAULT_MAX_IO_LB);
 private:
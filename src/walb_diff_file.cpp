@@ -1,4 +1,5 @@
 #include "walb_diff_file.hpp"
+#include "murmurhash3.hpp"
 
 namespace walb {
 
@@ -27,8 +28,9 @@ std::string DiffFileHeader::str() const
         "  checksum: %08x\n"
         "  version: %u\n"
         "  type: %s\n"
+        "  dict_id: %u\n"
         "  uuid: %s\n"
-        , checksum, version, typeStr().c_str(), getUuid().str().c_str());
+        , checksum, version, typeStr().c_str(), dict_id, getUuid().str().c_str());
 }
 
 bool DiffFileHeader::isIndexed() const
@@ -60,6 +62,7 @@ void SortedDiffWriter::close()
     if (!isClosed_) {
         writePack(); // if buffered data exist.
         writeEof();
+        if (isWrittenHeader_) indexMem_.writeTo(fileW_, offset_);
         fileW_.close();
         isClosed_ = true;
     }
@@ -72,6 +75,7 @@ void SortedDiffWriter::writeHeader(DiffFileHeader &header)
     }
     header.type = ::WALB_DIFF_TYPE_SORTED;
     header.writeTo(fileW_);
+    offset_ += header.getSize();
     isWrittenHeader_ = true;
 }
 
@@ -122,6 +126,8 @@ void SortedDiffWriter::init()
     while (!ioQ_.empty()) ioQ_.pop();
     stat_.clear();
     stat_.wdiffNr = 1;
+    offset_ = 0;
+    indexMem_.clear();
 }
 
 bool SortedDiffWriter::addAndPush(const DiffRecord &rec, AlignedArray &&buf)
@@ -155,6 +161,7 @@ void SortedDiffWriter::writePack()
     }
 
     stat_.update(pack_);
+    indexMem_.add(pack_, offset_);
     pack_.writeTo(fileW_);
 
     assert(pack_.n_records == ioQ_.size());
@@ -167,9 +174,75 @@ void SortedDiffWriter::writePack()
         total += buf.size();
     }
     assert(total == pack_.total_size);
+    offset_ += WALB_DIFF_PACK_SIZE + total;
     pack_.clear();
 }
 
+void SortedDiffIndexMem::add(const DiffPackHeader &pack, uint64_t packOffset)
+{
+    if (pack.n_records == 0) return;
+    SortedDiffIndexRecord idx;
+    ::memset(&idx, 0, sizeof(idx));
+    idx.pack_offset = packOffset;
+    idx.io_address = pack[0].io_address;
+    idx.n_records = pack.n_records;
+    for (size_t i = 0; i < pack.n_records; i++) {
+        const DiffRecord &rec = pack[i];
+        idx.end_address = std::max(idx.end_address, rec.endIoAddress());
+        if (rec.isNormal()) idx.normal_blocks += rec.io_blocks;
+    }
+    recV_.push_back(idx);
+    stat_.update(pack);
+}
+
+void SortedDiffIndexMem::append(const SortedDiffIndexMem &rhs, uint64_t offset)
+{
+    for (SortedDiffIndexRecord idx : rhs.recV_) {
+        idx.pack_offset += offset;
+        recV_.push_back(idx);
+    }
+    stat_.update(rhs.stat_);
+}
+
+void SortedDiffIndexMem::writeTo(cybozu::util::File &file, uint64_t indexOffset) const
+{
+    struct stat st;
+    if (::fstat(file.fd(), &st) < 0 || !S_ISREG(st.st_mode)) return;
+    const size_t size = recV_.size() * sizeof(SortedDiffIndexRecord);
+    SortedDiffIndexSuper super;
+    super.init();
+    super.index_offset = indexOffset;
+    super.setStat(stat_);
+    super.n_packs = recV_.size();
+    super.index_checksum = cybozu::util::calcChecksum(recV_.data(), size, 0);
+    super.updateChecksum();
+    file.write(recV_.data(), size);
+    file.write(&super, sizeof(super));
+}
+
+bool readSortedDiffIndex(
+    cybozu::util::File &file, SortedDiffIndexSuper &super, std::vector<SortedDiffIndexRecord> &recV)
+{
+    struct stat st;
+    if (::fstat(file.fd(), &st) < 0 || !S_ISREG(st.st_mode)) return false;
+    const uint64_t fileSize = st.st_size;
+    if (fileSize < sizeof(DiffFileHeader) + WALB_DIFF_PACK_SIZE + sizeof(super)) return false;
+
+    const off_t pos = file.lseek(0, SEEK_CUR);
+    file.pread(&super, sizeof(super), fileSize - sizeof(super));
+    const bool hasIndex = super.isValid(fileSize);
+    if (hasIndex) {
+        recV.resize(super.n_packs);
+        const size_t size = recV.size() * sizeof(SortedDiffIndexRecord);
+        file.pread(recV.data(), size, super.index_offset);
+        if (cybozu::util::calcChecksum(recV.data(), size, 0) != super.index_checksum) {
+            throw cybozu::Exception(__func__) << "invalid index checksum";
+        }
+    }
+    file.lseek(pos);
+    return hasIndex;
+}
+
 
 void SortedDiffReader::readHeader(DiffFileHeader &head, bool doReadPackHeader)
 {
@@ -248,6 +321,79 @@ void SortedDiffReader::readDiffIo(const DiffRecord &rec, AlignedArray &buf, bool
     recIdx_++;
 }
 
+void SortedDiffReader::seekByPackScan(uint64_t addr)
+{
+    if (!isReadHeader_) {
+        throw cybozu::Exception(NAME) << "seekByPackScan: call readHeader() before.";
+    }
+    while (prepareRead()) {
+        if (recIdx_ == pack_.n_records) continue; // empty pack.
+        const DiffRecord &last = pack_[pack_.n_records - 1];
+        if (last.endIoAddress() <= addr) {
+            // Skip all the remaining records in the pack.
+            fileR_.lseek(pack_.total_size - totalSize_, SEEK_CUR);
+            totalSize_ = pack_.total_size;
+            recIdx_ = pack_.n_records;
+            continue;
+        }
+        const DiffRecord &rec = pack_[recIdx_];
+        if (rec.endIoAddress() > addr) return;
+        fileR_.lseek(rec.data_size, SEEK_CUR);
+        totalSize_ += rec.data_size;
+        recIdx_++;
+    }
+}
+
+void SortedDiffReader::seek(uint64_t addr)
+{
+    if (!isReadHeader_) {
+        throw cybozu::Exception(NAME) << "seek: call readHeader() before.";
+    }
+    loadIndex();
+    if (!hasIndex_) {
+        seekByPackScan(addr);
+        return;
+    }
+    auto it = std::lower_bound(
+        packIndex_.cbegin(), packIndex_.cend(), addr,
+        [](const SortedDiffIndexRecord &idx, uint64_t a) { return idx.end_address <= a; });
+    if (it == packIndex_.cend()) {
+        pack_.setEnd();
+        return;
+    }
+    fileR_.lseek(it->pack_offset);
+    if (!readPackHeader()) {
+        throw cybozu::Exception(NAME) << "seek: bad pack offset in the index" << it->pack_offset;
+    }
+    seekByPackScan(addr);
+}
+
+void SortedDiffReader::loadIndex()
+{
+    if (isIndexLoaded_) return;
+    isIndexLoaded_ = true;
+    SortedDiffIndexSuper super;
+    hasIndex_ = readSortedDiffIndex(fileR_, super, packIndex_);
+}
+
+bool SortedDiffReader::readPack(std::vector<DiffRecord> &recV, std::vector<AlignedArray> &bufV)
+{
+    recV.clear();
+    bufV.clear();
+    if (!prepareRead()) return false;
+    while (recIdx_ < pack_.n_records) {
+        const DiffRecord &rec = pack_[recIdx_];
+        if (!rec.isValid()) {
+            throw cybozu::Exception(__func__)
+                << "invalid record" << fileR_.fd() << recIdx_ << rec;
+        }
+        recV.push_back(rec);
+        bufV.emplace_back();
+        readDiffIo(rec, bufV.back(), false);
+    }
+    return true;
+}
+
 bool SortedDiffReader::readPackHeader()
 {
     try {
@@ -271,6 +417,9 @@ void SortedDiffReader::init()
     totalSize_ = 0;
     stat_.clear();
     stat_.wdiffNr = 1;
+    isIndexLoaded_ = false;
+    hasIndex_ = false;
+    packIndex_.clear();
 }
 
 void DiffIndexMem::checkNoOverlappedAndSorted() const
@@ -407,14 +556,88 @@ void IndexedDiffWriter::compressAndWriteDiff(
         writeDiff(rec, data);
         return;
     }
-    size_t outSize = 0;
-    type = compressData(data, rec.io_blocks * LOGICAL_BLOCK_SIZE,
-                        buf_, outSize, type, level);
-    IndexedDiffRecord r = rec;
-    r.compression_type = type;
-    r.data_size = outSize;
-    r.io_checksum = calcDiffIoChecksum(buf_);
+    if (dedupTbl_.getMaxSize() > 0) {
+        dedupAndWriteDiff(rec, data, type, level);
+        return;
+    }
+    compressAndWriteNormalDiff(rec, data, type, level);
+}
+
+IndexedDiffRecord IndexedDiffWriter::compressAndWriteNormalDiff(
+    const IndexedDiffRecord &rec, const char *data, int type, int level)
+{
+    IndexedDiffRecord r;
+    compressDiffIo(rec, data, r, buf_, type, level);
+    r.data_offset = offset_;
     writeDiff(r, buf_.data());
+    return r;
+}
+
+/**
+ * The IO is divided at DIFF_DEDUP_BLOCK_SIZE boundaries from its head.
+ * Runs of blocks not found in the table are written as usual and added to the table.
+ */
+void IndexedDiffWriter::dedupAndWriteDiff(
+    const IndexedDiffRecord &rec, const char *data, int type, int level)
+{
+    const uint32_t blkLb = DIFF_DEDUP_BLOCK_SIZE / LOGICAL_BLOCK_SIZE;
+    uint32_t bgn = 0; // head of the run [logical block].
+    std::unordered_map<uint64_t, uint32_t> runMap; // blocks in the run. key -> offset from rec head.
+
+    auto writeRun = [&](uint32_t end) {
+        if (bgn == end) return;
+        IndexedDiffRecord r = rec;
+        r.io_address = rec.io_address + bgn;
+        r.io_blocks = end - bgn;
+        r.orig_blocks = r.io_blocks;
+        r.io_offset = 0;
+        r.data_size = r.io_blocks * LOGICAL_BLOCK_SIZE;
+        r = compressAndWriteNormalDiff(r, data + bgn * LOGICAL_BLOCK_SIZE, type, level);
+        for (uint32_t off = 0; off + blkLb <= r.io_blocks; off += blkLb) {
+            const char *p = data + (bgn + off) * LOGICAL_BLOCK_SIZE;
+            r.io_offset = off;
+            dedupTbl_.add(DiffDedupTable::getKey(p), r, p);
+        }
+        bgn = end;
+        runMap.clear();
+    };
+
+    for (uint32_t i = 0; i + blkLb <= rec.io_blocks; i += blkLb) {
+        const char *p = data + i * LOGICAL_BLOCK_SIZE;
+        const uint64_t key = DiffDedupTable::getKey(p);
+        IndexedDiffRecord ref;
+        bool found = dedupTbl_.find(key, p, ref);
+        if (!found) {
+            // The same block may be in the run not written yet.
+            std::unordered_map<uint64_t, uint32_t>::const_iterator it = runMap.find(key);
+            if (it != runMap.end() &&
+                ::memcmp(data + it->second * LOGICAL_BLOCK_SIZE, p, DIFF_DEDUP_BLOCK_SIZE) == 0) {
+                writeRun(i);
+                found = dedupTbl_.find(key, p, ref);
+            }
+        }
+        if (!found) {
+            runMap.emplace(key, i);
+            continue;
+        }
+        writeRun(i);
+        writeRef(ref, rec.io_address + i, blkLb);
+        bgn = i + blkLb;
+    }
+    writeRun(rec.io_blocks);
+}
+
+void IndexedDiffWriter::writeRef(const IndexedDiffRecord &ref, uint64_t ioAddr, uint32_t ioBlocks)
+{
+    checkWrittenHeader();
+    IndexedDiffRecord r = ref;
+    r.io_address = ioAddr;
+    r.io_blocks = ioBlocks;
+    r.updateRecChecksum();
+    indexMem_.add(r);
+    /* Account the share of the referred data as if the IO had been written. */
+    stat_.dataSize += uint64_t(ref.data_size) * ioBlocks / ref.io_blocks;
+    dedupLb_ += ioBlocks;
 }
 
 void IndexedDiffWriter::init()
@@ -426,6 +649,8 @@ void IndexedDiffWriter::init()
     isClosed_ = true;
     stat_.clear();
     stat_.wdiffNr = 1;
+    dedupTbl_.clear();
+    dedupLb_ = 0;
 }
 
 void IndexedDiffWriter::writeSuper()
@@ -440,6 +665,43 @@ void IndexedDiffWriter::writeSuper()
     fileW_.write(&super, sizeof(super));
 }
 
+uint64_t DiffDedupTable::getKey(const char *block)
+{
+    const cybozu::murmurhash3::Hash h = cybozu::murmurhash3::Hasher()(block, DIFF_DEDUP_BLOCK_SIZE);
+    uint64_t key;
+    ::memcpy(&key, &h.data[0], sizeof(key));
+    return key;
+}
+
+bool DiffDedupTable::find(uint64_t key, const char *block, IndexedDiffRecord &rec) const
+{
+    std::unordered_map<uint64_t, Entry>::const_iterator it = map_.find(key);
+    if (it == map_.end()) return false;
+    const Entry &e = it->second;
+    if (::memcmp(e.data.data(), block, DIFF_DEDUP_BLOCK_SIZE) != 0) return false;
+    rec = e.rec;
+    return true;
+}
+
+void DiffDedupTable::add(uint64_t key, const IndexedDiffRecord &rec, const char *block)
+{
+    if (maxNr_ == 0) return;
+    std::unordered_map<uint64_t, Entry>::iterator it = map_.find(key);
+    if (it == map_.end()) {
+        it = map_.emplace(key, Entry()).first;
+        keyQ_.push_back(key);
+    }
+    // A colliding block replaces the old one but keeps its position in keyQ_.
+    Entry &e = it->second;
+    e.rec = rec;
+    util::assignAlignedArray(e.data, block, DIFF_DEDUP_BLOCK_SIZE);
+
+    while (map_.size() > maxNr_) {
+        map_.erase(keyQ_.front());
+        keyQ_.pop_front();
+    }
+}
+
 AlignedArray* IndexedDiffCache::find(Key key)
 {
     auto it = map_.find(key);
@@ -494,9 +756,15 @@ void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &ca
             << "non-seekable file descriptor is not supported" << fileR.fd();
     }
     cache_ = &cache;
+    cacheTag_ = IndexedDiffCache::newTag();
     memFile_.setReadOnly();
     memFile_.reset(std::move(fileR));
 
+    DiffIndexSuper super;
+    if (memFile_.getFileSize() < sizeof(header_) + sizeof(super)) {
+        throw cybozu::Exception(NAME) << "too small file" << memFile_.getFileSize();
+    }
+
     // read header.
     ::memcpy(&header_, &memFile_[0], sizeof(header_));
     header_.verify();
@@ -505,10 +773,12 @@ void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &ca
     }
 
     // read index super.
-    DiffIndexSuper super;
     idxEndOffset_  = memFile_.getFileSize() - sizeof(super);
     ::memcpy(&super, &memFile_[idxEndOffset_], sizeof(super));
     super.verify();
+    if (super.index_offset < sizeof(header_) || idxEndOffset_ < super.index_offset) {
+        throw cybozu::Exception(NAME) << "invalid index offset" << super.index_offset << idxEndOffset_;
+    }
     idxBgnOffset_ = super.index_offset;
     idxOffset_ = idxBgnOffset_;
 
@@ -525,9 +795,27 @@ bool IndexedDiffReader::readDiffRecord(IndexedDiffRecord &rec, bool doVerify)
     return true;
 }
 
+void IndexedDiffReader::seek(uint64_t addr)
+{
+    const size_t recSize = sizeof(IndexedDiffRecord);
+    size_t bgn = (idxOffset_ - idxBgnOffset_) / recSize;
+    size_t end = (idxEndOffset_ - idxBgnOffset_) / recSize;
+    IndexedDiffRecord rec;
+    while (bgn < end) {
+        const size_t mid = (bgn + end) / 2;
+        ::memcpy(&rec, &memFile_[idxBgnOffset_ + mid * recSize], recSize);
+        if (rec.endIoAddress() <= addr) {
+            bgn = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    idxOffset_ = idxBgnOffset_ + bgn * recSize;
+}
+
 bool IndexedDiffReader::isOnCache(const IndexedDiffRecord &rec) const
 {
-    const IndexedDiffCache::Key key{this, rec.data_offset};
+    const IndexedDiffCache::Key key{cacheTag_, rec.data_offset};
     return cache_->find(key) != nullptr;
 }
 
@@ -540,7 +828,7 @@ bool IndexedDiffReader::loadToCache(const IndexedDiffRecord &rec, bool throwErro
     std::unique_ptr<AlignedArray> p(new AlignedArray());
     p->resize(rec.orig_blocks * LOGICAL_BLOCK_SIZE);
     uncompressData(&memFile_[rec.data_offset], rec.data_size, *p, rec.compression_type);
-    const IndexedDiffCache::Key key{this, rec.data_offset};
+    const IndexedDiffCache::Key key{cacheTag_, rec.data_offset};
     cache_->add(key, std::move(p));
     return true;
 }
@@ -555,7 +843,7 @@ void IndexedDiffReader::readDiffIo(const IndexedDiffRecord &rec, AlignedArray &d
         throw cybozu::Exception(NAME) << "BUG: cache_ must be set.";
     }
 
-    const IndexedDiffCache::Key key{this, rec.data_offset};
+    const IndexedDiffCache::Key key{cacheTag_, rec.data_offset};
     AlignedArray *aryPtr = cache_->find(key);
     if (aryPtr == nullptr) {
         loadToCache(rec);
@@ -576,6 +864,16 @@ bool IndexedDiffReader::getNextRec(IndexedDiffRecord& rec)
     return true;
 }
 
+void IndexedDiffReader::verifyIo(const IndexedDiffRecord &rec) const
+{
+    if (!rec.isNormal()) return;
+    if (rec.data_offset < sizeof(header_) || idxBgnOffset_ < rec.data_offset + rec.data_size) {
+        throw cybozu::Exception(NAME) << "IO data out of range"
+                                      << rec.data_offset << rec.data_size << idxBgnOffset_;
+    }
+    verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, true);
+}
+
 bool IndexedDiffReader::verifyIoData(uint64_t offset, uint32_t size, uint32_t csum, bool throwError) const
 {
     if (cybozu::util::calcChecksum(&memFile_[offset], size, 0) == csum) {
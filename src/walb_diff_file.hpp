@@ -4,6 +4,8 @@
  * @brief walb diff utiltities for files.
  */
 #include <unordered_map>
+#include <deque>
+#include <atomic>
 #include "walb_diff_pack.hpp"
 #include "walb_diff_stat.hpp"
 #include "uuid.hpp"
@@ -42,6 +44,12 @@ struct DiffFileHeader : walb_diff_file_header
     void setUuid(const cybozu::Uuid& uuid) {
         uuid.copyTo(this->uuid);
     }
+    /**
+     * Dictionaries must be loaded from elsewhere
+     * because compressed frames refer to them by the id.
+     */
+    uint32_t getDictId() const { return dict_id; }
+    void setDictId(uint32_t dictId) { dict_id = dictId; }
 
     std::string str() const;
     friend inline std::ostream& operator<<(std::ostream &os, const DiffFileHeader &fileH) {
@@ -72,11 +80,26 @@ struct DiffFileHeader : walb_diff_file_header
     }
 };
 
+/**
+ * A wdiff file refers to at most one zstd dictionary.
+ * Merged wdiffs that refer to different ones get MIXED_DICT_ID,
+ * and their zstd-compressed IOs must be uncompressed in the output.
+ */
+const uint32_t MIXED_DICT_ID = UINT32_MAX;
+
+inline uint32_t mergeDictId(uint32_t dictId0, uint32_t dictId1)
+{
+    if (dictId0 == 0) return dictId1;
+    if (dictId1 == 0 || dictId0 == dictId1) return dictId0;
+    return MIXED_DICT_ID;
+}
+
 template <class Writer>
-void writeDiffFileHeader(Writer& writer, const cybozu::Uuid &uuid)
+void writeDiffFileHeader(Writer& writer, const cybozu::Uuid &uuid, uint32_t dictId = 0)
 {
     DiffFileHeader fileH;
     fileH.setUuid(uuid);
+    fileH.setDictId(dictId);
     fileH.writeTo(writer);
 }
 
@@ -90,8 +113,95 @@ void writeDiffEofPack(Writer& writer)
     pack.writeTo(writer);
 }
 
+using SortedDiffIndexRecord = walb_diff_sorted_index_record;
+
+struct SortedDiffIndexSuper : walb_diff_sorted_index_super
+{
+    constexpr static const char *NAME = "SortedDiffIndexSuper";
+    void init() {
+        ::memset(this, 0, sizeof(*this));
+        magic = WALB_DIFF_SORTED_INDEX_MAGIC;
+    }
+    void updateChecksum() {
+        checksum = 0;
+        checksum = cybozu::util::calcChecksum(this, sizeof(*this), 0);
+    }
+    /**
+     * Files without the index end with other data, so this does not throw.
+     */
+    bool isValid(uint64_t fileSize) const {
+        return magic == WALB_DIFF_SORTED_INDEX_MAGIC
+            && cybozu::util::calcChecksum(this, sizeof(*this), 0) == 0
+            && index_offset + n_packs * sizeof(SortedDiffIndexRecord) + sizeof(*this) == fileSize;
+    }
+    void setStat(const DiffStatistics &stat) {
+        normal_nr = stat.normNr;
+        allzero_nr = stat.zeroNr;
+        discard_nr = stat.discNr;
+        normal_lb = stat.normLb;
+        allzero_lb = stat.zeroLb;
+        discard_lb = stat.discLb;
+        data_size = stat.dataSize;
+    }
+    DiffStatistics getStat() const {
+        DiffStatistics stat;
+        stat.wdiffNr = 1;
+        stat.normNr = normal_nr;
+        stat.zeroNr = allzero_nr;
+        stat.discNr = discard_nr;
+        stat.normLb = normal_lb;
+        stat.zeroLb = allzero_lb;
+        stat.discLb = discard_lb;
+        stat.dataSize = data_size;
+        return stat;
+    }
+};
+
+/**
+ * Pack index of a sorted wdiff being written.
+ */
+class SortedDiffIndexMem /* final */
+{
+private:
+    std::vector<SortedDiffIndexRecord> recV_;
+    DiffStatistics stat_;
+
+public:
+    void clear() {
+        recV_.clear();
+        stat_.clear();
+    }
+    /**
+     * @pack a pack written at packOffset of the file.
+     */
+    void add(const DiffPackHeader &pack, uint64_t packOffset);
+    /**
+     * Add the packs of another part of the file.
+     * @offset offset of the part in the file.
+     */
+    void append(const SortedDiffIndexMem &rhs, uint64_t offset);
+    /**
+     * Append the index to the file.
+     * Nothing is written unless the file is a regular file
+     * because streams may be followed by other data.
+     *
+     * @indexOffset current file offset, just after the end pack.
+     */
+    void writeTo(cybozu::util::File &file, uint64_t indexOffset) const;
+};
+
+/**
+ * Read the pack index of a sorted wdiff file.
+ * The file offset is not changed.
+ * RETURN:
+ *   false if the file has no index.
+ */
+bool readSortedDiffIndex(
+    cybozu::util::File &file, SortedDiffIndexSuper &super, std::vector<SortedDiffIndexRecord> &recV);
+
 /**
  * Walb diff writer.
+ * It appends the pack index to the file at close() if the file is a regular file.
  */
 class SortedDiffWriter /* final */
 {
@@ -108,6 +218,9 @@ private:
 
     DiffStatistics stat_;
 
+    uint64_t offset_; // current file offset [byte].
+    SortedDiffIndexMem indexMem_;
+
 public:
     SortedDiffWriter() : pack_(edp_.header) {
         init();
@@ -183,6 +296,7 @@ private:
 
     void writeEof() {
         writeDiffEofPack(fileW_);
+        offset_ += WALB_DIFF_PACK_SIZE;
     }
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
@@ -216,6 +330,10 @@ private:
 
     DiffStatistics stat_;
 
+    bool isIndexLoaded_;
+    bool hasIndex_;
+    std::vector<SortedDiffIndexRecord> packIndex_;
+
 public:
     constexpr static const char *NAME = "SortedDiffReader";
     SortedDiffReader() : pack_(edp_.header) {
@@ -293,6 +411,35 @@ public:
      * @io block IO to be filled.
      */
     void readDiffIo(const DiffRecord &rec, AlignedArray &buf, bool verifyChecksum = true);
+    /**
+     * Skip records whose end address <= addr.
+     * Only pack headers will be read. IO data of skipped records will not be read.
+     * The file must be seekable.
+     */
+    void seekByPackScan(uint64_t addr);
+    /**
+     * Skip records whose end address <= addr like seekByPackScan().
+     * If the file has the pack index, it jumps to the target pack directly
+     * and it can move backward also.
+     * The file must be seekable.
+     */
+    void seek(uint64_t addr);
+    /**
+     * RETURN:
+     *   true if the file has the pack index.
+     */
+    bool hasIndex() {
+        loadIndex();
+        return hasIndex_;
+    }
+    /**
+     * Read all the remaining records in the current pack and their IO data.
+     * IO checksums will not be verified. Use this instead of readDiff() to read packs ahead.
+     *
+     * RETURN:
+     *   false if the input stream reached the end.
+     */
+    bool readPack(std::vector<DiffRecord> &recV, std::vector<AlignedArray> &bufV);
 
     const DiffStatistics& getStat() const {
         return stat_;
@@ -300,6 +447,7 @@ public:
 private:
     bool readPackHeader();
     void init();
+    void loadIndex();
 };
 
 
@@ -344,6 +492,55 @@ public:
 };
 
 
+const uint32_t DIFF_DEDUP_BLOCK_SIZE = 4096;
+
+/**
+ * Recently written blocks of an indexed diff file.
+ * A block found here can be replaced by a record that refers to its data
+ * with data_offset and io_offset, like a part of a split IO.
+ * So readers need not know about deduplication.
+ * References do not survive sorted wdiffs, so they are expanded
+ * when an indexed diff is merged into a sorted one.
+ * wdiff-transfer of version 2 sends indexed diffs as they are to keep them.
+ */
+class DiffDedupTable /* final */
+{
+private:
+    struct Entry {
+        IndexedDiffRecord rec; // only the fields to refer to the data are used.
+        AlignedArray data; // uncompressed block.
+    };
+    size_t maxNr_;
+    std::unordered_map<uint64_t, Entry> map_; // key: hash of the block.
+    std::deque<uint64_t> keyQ_; // keys in insertion order to evict old ones.
+
+public:
+    DiffDedupTable() : maxNr_(0), map_(), keyQ_() {}
+    /**
+     * @maxNr max number of blocks to keep. 0 means disabled.
+     */
+    void setMaxSize(size_t maxNr) {
+        maxNr_ = maxNr;
+        clear();
+    }
+    size_t getMaxSize() const { return maxNr_; }
+    void clear() {
+        map_.clear();
+        keyQ_.clear();
+    }
+    static uint64_t getKey(const char *block);
+    /**
+     * @rec record that refers to the same block will be set if found.
+     * RETURN:
+     *   true if found.
+     */
+    bool find(uint64_t key, const char *block, IndexedDiffRecord &rec) const;
+    /**
+     * @rec record that refers to the block.
+     */
+    void add(uint64_t key, const IndexedDiffRecord &rec, const char *block);
+};
+
 /**
  * Indexed diff writer.
  */
@@ -358,9 +555,11 @@ private:
     DiffIndexMem indexMem_;
     DiffStatistics stat_;
     AlignedArray buf_;
+    DiffDedupTable dedupTbl_;
+    uint64_t dedupLb_;
 
 public:
-    IndexedDiffWriter() {
+    IndexedDiffWriter() : dedupTbl_() {
         init();
     }
     ~IndexedDiffWriter() noexcept try {
@@ -383,6 +582,15 @@ public:
         isClosed_ = false;
     }
     void finalize();
+    /**
+     * Close the file without writing the index.
+     * The output is not a valid wdiff. Use this to give up writing.
+     */
+    void abort() {
+        if (isClosed_) return;
+        isClosed_ = true;
+        fileW_.close();
+    }
     void writeHeader(DiffFileHeader &header);
     /**
      * rec.io_checksum must be set before calling this function.
@@ -400,6 +608,17 @@ public:
     }
 
     void setMaxIoBlocks(uint32_t maxIoBlocks) { indexMem_.setMaxIoBlocks(maxIoBlocks); }
+    /**
+     * Replace DIFF_DEDUP_BLOCK_SIZE blocks of uncompressed IOs given to compressAndWriteDiff()
+     * that are identical to recently written ones with references to them.
+     * @maxNr max number of blocks to remember. 0 means disabled (default).
+     */
+    void setDedup(size_t maxNr) { dedupTbl_.setMaxSize(maxNr); }
+    size_t getDedupMaxNr() const { return dedupTbl_.getMaxSize(); }
+    /**
+     * Total size of deduplicated blocks [logical block].
+     */
+    uint64_t getDedupLb() const { return dedupLb_; }
 
     /**
      * for debug and test.
@@ -413,6 +632,13 @@ public:
 private:
     void init();
     void writeSuper();
+    void dedupAndWriteDiff(const IndexedDiffRecord &rec, const char *data, int type, int level);
+    /**
+     * RETURN:
+     *   written record.
+     */
+    IndexedDiffRecord compressAndWriteNormalDiff(const IndexedDiffRecord &rec, const char *data, int type, int level);
+    void writeRef(const IndexedDiffRecord &ref, uint64_t ioAddr, uint32_t ioBlocks);
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
             throw cybozu::Exception(NAME) <<
@@ -426,7 +652,7 @@ class IndexedDiffCache /* final */
 {
 public:
     struct Key {
-        const void *tag;
+        uint64_t tag; // see newTag().
         uint64_t addr;
 
         friend inline std::ostream& operator<<(std::ostream& os, const Key& key) {
@@ -437,7 +663,7 @@ public:
 private:
     struct HashKey {
         size_t operator()(Key key) const {
-            size_t h0 = std::hash<uintptr_t>()(uintptr_t(key.tag));
+            size_t h0 = std::hash<uint64_t>()(key.tag);
             size_t h1 = std::hash<uint64_t>()(key.addr);
             // like boost::hash_combine().
             return h0 ^ (h1 + 0x9e3779b9 + (h0 << 6) + (h0 >> 2));
@@ -466,6 +692,15 @@ public:
     AlignedArray* find(Key key);
     void add(Key key, std::unique_ptr<AlignedArray> &&dataPtr);
     void clear();
+    /**
+     * Each opened file must have its own tag.
+     * Addresses of readers can not be used as tags
+     * because they may be reused after the readers are destroyed.
+     */
+    static uint64_t newTag() {
+        static std::atomic<uint64_t> tag(0);
+        return tag++;
+    }
 private:
     void evictOne();
 };
@@ -486,13 +721,14 @@ private:
     size_t idxOffset_;
 
     IndexedDiffCache *cache_;
+    uint64_t cacheTag_;
     DiffStatistics stat_;
 
 public:
     constexpr static const char *NAME = "IndexedDiffReader";
     IndexedDiffReader()
         : memFile_(), header_(), idxBgnOffset_(), idxEndOffset_()
-        , idxOffset_(), cache_(nullptr), stat_() {}
+        , idxOffset_(), cache_(nullptr), cacheTag_(0), stat_() {}
     void setFile(cybozu::util::File &&fileR, IndexedDiffCache &cache);
     const DiffFileHeader& header() const { return header_; }
 
@@ -506,8 +742,17 @@ public:
         readDiffIo(rec, data);
         return true;
     }
+    /**
+     * Skip records whose end address <= addr.
+     * This uses binary search on the index.
+     */
+    void seek(uint64_t addr);
     const DiffStatistics& getStat() const { return stat_; }
     void close() { memFile_.reset(); }
+    /**
+     * Verify the IO data of a normal record without uncompressing it.
+     */
+    void verifyIo(const IndexedDiffRecord &rec) const;
 
     /*
      * isOnCache() and loadToCache() are special interface for wdiff-show command.
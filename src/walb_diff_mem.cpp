@@ -25,6 +25,16 @@ bool DiffRecIo::isValid(bool isChecksum) const
     return true;
 }
 
+void DiffRecIo::uncompress()
+{
+    if (!rec_.isNormal() || !rec_.isCompressed()) return;
+    DiffRecord rec;
+    AlignedArray buf;
+    uncompressDiffIo(rec_, io_.data(), rec, buf, false);
+    rec_ = rec;
+    io_ = std::move(buf);
+}
+
 std::vector<DiffRecIo> DiffRecIo::splitAll(uint32_t ioBlocks) const
 {
     assert(isValid());
@@ -183,13 +193,14 @@ void DiffMemory::add(const DiffRecord& rec, AlignedArray &&buf)
 
     /* Search overlapped items. */
     const uint64_t addr1 = rec.endIoAddress();
-    std::queue<DiffRecIo> q;
+    std::vector<DiffRecIo> v0;
     while (it != map_.end() && it->first < addr1) {
         DiffRecIo &r = it->second;
         if (r.record().isOverlapped(rec)) {
             nIos_--;
             nBlocks_ -= r.record().io_blocks;
-            q.push(std::move(r));
+            dataSize_ -= r.record().data_size;
+            v0.push_back(std::move(r));
             it = map_.erase(it);
         } else {
             ++it;
@@ -198,29 +209,31 @@ void DiffMemory::add(const DiffRecord& rec, AlignedArray &&buf)
 
     /* Eliminate overlaps. */
     DiffRecIo r0(rec, std::move(buf));
-    while (!q.empty()) {
-        std::vector<DiffRecIo> v = q.front().minus(r0);
-        for (DiffRecIo &r : v) {
+    if (!v0.empty()) r0.uncompress();
+    for (DiffRecIo &r1 : v0) {
+        r1.uncompress();
+        for (DiffRecIo &r : r1.minus(r0)) {
             const DiffRecord& dr = r.record();
             nIos_++;
             nBlocks_ += dr.io_blocks;
+            dataSize_ += dr.data_size;
             map_.emplace(dr.io_address, std::move(r));
         }
-        q.pop();
     }
     /* Insert the item. */
     nIos_++;
     nBlocks_ += r0.record().io_blocks;
-    std::vector<DiffRecIo> rv;
     if (maxIoBlocks_ > 0 && maxIoBlocks_ < rec.io_blocks) {
         // split a large IO into smaller IOs.
-        rv = r0.splitAll(maxIoBlocks_);
+        r0.uncompress();
+        for (DiffRecIo &r : r0.splitAll(maxIoBlocks_)) {
+            uint64_t addr = r.record().io_address;
+            dataSize_ += r.record().data_size;
+            map_.emplace(addr, std::move(r));
+        }
     } else {
-        rv.push_back(std::move(r0));
-    }
-    for (DiffRecIo &r : rv) {
-        uint64_t addr = r.record().io_address;
-        map_.emplace(addr, std::move(r));
+        dataSize_ += r0.record().data_size;
+        map_.emplace(rec.io_address, std::move(r0));
     }
 }
 
@@ -238,11 +251,13 @@ void DiffMemory::checkStatistics() const
 {
     uint64_t nBlocks = 0;
     uint64_t nIos = 0;
+    uint64_t dataSize = 0;
     auto it = map_.cbegin();
     while (it != map_.cend()) {
         const DiffRecord &rec = it->second.record();
         nBlocks += rec.io_blocks;
         nIos++;
+        dataSize += rec.data_size;
         ++it;
     }
     if (nBlocks_ != nBlocks) {
@@ -251,6 +266,9 @@ void DiffMemory::checkStatistics() const
     if (nIos_ != nIos) {
         throw cybozu::Exception("DiffMemory:getNIos:bad ios") << nIos_ << nIos;
     }
+    if (dataSize_ != dataSize) {
+        throw cybozu::Exception("DiffMemory:getNIos:bad data size") << dataSize_ << dataSize;
+    }
 }
 
 void DiffMemory::writeTo(int outFd, int cmprType)
@@ -311,7 +329,18 @@ void DiffMemory::eraseFromMap(Map::iterator& i)
 {
     nIos_--;
     nBlocks_ -= i->second.record().io_blocks;
+    dataSize_ -= i->second.record().data_size;
     i = map_.erase(i);
 }
 
+void DiffMemory::eraseFromMap(Map::iterator bgn, Map::iterator end)
+{
+    for (Map::iterator i = bgn; i != end; ++i) {
+        nIos_--;
+        nBlocks_ -= i->second.record().io_blocks;
+        dataSize_ -= i->second.record().data_size;
+    }
+    map_.erase(bgn, end);
+}
+
 } //namespace walb
@@ -8,15 +8,15 @@
  */
 #include <vector>
 #include <cassert>
-#include <map>
 #include "walb_diff_base.hpp"
 #include "walb_diff_file.hpp"
+#include "btree_map.hpp"
 
 namespace walb {
 
 /**
  * Diff record and its IO data.
- * Data compression is not supported.
+ * IO data may be compressed. Call uncompress() before splitting it.
  * Checksum is not calculated.
  */
 class DiffRecIo /* final */
@@ -39,6 +39,11 @@ public:
         assert(isValid());
     }
     bool isValid(bool isChecksum = false) const;
+    /**
+     * Uncompress the IO data if compressed.
+     * The checksum field will be 0 (not calculated).
+     */
+    void uncompress();
 
     void print(::FILE *fp = ::stdout) const {
         rec_.printOneline(fp);
@@ -62,13 +67,17 @@ public:
 
 /**
  * Simpler implementation of in-memory walb diff data.
- * IO data compression is not supported.
+ * Compressed IOs are kept as they are until overlapped by other IOs or split.
  * IO checksum is not calculated.
+ *
+ * Records are kept in a B+tree with chunked leaves instead of std::map
+ * to avoid a node allocation per record and pointer chasing.
+ * IO data are moved in and out without copy.
  */
 class DiffMemory
 {
 public:
-    using Map = std::map<uint64_t, DiffRecIo>;
+    using Map = BtreeMap<uint64_t, DiffRecIo>;
 private:
     /*
      * This parameter is in order not to exist too large IOs.
@@ -80,20 +89,23 @@ private:
     DiffFileHeader fileH_;
     uint64_t nIos_; /* Number of IOs in the diff. */
     uint64_t nBlocks_; /* Number of logical blocks in the diff. */
+    uint64_t dataSize_; /* Total size of IO data (compressed or not) [byte]. */
 
 public:
     DiffMemory()
         : maxIoBlocks_(DEFAULT_MAX_IO_LB)
-        , map_(), fileH_(), nIos_(0), nBlocks_(0) {
+        , map_(), fileH_(), nIos_(0), nBlocks_(0), dataSize_(0) {
         fileH_.init();
     }
     ~DiffMemory() noexcept = default;
     void setMaxIoBlocks(uint32_t maxIoBlocks) { maxIoBlocks_ = maxIoBlocks; }
+    uint32_t getMaxIoBlocks() const { return maxIoBlocks_; }
     bool empty() const { return map_.empty(); }
     void add(const DiffRecord& rec, AlignedArray &&buf);
     void print(::FILE *fp = ::stdout) const;
     uint64_t getNBlocks() const { return nBlocks_; }
     uint64_t getNIos() const { return nIos_; }
+    uint64_t getDataSize() const { return dataSize_; }
     void checkStatistics() const;
     DiffFileHeader& header() { return fileH_; }
     void writeTo(int outFd, int cmprType = ::WALB_DIFF_CMPR_SNAPPY);
@@ -105,12 +117,17 @@ public:
         map_.clear();
         nIos_ = 0;
         nBlocks_ = 0;
+        dataSize_ = 0;
         fileH_.init();
     }
     void checkNoOverlappedAndSorted() const;
     const Map& getMap() const { return map_; }
     Map& getMap() { return map_; }
     void eraseFromMap(Map::iterator& i);
+    /**
+     * Erase items in [bgn, end).
+     */
+    void eraseFromMap(Map::iterator bgn, Map::iterator end);
 };
 
 } //namespace walb
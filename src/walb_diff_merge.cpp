@@ -1,7 +1,162 @@
 #include "walb_diff_merge.hpp"
+#include "thread_util.hpp"
+#include "tmp_file.hpp"
 
 namespace walb {
 
+DiffPrefetcher::DiffPrefetcher(size_t threadNr, size_t maxPackNr, bool doUncompress)
+    : maxPackNr_(maxPackNr)
+    , doUncompress_(doUncompress)
+    , m_()
+    , quit_(false)
+    , streamV_()
+    , ready_()
+    , avail_()
+    , workerV_()
+{
+    assert(threadNr > 0);
+    assert(maxPackNr > 0);
+    for (size_t i = 0; i < threadNr; i++) {
+        workerV_.emplace_back(&DiffPrefetcher::workerEntry, this);
+    }
+}
+
+DiffPrefetcher::~DiffPrefetcher() noexcept
+{
+    {
+        LockGuard lk(m_);
+        quit_ = true;
+        ready_.notify_all();
+    }
+    for (std::thread &th : workerV_) th.join();
+}
+
+size_t DiffPrefetcher::addStream(SortedDiffReader &reader)
+{
+    LockGuard lk(m_);
+    streamV_.emplace_back(new Stream(&reader));
+    ready_.notify_one();
+    return streamV_.size() - 1;
+}
+
+bool DiffPrefetcher::pop(size_t id, Pack &pack)
+{
+    Task task;
+    {
+        UniqueLock lk(m_);
+        Stream &s = *streamV_[id];
+        assert(!s.isRemoved);
+        avail_.wait(lk, [&]() {
+                return (!s.taskQ.empty() && s.taskQ.front().isAvailable) || (s.taskQ.empty() && s.isEnd);
+            });
+        if (s.taskQ.empty()) return false;
+        task = std::move(s.taskQ.front());
+        s.taskQ.pop_front();
+        ready_.notify_one();
+    }
+    if (task.ep) std::rethrow_exception(task.ep);
+    pack = std::move(task.pack);
+    return true;
+}
+
+void DiffPrefetcher::removeStream(size_t id)
+{
+    UniqueLock lk(m_);
+    Stream &s = *streamV_[id];
+    avail_.wait(lk, [&]() { return !s.isReading && s.convertingNr == 0; });
+    s.isRemoved = true;
+    s.reader = nullptr;
+    s.taskQ.clear();
+}
+
+void DiffPrefetcher::workerEntry() noexcept
+{
+    for (;;) {
+        Stream *s = nullptr;
+        {
+            UniqueLock lk(m_);
+            ready_.wait(lk, [&]() { return quit_ || (s = pickStream()) != nullptr; });
+            if (quit_) return;
+            s->isReading = true;
+        }
+        Pack pack;
+        std::exception_ptr ep;
+        bool found = false;
+        try {
+            found = s->reader->readPack(pack.recV, pack.bufV);
+        } catch (...) {
+            ep = std::current_exception();
+        }
+        Task *task = nullptr;
+        {
+            LockGuard lk(m_);
+            s->isReading = false;
+            if (ep) {
+                s->taskQ.emplace_back();
+                s->taskQ.back().ep = ep;
+                s->taskQ.back().isAvailable = true;
+            } else if (found) {
+                s->taskQ.emplace_back();
+                task = &s->taskQ.back(); // references to deque elements are kept by push_back/pop_front.
+                s->convertingNr++;
+            }
+            if (!found) s->isEnd = true;
+            ready_.notify_one(); // another worker can read the stream now.
+            avail_.notify_all();
+        }
+        if (!task) continue;
+        try {
+            convertPack(pack);
+        } catch (...) {
+            ep = std::current_exception();
+        }
+        {
+            LockGuard lk(m_);
+            task->pack = std::move(pack);
+            task->ep = ep;
+            task->isAvailable = true;
+            s->convertingNr--;
+            avail_.notify_all();
+        }
+    }
+}
+
+/**
+ * Choose the stream with the shortest queue to feed the consumer evenly.
+ * Lock must be held.
+ */
+DiffPrefetcher::Stream *DiffPrefetcher::pickStream()
+{
+    Stream *ret = nullptr;
+    for (std::unique_ptr<Stream> &sp : streamV_) {
+        Stream &s = *sp;
+        if (s.isRemoved || s.isEnd || s.isReading || s.taskQ.size() >= maxPackNr_) continue;
+        if (!ret || s.taskQ.size() < ret->taskQ.size()) ret = &s;
+        if (ret->taskQ.empty()) break;
+    }
+    return ret;
+}
+
+void DiffPrefetcher::convertPack(Pack &pack) const
+{
+    assert(pack.recV.size() == pack.bufV.size());
+    for (size_t i = 0; i < pack.recV.size(); i++) {
+        DiffRecord &rec = pack.recV[i];
+        AlignedArray &buf = pack.bufV[i];
+        if (!rec.isNormal()) continue;
+        const uint32_t csum = calcDiffIoChecksum(buf);
+        if (rec.checksum != csum) {
+            throw cybozu::Exception(NAME()) << "checksum differ" << rec.checksum << csum;
+        }
+        if (!doUncompress_ || !rec.isCompressed()) continue;
+        DiffRecord outRec;
+        AlignedArray outBuf;
+        uncompressDiffIo(rec, buf.data(), outRec, outBuf, false);
+        rec = outRec;
+        buf = std::move(outBuf);
+    }
+}
+
 void DiffMerger::Wdiff::setFile(cybozu::util::File &&file, IndexedDiffCache *cache)
 {
     header_.readFrom(file);
@@ -16,6 +171,13 @@ void DiffMerger::Wdiff::setFile(cybozu::util::File &&file, IndexedDiffCache *cac
         sReader_.dontReadHeader();
         // cache is not used.
     }
+    if (bgnAddr_ > 0) {
+        if (isIndexed_) {
+            iReader_.seek(bgnAddr_);
+        } else {
+            sReader_.seek(bgnAddr_);
+        }
+    }
 }
 
 void DiffMerger::Wdiff::getAndRemoveIo(AlignedArray &buf)
@@ -40,17 +202,51 @@ void DiffMerger::Wdiff::fill() const
 {
     if (isEnd_ || isFilled_) return;
 
-    bool success;
-    if (isIndexed_) {
-        success = readIndexedDiff();
-    } else {
-        success = sReader_.readAndUncompressDiff(rec_, buf_, false);
+    for (;;) {
+        bool success;
+        if (isIndexed_) {
+            success = readIndexedDiff();
+        } else if (prefetcher_) {
+            success = readPrefetchedDiff();
+        } else {
+            // IOs will be uncompressed later only if necessary.
+            success = sReader_.readDiff(rec_, buf_);
+        }
+        if (!success || rec_.io_address >= endAddr_) {
+            isEnd_ = true;
+            return;
+        }
+        if (rec_.endIoAddress() > bgnAddr_) break;
     }
-    if (success) {
-        isFilled_ = true;
-    } else {
-        isEnd_ = true;
+    if (rec_.io_address < bgnAddr_ || rec_.endIoAddress() > endAddr_) {
+        trimToAddrRange();
     }
+    isFilled_ = true;
+}
+
+void DiffMerger::Wdiff::trimToAddrRange() const
+{
+    if (rec_.isNormal() && rec_.isCompressed()) {
+        DiffRecord rec;
+        AlignedArray buf;
+        uncompressDiffIo(rec_, buf_.data(), rec, buf, false);
+        rec_ = rec;
+        buf_ = std::move(buf);
+    }
+    const uint64_t bgn = std::max(rec_.io_address, bgnAddr_);
+    const uint64_t end = std::min(rec_.endIoAddress(), endAddr_);
+    assert(bgn < end);
+    if (rec_.isNormal()) {
+        const size_t off = (bgn - rec_.io_address) * LOGICAL_BLOCK_SIZE;
+        const size_t size = (end - bgn) * LOGICAL_BLOCK_SIZE;
+        AlignedArray buf;
+        util::assignAlignedArray(buf, buf_.data() + off, size);
+        buf_ = std::move(buf);
+        rec_.data_size = size;
+        rec_.checksum = 0; // not calculated.
+    }
+    rec_.io_address = bgn;
+    rec_.io_blocks = end - bgn;
 }
 
 bool DiffMerger::Wdiff::readIndexedDiff() const
@@ -75,8 +271,25 @@ bool DiffMerger::Wdiff::readIndexedDiff() const
     return true;
 }
 
-void DiffMerger::mergeToFd(int outFd)
+bool DiffMerger::Wdiff::readPrefetchedDiff() const
+{
+    while (packIdx_ == pack_.recV.size()) {
+        packIdx_ = 0;
+        if (!prefetcher_->pop(streamId_, pack_)) {
+            pack_.recV.clear();
+            pack_.bufV.clear();
+            return false;
+        }
+    }
+    rec_ = pack_.recV[packIdx_];
+    buf_ = std::move(pack_.bufV[packIdx_]);
+    packIdx_++;
+    return true;
+}
+
+bool DiffMerger::mergeToFd(int outFd, const std::function<bool()> &func)
 {
+    setKeepCompressed(true);
     prepare();
     SortedDiffWriter writer;
     writer.setFd(outFd);
@@ -84,6 +297,7 @@ void DiffMerger::mergeToFd(int outFd)
 
     DiffRecIo d;
     while (getAndRemove(d)) {
+        if (!func()) return false;
         assert(d.isValid());
         writer.compressAndWriteDiff(d.record(), d.io().data());
     }
@@ -92,19 +306,68 @@ void DiffMerger::mergeToFd(int outFd)
     assert(wdiffs_.empty());
     assert(diffMem_.empty());
     statOut_.update(writer.getStat());
+    return true;
+}
+
+uint64_t DiffMerger::mergeToIndexedFd(int outFd, size_t maxDedupNr)
+{
+    // The writer must see uncompressed IOs to deduplicate them.
+    setKeepCompressed(false);
+    prepare();
+    IndexedDiffWriter writer;
+    writer.setFd(outFd);
+    writer.setDedup(maxDedupNr);
+    DiffFileHeader header = wdiffH_;
+    header.setDictId(0);
+    writer.writeHeader(header);
+
+    DiffRecIo d;
+    while (getAndRemove(d)) {
+        assert(d.isValid());
+        const DiffRecord& rec = d.record();
+        IndexedDiffRecord irec;
+        irec.init();
+        irec.io_address = rec.io_address;
+        irec.io_blocks = rec.io_blocks;
+        if (rec.isDiscard()) {
+            irec.setDiscard();
+        } else if (rec.isAllZero()) {
+            irec.setAllZero();
+        } else {
+            irec.orig_blocks = rec.io_blocks;
+            irec.data_size = rec.data_size;
+        }
+        writer.compressAndWriteDiff(irec, d.io().data());
+    }
+
+    writer.finalize();
+    assert(wdiffs_.empty());
+    assert(diffMem_.empty());
+    statOut_.update(writer.getStat());
+    return writer.getDedupLb();
 }
 
 void DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr)
 {
     cybozu::util::File file(outFd);
+    setKeepCompressed(true);
+    prepare();
     DiffFileHeader header;
     header.type = ::WALB_DIFF_TYPE_SORTED;
+    header.setDictId(getDictId());
     header.writeTo(file);
 
-    prepare();
     const size_t maxPushedNr = cmpr.numCpu * 2 + 1;
     ConverterQueue conv(maxPushedNr, cmpr.numCpu, true, cmpr.type, cmpr.level);
 
+    SortedDiffIndexMem indexMem;
+    uint64_t offset = header.getSize();
+    auto writePack = [&](const AlignedArray &pack) {
+        indexMem.add(*reinterpret_cast<const DiffPackHeader *>(pack.data()), offset);
+        file.write(pack.data(), pack.size());
+        offset += pack.size();
+    };
+
     DiffRecIo d;
     DiffPacker packer;
     size_t pushedNr = 0;
@@ -118,8 +381,7 @@ void DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr)
         packer.clear();
         packer.add(rec, buf.data());
         if (pushedNr < maxPushedNr) continue;
-        AlignedArray pack(conv.pop());
-        file.write(pack.data(), pack.size());
+        writePack(conv.pop());
         pushedNr--;
     }
     if (!packer.empty()) {
@@ -127,10 +389,11 @@ void DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr)
     }
     conv.quit();
     for (AlignedArray pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        file.write(pack.data(), pack.size());
+        writePack(pack);
     }
 
     writeDiffEofPack(file);
+    indexMem.writeTo(file, offset + WALB_DIFF_PACK_SIZE);
 }
 
 void DiffMerger::prepare()
@@ -144,9 +407,19 @@ void DiffMerger::prepare()
 
         wdiffH_.init();
         wdiffH_.setUuid(uuid);
+        uint32_t dictId = 0;
+        for (const WdiffPtr &wdiffP : wdiffs_) {
+            if (wdiffP) dictId = mergeDictId(dictId, wdiffP->header().getDictId());
+        }
+        isMixedDict_ = dictId == MIXED_DICT_ID;
+        wdiffH_.setDictId(isMixedDict_ ? 0 : dictId);
 
-        removeEndedWdiffs();
-        doneAddr_ = getMinimumAddr();
+        if (prefetchThreadNr_ > 0) {
+            prefetcher_.reset(new DiffPrefetcher(prefetchThreadNr_, prefetchPackNr_, !keepCompressed_));
+            for (WdiffPtr &wdiffP : wdiffs_) wdiffP->startPrefetch(*prefetcher_);
+        }
+        initAddrTree();
+        doneAddr_ = addrTree_.min();
         isHeaderPrepared_ = true;
     }
 }
@@ -160,23 +433,16 @@ bool DiffMerger::getAndRemove(DiffRecIo &recIo)
             assert(wdiffs_.empty());
             return false;
         }
+        updatePeakMemBytes();
+        if (shouldSpill()) spill();
     }
     recIo = std::move(mergedQ_.front());
     mergedQ_.pop();
-    return true;
-}
-
-uint64_t DiffMerger::getMinimumAddr() const
-{
-    uint64_t addr = UINT64_MAX;
-    WdiffPtrList::const_iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        Wdiff &wdiff = **it;
-        DiffRecord rec = wdiff.getFrontRec();
-        addr = std::min(addr, rec.io_address);
-        ++it;
+    mergedQBytes_ -= recIo.record().data_size;
+    if (!keepCompressed_ || (isMixedDict_ && recIo.record().compression_type == ::WALB_DIFF_CMPR_ZSTD)) {
+        recIo.uncompress();
     }
-    return addr;
+    return true;
 }
 
 void DiffMerger::moveToDiffMemory()
@@ -238,61 +504,74 @@ size_t DiffMerger::tryMoveToDiffMemory()
 {
     using Range = walb_diff_merge_local::Range;
 
-    size_t nr = 0;
-    uint64_t nextDoneAddr = UINT64_MAX;
-    uint64_t minAddr = UINT64_MAX;
-    if (wdiffs_.empty()) {
-        doneAddr_ = nextDoneAddr;
+    const uint64_t minAddr = addrTree_.min();
+    if (minAddr == UINT64_MAX) {
+        assert(wdiffs_.empty());
+        doneAddr_ = UINT64_MAX;
         return 0;
     }
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    Range range(wdiffs_.front()->getFrontRec());
-    while (it != wdiffs_.end()) {
-        bool goNext = true;
-        Wdiff &wdiff = **it;
+    /*
+     * Wdiffs whose current address >= limit can not provide any IO in this turn,
+     * so we visit only the others in age order.
+     * A record can be merged only when its end address <= the minimum current address
+     * of the older wdiffs, otherwise older IOs overlapped with it would overwrite it later.
+     */
+    const uint64_t limit = doneAddr_ + searchLen_;
+    size_t nr = 0;
+    std::vector<Range> rangeV;
+    size_t i = addrTree_.findNext(0, limit);
+    while (i != AddrTournamentTree::npos) {
+        Wdiff &wdiff = *wdiffs_[i];
+        const uint64_t olderMinAddr = addrTree_.minBefore(i);
         DiffRecord rec = wdiff.getFrontRec();
-        minAddr = std::min(minAddr, rec.io_address);
         Range curRange(rec);
-        while (shouldMerge(rec, nextDoneAddr)) {
+        while (shouldMerge(rec, olderMinAddr)) {
             nr++;
             curRange.merge(Range(rec));
             AlignedArray buf;
             wdiff.getAndRemoveIo(buf);
             mergeIo(rec, std::move(buf));
-            if (wdiff.isEnd()) {
-                statIn_.update(wdiff.getStat());
-                it = wdiffs_.erase(it);
-                goNext = false;
-                break;
-            }
+            if (wdiff.isEnd() || isOverMemBudget()) break;
             rec = wdiff.getFrontRec();
         }
-        if (range.isOverlapped(curRange)) {
-            range.merge(curRange);
-        } else if (curRange.isLeftRight(range)) {
-            range = curRange;
-        } else {
-            assert(range.isLeftRight(curRange));
-            // do nothing
+        rangeV.push_back(curRange);
+        updateAddr(i);
+        if (isOverMemBudget()) break; // to spill. the rest will be merged later.
+        i = addrTree_.findNext(i + 1, limit);
+    }
+
+    /*
+     * The range is the overlapped area that begins at minAddr,
+     * which consists of the merged IOs and the current IOs of all the wdiffs.
+     * searchLen_ must cover it to progress at the next turn.
+     */
+    std::sort(rangeV.begin(), rangeV.end(), [](const Range& a, const Range& b) {
+            return a.bgn < b.bgn;
+        });
+    Range range(minAddr, minAddr + 1);
+    for (;;) {
+        const uint64_t end0 = range.end;
+        for (const Range& r : rangeV) {
+            if (r.bgn >= range.end) break;
+            range.merge(r);
         }
-        if (goNext) {
-            nextDoneAddr = std::min(nextDoneAddr, wdiff.currentAddress());
-            ++it;
+        const uint64_t end1 = range.end;
+        for (i = addrTree_.findNext(0, end1); i != AddrTournamentTree::npos; i = addrTree_.findNext(i + 1, end1)) {
+            range.merge(Range(wdiffs_[i]->getFrontRec()));
         }
-    }
-    if (minAddr != UINT64_MAX) {
-        assert(minAddr == range.bgn);
+        if (range.end == end0) break;
     }
     searchLen_ = std::max(searchLen_, range.size());
 #if 0 // debug code
     std::cout << "nr " << nr << " "
               << "doneAddr_ " << doneAddr_ << " "
-              << "nextDoneAddr " << (nextDoneAddr == UINT64_MAX ? "-" : cybozu::itoa(nextDoneAddr)) << " "
+              << "nextDoneAddr " << (addrTree_.min() == UINT64_MAX ? "-" : cybozu::itoa(addrTree_.min())) << " "
               << "searchLen_ " << searchLen_ << " "
               << "minAddr " << minAddr << " "
               << "range " << range << std::endl;
 #endif
-    doneAddr_ = nextDoneAddr;
+    doneAddr_ = addrTree_.min();
+    if (doneAddr_ == UINT64_MAX) wdiffs_.clear();
     return nr;
 }
 
@@ -304,24 +583,156 @@ bool DiffMerger::moveToMergedQueue()
     while (i != map.end()) {
         DiffRecIo& recIo = i->second;
         if (recIo.record().endIoAddress() > doneAddr_) break;
+        mergedQBytes_ += recIo.record().data_size;
         mergedQ_.push(std::move(recIo));
-        diffMem_.eraseFromMap(i);
+        ++i;
     }
+    // Moved-out items keep their records, so statistics can be updated.
+    diffMem_.eraseFromMap(map.begin(), i);
     return true;
 }
 
-void DiffMerger::removeEndedWdiffs()
+void DiffMerger::initAddrTree()
 {
-    WdiffPtrList::iterator it = wdiffs_.begin();
-    while (it != wdiffs_.end()) {
-        const Wdiff &wdiff = **it;
-        if (wdiff.isEnd()) {
-            statIn_.update(wdiff.getStat());
-            it = wdiffs_.erase(it);
-        } else {
-            ++it;
+    addrTree_.init(wdiffs_.size());
+    for (size_t i = 0; i < wdiffs_.size(); i++) {
+        updateAddr(i);
+    }
+    if (addrTree_.min() == UINT64_MAX) wdiffs_.clear();
+}
+
+void DiffMerger::updateAddr(size_t i)
+{
+    WdiffPtr &wdiffP = wdiffs_[i];
+    assert(wdiffP);
+    if (wdiffP->isEnd()) {
+        if (!wdiffP->isTmp()) statIn_.update(wdiffP->getStat());
+        wdiffP.reset();
+        addrTree_.update(i, UINT64_MAX);
+    } else {
+        addrTree_.update(i, wdiffP->currentAddress());
+    }
+}
+
+namespace walb_diff_merge_local {
+
+inline void writeRecIo(IndexedDiffWriter &writer, const DiffRecIo &recIo)
+{
+    const DiffRecord &rec = recIo.record();
+    IndexedDiffRecord irec;
+    irec.init();
+    irec.io_address = rec.io_address;
+    irec.io_blocks = rec.io_blocks;
+    irec.flags = rec.flags;
+    if (rec.isNormal()) {
+        irec.compression_type = rec.compression_type;
+        irec.data_size = rec.data_size;
+        irec.orig_blocks = rec.io_blocks;
+        irec.io_offset = 0;
+        irec.io_checksum = calcDiffIoChecksum(recIo.io());
+    }
+    writer.compressAndWriteDiff(irec, recIo.io().data());
+}
+
+} // namespace walb_diff_merge_local
+
+bool DiffMerger::shouldSpill() const
+{
+    if (!isOverMemBudget()) return false;
+    /*
+     * Spilling n wdiffs makes two groups from n + 1 wdiffs.
+     * Each group must be smaller than n to terminate, so n >= 3 is required.
+     * Merging two wdiffs never spills.
+     */
+    const size_t n = std::count_if(wdiffs_.begin(), wdiffs_.end(), [](const WdiffPtr &p) { return bool(p); });
+    return n >= 3;
+}
+
+/**
+ * Any IO in diffMem_ is older than IOs overlapped with it in the rest of the inputs,
+ * so diffMem_ can be treated as the oldest input.
+ * Merging is associative, so consecutive inputs can be merged in advance.
+ */
+void DiffMerger::spill()
+{
+    WdiffPtrVec wdiffV;
+    wdiffV.push_back(spillDiffMemory());
+    for (WdiffPtr &wdiffP : wdiffs_) {
+        if (wdiffP) wdiffV.push_back(std::move(wdiffP));
+    }
+    const size_t half = (wdiffV.size() + 1) / 2;
+    WdiffPtrVec wdiffV0, wdiffV1;
+    for (size_t i = 0; i < wdiffV.size(); i++) {
+        (i < half ? wdiffV0 : wdiffV1).push_back(std::move(wdiffV[i]));
+    }
+    wdiffs_.clear();
+    wdiffs_.push_back(mergeToTmpWdiff(std::move(wdiffV0)));
+    wdiffs_.push_back(mergeToTmpWdiff(std::move(wdiffV1)));
+    spillNr_++;
+    LOGs.info() << "DiffMerger:spill" << bgnAddr_ << wdiffV.size() << memUsageStr();
+
+    searchLen_ = initSearchLen_;
+    initAddrTree();
+    doneAddr_ = addrTree_.min();
+}
+
+DiffMerger::WdiffPtr DiffMerger::spillDiffMemory()
+{
+    cybozu::TmpFile tmpFile(tmpDir_);
+    IndexedDiffWriter writer;
+    writer.setFd(tmpFile.fd());
+    DiffFileHeader header = wdiffH_;
+    writer.writeHeader(header);
+    DiffMemory::Map& map = diffMem_.getMap();
+    for (DiffMemory::Map::iterator i = map.begin(); i != map.end(); ++i) {
+        walb_diff_merge_local::writeRecIo(writer, i->second);
+    }
+    writer.finalize();
+    diffMem_.clear();
+    return openTmpWdiff(tmpFile);
+}
+
+DiffMerger::WdiffPtr DiffMerger::mergeToTmpWdiff(WdiffPtrVec &&wdiffV)
+{
+    assert(!wdiffV.empty());
+    if (wdiffV.size() == 1) return std::move(wdiffV.front());
+
+    cybozu::TmpFile tmpFile(tmpDir_);
+    {
+        DiffMerger merger(initSearchLen_);
+        merger.setMaxIoBlocks(diffMem_.getMaxIoBlocks());
+        merger.setKeepCompressed(true);
+        merger.setAddrRange(bgnAddr_, endAddr_);
+        merger.setMemoryBudget(memBudget_, tmpDir_);
+        merger.wdiffs_ = std::move(wdiffV);
+        merger.prepare();
+
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        DiffFileHeader header = wdiffH_;
+        writer.writeHeader(header);
+        DiffRecIo d;
+        while (merger.getAndRemove(d)) {
+            walb_diff_merge_local::writeRecIo(writer, d);
         }
+        writer.finalize();
+
+        statIn_.update(merger.statIn_);
+        peakMemBytes_ = std::max(peakMemBytes_, merger.peakMemBytes_);
+        spillNr_ += merger.spillNr_;
     }
+    return openTmpWdiff(tmpFile);
+}
+
+/**
+ * The file will remain until the wdiff is closed even if tmpFile is removed.
+ */
+DiffMerger::WdiffPtr DiffMerger::openTmpWdiff(const cybozu::TmpFile &tmpFile)
+{
+    WdiffPtr wdiffP(new Wdiff(bgnAddr_, endAddr_));
+    wdiffP->setTmp();
+    wdiffP->open(tmpFile.path(), &cache_);
+    return wdiffP;
 }
 
 void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
@@ -334,4 +745,260 @@ void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
     }
 }
 
+namespace walb_diff_merge_local {
+
+/**
+ * Open the same file again to get an independent file offset.
+ */
+inline cybozu::util::File reopenFile(const cybozu::util::File &file)
+{
+    return cybozu::util::File("/proc/self/fd/" + cybozu::itoa(file.fd()), O_RDONLY);
+}
+
+struct AddrWeight
+{
+    uint64_t addr;
+    uint64_t weight; // see getWeight().
+};
+
+/**
+ * Merge cost of a record: discard and all-zero IOs are cheap however large they are.
+ */
+template <typename Record>
+inline uint64_t getWeight(const Record &rec)
+{
+    return 1 + (rec.isNormal() ? rec.io_blocks : 0);
+}
+
+/**
+ * Scan a wdiff and put (address, weight) samples.
+ * Each sample corresponds to a pack for sorted wdiffs
+ * and to a fixed number of records for indexed wdiffs.
+ * Sorted wdiffs with the pack index are not scanned, the index is used instead.
+ */
+inline void scanWdiff(cybozu::util::File &&file, std::vector<AddrWeight> &v,
+                      DiffFileHeader &header, DiffStatistics &stat)
+{
+    header.readFrom(file);
+    if (header.isIndexed()) {
+        const size_t nrRecsPerSample = 64;
+        IndexedDiffCache cache;
+        IndexedDiffReader reader;
+        reader.setFile(std::move(file), cache);
+        IndexedDiffRecord rec;
+        size_t i = 0;
+        while (reader.readDiffRecord(rec, false)) {
+            if (i % nrRecsPerSample == 0) v.push_back({rec.io_address, 0});
+            v.back().weight += getWeight(rec);
+            i++;
+        }
+        stat.update(reader.getStat());
+        return;
+    }
+    SortedDiffIndexSuper super;
+    std::vector<SortedDiffIndexRecord> idxV;
+    if (readSortedDiffIndex(file, super, idxV)) {
+        for (const SortedDiffIndexRecord &idx : idxV) {
+            // The same as the sum of getWeight() of the records in the pack.
+            v.push_back({idx.io_address, idx.n_records + idx.normal_blocks});
+        }
+        stat.update(super.getStat());
+        return;
+    }
+    AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+    DiffPackHeader &pack = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+    DiffStatistics st;
+    st.wdiffNr = 1;
+    for (;;) {
+        try {
+            pack.readFrom(file);
+        } catch (cybozu::util::EofError &) {
+            break;
+        }
+        if (pack.isEnd()) break;
+        st.update(pack);
+        if (pack.n_records > 0) {
+            uint64_t weight = 0;
+            for (size_t i = 0; i < pack.n_records; i++) weight += getWeight(pack[i]);
+            v.push_back({pack[0].io_address, weight});
+        }
+        file.lseek(pack.total_size, SEEK_CUR);
+    }
+    stat.update(st);
+}
+
+/**
+ * Decide shard boundaries so that each shard has similar total weight.
+ * RETURN:
+ *   boundaries including 0 and UINT64_MAX.
+ */
+inline std::vector<uint64_t> decideShards(std::vector<AddrWeight> &v, size_t maxShardNr)
+{
+    std::sort(v.begin(), v.end(), [](const AddrWeight &a, const AddrWeight &b) {
+            return a.addr < b.addr;
+        });
+    uint64_t total = 0;
+    for (const AddrWeight &aw : v) total += aw.weight;
+
+    std::vector<uint64_t> addrV;
+    addrV.push_back(0);
+    uint64_t sum = 0;
+    size_t k = 1;
+    for (const AddrWeight &aw : v) {
+        if (k == maxShardNr) break;
+        if (sum >= total * k / maxShardNr) {
+            if (aw.addr > addrV.back()) addrV.push_back(aw.addr);
+            k++;
+        }
+        sum += aw.weight;
+    }
+    addrV.push_back(UINT64_MAX);
+    return addrV;
+}
+
+} // namespace walb_diff_merge_local
+
+void ShardedDiffMerger::prepare(size_t maxShardNr)
+{
+    using namespace walb_diff_merge_local;
+
+    if (fileV_.empty()) {
+        throw cybozu::Exception(__func__) << "Wdiffs are not set.";
+    }
+    if (maxShardNr == 0) maxShardNr = 1;
+    std::vector<AddrWeight> v;
+    std::vector<cybozu::Uuid> uuidV;
+    uint32_t dictId = 0;
+    statIn_.clear();
+    for (const cybozu::util::File &file : fileV_) {
+        DiffFileHeader header;
+        scanWdiff(reopenFile(file), v, header, statIn_);
+        uuidV.push_back(header.getUuid());
+        dictId = mergeDictId(dictId, header.getDictId());
+    }
+    const cybozu::Uuid &uuid = uuidV.back();
+    if (shouldValidateUuid_) {
+        for (const cybozu::Uuid &uuid1 : uuidV) {
+            if (uuid1 != uuid) {
+                throw cybozu::Exception(__func__) << "uuid differ" << uuid1 << uuid;
+            }
+        }
+    }
+    wdiffH_.init();
+    wdiffH_.setUuid(uuid);
+    // Each shard uncompresses zstd IOs by itself if the dictionaries are mixed.
+    wdiffH_.setDictId(dictId == MIXED_DICT_ID ? 0 : dictId);
+    addrV_ = decideShards(v, maxShardNr);
+    memUsageV_.assign(getShardNr(), "");
+}
+
+bool ShardedDiffMerger::run(const ShardFunc &func)
+{
+    return runDetail(func, false);
+}
+
+bool ShardedDiffMerger::runDetail(const ShardFunc &func, bool keepCompressed)
+{
+    using namespace walb_diff_merge_local;
+
+    const size_t shardNr = getShardNr();
+    std::vector<char> resultV(shardNr, false);
+    const size_t memBudget = memBudget_ == 0 ? 0 : std::max<size_t>(memBudget_ / shardNr, 1);
+    cybozu::thread::ThreadRunnerSet thSet;
+    for (size_t i = 0; i < shardNr; i++) {
+        std::vector<cybozu::util::File> fileV;
+        for (const cybozu::util::File &file : fileV_) {
+            fileV.push_back(reopenFile(file));
+        }
+        std::shared_ptr<std::vector<cybozu::util::File>> fileVP =
+            std::make_shared<std::vector<cybozu::util::File>>(std::move(fileV));
+        thSet.add([this, i, fileVP, &func, &resultV, keepCompressed, memBudget]() {
+                DiffMerger merger;
+                merger.setMaxIoBlocks(maxIoBlocks_);
+                merger.setKeepCompressed(keepCompressed);
+                merger.setAddrRange(addrV_[i], addrV_[i + 1]);
+                merger.setMaxCacheSize(INDEXED_DIFF_CACHE_SIZE);
+                merger.setPrefetch(prefetchThreadNr_, prefetchPackNr_);
+                merger.setMemoryBudget(memBudget, tmpDir_);
+                merger.addWdiffs(std::move(*fileVP));
+                merger.prepare();
+                resultV[i] = func(i, merger);
+                memUsageV_[i] = merger.memUsageStr();
+            });
+    }
+    thSet.start();
+    std::vector<std::exception_ptr> epV = thSet.join();
+    if (!epV.empty()) std::rethrow_exception(epV.front());
+    return std::all_of(resultV.begin(), resultV.end(), [](char b) { return b; });
+}
+
+bool ShardedDiffMerger::mergeToFd(
+    int outFd, const CompressOpt &cmpr, const std::string &tmpDir, const std::function<bool()> &func)
+{
+    cybozu::util::File outFile(outFd);
+    wdiffH_.type = ::WALB_DIFF_TYPE_SORTED;
+    wdiffH_.writeTo(outFile);
+
+    // The first shard writes to outFile directly. The others write to temporary files.
+    const size_t shardNr = getShardNr();
+    std::vector<cybozu::TmpFile> tmpFileV(shardNr - 1);
+    for (cybozu::TmpFile &tmpFile : tmpFileV) {
+        tmpFile.prepare(tmpDir);
+    }
+    std::vector<DiffStatistics> statV(shardNr);
+    // Pack offsets are relative to the head of each shard.
+    std::vector<SortedDiffIndexMem> indexMemV(shardNr);
+    std::vector<uint64_t> sizeV(shardNr, 0);
+    const bool ret = runDetail([&](size_t i, DiffMerger &merger) {
+            cybozu::util::File file(i == 0 ? outFd : tmpFileV[i - 1].fd());
+            DiffStatistics &stat = statV[i];
+            PackCompressor compr(cmpr.type, cmpr.level);
+            DiffPacker packer;
+            auto writePack = [&]() {
+                const AlignedArray pack = compr.convert(packer.getPackAsArray().data());
+                const DiffPackHeader &packH = *reinterpret_cast<const DiffPackHeader *>(pack.data());
+                stat.update(packH);
+                indexMemV[i].add(packH, sizeV[i]);
+                file.write(pack.data(), pack.size());
+                sizeV[i] += pack.size();
+            };
+            DiffRecIo d;
+            while (merger.getAndRemove(d)) {
+                if (!func()) return false;
+                if (packer.add(d.record(), d.io().data())) continue;
+                writePack();
+                packer.add(d.record(), d.io().data());
+            }
+            if (!packer.empty()) writePack();
+            return true;
+        }, true);
+    if (!ret) return false;
+
+    AlignedArray buf(MAX_BULK_SIZE, false);
+    for (cybozu::TmpFile &tmpFile : tmpFileV) {
+        cybozu::util::File file(tmpFile.fd());
+        file.lseek(0);
+        for (;;) {
+            const size_t size = file.readsome(buf.data(), buf.size());
+            if (size == 0) break;
+            outFile.write(buf.data(), size);
+        }
+    }
+    writeDiffEofPack(outFile);
+    SortedDiffIndexMem indexMem;
+    uint64_t offset = wdiffH_.getSize();
+    for (size_t i = 0; i < shardNr; i++) {
+        indexMem.append(indexMemV[i], offset);
+        offset += sizeV[i];
+    }
+    indexMem.writeTo(outFile, offset + WALB_DIFF_PACK_SIZE);
+
+    statOut_.clear();
+    statOut_.wdiffNr = 1;
+    for (const DiffStatistics &stat : statV) {
+        statOut_.update(stat); // stat.wdiffNr is 0.
+    }
+    return true;
+}
+
 } //namespace walb
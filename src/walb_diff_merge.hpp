@@ -10,7 +10,13 @@
 #include <string>
 #include <vector>
 #include <queue>
-#include <list>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
 #include <cassert>
 #include <cstring>
 
@@ -21,14 +27,177 @@
 #include "walb_diff_compressor.hpp"
 #include "host_info.hpp"
 #include "fileio.hpp"
+#include "tmp_file.hpp"
 
 namespace walb {
 
+/**
+ * Tournament tree of addresses.
+ *
+ * Leaf i keeps the current address of the i-th input stream
+ * (UINT64_MAX means the stream has reached the end),
+ * and each inner node keeps the minimum address of its children.
+ * All the operations except min() cost O(log N).
+ */
+class AddrTournamentTree /* final */
+{
+private:
+    size_t leafNr_; // power of 2.
+    std::vector<uint64_t> tree_; // tree_[1] is the root. tree_[leafNr_ + i] is leaf i.
+
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    AddrTournamentTree() : leafNr_(1), tree_(2, UINT64_MAX) {}
+    /**
+     * Initialize with n leaves where all the addresses are UINT64_MAX.
+     */
+    void init(size_t n) {
+        leafNr_ = 1;
+        while (leafNr_ < n) leafNr_ *= 2;
+        tree_.assign(leafNr_ * 2, UINT64_MAX);
+    }
+    void update(size_t i, uint64_t addr) {
+        assert(i < leafNr_);
+        size_t k = leafNr_ + i;
+        tree_[k] = addr;
+        for (k /= 2; k > 0; k /= 2) {
+            tree_[k] = std::min(tree_[k * 2], tree_[k * 2 + 1]);
+        }
+    }
+    uint64_t get(size_t i) const {
+        assert(i < leafNr_);
+        return tree_[leafNr_ + i];
+    }
+    /**
+     * Minimum address of all the leaves.
+     */
+    uint64_t min() const { return tree_[1]; }
+    /**
+     * Minimum address of leaves [0, i).
+     */
+    uint64_t minBefore(size_t i) const {
+        uint64_t addr = UINT64_MAX;
+        size_t l = leafNr_, r = leafNr_ + std::min(i, leafNr_);
+        for (; l < r; l /= 2, r /= 2) {
+            if (l & 1) addr = std::min(addr, tree_[l++]);
+            if (r & 1) addr = std::min(addr, tree_[--r]);
+        }
+        return addr;
+    }
+    /**
+     * RETURN:
+     *   the smallest leaf index j where j >= i and address of j < limit.
+     *   npos if not found.
+     */
+    size_t findNext(size_t i, uint64_t limit) const {
+        if (i >= leafNr_) return npos;
+        size_t k = leafNr_ + i;
+        for (;;) {
+            if (tree_[k] < limit) {
+                while (k < leafNr_) {
+                    k *= 2;
+                    if (tree_[k] >= limit) k++;
+                }
+                return k - leafNr_;
+            }
+            while (k & 1) k /= 2; // go up while k is a right child.
+            if (k == 0) return npos;
+            k++; // right sibling.
+        }
+    }
+};
+
+/**
+ * Read-ahead of sorted wdiff streams.
+ *
+ * Worker threads shared by all the streams read whole packs ahead,
+ * verify IO checksums, and uncompress IOs if required.
+ * Each stream has a bounded queue of packs in the file order,
+ * so the consumer need not wait for IO or codecs while its queue is not empty.
+ * This works like ConverterQueueT, but its engines serve multiple input streams.
+ *
+ * addStream(), pop() and removeStream() caller must be single-thread.
+ */
+class DiffPrefetcher /* final */
+{
+public:
+    struct Pack {
+        std::vector<DiffRecord> recV;
+        std::vector<AlignedArray> bufV; // bufV[i] is IO data of recV[i].
+    };
+private:
+    using LockGuard = std::lock_guard<std::mutex>;
+    using UniqueLock = std::unique_lock<std::mutex>;
+
+    struct Task {
+        Pack pack;
+        std::exception_ptr ep;
+        bool isAvailable;
+
+        Task() : pack(), ep(), isAvailable(false) {}
+    };
+    struct Stream {
+        SortedDiffReader *reader;
+        std::deque<Task> taskQ; // in the file order.
+        size_t convertingNr; // the number of tasks being converted by workers.
+        bool isReading; // a worker is reading the stream.
+        bool isEnd; // the reader reached the end or got an error.
+        bool isRemoved;
+
+        explicit Stream(SortedDiffReader *reader)
+            : reader(reader), taskQ(), convertingNr(0)
+            , isReading(false), isEnd(false), isRemoved(false) {
+        }
+    };
+
+    const size_t maxPackNr_;
+    const bool doUncompress_;
+
+    std::mutex m_;
+    bool quit_;
+    std::vector<std::unique_ptr<Stream>> streamV_;
+    std::condition_variable ready_, avail_;
+    std::vector<std::thread> workerV_;
+
+public:
+    static constexpr const char* NAME() { return "DiffPrefetcher"; }
+    /**
+     * @threadNr number of worker threads.
+     * @maxPackNr max number of packs to read ahead for each stream.
+     * @doUncompress uncompress IOs if true, otherwise keep them as they are.
+     */
+    DiffPrefetcher(size_t threadNr, size_t maxPackNr, bool doUncompress);
+    ~DiffPrefetcher() noexcept;
+    /**
+     * The reader must not be used by the caller until the stream is removed.
+     * RETURN:
+     *   stream id.
+     */
+    size_t addStream(SortedDiffReader &reader);
+    /**
+     * Get the next pack of the stream. This blocks until it is available.
+     * RETURN:
+     *   false if the stream reached the end.
+     */
+    bool pop(size_t id, Pack &pack);
+    /**
+     * Stop reading ahead the stream.
+     * The reader can be used or destroyed by the caller after this returns.
+     */
+    void removeStream(size_t id);
+private:
+    void workerEntry() noexcept;
+    Stream *pickStream();
+    void convertPack(Pack &pack) const;
+};
+
 /**
  * To merge walb diff files.
  *
  * Usage:
- *   (1) call setMaxIoBlocks() and setShouldValidateUuid() if necessary.
+ *   (1) call setMaxIoBlocks(), setShouldValidateUuid(), setKeepCompressed(),
+ *       setAddrRange(), setPrefetch() and setMemoryBudget() if necessary.
  *   (2) add wdiffs by calling addWdiff() or addWdiffs().
  *   (3a) call mergeToFd() to write out the merged diff data.
  *   (3b) call prepare(), then call header() and getAndRemove() multiple times for other purpose.
@@ -42,15 +211,27 @@ private:
         mutable IndexedDiffReader iReader_;
         mutable bool isIndexed_;  // true: use iReader_, false: use sReader_.
         DiffFileHeader header_;
-        mutable DiffRecord rec_; // checksum field may not be calculated.
+        mutable DiffRecord rec_; // compressed or not. checksum field may not be calculated.
         mutable AlignedArray buf_;
         mutable bool isFilled_;
         mutable bool isEnd_;
+        uint64_t bgnAddr_, endAddr_; // IOs out of [bgnAddr_, endAddr_) will be ignored.
+        DiffPrefetcher *prefetcher_; // nullptr if sReader_ is used directly.
+        size_t streamId_;
+        mutable DiffPrefetcher::Pack pack_; // prefetched records and IOs.
+        mutable size_t packIdx_;
+        bool isTmp_; // a temporary wdiff created by spilling. Not counted in statistics.
 
     public:
         constexpr static const char *NAME = "DiffMerger::Wdiff";
-        Wdiff() : sReader_(), iReader_(), isIndexed_(false)
-                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false) {
+        Wdiff(uint64_t bgnAddr, uint64_t endAddr)
+            : sReader_(), iReader_(), isIndexed_(false)
+            , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false)
+            , bgnAddr_(bgnAddr), endAddr_(endAddr)
+            , prefetcher_(nullptr), streamId_(0), pack_(), packIdx_(0), isTmp_(false) {
+        }
+        ~Wdiff() noexcept {
+            if (prefetcher_) prefetcher_->removeStream(streamId_);
         }
         void open(const std::string &wdiffPath, IndexedDiffCache *cache) {
             setFile(cybozu::util::File(wdiffPath, O_RDONLY), cache);
@@ -60,8 +241,20 @@ private:
          * isIndexed_ will be set.
          */
         void setFile(cybozu::util::File &&file, IndexedDiffCache *cache);
+        /**
+         * Read ahead by the prefetcher. Indexed wdiffs are not supported.
+         * Call this before reading any IO.
+         */
+        void startPrefetch(DiffPrefetcher &prefetcher) {
+            assert(!isFilled_ && !isEnd_);
+            if (isIndexed_) return;
+            streamId_ = prefetcher.addStream(sReader_);
+            prefetcher_ = &prefetcher;
+        }
 
         const DiffFileHeader &header() const { return header_; }
+        void setTmp() { isTmp_ = true; }
+        bool isTmp() const { return isTmp_; }
         DiffRecord getFrontRec() const {
             verifyNotEnd(__func__);
             fill();
@@ -83,6 +276,9 @@ private:
             verifyFilled(__func__);
             return rec_.io_address;
         }
+        /**
+         * Call this after isEnd() returned true.
+         */
         const DiffStatistics& getStat() const {
             if (isIndexed_) {
                 return iReader_.getStat();
@@ -93,6 +289,8 @@ private:
     private:
         void fill() const;
         bool readIndexedDiff() const;
+        bool readPrefetchedDiff() const;
+        void trimToAddrRange() const;
 #ifdef DEBUG
         void verifyNotEnd(const char *msg) const {
             if (isEnd()) throw cybozu::Exception(msg) << "reached to end";
@@ -108,19 +306,32 @@ private:
 #endif
     };
     bool shouldValidateUuid_;
+    bool keepCompressed_;
+    uint64_t bgnAddr_, endAddr_;
+    size_t prefetchThreadNr_, prefetchPackNr_;
+    size_t memBudget_; // [byte]. 0 means unlimited.
+    std::string tmpDir_;
 
     DiffFileHeader wdiffH_;
     bool isHeaderPrepared_;
+    bool isMixedDict_; // input wdiffs refer to different zstd dictionaries.
 
+    std::unique_ptr<DiffPrefetcher> prefetcher_; // must be destroyed after wdiffs_.
     using WdiffPtr = std::unique_ptr<Wdiff>;
-    using WdiffPtrList = std::list<WdiffPtr>;
-    WdiffPtrList wdiffs_;
+    using WdiffPtrVec = std::vector<WdiffPtr>;
+    WdiffPtrVec wdiffs_; // older wdiff has smaller index. ended ones are nullptr.
+    AddrTournamentTree addrTree_; // current addresses of wdiffs_.
     DiffMemory diffMem_;
     std::queue<DiffRecIo> mergedQ_;
     uint64_t doneAddr_;
+    const size_t initSearchLen_;
     size_t searchLen_;
     IndexedDiffCache cache_; // shared by indexed diff files.
 
+    uint64_t mergedQBytes_; // IO data size in mergedQ_.
+    uint64_t peakMemBytes_; // peak IO data size in diffMem_ and mergedQ_.
+    size_t spillNr_;
+
     /**
      * Diff recIos will be read from wdiffs_,
      * then added to diffMem_ (and merged inside it),
@@ -129,6 +340,10 @@ private:
      * The point of the algorithm is which wdiff will be chosen to get recIos.
      * See moveToDiffMemory() for detail.
      *
+     * addrTree_ keeps the current address of each wdiff indexed by its age,
+     * so that we can visit only wdiffs whose current address is in the search range
+     * in age order, and get the minimum address of older wdiffs, in O(log N) each.
+     *
      * doneAddr_ is the minimum address in all the input wdiff streams.
      * There is no overlapped IOs which endAddr is <= doneAddr in all the streams.
      * so such IOs in diffMem_ can be put out safely.
@@ -140,25 +355,37 @@ private:
      * diff1        XXXXX
      * diff0          XXXXX
      * required  <-------->
+     *
+     * Long chains of such IOs make searchLen_ and diffMem_ huge.
+     * If memBudget_ is exceeded, diffMem_ is spilled. See spill() for detail.
      */
 
     /**
      * statIn: input wdiffs statistics.
      * statOut: output wdiff statistics.
-     *     This is meaningful only when you use mergeToFd().
+     *     This is meaningful only when you use mergeToFd() or mergeToIndexedFd().
      */
     mutable DiffStatistics statIn_, statOut_;
 
 public:
     explicit DiffMerger(size_t initSearchLen = DEFAULT_MERGE_BUFFER_LB)
         : shouldValidateUuid_(false)
+        , keepCompressed_(false)
+        , bgnAddr_(0), endAddr_(UINT64_MAX)
+        , prefetchThreadNr_(0), prefetchPackNr_(DEFAULT_MERGE_PREFETCH_PACKS)
+        , memBudget_(0), tmpDir_()
         , wdiffH_()
         , isHeaderPrepared_(false)
+        , isMixedDict_(false)
+        , prefetcher_()
         , wdiffs_()
+        , addrTree_()
         , diffMem_()
         , mergedQ_()
         , doneAddr_(0)
+        , initSearchLen_(initSearchLen)
         , searchLen_(initSearchLen)
+        , mergedQBytes_(0), peakMemBytes_(0), spillNr_(0)
         , statIn_(), statOut_() {
     }
     void setMaxIoBlocks(uint32_t maxIoBlocks) {
@@ -170,15 +397,63 @@ public:
     void setShouldValidateUuid(bool shouldValidateUuid) {
         shouldValidateUuid_ = shouldValidateUuid;
     }
+    /**
+     * @keepCompressed
+     *   if true, getAndRemove() may return compressed IOs.
+     *   Records that do not overlap any others are passed through
+     *   with their original compressed data, checksum and compression type.
+     *   otherwise, all the IOs will be uncompressed.
+     */
+    void setKeepCompressed(bool keepCompressed) {
+        keepCompressed_ = keepCompressed;
+    }
     void setMaxCacheSize(size_t bytes) {
         cache_.setMaxSize(bytes);
     }
+    /**
+     * Read sorted wdiffs ahead in background threads shared by all the input wdiffs.
+     * IOs will be uncompressed there unless setKeepCompressed(true) has been called.
+     * Call this before prepare().
+     *
+     * @threadNr number of threads. 0 means no prefetch (default).
+     * @packNr max number of packs to read ahead for each wdiff.
+     */
+    void setPrefetch(size_t threadNr, size_t packNr = DEFAULT_MERGE_PREFETCH_PACKS) {
+        assert(!isHeaderPrepared_);
+        prefetchThreadNr_ = threadNr;
+        prefetchPackNr_ = std::max<size_t>(packNr, 1);
+    }
+    /**
+     * Limit the size of IO data kept in memory to merge.
+     * If it is exceeded, the IOs in memory are spilled to a temporary indexed wdiff,
+     * the rest of the inputs are merged in two groups into temporary indexed wdiffs,
+     * and then the two are merged.
+     * Call this before prepare().
+     *
+     * @bytes 0 means unlimited (default).
+     * @tmpDir directory to put temporary files.
+     */
+    void setMemoryBudget(size_t bytes, const std::string &tmpDir) {
+        assert(!isHeaderPrepared_);
+        memBudget_ = bytes;
+        tmpDir_ = tmpDir;
+    }
+    /**
+     * Merge only IOs in the address range [bgnAddr, endAddr).
+     * IOs across the boundaries will be trimmed.
+     * Call this before adding wdiffs.
+     */
+    void setAddrRange(uint64_t bgnAddr, uint64_t endAddr) {
+        assert(wdiffs_.empty());
+        bgnAddr_ = bgnAddr;
+        endAddr_ = endAddr;
+    }
     /**
      * Add a diff file.
      * Newer wdiff file must be added later.
      */
     void addWdiff(const std::string& wdiffPath) {
-        wdiffs_.emplace_back(new Wdiff());
+        wdiffs_.emplace_back(new Wdiff(bgnAddr_, endAddr_));
         wdiffs_.back()->open(wdiffPath, &cache_);
     }
     /**
@@ -191,7 +466,7 @@ public:
     }
     void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
         for (cybozu::util::File &file : fileV) {
-            wdiffs_.emplace_back(new Wdiff());
+            wdiffs_.emplace_back(new Wdiff(bgnAddr_, endAddr_));
             wdiffs_.back()->setFile(std::move(file), &cache_);
         }
         fileV.clear();
@@ -201,9 +476,21 @@ public:
      * The last wdiff's uuid will be used for output wdiff.
      *
      * @outFd file descriptor for output wdiff.
+     * @func called periodically. return false to stop merging.
+     * RETURN:
+     *   false if stopped by func.
      */
-    void mergeToFd(int outFd);
+    bool mergeToFd(int outFd, const std::function<bool()> &func = []() { return true; });
     void mergeToFdInParallel(int outFd, const CompressOpt& cmpr);
+    /**
+     * Merge input wdiff files into an indexed wdiff,
+     * deduplicating its blocks. See IndexedDiffWriter::setDedup().
+     * Merging deduplicated wdiffs by mergeToFd() expands the references.
+     *
+     * RETURN:
+     *   total size of deduplicated blocks [logical block].
+     */
+    uint64_t mergeToIndexedFd(int outFd, size_t maxDedupNr);
     /**
      * Prepare wdiff header and variables.
      */
@@ -215,8 +502,16 @@ public:
         assert(isHeaderPrepared_);
         return wdiffH_;
     }
+    /**
+     * Zstd dictionary id that output IOs may refer to. 0 means none.
+     */
+    uint32_t getDictId() const {
+        return header().getDictId();
+    }
     /**
      * Get a DiffRecIo and remove it from the merger.
+     * The IO may be compressed only when setKeepCompressed(true) has been called.
+     * Zstd-compressed IOs are uncompressed anyway if the inputs refer to different dictionaries.
      * RETURN:
      *   false if there is no diffIo anymore.
      */
@@ -227,17 +522,22 @@ public:
         return statIn_;
     }
     /**
-     * Use this only if you used mergeToFd().
+     * Use this only if you used mergeToFd() or mergeToIndexedFd().
      */
     const DiffStatistics& statOut() const {
         assert(wdiffs_.empty());
         return statOut_;
     }
+    /**
+     * Peak size of IO data kept in memory.
+     */
     std::string memUsageStr() const {
-        return cybozu::itoa(searchLen_ * LBS / KIBI) + "KiB";
+        std::string s = cybozu::itoa(peakMemBytes_ / KIBI) + "KiB";
+        if (spillNr_ > 0) s += "(spilled " + cybozu::itoa(spillNr_) + ")";
+        return s;
     }
+    size_t getSpillNr() const { return spillNr_; }
 private:
-    uint64_t getMinimumAddr() const;
     void moveToDiffMemory();
 
     /**
@@ -263,14 +563,166 @@ private:
      *   false if there is no Io to move.
      */
     bool moveToMergedQueue();
-    void removeEndedWdiffs();
+    void initAddrTree();
+    /**
+     * Update the address of the i-th wdiff in addrTree_.
+     * If the wdiff has reached the end, it will be removed.
+     */
+    void updateAddr(size_t i);
 
     void mergeIo(const DiffRecord &rec, AlignedArray &&buf) {
-        assert(!rec.isCompressed());
         diffMem_.add(rec, std::move(buf));
     }
+    bool isOverMemBudget() const {
+        return memBudget_ > 0 && diffMem_.getDataSize() > memBudget_;
+    }
+    void updatePeakMemBytes() {
+        peakMemBytes_ = std::max(peakMemBytes_, diffMem_.getDataSize() + mergedQBytes_);
+    }
+    bool shouldSpill() const;
+    /**
+     * Spill diffMem_ and merge the rest of the inputs in two groups.
+     * Only two temporary wdiffs will remain in wdiffs_.
+     */
+    void spill();
+    WdiffPtr spillDiffMemory();
+    /**
+     * Merge wdiffs into a temporary indexed wdiff with another merger.
+     * wdiffV must be sorted by age.
+     */
+    WdiffPtr mergeToTmpWdiff(WdiffPtrVec &&wdiffV);
+    WdiffPtr openTmpWdiff(const cybozu::TmpFile &tmpFile);
 
     void verifyUuid(const cybozu::Uuid &uuid) const;
 };
 
+/**
+ * To merge walb diff files in parallel.
+ *
+ * The address space is split into shards and each shard is merged
+ * by its own DiffMerger on its own thread.
+ * Shard boundaries are decided by scanning pack headers of sorted wdiffs
+ * and indexes of indexed wdiffs so that each shard has similar amount of IO blocks.
+ *
+ * Usage:
+ *   (1) call setMaxIoBlocks(), setShouldValidateUuid(), setPrefetch()
+ *       and setMemoryBudget() if necessary.
+ *   (2) add wdiffs by calling addWdiff() or addWdiffs().
+ *   (3) call prepare().
+ *   (4a) call mergeToFd() to write out the merged diff data.
+ *   (4b) call run() to consume merged IOs of each shard for other purpose.
+ */
+class ShardedDiffMerger /* final */
+{
+private:
+    std::vector<cybozu::util::File> fileV_; // input wdiffs. older one has smaller index.
+    uint32_t maxIoBlocks_;
+    bool shouldValidateUuid_;
+    size_t prefetchThreadNr_, prefetchPackNr_;
+    size_t memBudget_;
+    std::string tmpDir_;
+    DiffFileHeader wdiffH_;
+    std::vector<uint64_t> addrV_; // shard i is [addrV_[i], addrV_[i + 1]).
+    StrVec memUsageV_;
+    DiffStatistics statIn_, statOut_;
+
+public:
+    /**
+     * RETURN:
+     *   false if the shard must stop.
+     */
+    using ShardFunc = std::function<bool(size_t shardIdx, DiffMerger &merger)>;
+
+    ShardedDiffMerger()
+        : fileV_(), maxIoBlocks_(0), shouldValidateUuid_(false)
+        , prefetchThreadNr_(0), prefetchPackNr_(DEFAULT_MERGE_PREFETCH_PACKS)
+        , memBudget_(0), tmpDir_()
+        , wdiffH_(), addrV_(), memUsageV_(), statIn_(), statOut_() {
+    }
+    void setMaxIoBlocks(uint32_t maxIoBlocks) {
+        maxIoBlocks_ = maxIoBlocks;
+    }
+    void setShouldValidateUuid(bool shouldValidateUuid) {
+        shouldValidateUuid_ = shouldValidateUuid;
+    }
+    /**
+     * See DiffMerger::setPrefetch(). Each shard has its own prefetch threads.
+     */
+    void setPrefetch(size_t threadNr, size_t packNr = DEFAULT_MERGE_PREFETCH_PACKS) {
+        prefetchThreadNr_ = threadNr;
+        prefetchPackNr_ = packNr;
+    }
+    /**
+     * See DiffMerger::setMemoryBudget(). The budget is divided among the shards.
+     */
+    void setMemoryBudget(size_t bytes, const std::string &tmpDir) {
+        memBudget_ = bytes;
+        tmpDir_ = tmpDir;
+    }
+    /**
+     * Newer wdiff file must be added later.
+     */
+    void addWdiff(const std::string& wdiffPath) {
+        fileV_.emplace_back(wdiffPath, O_RDONLY);
+    }
+    void addWdiffs(const StrVec &wdiffPaths) {
+        for (const std::string &s : wdiffPaths) {
+            addWdiff(s);
+        }
+    }
+    void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
+        for (cybozu::util::File &file : fileV) {
+            fileV_.push_back(std::move(file));
+        }
+        fileV.clear();
+    }
+    /**
+     * Scan the input wdiffs and decide shards.
+     * @maxShardNr the number of shards will be <= maxShardNr.
+     *   Each shard uses one thread.
+     */
+    void prepare(size_t maxShardNr);
+    size_t getShardNr() const {
+        assert(!addrV_.empty());
+        return addrV_.size() - 1;
+    }
+    const DiffFileHeader &header() const {
+        assert(!addrV_.empty());
+        return wdiffH_;
+    }
+    /**
+     * Call func for each shard in parallel.
+     * The DiffMerger given to func has been prepared and
+     * returns uncompressed IOs in the shard in address order.
+     *
+     * RETURN:
+     *   false if any func returned false.
+     */
+    bool run(const ShardFunc &func);
+    /**
+     * Merge input wdiffs and put them into output fd as a sorted wdiff.
+     * The last wdiff's uuid will be used for output wdiff.
+     *
+     * @outFd file descriptor for output wdiff. It need not be seekable.
+     * @cmpr compression type and level for output. cmpr.numCpu will not be used.
+     * @tmpDir directory to put temporary files of the shards except the first one.
+     * @func called for each shard periodically. return false to stop merging.
+     * RETURN:
+     *   false if stopped by func.
+     */
+    bool mergeToFd(int outFd, const CompressOpt &cmpr, const std::string &tmpDir,
+                   const std::function<bool()> &func = []() { return true; });
+
+    const DiffStatistics& statIn() const { return statIn_; }
+    /**
+     * Use this only if you used mergeToFd().
+     */
+    const DiffStatistics& statOut() const { return statOut_; }
+    std::string memUsageStr() const {
+        return cybozu::util::concat(memUsageV_, ",");
+    }
+private:
+    bool runDetail(const ShardFunc &func, bool keepCompressed);
+};
+
 } //namespace walb
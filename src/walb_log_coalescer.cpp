@@ -0,0 +1,79 @@
+#include "walb_log_coalescer.hpp"
+#include <map>
+
+namespace walb {
+
+namespace {
+
+/**
+ * Non-overlapping address ranges.
+ * key: begin [logical block], value: end [logical block].
+ */
+using RangeMap = std::map<uint64_t, uint64_t>;
+
+bool isCovered(const RangeMap &map, uint64_t bgn, uint64_t end)
+{
+    RangeMap::const_iterator it = map.upper_bound(bgn);
+    if (it == map.begin()) return false;
+    --it;
+    return end <= it->second;
+}
+
+void addRange(RangeMap &map, uint64_t bgn, uint64_t end)
+{
+    RangeMap::iterator it = map.upper_bound(bgn);
+    if (it != map.begin()) {
+        RangeMap::iterator prev = std::prev(it);
+        if (bgn <= prev->second) {
+            bgn = prev->first;
+            end = std::max(end, prev->second);
+            it = map.erase(prev);
+        }
+    }
+    while (it != map.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = map.erase(it);
+    }
+    map.emplace(bgn, end);
+}
+
+} // namespace
+
+void WlogCoalescer::push(const LogPackHeader &packH, std::vector<AlignedArray> &&ioV)
+{
+    if (ioV.size() != packH.nRecords()) {
+        throw cybozu::Exception("WlogCoalescer:push:bad ioV size")
+            << packH.nRecords() << ioV.size();
+    }
+    packQ_.emplace_back();
+    Pack &pack = packQ_.back();
+    pack.packH.copyFrom(packH);
+    pack.ioV = std::move(ioV);
+    bufferedPb_ += 1 + packH.totalIoSize();
+}
+
+void WlogCoalescer::coalesce()
+{
+    RangeMap covered;
+    for (std::deque<Pack>::reverse_iterator it = packQ_.rbegin(); it != packQ_.rend(); ++it) {
+        LogPackHeader &packH = it->packH;
+        bool isChanged = false;
+        for (size_t i = packH.nRecords(); i > 0; i--) {
+            WlogRecord &rec = packH.record(i - 1);
+            if (rec.isPadding()) continue;
+            const uint64_t bgn = rec.offset;
+            const uint64_t end = bgn + rec.ioSizeLb();
+            if (!rec.isDiscard() && isCovered(covered, bgn, end)) {
+                coalescedPb_ += rec.ioSizePb(packH.pbs());
+                rec.setDiscard();
+                rec.checksum = 0;
+                it->ioV[i - 1] = AlignedArray();
+                isChanged = true;
+            }
+            addRange(covered, bgn, end);
+        }
+        if (isChanged) packH.updateChecksum();
+    }
+}
+
+} // namespace walb
@@ -0,0 +1,72 @@
+#pragma once
+/**
+ * @file
+ * @brief Coalescing overwritten IOs in walb logs.
+ */
+#include <vector>
+#include <deque>
+#include "walb_log_base.hpp"
+
+namespace walb {
+
+/**
+ * Buffer a window of logpacks and drop IO data that will be overwritten
+ * by later IOs in the same window.
+ *
+ * A normal IO entirely covered by later IOs in the window is turned into
+ * a discard IO of the same address range. Discard IOs have no data,
+ * so the data will not be sent, while the lsids of logpacks are kept as they are.
+ * The diff converted from the logpacks does not change
+ * because every block of the IO is overwritten later in the same diff.
+ * So a window must not exceed a range converted into one diff,
+ * that is a range between two MetaLsidGid records.
+ *
+ * Partially overwritten IOs are kept.
+ */
+class WlogCoalescer
+{
+    struct Pack {
+        LogPackHeader packH;
+        std::vector<AlignedArray> ioV; // for each record.
+    };
+    std::deque<Pack> packQ_;
+    uint64_t bufferedPb_;
+    uint64_t coalescedPb_;
+
+public:
+    WlogCoalescer() : packQ_(), bufferedPb_(0), coalescedPb_(0) {
+    }
+    /**
+     * ioV[i] must be the data of packH.record(i), that is empty if it does not have data.
+     */
+    void push(const LogPackHeader &packH, std::vector<AlignedArray> &&ioV);
+    bool empty() const { return packQ_.empty(); }
+    /**
+     * RETURN:
+     *   buffered logpack headers and IO data [physical block].
+     */
+    uint64_t getBufferedPb() const { return bufferedPb_; }
+    /**
+     * RETURN:
+     *   total size of IO data dropped so far [physical block].
+     */
+    uint64_t getCoalescedPb() const { return coalescedPb_; }
+    /**
+     * Coalesce the buffered logpacks,
+     * then call f(const LogPackHeader &, const std::vector<AlignedArray> &)
+     * for each of them in the pushed order, and clear the window.
+     */
+    template <typename F>
+    void flush(F f) {
+        coalesce();
+        for (const Pack &pack : packQ_) {
+            f(pack.packH, pack.ioV);
+        }
+        packQ_.clear();
+        bufferedPb_ = 0;
+    }
+private:
+    void coalesce();
+};
+
+} // namespace walb
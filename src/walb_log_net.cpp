@@ -1,15 +1,37 @@
 #include "walb_log_net.hpp"
+#include "walb_diff_converter.hpp"
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace walb {
 
+WlogSender::WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt,
+                       int cmprType, size_t cmprLevel, size_t cmprThreads, size_t batchSize)
+    : sockBuf_(sock), packet_(sockBuf_), ctrl_(packet_), logger_(logger), pbs_(pbs), salt_(salt)
+    , cmprType_(cmprType), cmprLevel_(cmprLevel), batchSize_(batchSize), batch_()
+    , cmprQ_(Q_SIZE * std::max<size_t>(cmprThreads, 1))
+    , sendQ_(Q_SIZE * std::max<size_t>(cmprThreads, 1))
+    , cmprThV_(), sendTh_(), mu_(), cv_(), isFailed_(false)
+{
+    if (cmprThreads == 0) return;
+    cmprThV_.reserve(cmprThreads);
+    for (size_t i = 0; i < cmprThreads; i++) {
+        cmprThV_.emplace_back([this]() { runCompressor(); });
+        cmprThV_.back().start();
+    }
+    sendTh_.set([this]() { runSender(); });
+    sendTh_.start();
+}
+
 void WlogSender::process(CompressedData& cd, bool doCompress) try
 {
-    if (doCompress) cd.compress();
+    if (doCompress) cd.compress(cmprType_, cmprLevel_);
     ctrl_.next();
     cd.send(packet_);
 } catch (std::exception& e) {
     try {
-        packet::StreamControl(packet_.sock()).error();
+        packet::StreamControl(packet_).error();
+        packet_.flush();
     } catch (...) {}
     logger_.error() << "WlogSender:process" << e.what();
 }
@@ -24,9 +46,141 @@ void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, const char
     if (!rec.hasData()) return;
 
     const size_t size = rec.ioSizePb(pbs_) * pbs_;
-    CompressedData cd;
-    cd.compressFrom(data, size);
-    process(cd, false);
+    push(data, size);
+}
+
+void WlogSender::sync()
+{
+    flushBatch();
+    if (isPipelined()) {
+        try {
+            cmprQ_.sync();
+            sendQ_.sync();
+        } catch (TaskQueue::FailedError &) {
+            // The error will be thrown by join.
+        }
+        std::exception_ptr cmprEp;
+        for (cybozu::thread::ThreadRunner &th : cmprThV_) {
+            std::exception_ptr ep = th.joinNoThrow();
+            if (ep && !cmprEp) cmprEp = ep;
+        }
+        cmprThV_.clear();
+        // Compressor threads fail with FailedError when the sender thread fails.
+        std::exception_ptr ep = sendTh_.joinNoThrow();
+        if (ep) std::rethrow_exception(ep);
+        if (cmprEp) std::rethrow_exception(cmprEp);
+    }
+    ctrl_.end();
+    packet_.flush();
+}
+
+void WlogSender::push(const void *data, size_t size)
+{
+    if (batchSize_ == 0) {
+        pushFrame(data, size);
+        return;
+    }
+    if (batch_.empty()) {
+        // Reserve the buffer because resize() of AlignedArray reallocates to the exact size.
+        batch_.resize(batchSize_, false);
+        batch_.clear();
+    }
+    const size_t off = batch_.size();
+    batch_.resize(off + size, false);
+    ::memcpy(&batch_[off], data, size);
+    if (batch_.size() >= batchSize_) flushBatch();
+}
+
+/**
+ * Tasks are queued to sendQ_ before cmprQ_
+ * so that the sender thread sends them in the pushed order.
+ */
+void WlogSender::pushFrame(const void *data, size_t size)
+{
+    if (!isPipelined()) {
+        CompressedData cd;
+        cd.compressFrom(data, size, cmprType_, cmprLevel_);
+        process(cd, false);
+        return;
+    }
+    TaskPtr task = std::make_shared<Task>();
+    task->cd.setUncompressed(data, size);
+    sendQ_.push(task);
+    cmprQ_.push(std::move(task));
+}
+
+void WlogSender::flushBatch()
+{
+    if (batch_.empty()) return;
+    if (!isPipelined()) {
+        pushFrame(batch_.data(), batch_.size());
+        batch_.clear();
+        return;
+    }
+    TaskPtr task = std::make_shared<Task>();
+    task->cd.setUncompressed(std::move(batch_));
+    sendQ_.push(task);
+    cmprQ_.push(std::move(task));
+}
+
+void WlogSender::runCompressor()
+{
+    TaskPtr task;
+    while (cmprQ_.pop(task)) {
+        try {
+            task->cd.compress(cmprType_, cmprLevel_);
+        } catch (...) {
+            task->ep = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            task->isDone = true;
+        }
+        cv_.notify_all();
+        task.reset();
+    }
+}
+
+void WlogSender::runSender() try
+{
+    TaskPtr task;
+    while (sendQ_.pop(task)) {
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&]() { return task->isDone || isFailed_; });
+            if (!task->isDone) throw cybozu::Exception(NAME()) << "failed";
+        }
+        if (task->ep) std::rethrow_exception(task->ep);
+        process(task->cd, false);
+        task.reset();
+    }
+} catch (...) {
+    try {
+        packet::StreamControl(packet_).error();
+        packet_.flush();
+    } catch (...) {}
+    fail();
+    throw;
+}
+
+void WlogSender::fail() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        isFailed_ = true;
+    }
+    cv_.notify_all();
+    cmprQ_.fail();
+    sendQ_.fail();
+}
+
+void WlogSender::stop() noexcept
+{
+    if (!isPipelined()) return;
+    fail();
+    for (cybozu::thread::ThreadRunner &th : cmprThV_) th.joinNoThrow();
+    sendTh_.joinNoThrow();
+    cmprThV_.clear();
 }
 
 void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
@@ -40,32 +194,159 @@ void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
 }
 
 
-bool WlogReceiver::process(CompressedData& cd)
+WlogDiffSender::WlogDiffSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt,
+                               const cybozu::Uuid &uuid, size_t maxDedupNr)
+    : sockBuf_(sock), packet_(sockBuf_), ctrl_(packet_), logger_(logger), pbs_(pbs), salt_(salt)
+    , pipeR_(), writer_(), sendTh_(), isFailed_(false), isAborted_(false), isSynced_(false)
+{
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) < 0) {
+        throw cybozu::Exception(NAME()) << "pipe2 failed" << cybozu::ErrorNo();
+    }
+    pipeR_ = cybozu::util::File(fds[0], true);
+    writer_.setFile(cybozu::util::File(fds[1], true));
+    writer_.setDedup(maxDedupNr);
+    // The header is small enough to be written before the reader starts.
+    DiffFileHeader header;
+    header.setUuid(uuid);
+    header.type = WALB_DIFF_TYPE_INDEXED;
+    writer_.writeHeader(header);
+
+    sendTh_.set([this]() { runSender(); });
+    sendTh_.start();
+}
+
+void WlogDiffSender::pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data)
+{
+    verifyPbsAndSalt(header);
+    if (isFailed_) throw cybozu::Exception(NAME()) << "sender failed";
+    IndexedDiffRecord drec;
+    if (convertLogToDiff(header.record(recIdx), data, drec)) {
+        writer_.compressAndWriteDiff(drec, data);
+    }
+}
+
+void WlogDiffSender::sync()
+{
+    writer_.finalize();
+    isSynced_ = true;
+    sendTh_.join();
+}
+
+/**
+ * The pipe is read until the end even after sending failed,
+ * so that writing to it never blocks.
+ */
+void WlogDiffSender::runSender()
+{
+    const size_t frameSize = 1 * MEBI;
+    AlignedArray buf(frameSize, false);
+    std::exception_ptr ep;
+    for (;;) {
+        size_t size = 0;
+        while (size < buf.size()) {
+            const size_t s = pipeR_.readsome(&buf[size], buf.size() - size);
+            if (s == 0) break;
+            size += s;
+        }
+        if (size == 0) break;
+        if (ep) continue;
+        try {
+            CompressedData cd;
+            cd.setUncompressed(buf.data(), size);
+            ctrl_.next();
+            cd.send(packet_);
+        } catch (...) {
+            ep = std::current_exception();
+            isFailed_ = true;
+        }
+    }
+    if (ep) std::rethrow_exception(ep);
+    if (isAborted_) {
+        ctrl_.error();
+    } else {
+        ctrl_.end();
+    }
+    packet_.flush();
+}
+
+void WlogDiffSender::stop() noexcept
+{
+    if (isSynced_) return;
+    isAborted_ = true;
+    try {
+        writer_.abort();
+    } catch (...) {}
+    std::exception_ptr ep = sendTh_.joinNoThrow();
+    if (ep) logger_.warn() << NAME() << cybozu::thread::exceptionPtrToStr(ep);
+}
+
+void WlogDiffSender::verifyPbsAndSalt(const LogPackHeader &header) const
+{
+    if (header.pbs() != pbs_) {
+        throw cybozu::Exception(NAME()) << "invalid pbs" << pbs_ << header.pbs();
+    }
+    if (header.salt() != salt_) {
+        throw cybozu::Exception(NAME()) << "invalid salt" << salt_ << header.salt();
+    }
+}
+
+
+std::pair<uint8_t, uint8_t> decideWlogCmpr(
+    uint8_t type, uint8_t level, const std::vector<int> &acceptedTypeV)
+{
+    const bool isAccepted =
+        std::find(acceptedTypeV.begin(), acceptedTypeV.end(), type) != acceptedTypeV.end();
+    if (!isAccepted || type == ::WALB_DIFF_CMPR_AUTO || level > 9) {
+        return {::WALB_DIFF_CMPR_SNAPPY, 0};
+    }
+    return {type, level};
+}
+
+
+bool WlogFrameReceiver::recv(CompressedData &cd)
 {
     if (ctrl_.isNext()) {
         cd.recv(packet_);
-        cd.uncompress();
         ctrl_.reset();
         return true;
     }
     if (ctrl_.isError()) {
-        throw cybozu::Exception("WlogReceiver:process:isError");
+        throw cybozu::Exception("WlogFrameReceiver:recv:isError");
     }
     return false;
 }
 
+WlogReceiver::WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt, bool isBatched)
+    : WlogReceiver(FrameSource(), pbs, salt, isBatched)
+{
+    std::shared_ptr<WlogFrameReceiver> frameR = std::make_shared<WlogFrameReceiver>(sock);
+    source_ = [frameR](CompressedData &cd) {
+        if (!frameR->recv(cd)) return false;
+        cd.uncompress();
+        return true;
+    };
+}
+
 bool WlogReceiver::popHeader(LogPackHeader &header)
 {
     const char *const FUNC = __func__;
-    CompressedData cd;
-    if (!process(cd)) {
-        return false;
+    if (isBatched_) {
+        if (!fetchFrame()) return false;
+        AlignedArray buf(pbs_, false);
+        readFromFrames(buf.data(), pbs_);
+        header.copyFrom(buf.data(), pbs_);
+    } else {
+        CompressedData cd;
+        if (!process(cd)) {
+            return false;
+        }
+        assert(!cd.isCompressed());
+        if (cd.rawSize() != pbs_) {
+            throw cybozu::Exception(FUNC) << "invalid pack header size" << cd.rawSize() << pbs_;
+        }
+        header.copyFrom(cd.rawData(), pbs_);
     }
-    assert(!cd.isCompressed());
-    if (cd.rawSize() != pbs_) {
-        throw cybozu::Exception(FUNC) << "invalid pack header size" << cd.rawSize() << pbs_;
-    }
-    header.copyFrom(cd.rawData(), pbs_);
     if (header.isEnd()) throw cybozu::Exception(FUNC) << "end header is not permitted";
     return true;
 }
@@ -78,12 +359,17 @@ void WlogReceiver::popIo(const WlogRecord &rec, AlignedArray &data)
     data.clear();
     if (!rec.hasData()) return;
 
-    CompressedData cd;
-    if (!process(cd)) {
-        throw cybozu::Exception("WlogReceiver:popIo:failed") << rec;
+    if (isBatched_) {
+        data.resize(rec.ioSizePb(pbs_) * pbs_, false);
+        readFromFrames(data.data(), data.size());
+    } else {
+        CompressedData cd;
+        if (!process(cd)) {
+            throw cybozu::Exception("WlogReceiver:popIo:failed") << rec;
+        }
+        assert(!cd.isCompressed());
+        cd.moveTo(data);
     }
-    assert(!cd.isCompressed());
-    cd.moveTo(data);
     if (!rec.hasDataForChecksum()) return;
 
     const size_t ioSizeB = rec.ioSizeLb() * LBS;
@@ -93,4 +379,157 @@ void WlogReceiver::popIo(const WlogRecord &rec, AlignedArray &data)
     }
 }
 
+bool WlogReceiver::fetchFrame()
+{
+    if (frameOff_ < frame_.size()) return true;
+    CompressedData cd;
+    if (!process(cd)) return false;
+    assert(!cd.isCompressed());
+    cd.moveTo(frame_);
+    frameOff_ = 0;
+    return true;
+}
+
+void WlogReceiver::readFromFrames(void *data, size_t size)
+{
+    char *p = (char *)data;
+    while (size > 0) {
+        if (!fetchFrame()) {
+            throw cybozu::Exception("WlogReceiver:readFromFrames:unexpected end") << size;
+        }
+        const size_t s = std::min(size, frame_.size() - frameOff_);
+        ::memcpy(p, &frame_[frameOff_], s);
+        frameOff_ += s;
+        p += s;
+        size -= s;
+    }
+}
+
+namespace {
+
+struct WlogFrame
+{
+    CompressedData cd;
+    std::exception_ptr ep;
+};
+
+struct DiffIoTask
+{
+    IndexedDiffRecord rec;
+    AlignedArray data;
+    std::exception_ptr ep;
+};
+
+} // namespace
+
+bool recvWlogAndWriteDiffInPipeline(
+    const WlogReceiver::FrameSource &recvFrame, IndexedDiffWriter &writer,
+    uint32_t pbs, uint32_t salt, bool isBatched, size_t nrThreads,
+    const std::function<bool()> &shouldStop)
+{
+    if (nrThreads == 0) throw cybozu::Exception(__func__) << "nrThreads must not be 0";
+    const bool doesDedup = writer.getDedupMaxNr() > 0;
+
+    cybozu::thread::ParallelConverter<CompressedData, WlogFrame> decmpr([](CompressedData &&cd) -> WlogFrame {
+            WlogFrame frame;
+            try {
+                cd.uncompress();
+                frame.cd = std::move(cd);
+            } catch (...) {
+                frame.ep = std::current_exception();
+            }
+            return frame;
+        });
+    cybozu::thread::ParallelConverter<DiffIoTask, DiffIoTask> cmpr([doesDedup](DiffIoTask &&task) -> DiffIoTask {
+            // Deduplication must see the IOs in order, so the writer compresses them.
+            if (doesDedup || !task.rec.isNormal() || task.rec.isCompressed()) return std::move(task);
+            try {
+                AlignedArray buf;
+                compressDiffIo(task.rec, task.data.data(), task.rec, buf);
+                task.data = std::move(buf);
+            } catch (...) {
+                task.ep = std::current_exception();
+            }
+            return std::move(task);
+        });
+
+    std::mutex mu;
+    bool isFailed = false;
+    std::exception_ptr firstEp;
+    auto fail = [&](std::exception_ptr ep) noexcept {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if (isFailed) return;
+            isFailed = true;
+            firstEp = ep;
+        }
+        decmpr.fail();
+        cmpr.fail();
+    };
+
+    cybozu::thread::ThreadRunner convTh([&]() {
+            try {
+                WlogReceiver receiver([&](CompressedData &cd) {
+                        WlogFrame frame;
+                        if (!decmpr.pop(frame)) return false;
+                        if (frame.ep) std::rethrow_exception(frame.ep);
+                        cd = std::move(frame.cd);
+                        return true;
+                    }, pbs, salt, isBatched);
+                LogPackHeader packH(pbs, salt);
+                while (receiver.popHeader(packH)) {
+                    for (size_t i = 0; i < packH.nRecords(); i++) {
+                        const WlogRecord &lrec = packH.record(i);
+                        DiffIoTask task;
+                        receiver.popIo(lrec, task.data);
+                        if (!convertLogToDiff(lrec, task.data.data(), task.rec)) continue;
+                        if (!task.rec.isNormal()) task.data.clear();
+                        cmpr.push(std::move(task));
+                    }
+                }
+                cmpr.sync();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    cybozu::thread::ThreadRunner writeTh([&]() {
+            try {
+                DiffIoTask task;
+                while (cmpr.pop(task)) {
+                    if (task.ep) std::rethrow_exception(task.ep);
+                    writer.compressAndWriteDiff(task.rec, task.data.data());
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+
+    decmpr.start(nrThreads);
+    cmpr.start(nrThreads);
+    convTh.start();
+    writeTh.start();
+    bool isStopped = false;
+    try {
+        CompressedData cd;
+        while (recvFrame(cd)) {
+            if (shouldStop()) {
+                isStopped = true;
+                break;
+            }
+            decmpr.push(std::move(cd));
+        }
+        if (isStopped) {
+            fail(std::exception_ptr());
+        } else {
+            decmpr.sync();
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    convTh.join();
+    writeTh.join();
+    if (firstEp) std::rethrow_exception(firstEp);
+    return !isStopped;
+}
+
 } //namespace walb
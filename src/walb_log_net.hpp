@@ -8,11 +8,18 @@
  */
 #include <vector>
 #include <cstring>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <algorithm>
 
 #include "walb_log_base.hpp"
 #include "walb_log_file.hpp"
 #include "compressed_data.hpp"
 #include "walb_logger.hpp"
+#include "walb_diff_file.hpp"
 
 namespace walb {
 
@@ -22,25 +29,60 @@ constexpr size_t Q_SIZE = 16;
  * Walb log sender via TCP/IP connection.
  * This will send packets only, never receive packets.
  *
+ * cmprType and cmprLevel must be agreed with the receiver in advance.
+ * See decideWlogCmpr().
+ *
+ * If batchSize > 0, pack headers and IOs are concatenated
+ * and sent as frames of about batchSize bytes.
+ * The receiver must be also created with isBatched = true.
+ *
+ * If cmprThreads > 0, push*() only hand data to compressor threads,
+ * and a sender thread sends compressed data in the pushed order.
+ * Otherwise push*() compress and send data by themselves.
+ *
  * Usage:
- *   (1) call setParams() to set parameters.
- *   (2) call start() to start worker threads.
- *   (3) call pushHeader() and corresponding pushIo() multiple times.
- *   (4) repeat (3).
- *   (5) call sync() for normal finish, or fail().
+ *   (1) call pushHeader() and corresponding pushIo() multiple times.
+ *   (2) repeat (1).
+ *   (3) call sync() for normal finish.
  */
 class WlogSender
 {
 private:
+    packet::SocketBuffer sockBuf_;
     packet::Packet packet_;
     packet::StreamControl ctrl_;
     Logger &logger_;
     uint32_t pbs_;
     uint32_t salt_;
+    int cmprType_;
+    size_t cmprLevel_;
+    size_t batchSize_;
+    AlignedArray batch_;
+
+    struct Task {
+        CompressedData cd;
+        bool isDone;
+        std::exception_ptr ep;
+        Task() : cd(), isDone(false), ep() {}
+    };
+    using TaskPtr = std::shared_ptr<Task>;
+    using TaskQueue = cybozu::thread::BoundedQueue<TaskPtr>;
+
+    TaskQueue cmprQ_;
+    TaskQueue sendQ_;
+    std::vector<cybozu::thread::ThreadRunner> cmprThV_;
+    cybozu::thread::ThreadRunner sendTh_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool isFailed_;
+
 public:
     static constexpr const char *NAME() { return "WlogSender"; }
-    WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), logger_(logger), pbs_(pbs), salt_(salt) {
+    WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt,
+               int cmprType = ::WALB_DIFF_CMPR_SNAPPY, size_t cmprLevel = 0, size_t cmprThreads = 0,
+               size_t batchSize = 0);
+    ~WlogSender() noexcept {
+        stop();
     }
     void process(CompressedData& cd, bool doCompress);
 
@@ -50,9 +92,7 @@ public:
      */
     void pushHeader(const LogPackHeader &header) {
         verifyPbsAndSalt(header);
-        CompressedData cd;
-        cd.setUncompressed(header.rawData(), pbs_);
-        process(cd, true);
+        push(header.rawData(), pbs_);
     }
     /**
      * You must call this for discard/padding record also.
@@ -61,16 +101,190 @@ public:
 
     /**
      * Notify the end of input.
+     * This waits for all the pushed data to be sent.
      */
-    void sync() {
-        ctrl_.end();
+    void sync();
+private:
+    void verifyPbsAndSalt(const LogPackHeader &header) const;
+    bool isPipelined() const { return !cmprThV_.empty(); }
+    void push(const void *data, size_t size);
+    void pushFrame(const void *data, size_t size);
+    void flushBatch();
+    void runCompressor();
+    void runSender();
+    void fail() noexcept;
+    void stop() noexcept;
+};
+
+/**
+ * Convert walb logs into an indexed wdiff and send it via TCP/IP connection.
+ * This has the same interface as WlogSender,
+ * so that a storage server can make wdiffs instead of proxies.
+ *
+ * The wdiff is written to a pipe, and a sender thread sends what it reads
+ * from the pipe as uncompressed frames, because IO data are already compressed.
+ * The receiver gets the frames by recvWdiffStream().
+ * The stream ends with an error if sync() is not called.
+ */
+class WlogDiffSender
+{
+private:
+    packet::SocketBuffer sockBuf_;
+    packet::Packet packet_;
+    packet::StreamControl ctrl_;
+    Logger &logger_;
+    uint32_t pbs_;
+    uint32_t salt_;
+    cybozu::util::File pipeR_;
+    IndexedDiffWriter writer_;
+    cybozu::thread::ThreadRunner sendTh_;
+    std::atomic<bool> isFailed_; // the sender thread failed.
+    std::atomic<bool> isAborted_; // the input was given up.
+    bool isSynced_;
+
+public:
+    static constexpr const char *NAME() { return "WlogDiffSender"; }
+    /**
+     * maxDedupNr: see IndexedDiffWriter::setDedup().
+     */
+    WlogDiffSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt,
+                   const cybozu::Uuid &uuid, size_t maxDedupNr = 0);
+    ~WlogDiffSender() noexcept {
+        stop();
     }
+    void pushHeader(const LogPackHeader &header) {
+        verifyPbsAndSalt(header);
+    }
+    void pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data);
+    /**
+     * Finalize the wdiff and wait for it to be sent.
+     */
+    void sync();
 private:
     void verifyPbsAndSalt(const LogPackHeader &header) const;
+    void runSender();
+    void stop() noexcept;
+};
+
+/**
+ * Receive a wdiff sent by WlogDiffSender and write it to a file.
+ * RETURN:
+ *   false if shouldStop() returned true.
+ */
+template <typename ShouldStop>
+bool recvWdiffStream(cybozu::Socket &sock, cybozu::util::File &file, ShouldStop shouldStop)
+{
+    packet::Packet packet(sock);
+    packet::StreamControl ctrl(sock);
+    while (ctrl.isNext()) {
+        if (shouldStop()) return false;
+        CompressedData cd;
+        cd.recv(packet);
+        if (cd.isCompressed()) {
+            throw cybozu::Exception(__func__) << "compressed frame" << cd.cmprType();
+        }
+        file.write(cd.rawData(), cd.rawSize());
+        ctrl.reset();
+    }
+    if (!ctrl.isEnd()) {
+        throw cybozu::Exception(__func__) << "the sender failed";
+    }
+    return true;
+}
+
+/**
+ * Decide the codec of wlog-transfer on the receiver side.
+ * The requested codec is used if it is one of acceptedTypeV,
+ * otherwise snappy that all the versions support.
+ *
+ * RETURN:
+ *   agreed (type, level).
+ */
+std::pair<uint8_t, uint8_t> decideWlogCmpr(
+    uint8_t type, uint8_t level, const std::vector<int> &acceptedTypeV);
+
+/**
+ * Options of wlog-transfer negotiated between a storage and a proxy.
+ * The storage sends its request after the volume parameters,
+ * and the proxy replies the agreed options after msgAccept.
+ * maxDedupNr is decided by the proxy, so it is in the reply only.
+ *
+ * They are exchanged only if the connection version is 2 or later.
+ * Otherwise nothing is sent and the default values are used,
+ * which are what version 1 peers do.
+ */
+struct WlogTransferOpt
+{
+    uint8_t cmprType;
+    uint8_t cmprLevel;
+    uint32_t batchKb; /* 0 means an IO per frame. */
+    uint32_t maxChunks; /* 1 means a chunk per session without hasNext. */
+    bool isOffload; /* the storage sends wdiffs instead of wlogs. */
+    uint64_t maxDedupNr; /* for the storage to make wdiffs if isOffload. */
+
+    WlogTransferOpt()
+        : cmprType(::WALB_DIFF_CMPR_SNAPPY), cmprLevel(0), batchKb(0), maxChunks(1)
+        , isOffload(false), maxDedupNr(0) {
+    }
+    static bool isExchanged(uint32_t version) { return version >= 2; }
+
+    template <typename OutputStream>
+    void saveRequest(OutputStream &os, uint32_t version) const {
+        if (!isExchanged(version)) return;
+        cybozu::save(os, cmprType);
+        cybozu::save(os, cmprLevel);
+        cybozu::save(os, batchKb);
+        cybozu::save(os, maxChunks);
+        cybozu::save(os, isOffload);
+    }
+    template <typename InputStream>
+    void loadRequest(InputStream &is, uint32_t version) {
+        *this = WlogTransferOpt();
+        if (!isExchanged(version)) return;
+        cybozu::load(cmprType, is);
+        cybozu::load(cmprLevel, is);
+        cybozu::load(batchKb, is);
+        cybozu::load(maxChunks, is);
+        cybozu::load(isOffload, is);
+    }
+    template <typename OutputStream>
+    void saveReply(OutputStream &os, uint32_t version) const {
+        saveRequest(os, version);
+        if (!isExchanged(version)) return;
+        cybozu::save(os, maxDedupNr);
+    }
+    template <typename InputStream>
+    void loadReply(InputStream &is, uint32_t version) {
+        loadRequest(is, version);
+        if (!isExchanged(version)) return;
+        cybozu::load(maxDedupNr, is);
+    }
+};
+
+/**
+ * Receive frames of wlog-transfer as they are sent.
+ */
+class WlogFrameReceiver
+{
+private:
+    packet::Packet packet_;
+    packet::StreamControl ctrl_;
+public:
+    explicit WlogFrameReceiver(cybozu::Socket &sock)
+        : packet_(sock), ctrl_(sock) {
+    }
+    /**
+     * cd may be compressed.
+     * RETURN:
+     *   false if the input stream has reached the end.
+     */
+    bool recv(CompressedData &cd);
 };
 
 /**
  * Walb log receiver via TCP/IP connection.
+ * Any codec can be received because compressed data carry its id.
+ * isBatched must be the same as (batchSize > 0) of the sender.
  *
  * Usage:
  *   (1) call setParams() to set parameters.
@@ -81,17 +295,31 @@ private:
  */
 class WlogReceiver
 {
+public:
+    /**
+     * Give an uncompressed frame.
+     * RETURN:
+     *   false if the input stream has reached the end.
+     */
+    using FrameSource = std::function<bool(CompressedData&)>;
 private:
-    packet::Packet packet_;
-    packet::StreamControl ctrl_;
+    FrameSource source_;
     uint32_t pbs_;
     uint32_t salt_;
+    bool isBatched_;
+    AlignedArray frame_;
+    size_t frameOff_;
 public:
     static constexpr const char *NAME() { return "WlogReceiver"; }
-    WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), pbs_(pbs), salt_(salt) {
+    WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt, bool isBatched = false);
+    /**
+     * Parse frames given by source instead of receiving them.
+     */
+    WlogReceiver(FrameSource &&source, uint32_t pbs, uint32_t salt, bool isBatched = false)
+        : source_(std::move(source)), pbs_(pbs), salt_(salt)
+        , isBatched_(isBatched), frame_(), frameOff_(0) {
     }
-    bool process(CompressedData& cd);
+    bool process(CompressedData& cd) { return source_(cd); }
 
     /**
      * You must call popHeader(h) and its corresponding popIo() n times,
@@ -107,6 +335,33 @@ public:
      * You must call this for discard/padding record also.
      */
     void popIo(const WlogRecord &rec, AlignedArray &data);
+private:
+    /**
+     * For batched streams.
+     * RETURN:
+     *   false if the input stream has reached the end.
+     */
+    bool fetchFrame();
+    void readFromFrames(void *data, size_t size);
 };
 
+/**
+ * Convert walb logs into an indexed wdiff in a pipeline of stages:
+ *   (1) the caller thread receives frames by recvFrame (see WlogFrameReceiver::recv()).
+ *   (2) nrThreads threads uncompress the frames.
+ *   (3) a thread parses logpacks, verifies IO checksums, and converts them into diff records.
+ *   (4) nrThreads threads compress the IOs unless the writer deduplicates them.
+ *   (5) a thread writes the IOs and builds the index.
+ * The order is kept between stages, so the output is the same as
+ * that of WlogReceiver and IndexedDiffWriter::compressAndWriteDiff() called one after another.
+ *
+ * writer: its header must have been written. This does not finalize it.
+ * RETURN:
+ *   false if shouldStop() returned true.
+ */
+bool recvWlogAndWriteDiffInPipeline(
+    const WlogReceiver::FrameSource &recvFrame, IndexedDiffWriter &writer,
+    uint32_t pbs, uint32_t salt, bool isBatched, size_t nrThreads,
+    const std::function<bool()> &shouldStop);
+
 } //namespace walb
@@ -184,18 +184,25 @@ bool AsyncWldevReader::prepareAheadIo()
     const uint32_t aioKey = aio_.prepareRead(off, ioSize, ptr);
     assert(aioKey > 0);
     aheadLsid_ += ioPb;
-    ioQ_.push({aioKey, ioSize});
+    const ReadAheadTuner::TimePoint now = ReadAheadTuner::Clock::now();
+    ioQ_.push({aioKey, ioSize, now});
+    aheadSize_ += ioSize;
+    tuner_.submitted(ioQ_.size(), now);
     return true;
 }
 
 
 size_t AsyncWldevReader::decideIoSize() const
 {
-    if (ringBuf_.getFreeSize() < maxIoSize_) {
+    size_t ioSize = tuner_.ioSize();
+    if (aheadSize_ + ioSize > tuner_.windowSize()) {
+        /* Enough IOs are in flight. */
+        return 0;
+    }
+    if (ringBuf_.getFreeSize() < ioSize) {
         /* There is not enough free space. */
         return 0;
     }
-    size_t ioSize = maxIoSize_;
     /* Log device ring buffer edge. */
     uint64_t s = super_.getRingBufferSize();
     s = s - aheadLsid_ % s;
@@ -18,6 +18,7 @@
 #include "aio_util.hpp"
 #include "bdev_util.hpp"
 #include "bdev_reader.hpp"
+#include "read_ahead.hpp"
 #include "random.hpp"
 #include "linux/walb/super.h"
 #include "linux/walb/log_device.h"
@@ -261,7 +262,6 @@ class AsyncWldevReader
 private:
     cybozu::util::File file_;
     const size_t pbs_;
-    const size_t maxIoSize_;
 
     SuperBlock super_;
     cybozu::aio::Aio aio_;
@@ -272,10 +272,14 @@ private:
     {
         uint32_t key;
         size_t size;
+        ReadAheadTuner::TimePoint ts; // submitted time.
     };
     std::queue<Io> ioQ_;
+    size_t aheadSize_; // total size of ioQ_.
 
     uint64_t readAheadPb_; // read ahead size [physical block]
+    ReadAheadTuner tuner_;
+    ReadAheadMonitor *monitor_;
 
     static constexpr size_t DEFAULT_BUFFER_SIZE = 4U << 20; /* 4MiB */
     static constexpr size_t DEFAULT_MAX_IO_SIZE = 64U << 10; /* 64KiB. */
@@ -283,26 +287,30 @@ public:
     static constexpr const char *NAME() { return "AsyncWldevReader"; }
     /**
      * @wldevPath walb log device path.
-     * @bufferSize buffer size to read ahead [byte].
+     * @bufferSize max size to read ahead [byte].
      * @maxIoSize max IO size [byte].
+     * The IO size and the read-ahead size are decided by ReadAheadTuner within them.
      */
     AsyncWldevReader(cybozu::util::File &&wldevFile,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
                      size_t maxIoSize = DEFAULT_MAX_IO_SIZE)
         : file_(std::move(wldevFile))
         , pbs_(cybozu::util::getPhysicalBlockSize(file_.fd()))
-        , maxIoSize_(maxIoSize)
         , super_()
-        , aio_(file_.fd(), bufferSize / pbs_ + 1)
+        , aio_(file_.fd(), ReadAheadTuner::getMaxQueueDepth(bufferSize, maxIoSize, pbs_))
         , aheadLsid_(0)
         , ringBuf_()
         , ioQ_()
-        , readAheadPb_(UINT64_MAX) {
+        , aheadSize_(0)
+        , readAheadPb_(UINT64_MAX)
+        , tuner_(bufferSize, maxIoSize, pbs_)
+        , monitor_(nullptr) {
         assert(pbs_ != 0);
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
-        verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
+        verifyMultiple(maxIoSize, pbs_, "bad maxIoSize");
         super_.read(file_.fd());
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.data(), ringBuf_.capacity());
     }
     AsyncWldevReader(const std::string &wldevPath,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
@@ -318,14 +326,21 @@ public:
             } catch (...) {
             }
         }
+        if (monitor_) monitor_->set(tuner_.getStat());
     }
     SuperBlock &super() { return super_; }
     /**
      * Reset current IOs and start read from a lsid.
+     * The IO size and the read-ahead size are kept.
      */
     void reset(uint64_t lsid, uint64_t maxSizePb = UINT64_MAX);
     void read(void *data, size_t size);
     void skip(size_t size);
+    /**
+     * The statistics will be set to the monitor periodically.
+     */
+    void setMonitor(ReadAheadMonitor *monitor) { monitor_ = monitor; }
+    ReadAheadStat getStat() const { return tuner_.getStat(); }
 private:
     void verifyMultiple(uint64_t size, size_t pbs, const char *msg) const {
         if (size == 0 || size % pbs != 0) {
@@ -336,7 +351,14 @@ private:
         assert(!ioQ_.empty());
         const Io io = ioQ_.front();
         ioQ_.pop();
+        aheadSize_ -= io.size;
+        const ReadAheadTuner::TimePoint ts = ReadAheadTuner::Clock::now();
         aio_.waitFor(io.key);
+        const ReadAheadTuner::TimePoint now = ReadAheadTuner::Clock::now();
+        if (tuner_.completed(io.size, ReadAheadTuner::elapsedUs(io.ts, now),
+                             ReadAheadTuner::elapsedUs(ts, now), now) && monitor_) {
+            monitor_->set(tuner_.getStat(now));
+        }
         return io.size;
     }
     void prepareReadableData() {
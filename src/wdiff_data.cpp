@@ -1,4 +1,6 @@
 #include "wdiff_data.hpp"
+#include "walb_diff_file.hpp"
+#include "zstd_dict.hpp"
 
 namespace walb {
 
@@ -37,6 +39,19 @@ size_t WalbDiffFiles::removeDiffFiles(const MetaDiffVec &v)
     return v.size();
 }
 
+std::vector<uint32_t> WalbDiffFiles::gcZstdDicts(const std::set<uint32_t> &keptIdSet) const
+{
+    std::set<uint32_t> idSet = keptIdSet;
+    for (const std::string &fname : util::getFileNameList(dir_.str(), "wdiff")) {
+        cybozu::util::File file;
+        if (!file.open((dir_ + fname).str(), O_RDONLY)) continue; // removed meanwhile.
+        DiffFileHeader fileH;
+        fileH.readFrom(file);
+        idSet.insert(fileH.getDictId());
+    }
+    return removeZstdDictsExcept(dir_.str(), idSet);
+}
+
 void WalbDiffFiles::truncateDiffVecBySize(MetaDiffVec &v, uint64_t size) const
 {
     if (v.empty()) return;
@@ -1,6 +1,7 @@
 #pragma once
 #include <cassert>
 #include <map>
+#include <set>
 #include <vector>
 #include <mutex>
 #include <time.h>
@@ -155,6 +156,15 @@ public:
     void reload() {
         mgr_.reset(loadWdiffMetadata(dir_.str()));
     }
+    /**
+     * Remove the zstd dictionary files in the directory
+     * that no wdiff file in it refers to.
+     * Wdiff files not added to the manager yet are also taken into account.
+     * @keptIdSet dictionaries to keep even if no wdiff file refers to them.
+     * RETURN:
+     *   ids of the removed dictionaries. They are not unregistered.
+     */
+    std::vector<uint32_t> gcZstdDicts(const std::set<uint32_t> &keptIdSet = std::set<uint32_t>()) const;
     const cybozu::FilePath &dirPath() const {
         return dir_;
     }
@@ -1,18 +1,111 @@
 #include "wdiff_transfer.hpp"
+#include <algorithm>
 
 namespace walb {
 
-bool wdiffTransferClient(
-    packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
+namespace wdiff_transfer_local {
+
+void sendDict(packet::Packet& pkt, const ZstdDictPtr &dict)
+{
+    if (dict) {
+        pkt.write(dict->getId());
+        pkt.write(dict->data());
+    } else {
+        pkt.write(uint32_t(0));
+        pkt.write(std::string());
+    }
+}
+
+void sendIsIndexed(packet::Packet& pkt, uint32_t version, bool isIndexed)
+{
+    if (version < 2) return;
+    pkt.write(isIndexed);
+}
+
+uint64_t recvResumeAddr(packet::Packet& pkt, uint32_t version)
+{
+    if (version < 2) return 0;
+    pkt.flush();
+    uint64_t resumeAddr;
+    pkt.read(resumeAddr);
+    return resumeAddr;
+}
+
+void sendBgnAddr(packet::Packet& pkt, uint32_t version, uint64_t bgnAddr)
+{
+    if (version < 2) return;
+    pkt.write(bgnAddr);
+}
+
+} // namespace wdiff_transfer_local
+
+/**
+ * Indexed wdiff files are sent in frames of this size at most.
+ */
+constexpr size_t INDEXED_WDIFF_FRAME_SIZE = MEBI;
+
+/**
+ * Decide the dictionary to send, and let the merger keep compressed IOs if possible.
+ * canSendDict: false if some servers do not support dictionaries.
+ * dict: dictionary to send. It may be null.
+ * RETURN:
+ *   dictionary to compress IOs with. It may be null.
+ */
+static ZstdDictPtr prepareDict(
+    DiffMerger &merger, const CompressOpt &cmpr, const ZstdDictPtr &cmprDict, bool canSendDict, ZstdDictPtr &dict)
+{
+    const uint32_t refDictId = merger.getDictId();
+    if (!canSendDict) {
+        dict = nullptr;
+        merger.setKeepCompressed(refDictId == 0);
+        return nullptr;
+    }
+    const ZstdDictPtr usedCmprDict = cmpr.type == ::WALB_DIFF_CMPR_ZSTD ? cmprDict : nullptr;
+    dict = usedCmprDict;
+    if (!dict && refDictId != 0) dict = getZstdDictRegistry().getOrThrow(refDictId);
+
+    // Non-overlapped records will be sent without recompression
+    // unless they may refer to another dictionary.
+    merger.setKeepCompressed(refDictId == 0 || refDictId == dict->getId());
+    return usedCmprDict;
+}
+
+/**
+ * Remove the IO portion before bgnAddr from recIo.
+ * RETURN:
+ *   false if nothing remains.
+ */
+static bool trimDiffRecIo(DiffRecIo &recIo, uint64_t bgnAddr)
+{
+    const DiffRecord &rec = recIo.record();
+    if (rec.endIoAddress() <= bgnAddr) return false;
+    if (bgnAddr <= rec.io_address) return true;
+    recIo.uncompress();
+    DiffRecord headRec;
+    headRec.init();
+    headRec.io_address = rec.io_address;
+    headRec.io_blocks = bgnAddr - rec.io_address;
+    headRec.setDiscard();
+    std::vector<DiffRecIo> v = recIo.minus(DiffRecIo(headRec, AlignedArray()));
+    assert(v.size() == 1);
+    recIo = std::move(v[0]);
+    return true;
+}
+
+/**
+ * Merge IOs, pack and compress them, and call send(compressor::Buffer &&) for each pack in order.
+ * IOs before bgnAddr are skipped.
+ * RETURN:
+ *   false if force stopped.
+ */
+template <typename Send>
+static bool mergeAndCompress(
+    DiffMerger &merger, const CompressOpt &cmpr, const ZstdDictPtr &usedCmprDict,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    DiffStatistics &statOut)
+    ZstdDictTrainer *trainer, uint64_t bgnAddr, Send send)
 {
     const size_t maxPushedNum = cmpr.numCpu * 2 + 1;
-    ConverterQueue conv(maxPushedNum, cmpr.numCpu, true, cmpr.type, cmpr.level);
-    statOut.clear();
-    statOut.wdiffNr = -1;
-    packet::StreamControl ctrl(pkt.sock());
-
+    ConverterQueue conv(maxPushedNum, cmpr.numCpu, true, cmpr.type, cmpr.level, usedCmprDict);
     DiffRecIo recIo;
     DiffPacker packer;
     size_t pushedNum = 0;
@@ -20,15 +113,19 @@ bool wdiffTransferClient(
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
+        if (!trimDiffRecIo(recIo, bgnAddr)) continue;
         const DiffRecord& rec = recIo.record();
         const AlignedArray& buf = recIo.io();
+        if (trainer && rec.isNormal() && !rec.isCompressed()) {
+            trainer->add(buf.data(), buf.size());
+        }
         if (packer.add(rec, buf.data())) continue;
         conv.push(packer.getPackAsArray());
         pushedNum++;
         packer.clear();
         packer.add(rec, buf.data());
         if (pushedNum < maxPushedNum) continue;
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, conv.pop());
+        send(conv.pop());
         pushedNum--;
     }
     if (!packer.empty()) {
@@ -36,14 +133,217 @@ bool wdiffTransferClient(
     }
     conv.quit();
     for (compressor::Buffer pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        send(std::move(pack));
     }
+    return true;
+}
+
+bool wdiffTransferClient(
+    packet::Packet &pkt, uint32_t version, DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, const ZstdDictPtr &cmprDict, ZstdDictTrainer *trainer)
+{
+    const bool hasDict = version >= 2;
+    ZstdDictPtr dict;
+    const ZstdDictPtr usedCmprDict = prepareDict(merger, cmpr, cmprDict, hasDict, dict);
+    if (hasDict) wdiff_transfer_local::sendDict(pkt, dict);
+    wdiff_transfer_local::sendIsIndexed(pkt, version, false);
+    const uint64_t bgnAddr = wdiff_transfer_local::recvResumeAddr(pkt, version);
+    wdiff_transfer_local::sendBgnAddr(pkt, version, bgnAddr);
+
+    statOut.clear();
+    statOut.wdiffNr = -1;
+    packet::SocketBuffer sockBuf(pkt.sock());
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
+    const bool ret = mergeAndCompress(
+        merger, cmpr, usedCmprDict, stopState, ps, trainer, bgnAddr, [&](compressor::Buffer &&pack) {
+            wdiff_transfer_local::sendPack(bufPkt, ctrl, statOut, pack);
+        });
+    if (!ret) return false;
     ctrl.end();
-    pkt.flush();
+    bufPkt.flush();
+    return true;
+}
+
+
+bool wdiffTransferMultiClient(
+    const std::vector<packet::Packet *> &pktV, const std::vector<uint32_t> &versionV,
+    DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, std::vector<std::exception_ptr> &epV,
+    const ZstdDictPtr &cmprDict, ZstdDictTrainer *trainer, cybozu::util::File *cacheFile)
+{
+    const char *const FUNC = __func__;
+    using PackPtr = std::shared_ptr<const compressor::Buffer>;
+    using PackQueue = cybozu::thread::BoundedQueue<PackPtr>;
+    const size_t nr = pktV.size();
+    const size_t qSize = cmpr.numCpu * 2 + 1;
+    if (versionV.size() != nr) throw cybozu::Exception(FUNC) << "bad versionV size" << versionV.size() << nr;
+
+    // The stream is shared, so it refers to a dictionary only if all the servers support it.
+    const bool canSendDict = std::all_of(versionV.begin(), versionV.end(), [](uint32_t v) { return v >= 2; });
+    ZstdDictPtr dict;
+    const ZstdDictPtr usedCmprDict = prepareDict(merger, cmpr, cmprDict, canSendDict, dict);
+    epV.assign(cacheFile ? nr + 1 : nr, std::exception_ptr());
+    bool isCaching = false;
+    if (cacheFile) {
+        try {
+            writeDiffFileHeader(*cacheFile, merger.header().getUuid(), dict ? dict->getId() : 0);
+            isCaching = true;
+        } catch (...) {
+            epV[nr] = std::current_exception();
+        }
+    }
+    std::vector<std::unique_ptr<PackQueue> > qV;
+    std::vector<bool> isSendingV(nr, false);
+    std::vector<cybozu::thread::ThreadRunner> thV;
+    for (size_t i = 0; i < nr; i++) {
+        qV.emplace_back(new PackQueue(qSize));
+    }
+    std::vector<uint64_t> resumeAddrV(nr, 0);
+    for (size_t i = 0; i < nr; i++) {
+        try {
+            if (versionV[i] >= 2) wdiff_transfer_local::sendDict(*pktV[i], dict);
+            wdiff_transfer_local::sendIsIndexed(*pktV[i], versionV[i], false);
+            resumeAddrV[i] = wdiff_transfer_local::recvResumeAddr(*pktV[i], versionV[i]);
+            isSendingV[i] = true;
+        } catch (...) {
+            epV[i] = std::current_exception();
+        }
+    }
+    // The stream is shared, so it resumes only if all the servers agree.
+    // Servers of version 1 always ask for the whole stream.
+    uint64_t bgnAddr = UINT64_MAX;
+    for (size_t i = 0; i < nr; i++) {
+        if (!isSendingV[i]) continue;
+        if (bgnAddr == UINT64_MAX) {
+            bgnAddr = resumeAddrV[i];
+        } else if (bgnAddr != resumeAddrV[i]) {
+            bgnAddr = 0;
+        }
+    }
+    if (bgnAddr == UINT64_MAX || isCaching) bgnAddr = 0;
+    for (size_t i = 0; i < nr; i++) {
+        if (!isSendingV[i]) continue;
+        try {
+            wdiff_transfer_local::sendBgnAddr(*pktV[i], versionV[i], bgnAddr);
+        } catch (...) {
+            epV[i] = std::current_exception();
+            isSendingV[i] = false;
+            continue;
+        }
+        thV.emplace_back([&, i]() {
+                try {
+                    packet::SocketBuffer sockBuf(pktV[i]->sock());
+                    packet::Packet bufPkt(sockBuf);
+                    packet::StreamControl ctrl(bufPkt);
+                    DiffStatistics stat;
+                    PackPtr pack;
+                    while (qV[i]->pop(pack)) {
+                        wdiff_transfer_local::sendPack(bufPkt, ctrl, stat, *pack);
+                        pack.reset();
+                    }
+                    ctrl.end();
+                    bufPkt.flush();
+                } catch (...) {
+                    epV[i] = std::current_exception();
+                    qV[i]->fail();
+                }
+            });
+        thV.back().start();
+    }
+    auto failAll = [&]() {
+        for (std::unique_ptr<PackQueue> &q : qV) q->fail();
+        for (cybozu::thread::ThreadRunner &th : thV) th.joinNoThrow();
+    };
+
+    statOut.clear();
+    statOut.wdiffNr = -1;
+    bool ret;
+    try {
+        ret = mergeAndCompress(
+            merger, cmpr, usedCmprDict, stopState, ps, trainer, bgnAddr, [&](compressor::Buffer &&pack) {
+                statOut.update(*reinterpret_cast<const DiffPackHeader*>(pack.data()));
+                if (isCaching) {
+                    try {
+                        cacheFile->write(pack.data(), pack.size());
+                    } catch (...) {
+                        epV[nr] = std::current_exception();
+                        isCaching = false;
+                    }
+                }
+                const PackPtr packP = std::make_shared<const compressor::Buffer>(std::move(pack));
+                bool isSending = false;
+                for (size_t i = 0; i < nr; i++) {
+                    if (!isSendingV[i]) continue;
+                    try {
+                        qV[i]->push(packP);
+                        isSending = true;
+                    } catch (PackQueue::FailedError &) {
+                        isSendingV[i] = false;
+                    }
+                }
+                if (!isSending && !isCaching) {
+                    throw cybozu::Exception(FUNC) << "all the servers failed";
+                }
+            });
+    } catch (...) {
+        failAll();
+        throw;
+    }
+    if (!ret) {
+        failAll();
+        return false;
+    }
+    for (size_t i = 0; i < nr; i++) {
+        try {
+            qV[i]->sync();
+        } catch (PackQueue::FailedError &) {
+        }
+    }
+    for (cybozu::thread::ThreadRunner &th : thV) th.joinNoThrow();
+    if (isCaching) {
+        try {
+            writeDiffEofPack(*cacheFile);
+        } catch (...) {
+            epV[nr] = std::current_exception();
+        }
+    }
+    if (std::none_of(epV.begin(), epV.end(), [](const std::exception_ptr &ep) { return !ep; })) {
+        throw cybozu::Exception(FUNC) << "all the servers failed";
+    }
     return true;
 }
 
 
+/**
+ * Seek a sorted wdiff file to the pack next to the one whose last IO ends at addr.
+ * The file position must be a pack header. It is not changed if no such pack exists.
+ */
+static bool seekSortedWdiffTo(cybozu::util::File &fileR, uint64_t addr)
+{
+    const off_t off0 = fileR.lseek(0, SEEK_CUR);
+    AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+    DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+    for (;;) {
+        try {
+            packH.readFrom(fileR);
+        } catch (cybozu::util::EofError &) {
+            break;
+        }
+        if (packH.isEnd()) break;
+        fileR.lseek(packH.total_size, SEEK_CUR);
+        if (packH.n_records == 0) continue;
+        const uint64_t endAddr = packH[packH.n_records - 1].endIoAddress();
+        if (endAddr == addr) return true;
+        if (endAddr > addr) break;
+    }
+    fileR.lseek(off0);
+    return false;
+}
+
+
 /**
  * This function supports only sorted wdiff files.
  */
@@ -51,7 +351,9 @@ static bool sortedWdiffTransferNoMergeClient(
     packet::Packet &pkt, cybozu::util::File &fileR,
     const std::atomic<int> &stopState, const ProcessStatus &ps)
 {
-    packet::StreamControl ctrl(pkt.sock());
+    packet::SocketBuffer sockBuf(pkt.sock());
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
     AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
     DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
     DiffStatistics statOut;
@@ -70,10 +372,10 @@ static bool sortedWdiffTransferNoMergeClient(
         ::memcpy(pack.data(), packHBuf.data(), packHBuf.size());
         fileR.read(pack.data() + WALB_DIFF_PACK_SIZE, packH.total_size);
         verifyDiffPack(pack.data(), pack.size(), true);
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        wdiff_transfer_local::sendPack(bufPkt, ctrl, statOut, pack);
     }
     ctrl.end();
-    pkt.flush();
+    bufPkt.flush();
     return true;
 }
 
@@ -84,7 +386,9 @@ static bool indexedWdiffTransferNoMergeClient(
 {
     const size_t maxPushedNum = cmpr.numCpu * 2 + 1;
     ConverterQueue conv(maxPushedNum, cmpr.numCpu, true, cmpr.type, cmpr.level);
-    packet::StreamControl ctrl(pkt.sock());
+    packet::SocketBuffer sockBuf(pkt.sock());
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
     DiffStatistics statOut;
 
     IndexedDiffRecord irec;
@@ -105,7 +409,7 @@ static bool indexedWdiffTransferNoMergeClient(
             rec.data_offset = 0; // updated later.
             rec.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
             rec.checksum = irec.io_checksum;
-            dataPtr = data.data() + (irec.io_offset * LOGICAL_BLOCK_SIZE);
+            dataPtr = data.data(); // io_offset has been applied by the reader.
         }
 
         if (packer.add(rec, dataPtr)) continue;
@@ -114,7 +418,7 @@ static bool indexedWdiffTransferNoMergeClient(
         packer.clear();
         packer.add(rec, dataPtr);
         if (pushedNum < maxPushedNum) continue;
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, conv.pop());
+        wdiff_transfer_local::sendPack(bufPkt, ctrl, statOut, conv.pop());
         pushedNum--;
     }
     if (!packer.empty()) {
@@ -122,19 +426,76 @@ static bool indexedWdiffTransferNoMergeClient(
     }
     conv.quit();
     for (compressor::Buffer pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        wdiff_transfer_local::sendPack(bufPkt, ctrl, statOut, pack);
     }
     ctrl.end();
-    pkt.flush();
+    bufPkt.flush();
+    return true;
+}
+
+
+/**
+ * Send the whole file including the header as it is.
+ */
+static bool indexedWdiffTransferAsIsClient(
+    packet::Packet &pkt, cybozu::util::File &fileR,
+    const std::atomic<int> &stopState, const ProcessStatus &ps)
+{
+    packet::SocketBuffer sockBuf(pkt.sock());
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
+    AlignedArray buf(INDEXED_WDIFF_FRAME_SIZE, false);
+    fileR.lseek(0, SEEK_SET);
+    for (;;) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        size_t size = 0;
+        while (size < buf.size()) {
+            const size_t s = fileR.readsome(&buf[size], buf.size() - size);
+            if (s == 0) break;
+            size += s;
+        }
+        if (size == 0) break;
+        ctrl.next();
+        bufPkt.write<size_t>(size);
+        bufPkt.write(buf.data(), size);
+    }
+    ctrl.end();
+    bufPkt.flush();
     return true;
 }
 
 
 bool wdiffTransferNoMergeClient(
-    packet::Packet &pkt, cybozu::util::File &fileR, const DiffFileHeader &fileH,
+    packet::Packet &pkt, uint32_t version, cybozu::util::File &fileR, const DiffFileHeader &fileH,
     const std::atomic<int> &stopState, const ProcessStatus &ps)
 {
-    if (fileH.isIndexed()) {
+    const uint32_t dictId = fileH.getDictId();
+    if (version < 2 && dictId != 0) {
+        // The server can not refer to the dictionary, so IOs are recompressed without it.
+        std::vector<cybozu::util::File> fileV;
+        fileR.lseek(0, SEEK_SET);
+        fileV.push_back(std::move(fileR));
+        DiffMerger merger;
+        merger.addWdiffs(std::move(fileV));
+        merger.prepare();
+        DiffStatistics statOut;
+        return wdiffTransferClient(pkt, version, merger, CompressOpt(), stopState, ps, statOut);
+    }
+    const bool sendsIndexed = version >= 2 && fileH.isIndexed();
+    if (version >= 2) {
+        wdiff_transfer_local::sendDict(pkt, dictId == 0 ? nullptr : getZstdDictRegistry().getOrThrow(dictId));
+    }
+    wdiff_transfer_local::sendIsIndexed(pkt, version, sendsIndexed);
+    const uint64_t resumeAddr = wdiff_transfer_local::recvResumeAddr(pkt, version);
+    // Indexed wdiffs are sent from the beginning always.
+    const bool canResume = resumeAddr != 0 && !fileH.isIndexed() && seekSortedWdiffTo(fileR, resumeAddr);
+    wdiff_transfer_local::sendBgnAddr(pkt, version, canResume ? resumeAddr : 0);
+    if (sendsIndexed) {
+        // This does not touch index records and IO data, so deduplicated IOs are kept.
+        return indexedWdiffTransferAsIsClient(pkt, fileR, stopState, ps);
+    } else if (fileH.isIndexed()) {
         CompressOpt cmpr; // default value.
         IndexedDiffReader reader;
         IndexedDiffCache cache;
@@ -148,26 +509,110 @@ bool wdiffTransferNoMergeClient(
 }
 
 
+ZstdDictPtr wdiffTransferRecvDict(packet::Packet &pkt, uint32_t version)
+{
+    const char *const FUNC = __func__;
+    if (version < 2) return nullptr;
+    uint32_t dictId;
+    std::string data;
+    pkt.read(dictId);
+    pkt.read(data);
+    if (dictId == 0) return nullptr;
+    if (data.size() > MAX_ZSTD_DICT_SIZE) {
+        throw cybozu::Exception(FUNC) << "too large dictionary" << data.size();
+    }
+    ZstdDictPtr dict = std::make_shared<const ZstdDict>(std::move(data));
+    if (dict->getId() != dictId) {
+        throw cybozu::Exception(FUNC) << "dictionary id differ" << dict->getId() << dictId;
+    }
+    return dict;
+}
+
+
+bool wdiffTransferRecvIsIndexed(packet::Packet &pkt, uint32_t version)
+{
+    if (version < 2) return false;
+    bool isIndexed;
+    pkt.read(isIndexed);
+    return isIndexed;
+}
+
+
+uint64_t wdiffTransferNegotiateResume(packet::Packet &pkt, uint32_t version, uint64_t resumeAddr)
+{
+    if (version < 2) return 0;
+    pkt.write(resumeAddr);
+    pkt.flush();
+    uint64_t bgnAddr;
+    pkt.read(bgnAddr);
+    if (bgnAddr != 0 && bgnAddr != resumeAddr) {
+        throw cybozu::Exception(__func__) << "bad bgnAddr" << bgnAddr << resumeAddr;
+    }
+    return bgnAddr;
+}
+
+
+uint64_t wdiffTransferScanPartial(cybozu::util::File &file, uint64_t &validSize, SortedDiffIndexMem &indexMem)
+{
+    indexMem.clear();
+    validSize = file.lseek(0, SEEK_CUR);
+    uint64_t endAddr = 0;
+    AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+    DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+    AlignedArray pack;
+    for (;;) {
+        try {
+            packH.readFrom(file);
+            if (packH.isEnd()) break;
+            verifyDiffPackSize(packH.wholePackSize(), __func__);
+            pack.resize(packH.wholePackSize());
+            ::memcpy(pack.data(), packHBuf.data(), packHBuf.size());
+            file.read(pack.data() + WALB_DIFF_PACK_SIZE, packH.total_size);
+            verifyDiffPack(pack.data(), pack.size(), true);
+        } catch (std::exception &) {
+            // The pack has not been written durably.
+            break;
+        }
+        if (packH.n_records > 0) {
+            if (packH[0].io_address < endAddr) break; // not sorted.
+            endAddr = packH[packH.n_records - 1].endIoAddress();
+        }
+        indexMem.add(packH, validSize);
+        validSize += pack.size();
+    }
+    return endAddr;
+}
+
+
 bool wdiffTransferServer(
     packet::Packet &pkt, int wdiffOutFd,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize)
+    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize,
+    const SortedDiffIndexMem &indexMem0)
 {
     const char *const FUNC = __func__;
     cybozu::util::File fileW(wdiffOutFd);
+    SortedDiffIndexMem indexMem = indexMem0;
+    uint64_t offset = fileW.lseek(0, SEEK_CUR);
     AlignedArray buf;
-    packet::StreamControl ctrl(pkt.sock());
+    // Clients send nothing after the stream until they receive an ack,
+    // so reading ahead is safe.
+    packet::SocketBuffer sockBuf(pkt.sock(), 0, packet::DEFAULT_READ_BUFFER_SIZE);
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
     uint64_t writeSize = 0;
     while (ctrl.isNext()) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
         size_t size;
-        pkt.read(size);
+        bufPkt.read(size);
         verifyDiffPackSize(size, FUNC);
         buf.resize(size);
-        pkt.read(buf.data(), buf.size());
+        bufPkt.read(buf.data(), buf.size());
         verifyDiffPack(buf.data(), buf.size(), true);
         fileW.write(buf.data(), buf.size());
+        indexMem.add(*reinterpret_cast<const DiffPackHeader *>(buf.data()), offset);
+        offset += buf.size();
         writeSize += buf.size();
         if (writeSize >= fsyncIntervalSize) {
             fileW.fdatasync();
@@ -179,6 +624,63 @@ bool wdiffTransferServer(
         throw cybozu::Exception(FUNC) << "bad ctrl not end";
     }
     writeDiffEofPack(fileW);
+    indexMem.writeTo(fileW, offset + WALB_DIFF_PACK_SIZE);
+    return true;
+}
+
+
+bool wdiffTransferIndexedServer(
+    packet::Packet &pkt, int wdiffOutFd, const cybozu::Uuid &uuid, uint32_t dictId,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize)
+{
+    const char *const FUNC = __func__;
+    cybozu::util::File fileW(wdiffOutFd);
+    AlignedArray buf;
+    packet::SocketBuffer sockBuf(pkt.sock(), 0, packet::DEFAULT_READ_BUFFER_SIZE);
+    packet::Packet bufPkt(sockBuf);
+    packet::StreamControl ctrl(bufPkt);
+    uint64_t writeSize = 0;
+    while (ctrl.isNext()) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        size_t size;
+        bufPkt.read(size);
+        if (size == 0 || size > INDEXED_WDIFF_FRAME_SIZE) {
+            throw cybozu::Exception(FUNC) << "bad frame size" << size;
+        }
+        buf.resize(size);
+        bufPkt.read(buf.data(), buf.size());
+        fileW.write(buf.data(), buf.size());
+        writeSize += buf.size();
+        if (writeSize >= fsyncIntervalSize) {
+            fileW.fdatasync();
+            writeSize = 0;
+        }
+        ctrl.reset();
+    }
+    if (!ctrl.isEnd()) {
+        throw cybozu::Exception(FUNC) << "bad ctrl not end";
+    }
+
+    // Deduplicated IOs refer to others by offsets, so all the records and IO data are verified.
+    IndexedDiffCache cache;
+    IndexedDiffReader reader;
+    reader.setFile(cybozu::util::File(wdiffOutFd), cache);
+    const DiffFileHeader &fileH = reader.header();
+    if (fileH.getUuid() != uuid) {
+        throw cybozu::Exception(FUNC) << "uuid differs" << fileH.getUuid() << uuid;
+    }
+    if (fileH.getDictId() != dictId) {
+        throw cybozu::Exception(FUNC) << "dictionary id differs" << fileH.getDictId() << dictId;
+    }
+    IndexedDiffRecord rec;
+    while (reader.readDiffRecord(rec, true)) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        reader.verifyIo(rec);
+    }
     return true;
 }
 
@@ -4,6 +4,7 @@
 #include "walb_diff_merge.hpp"
 #include "walb_diff_compressor.hpp"
 #include "walb_diff_pack.hpp"
+#include "zstd_dict.hpp"
 #include "server_util.hpp"
 #include "host_info.hpp"
 
@@ -20,32 +21,154 @@ inline void sendPack(packet::Packet& pkt, packet::StreamControl& ctrl, DiffStati
     statOut.update(*reinterpret_cast<const DiffPackHeader*>(pack.data()));
 }
 
+/**
+ * dict: may be null.
+ */
+void sendDict(packet::Packet& pkt, const ZstdDictPtr &dict);
+
+/**
+ * Tell the server whether the stream is an indexed wdiff file sent as it is.
+ * Call this after sendDict(). Nothing is sent if version is less than 2.
+ */
+void sendIsIndexed(packet::Packet& pkt, uint32_t version, bool isIndexed);
+
+/**
+ * Resume negotiation of the client side. Call these after sendDict().
+ * The server reports the address the stream can resume from,
+ * and the client replies the address it will start from, that is the reported one or 0.
+ * Nothing is exchanged if version is less than 2, and the stream starts from 0.
+ */
+uint64_t recvResumeAddr(packet::Packet& pkt, uint32_t version);
+void sendBgnAddr(packet::Packet& pkt, uint32_t version, uint64_t bgnAddr);
+
 } // namespace wdiff_transfer_local
 
 /**
+ * A zstd dictionary is sent once at the beginning of a session.
+ * IOs in the stream refer to it only.
+ * Then the stream starts from the address the server asks to resume from.
+ * The stream consists of sorted diff packs.
+ *
+ * version: version of the connection.
+ *   If it is less than 2, the dictionary is not sent, IOs refer to no dictionary,
+ *   and the stream does not resume.
+ * cmprDict: dictionary to compress IOs with zstd. It may be null.
+ * trainer: if not null, uncompressed IOs will be sampled to it.
+ *
  * RETURN:
  *   false if force stopped.
  */
 bool wdiffTransferClient(
-    packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
+    packet::Packet &pkt, uint32_t version, DiffMerger &merger, const CompressOpt &cmpr,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    DiffStatistics &statOut);
+    DiffStatistics &statOut, const ZstdDictPtr &cmprDict = nullptr,
+    ZstdDictTrainer *trainer = nullptr);
+
+/**
+ * Send the same stream as wdiffTransferClient() to multiple servers.
+ * The merge and compression run once and each server has its own sender thread.
+ * A server that failed is left behind and the others continue.
+ *
+ * The stream resumes only if all the servers asked to resume from the same address
+ * and cacheFile is null.
+ * versionV: versionV[i] is the version of pktV[i].
+ *   IOs refer to no dictionary and the stream does not resume if some of them are less than 2.
+ * epV: epV[i] will be the error of pktV[i], or null if it has received the whole stream.
+ * cacheFile: if not null, the stream is also written to it as a sorted wdiff
+ *   that wdiffTransferNoMergeClient() can send later.
+ *   epV[pktV.size()] will be the error of writing it.
+ *   The merge goes on to complete it even if all the servers failed.
+ * RETURN:
+ *   false if force stopped.
+ *   It throws an error if all the servers and the cache file failed.
+ */
+bool wdiffTransferMultiClient(
+    const std::vector<packet::Packet *> &pktV, const std::vector<uint32_t> &versionV,
+    DiffMerger &merger, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, std::vector<std::exception_ptr> &epV,
+    const ZstdDictPtr &cmprDict = nullptr, ZstdDictTrainer *trainer = nullptr,
+    cybozu::util::File *cacheFile = nullptr);
 
 /**
  * fileH: the position must be the first pack header.
+ *   The dictionary it refers to must have been registered.
+ * The stream resumes only if the file is sorted
+ * and the address the server asks to resume from is at a pack boundary of it.
+ * An indexed file is sent as it is, so deduplicated IOs stay deduplicated in the server.
+ * If version is less than 2, the stream does not resume, an indexed file is converted to sorted packs,
+ * and IOs are recompressed without the dictionary if the file refers to one.
  */
 bool wdiffTransferNoMergeClient(
-    packet::Packet &pkt, cybozu::util::File &fileR, const DiffFileHeader &fileH,
+    packet::Packet &pkt, uint32_t version, cybozu::util::File &fileR, const DiffFileHeader &fileH,
     const std::atomic<int> &stopState, const ProcessStatus &ps);
 
+/**
+ * Receive the dictionary sent by a client.
+ * This must be called before writing the wdiff header.
+ * Clients of version less than 2 send no dictionary.
+ * The caller must register it and save it with the wdiff.
+ *
+ * RETURN:
+ *   dictionary whose id to put in the wdiff header. nullptr means none.
+ */
+ZstdDictPtr wdiffTransferRecvDict(packet::Packet &pkt, uint32_t version);
+
+/**
+ * Call this after wdiffTransferRecvDict().
+ * Clients of version less than 2 send sorted packs always.
+ * RETURN:
+ *   true if the client sends an indexed wdiff file as it is.
+ *   Receive it by wdiffTransferIndexedServer() then.
+ */
+bool wdiffTransferRecvIsIndexed(packet::Packet &pkt, uint32_t version);
+
+/**
+ * Resume negotiation of the server side. Call this after wdiffTransferRecvDict().
+ * Clients of version less than 2 do not resume, so nothing is exchanged and 0 is returned.
+ * resumeAddr: the address to resume from. 0 means the whole stream.
+ * RETURN:
+ *   the address the client starts the stream from, that is resumeAddr or 0.
+ *   IOs of the stream do not cover any address before it.
+ */
+uint64_t wdiffTransferNegotiateResume(packet::Packet &pkt, uint32_t version, uint64_t resumeAddr);
+
+/**
+ * Scan a partially received sorted wdiff to resume the transfer.
+ * The file position must be the first pack header.
+ * The scan stops at the first broken pack or the end pack.
+ *
+ * validSize: will be the size of the file header and the valid packs.
+ * indexMem: will be the pack index of the valid packs.
+ * RETURN:
+ *   end address of the last IO in the valid packs. 0 if there is no valid IO.
+ */
+uint64_t wdiffTransferScanPartial(cybozu::util::File &file, uint64_t &validSize, SortedDiffIndexMem &indexMem);
+
 /**
  * Wdiff header must have been written already before calling this.
+ * The pack index is appended to the output if it is a regular file.
  *
+ * indexMem: pack index of the packs already in the output when resuming.
  * RETURN:
  *   false if force stopped.
  */
 bool wdiffTransferServer(
     packet::Packet &pkt, int wdiffOutFd,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize,
+    const SortedDiffIndexMem &indexMem = SortedDiffIndexMem());
+
+/**
+ * Receive an indexed wdiff file sent as it is, and verify it.
+ * Indexed streams do not resume, so call wdiffTransferNegotiateResume() with 0 before this.
+ *
+ * wdiffOutFd: an empty regular file. The wdiff header is also received.
+ * uuid, dictId: the header must have them.
+ * RETURN:
+ *   false if force stopped.
+ */
+bool wdiffTransferIndexedServer(
+    packet::Packet &pkt, int wdiffOutFd, const cybozu::Uuid &uuid, uint32_t dictId,
     const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize);
 
 } // namespace walb
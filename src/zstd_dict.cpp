@@ -0,0 +1,175 @@
+#define ZSTD_STATIC_LINKING_ONLY // for ZSTD_getDictID_fromFrame().
+#include "zstd_dict.hpp"
+#include "dictBuilder/zdict.h"
+#include <cstdlib>
+#include "walb_util.hpp"
+
+namespace walb {
+
+ZstdDict::ZstdDict(std::string &&data)
+    : data_(std::move(data)), id_(0), cflag_(), dflag_(), cdict_(nullptr), ddict_(nullptr)
+{
+    id_ = ::ZDICT_getDictID(data_.data(), data_.size());
+    if (id_ == 0) {
+        throw cybozu::Exception("ZstdDict:invalid dictionary") << data_.size();
+    }
+}
+
+ZstdDict::~ZstdDict() noexcept
+{
+    ::ZSTD_freeCDict(cdict_);
+    ::ZSTD_freeDDict(ddict_);
+}
+
+const ::ZSTD_CDict* ZstdDict::cdict() const
+{
+    std::call_once(cflag_, [this]() {
+            cdict_ = ::ZSTD_createCDict(data_.data(), data_.size(), ZSTD_DICT_CMPR_LEVEL);
+        });
+    if (cdict_ == nullptr) throw cybozu::Exception("ZstdDict:ZSTD_createCDict failed") << id_;
+    return cdict_;
+}
+
+const ::ZSTD_DDict* ZstdDict::ddict() const
+{
+    std::call_once(dflag_, [this]() {
+            ddict_ = ::ZSTD_createDDict(data_.data(), data_.size());
+        });
+    if (ddict_ == nullptr) throw cybozu::Exception("ZstdDict:ZSTD_createDDict failed") << id_;
+    return ddict_;
+}
+
+ZstdDictPtr ZstdDictRegistry::add(std::string &&data)
+{
+    const uint32_t id = ::ZDICT_getDictID(data.data(), data.size());
+    ZstdDictPtr dict = get(id);
+    if (dict) {
+        if (dict->data() != data) {
+            throw cybozu::Exception("ZstdDictRegistry:add:id conflict") << id;
+        }
+        return dict;
+    }
+    return add(std::make_shared<const ZstdDict>(std::move(data)));
+}
+
+ZstdDictPtr ZstdDictRegistry::add(const ZstdDictPtr &dict)
+{
+    assert(dict);
+    std::lock_guard<std::mutex> lk(mu_);
+    auto pair = map_.emplace(dict->getId(), dict);
+    if (!pair.second && pair.first->second->data() != dict->data()) {
+        throw cybozu::Exception("ZstdDictRegistry:add:id conflict") << dict->getId();
+    }
+    return pair.first->second;
+}
+
+ZstdDictPtr ZstdDictRegistry::get(uint32_t id) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = map_.find(id);
+    if (it == map_.end()) return nullptr;
+    return it->second;
+}
+
+ZstdDictPtr ZstdDictRegistry::getOrThrow(uint32_t id) const
+{
+    ZstdDictPtr dict = get(id);
+    if (!dict) throw cybozu::Exception("ZstdDictRegistry:dictionary not found") << id;
+    return dict;
+}
+
+void ZstdDictRegistry::remove(uint32_t id)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    map_.erase(id);
+}
+
+ZstdDictRegistry& getZstdDictRegistry()
+{
+    static ZstdDictRegistry registry;
+    return registry;
+}
+
+uint32_t getZstdFrameDictId(const void *src, size_t size)
+{
+    return ::ZSTD_getDictID_fromFrame(src, size);
+}
+
+void ZstdDictTrainer::add(const void *data, size_t size)
+{
+    // Too large samples do not help small IOs.
+    const size_t maxSampleSize = 128 * KIBI;
+    if (isFull() || size == 0) return;
+    size = std::min(size, maxSampleSize);
+    samples_.append(static_cast<const char *>(data), size);
+    sizeV_.push_back(size);
+}
+
+ZstdDictPtr ZstdDictTrainer::train() const
+{
+    if (sizeV_.empty()) return nullptr;
+    std::string dict(dictSize_, '\0');
+    const size_t ret = ::ZDICT_trainFromBuffer(
+        &dict[0], dict.size(), samples_.data(), sizeV_.data(), sizeV_.size());
+    if (::ZDICT_isError(ret)) {
+        LOGs.debug() << "ZstdDictTrainer:train failed" << ::ZDICT_getErrorName(ret)
+                     << samples_.size() << sizeV_.size();
+        return nullptr;
+    }
+    dict.resize(ret);
+    return std::make_shared<const ZstdDict>(std::move(dict));
+}
+
+std::string createZstdDictFileName(uint32_t id)
+{
+    return cybozu::util::formatString("%u.zdict", id);
+}
+
+void saveZstdDict(const std::string &dirStr, const ZstdDict &dict)
+{
+    const cybozu::FilePath dir(dirStr);
+    const std::string fname = createZstdDictFileName(dict.getId());
+    if ((dir + fname).stat().exists()) return;
+    util::saveFile(dir, fname, dict.data());
+}
+
+ZstdDictVec loadZstdDicts(const std::string &dirStr)
+{
+    const cybozu::FilePath dir(dirStr);
+    ZstdDictRegistry &registry = getZstdDictRegistry();
+    ZstdDictVec v;
+    for (const std::string &fname : util::getFileNameList(dirStr, "zdict")) {
+        std::string data;
+        util::loadFile(dir, fname, data);
+        ZstdDictPtr dict = registry.add(std::move(data));
+        if (createZstdDictFileName(dict->getId()) != fname) {
+            throw cybozu::Exception("loadZstdDicts:bad file name") << fname << dict->getId();
+        }
+        v.push_back(dict);
+    }
+    return v;
+}
+
+bool existsZstdDict(const std::string &dirStr, uint32_t id)
+{
+    return (cybozu::FilePath(dirStr) + createZstdDictFileName(id)).stat().isFile();
+}
+
+std::vector<uint32_t> removeZstdDictsExcept(const std::string &dirStr, const std::set<uint32_t> &keptIdSet)
+{
+    const cybozu::FilePath dir(dirStr);
+    std::vector<uint32_t> idV;
+    for (const std::string &fname : util::getFileNameList(dirStr, "zdict")) {
+        const uint32_t id = std::strtoul(fname.c_str(), nullptr, 10);
+        if (createZstdDictFileName(id) != fname) continue; // not a dictionary file.
+        if (keptIdSet.count(id) > 0) continue;
+        const cybozu::FilePath path = dir + fname;
+        if (!path.unlink()) {
+            throw cybozu::Exception("removeZstdDictsExcept:unlink failed") << path.str() << cybozu::ErrorNo();
+        }
+        idV.push_back(id);
+    }
+    return idV;
+}
+
+} // namespace walb
@@ -0,0 +1,148 @@
+#pragma once
+/**
+ * @file
+ * @brief Trained zstd dictionaries shared by compressors and uncompressors.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include "zstd.h"
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * Compression level used with dictionaries.
+ * Small IOs are the target so it must be fast.
+ */
+const int ZSTD_DICT_CMPR_LEVEL = 1;
+
+const size_t MAX_ZSTD_DICT_SIZE = 1024 * 1024;
+
+/**
+ * A trained zstd dictionary.
+ * Its digested forms are created at the first use,
+ * so that archive servers do not hold compression contexts for received ones.
+ * This is thread-safe.
+ */
+class ZstdDict
+{
+    std::string data_;
+    uint32_t id_;
+    mutable std::once_flag cflag_, dflag_;
+    mutable ::ZSTD_CDict *cdict_;
+    mutable ::ZSTD_DDict *ddict_;
+public:
+    explicit ZstdDict(std::string &&data);
+    ~ZstdDict() noexcept;
+    ZstdDict(const ZstdDict&) = delete;
+    ZstdDict& operator=(const ZstdDict&) = delete;
+
+    uint32_t getId() const { return id_; }
+    const std::string& data() const { return data_; }
+    const ::ZSTD_CDict* cdict() const;
+    const ::ZSTD_DDict* ddict() const;
+};
+
+using ZstdDictPtr = std::shared_ptr<const ZstdDict>;
+using ZstdDictVec = std::vector<ZstdDictPtr>;
+
+/**
+ * Process-wide dictionary table.
+ * Compressed frames hold their dictionary id,
+ * so uncompressors look dictionaries up here.
+ */
+class ZstdDictRegistry
+{
+    mutable std::mutex mu_;
+    std::map<uint32_t, ZstdDictPtr> map_;
+public:
+    /**
+     * Register a dictionary.
+     * RETURN:
+     *   the registered one, that may be the same dictionary added before.
+     */
+    ZstdDictPtr add(std::string &&data);
+    ZstdDictPtr add(const ZstdDictPtr &dict);
+    /**
+     * RETURN:
+     *   nullptr if not found.
+     */
+    ZstdDictPtr get(uint32_t id) const;
+    /**
+     * Throw an exception if not found.
+     */
+    ZstdDictPtr getOrThrow(uint32_t id) const;
+    /**
+     * Unregister a dictionary. Its holders can still use it.
+     */
+    void remove(uint32_t id);
+};
+
+ZstdDictRegistry& getZstdDictRegistry();
+
+/**
+ * RETURN:
+ *   dictionary id of a compressed frame. 0 means no dictionary.
+ */
+uint32_t getZstdFrameDictId(const void *src, size_t size);
+
+/**
+ * Collect samples of IO data and train a dictionary from them.
+ */
+class ZstdDictTrainer
+{
+    std::string samples_;
+    std::vector<size_t> sizeV_;
+    size_t dictSize_;
+    size_t maxSamplesSize_;
+public:
+    /**
+     * dictSize: target dictionary size [byte].
+     * zstd recommends samples about 100 times as large as the dictionary.
+     */
+    explicit ZstdDictTrainer(size_t dictSize, size_t maxSamplesSize = 0)
+        : samples_(), sizeV_(), dictSize_(dictSize)
+        , maxSamplesSize_(maxSamplesSize == 0 ? dictSize * 100 : maxSamplesSize) {
+    }
+    /**
+     * Samples over the limit will be ignored.
+     */
+    void add(const void *data, size_t size);
+    bool isFull() const { return samples_.size() >= maxSamplesSize_; }
+    size_t getSamplesSize() const { return samples_.size(); }
+    size_t getSamplesNr() const { return sizeV_.size(); }
+    void clear() {
+        samples_.clear();
+        sizeV_.clear();
+    }
+    /**
+     * RETURN:
+     *   trained dictionary, or nullptr if the samples are not enough.
+     *   The dictionary is not registered.
+     */
+    ZstdDictPtr train() const;
+};
+
+/**
+ * Dictionary files are stored as "<id>.zdict" in a directory.
+ */
+std::string createZstdDictFileName(uint32_t id);
+void saveZstdDict(const std::string &dirStr, const ZstdDict &dict);
+/**
+ * Load all the dictionary files in a directory and register them.
+ */
+ZstdDictVec loadZstdDicts(const std::string &dirStr);
+bool existsZstdDict(const std::string &dirStr, uint32_t id);
+/**
+ * Remove the dictionary files in a directory except keptIdSet.
+ * They are not unregistered.
+ * RETURN:
+ *   ids of the removed ones.
+ */
+std::vector<uint32_t> removeZstdDictsExcept(const std::string &dirStr, const std::set<uint32_t> &keptIdSet);
+
+} // namespace walb
@@ -264,3 +264,63 @@ CYBOZU_TEST_AUTO(testAioWaitOne)
     std::sort(s1.begin(), s1.end());
     CYBOZU_TEST_ASSERT(s0 == s1);
 }
+
+bool isIoUringAvailable(int fd)
+{
+    try {
+        Aio aio(fd, 1, Backend::IO_URING);
+        return true;
+    } catch (std::exception&) {
+        return false;
+    }
+}
+
+CYBOZU_TEST_AUTO(testAioBackend)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    {
+        Aio aio(tmpF.fd(), 8, Backend::LIBAIO);
+        CYBOZU_TEST_ASSERT(aio.backend() == Backend::LIBAIO);
+        CYBOZU_TEST_ASSERT(!aio.registerBuffer(nullptr, 0));
+        AArray v0(LBS * 128), v1(LBS * 128);
+        fillArray(v0);
+        writeArray(aio, v0);
+        readArray(aio, v1);
+        CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+    }
+    {
+        Aio aio(tmpF.fd(), 8, Backend::AUTO);
+        CYBOZU_TEST_ASSERT(aio.backend() != Backend::AUTO);
+    }
+    CYBOZU_TEST_ASSERT(strToBackend("io_uring") == Backend::IO_URING);
+    CYBOZU_TEST_EXCEPTION(strToBackend("xxx"), std::exception);
+    if (!isIoUringAvailable(tmpF.fd())) {
+        ::printf("io_uring is not available.\n");
+        return;
+    }
+
+    AArray v0(LBS * 128);
+    AArray v1(LBS * 128);
+    fillArray(v0);
+    {
+        Aio aio(tmpF.fd(), 8, Backend::IO_URING);
+        CYBOZU_TEST_ASSERT(aio.backend() == Backend::IO_URING);
+        writeArray(aio, v0);
+        aio.prepareFlush();
+        aio.submit();
+        aio.waitOne();
+    }
+    {
+        /* Reads into a fixed buffer. */
+        Aio aio(tmpF.fd(), 8, Backend::IO_URING);
+        aio.registerBuffer(v1.data(), v1.size());
+        readArray(aio, v1);
+    }
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+
+    /* Read beyond the end of file. */
+    Aio aio(tmpF.fd(), 8, Backend::IO_URING);
+    const uint32_t key = aio.prepareRead(LBS * 128, LBS, &v1[0]);
+    aio.submit();
+    CYBOZU_TEST_EXCEPTION(aio.waitFor(key), cybozu::util::EofError);
+}
@@ -25,6 +25,10 @@ void test(const std::string& path,
     }
 
     CYBOZU_TEST_EQUAL(::memcmp(&data[off0], &buf1[off0], size - off0), 0);
+    const ReadAheadStat stat = reader.getStat();
+    CYBOZU_TEST_ASSERT(stat.bytes >= size - off0);
+    CYBOZU_TEST_ASSERT(stat.ioSize <= maxIoSize);
+    CYBOZU_TEST_ASSERT(stat.windowSize <= bufSize);
 }
 
 CYBOZU_TEST_AUTO(testAsyncBdevReader)
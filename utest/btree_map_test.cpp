@@ -0,0 +1,101 @@
+#include "cybozu/test.hpp"
+#include "btree_map.hpp"
+#include "random.hpp"
+#include <map>
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+using Map0 = std::map<uint64_t, uint64_t>;
+using Map1 = BtreeMap<uint64_t, uint64_t, 4, 4>;
+
+void verifyEquality(const Map0& m0, const Map1& m1)
+{
+    CYBOZU_TEST_ASSERT(m1.isValid());
+    CYBOZU_TEST_EQUAL(m0.size(), m1.size());
+    Map0::const_iterator it0 = m0.begin();
+    Map1::const_iterator it1 = m1.begin();
+    while (it0 != m0.end() && it1 != m1.end()) {
+        CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        CYBOZU_TEST_EQUAL(it0->second, it1->second);
+        ++it0;
+        ++it1;
+    }
+    CYBOZU_TEST_ASSERT(it0 == m0.end());
+    CYBOZU_TEST_ASSERT(it1 == m1.end());
+}
+
+CYBOZU_TEST_AUTO(BtreeMapSimple)
+{
+    Map1 m;
+    CYBOZU_TEST_ASSERT(m.empty());
+    CYBOZU_TEST_ASSERT(m.begin() == m.end());
+    for (uint64_t i = 0; i < 100; i++) {
+        CYBOZU_TEST_ASSERT(m.emplace(i * 2, i).second);
+    }
+    CYBOZU_TEST_ASSERT(m.isValid());
+    CYBOZU_TEST_ASSERT(!m.emplace(4, 100).second);
+    CYBOZU_TEST_EQUAL(m.size(), 100);
+    CYBOZU_TEST_EQUAL(m.lower_bound(5)->first, 6);
+    CYBOZU_TEST_EQUAL(m.lower_bound(6)->first, 6);
+    CYBOZU_TEST_ASSERT(m.lower_bound(199) == m.end());
+    CYBOZU_TEST_ASSERT(m.find(7) == m.end());
+    CYBOZU_TEST_EQUAL(m.find(8)->second, 4);
+
+    Map1::iterator it = m.end();
+    --it;
+    CYBOZU_TEST_EQUAL(it->first, 198);
+    it = m.erase(m.find(8));
+    CYBOZU_TEST_EQUAL(it->first, 10);
+    --it;
+    CYBOZU_TEST_EQUAL(it->first, 6);
+    it = m.erase(m.begin(), m.lower_bound(120));
+    CYBOZU_TEST_EQUAL(it->first, 120);
+    CYBOZU_TEST_EQUAL(m.begin()->first, 120);
+    CYBOZU_TEST_EQUAL(m.size(), 40);
+    CYBOZU_TEST_ASSERT(m.isValid());
+    m.erase(m.begin(), m.end());
+    CYBOZU_TEST_ASSERT(m.empty());
+    CYBOZU_TEST_ASSERT(m.isValid());
+    CYBOZU_TEST_ASSERT(m.emplace(1, 1).second);
+    CYBOZU_TEST_ASSERT(m.isValid());
+}
+
+CYBOZU_TEST_AUTO(BtreeMapRandom)
+{
+    Map0 m0;
+    Map1 m1;
+    const uint64_t keyRange = 2000;
+    for (size_t i = 0; i < 100000; i++) {
+        const uint64_t key = g_rand() % keyRange;
+        const size_t r = g_rand() % 100;
+        if (r < 55) {
+            const uint64_t val = g_rand();
+            const bool b0 = m0.emplace(key, val).second;
+            std::pair<Map1::iterator, bool> p1 = m1.emplace(key, val);
+            CYBOZU_TEST_EQUAL(b0, p1.second);
+            CYBOZU_TEST_EQUAL(p1.first->first, key);
+        } else if (r < 85) {
+            Map0::iterator it0 = m0.lower_bound(key);
+            Map1::iterator it1 = m1.lower_bound(key);
+            if (it0 == m0.end()) {
+                CYBOZU_TEST_ASSERT(it1 == m1.end());
+                continue;
+            }
+            CYBOZU_TEST_EQUAL(it0->first, it1->first);
+            it0 = m0.erase(it0);
+            it1 = m1.erase(it1);
+            CYBOZU_TEST_EQUAL(it0 == m0.end(), it1 == m1.end());
+            if (it0 != m0.end()) CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        } else {
+            const uint64_t key2 = key + g_rand() % 64;
+            Map0::iterator it0 = m0.erase(m0.lower_bound(key), m0.lower_bound(key2));
+            Map1::iterator it1 = m1.erase(m1.lower_bound(key), m1.lower_bound(key2));
+            CYBOZU_TEST_EQUAL(it0 == m0.end(), it1 == m1.end());
+            if (it0 != m0.end()) CYBOZU_TEST_EQUAL(it0->first, it1->first);
+        }
+        if (i % 1000 == 0) verifyEquality(m0, m1);
+    }
+    verifyEquality(m0, m1);
+}
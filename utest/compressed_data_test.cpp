@@ -38,6 +38,30 @@ CYBOZU_TEST_AUTO(compressedData)
     }
 }
 
+CYBOZU_TEST_AUTO(compressedDataWithType)
+{
+    cybozu::util::Random<uint32_t> rand;
+    const int typeV[] = {
+        ::WALB_DIFF_CMPR_NONE, ::WALB_DIFF_CMPR_SNAPPY, ::WALB_DIFF_CMPR_GZIP,
+        ::WALB_DIFF_CMPR_LZMA, ::WALB_DIFF_CMPR_LZ4, ::WALB_DIFF_CMPR_ZSTD,
+    };
+    for (int type : typeV) {
+        AlignedArray v(64 * 1024);
+        rand.fill(&v[0], 32); // the rest are zero.
+        CompressedData cd0, cd1;
+        cd0.compressFrom(v.data(), v.size(), type, 3);
+        if (type == ::WALB_DIFF_CMPR_NONE) {
+            CYBOZU_TEST_ASSERT(!cd0.isCompressed());
+        } else if (cd0.isCompressed()) {
+            CYBOZU_TEST_EQUAL(cd0.cmprType(), type);
+        }
+        cd1 = cd0;
+        cd1.uncompress();
+        CYBOZU_TEST_EQUAL(cd1.rawSize(), v.size());
+        CYBOZU_TEST_ASSERT(::memcmp(cd1.rawData(), v.data(), v.size()) == 0);
+    }
+}
+
 void throwErrorIf(std::vector<std::exception_ptr> &&ev)
 {
     bool isError = false;
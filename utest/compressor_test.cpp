@@ -35,6 +35,125 @@ CYBOZU_TEST_AUTO(testCompressor)
     test(WALB_DIFF_CMPR_ZSTD);
 }
 
+/*
+ * Small blocks sharing phrases like filesystem metadata.
+ */
+std::string makeZstdDictSample(cybozu::XorShift &rand, const std::vector<std::string> &phraseV)
+{
+    std::string s;
+    while (s.size() < 4096) {
+        s += phraseV[rand() % phraseV.size()];
+        s += char(rand() % 256);
+    }
+    s.resize(4096);
+    return s;
+}
+
+size_t compressWithZstdDict(const std::string &in, const ZstdDictPtr &dict)
+{
+    Compressor c(WALB_DIFF_CMPR_ZSTD, 0, dict);
+    std::string enc(in.size() * 2, '\0');
+    size_t encSize;
+    CYBOZU_TEST_ASSERT(c.run(&enc[0], &encSize, enc.size(), in.data(), in.size()));
+    enc.resize(encSize);
+    CYBOZU_TEST_EQUAL(getZstdFrameDictId(enc.data(), enc.size()), dict ? dict->getId() : 0);
+
+    Uncompressor d(WALB_DIFF_CMPR_ZSTD);
+    std::string dec(in.size(), '\0');
+    CYBOZU_TEST_EQUAL(d.run(&dec[0], dec.size(), enc.data(), enc.size()), in.size());
+    CYBOZU_TEST_EQUAL(dec, in);
+    return encSize;
+}
+
+CYBOZU_TEST_AUTO(zstdDict)
+{
+    cybozu::XorShift rand;
+    std::vector<std::string> phraseV(256);
+    for (std::string &phrase : phraseV) {
+        phrase.resize(48);
+        for (char &c : phrase) c = rand() % 256;
+    }
+    ZstdDictTrainer trainer(16 * KIBI);
+    while (!trainer.isFull()) {
+        const std::string s = makeZstdDictSample(rand, phraseV);
+        trainer.add(s.data(), s.size());
+    }
+    const ZstdDictPtr dict = trainer.train();
+    CYBOZU_TEST_ASSERT(bool(dict));
+
+    // Unknown dictionaries can not be used for uncompression.
+    const std::string in = makeZstdDictSample(rand, phraseV);
+    {
+        Compressor c(WALB_DIFF_CMPR_ZSTD, 0, dict);
+        std::string enc(in.size() * 2, '\0');
+        size_t encSize;
+        CYBOZU_TEST_ASSERT(c.run(&enc[0], &encSize, enc.size(), in.data(), in.size()));
+        Uncompressor d(WALB_DIFF_CMPR_ZSTD);
+        std::string dec(in.size(), '\0');
+        CYBOZU_TEST_EXCEPTION(d.run(&dec[0], dec.size(), enc.data(), encSize), cybozu::Exception);
+    }
+    CYBOZU_TEST_EQUAL(getZstdDictRegistry().add(dict), dict);
+    CYBOZU_TEST_EQUAL(getZstdDictRegistry().add(std::string(dict->data())), dict);
+
+    size_t total0 = 0, total1 = 0;
+    for (size_t i = 0; i < 100; i++) {
+        const std::string s = makeZstdDictSample(rand, phraseV);
+        total0 += compressWithZstdDict(s, nullptr);
+        total1 += compressWithZstdDict(s, dict);
+    }
+    printf("zstd without dict %zu with dict %zu\n", total0, total1);
+    CYBOZU_TEST_ASSERT(total1 < total0);
+
+    CYBOZU_TEST_EXCEPTION(Compressor(WALB_DIFF_CMPR_SNAPPY, 0, dict), cybozu::Exception);
+}
+
+std::string makeAutoSample(cybozu::XorShift &rand, size_t size, size_t nSymbols)
+{
+    std::string s(size, '\0');
+    for (char &c : s) c = rand() % nSymbols;
+    return s;
+}
+
+int selectCompression(const std::string &in, size_t budget, size_t *level)
+{
+    CompressionSelector selector(budget);
+    selector.add(in.data(), in.size());
+    return selector.choose(level);
+}
+
+CYBOZU_TEST_AUTO(compressionSelector)
+{
+    cybozu::XorShift rand;
+    size_t level;
+    const std::string random = makeAutoSample(rand, 64 * KIBI, 256);
+    for (size_t budget : {1, 5, 9}) {
+        CYBOZU_TEST_EQUAL(selectCompression(random, budget, &level), WALB_DIFF_CMPR_NONE);
+    }
+    // Only entropy coding shrinks it.
+    const std::string fewSymbols = makeAutoSample(rand, 64 * KIBI, 16);
+    CYBOZU_TEST_EQUAL(selectCompression(fewSymbols, 1, &level), WALB_DIFF_CMPR_NONE);
+    CYBOZU_TEST_EQUAL(selectCompression(fewSymbols, 5, &level), WALB_DIFF_CMPR_ZSTD);
+    CYBOZU_TEST_EQUAL(level, 1);
+    CYBOZU_TEST_EQUAL(selectCompression(fewSymbols, 8, &level), WALB_DIFF_CMPR_ZSTD);
+    CYBOZU_TEST_EQUAL(level, 6);
+    const std::string zero(64 * KIBI, '\0');
+    CYBOZU_TEST_EQUAL(selectCompression(zero, 1, &level), WALB_DIFF_CMPR_LZ4);
+    CYBOZU_TEST_EQUAL(selectCompression(std::string(), 5, &level), WALB_DIFF_CMPR_NONE);
+    CYBOZU_TEST_EXCEPTION(CompressionSelector(10), cybozu::Exception);
+
+    AlignedArray enc, dec;
+    size_t encSize;
+    CYBOZU_TEST_EQUAL(compressData(random.data(), random.size(), enc, encSize, WALB_DIFF_CMPR_AUTO, 0), WALB_DIFF_CMPR_NONE);
+    CYBOZU_TEST_EQUAL(encSize, random.size());
+    CYBOZU_TEST_ASSERT(::memcmp(enc.data(), random.data(), encSize) == 0);
+    const int type = compressData(fewSymbols.data(), fewSymbols.size(), enc, encSize, WALB_DIFF_CMPR_AUTO, 0);
+    CYBOZU_TEST_EQUAL(type, WALB_DIFF_CMPR_ZSTD);
+    CYBOZU_TEST_ASSERT(encSize < fewSymbols.size());
+    dec.resize(fewSymbols.size());
+    uncompressData(enc.data(), encSize, dec, type);
+    CYBOZU_TEST_ASSERT(::memcmp(dec.data(), fewSymbols.data(), dec.size()) == 0);
+}
+
 #include <cstdio>
 #include <stdexcept>
 #include "walb_diff_compressor.hpp"
@@ -161,6 +280,7 @@ CYBOZU_TEST_AUTO(walbDiffCompressor)
     testDiffCompression(::WALB_DIFF_CMPR_LZMA);
     testDiffCompression(::WALB_DIFF_CMPR_LZ4);
     testDiffCompression(::WALB_DIFF_CMPR_ZSTD);
+    testDiffCompression(::WALB_DIFF_CMPR_AUTO);
 }
 
 static const uint32_t headerSize = 4;
@@ -207,7 +327,7 @@ static std::string create(uint32_t len, int idx)
 }
 
 struct NoConverter : compressor::PackCompressorBase {
-    NoConverter(int, size_t) {}
+    NoConverter(int, size_t, const ZstdDictPtr& = nullptr) {}
     void convertRecord(char *, size_t, walb_diff_record&, const char *, const walb_diff_record&) {}
     compressor::Buffer convert(const char *buf)
     {
@@ -384,5 +504,6 @@ CYBOZU_TEST_AUTO(parallelCompress)
         testParallelCompress(8, 4, ::WALB_DIFF_CMPR_LZMA, isFirstDelay);
         testParallelCompress(8, 4, ::WALB_DIFF_CMPR_LZ4, isFirstDelay);
         testParallelCompress(8, 4, ::WALB_DIFF_CMPR_ZSTD, isFirstDelay);
+        testParallelCompress(8, 4, ::WALB_DIFF_CMPR_AUTO, isFirstDelay);
     }
 }
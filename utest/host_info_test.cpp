@@ -88,6 +88,10 @@ CYBOZU_TEST_AUTO(hostInfoForBkp)
         hi1.parse({"192.168.1.1:5000", "gzip:9:1", "0"});
         hi2.parse({"192.168.1.1:5000", "none:9:1", "0"});
         hi3.parse({"192.168.1.1:5000", "none:9:1", "100"});
+        HostInfoForBkp hi4;
+        hi4.parse({"192.168.1.1:5000", "auto:5:4", "0"});
+        CYBOZU_TEST_EQUAL(hi4.cmpr.type, ::WALB_DIFF_CMPR_AUTO);
+        CYBOZU_TEST_EQUAL(hi4.cmpr.str(), "auto:5:4");
         CYBOZU_TEST_EXCEPTION(parseHostInfoForBkp({"192.168.1.1:5000", "xxx:9:1"}), cybozu::Exception);
         CYBOZU_TEST_EXCEPTION(parseHostInfoForBkp({"192.168.1.1:5000", "snappy:10:1"}), cybozu::Exception);
         CYBOZU_TEST_EXCEPTION(parseHostInfoForBkp({"192.168.1.1:5000", "snappy:9:0"}), cybozu::Exception);
@@ -0,0 +1,59 @@
+#include "cybozu/test.hpp"
+#include "log_fill_stat.hpp"
+
+using namespace walb;
+
+CYBOZU_TEST_AUTO(logFillStat)
+{
+    using Sec = std::chrono::seconds;
+    LogFillStat stat;
+    const LogFillStat::TimePoint t0 = LogFillStat::Clock::now();
+    const size_t riskSec = 600;
+
+    CYBOZU_TEST_ASSERT(stat.needsSample(t0));
+    CYBOZU_TEST_EQUAL(stat.getSecToOverflow(), -1);
+    CYBOZU_TEST_EQUAL(stat.getPriority(riskSec), 0);
+
+    // No writes.
+    stat.update(1000, 100, 100000, t0);
+    CYBOZU_TEST_ASSERT(!stat.needsSample(t0));
+    CYBOZU_TEST_ASSERT(stat.needsSample(t0 + Sec(1)));
+    stat.update(1000, 100, 100000, t0 + Sec(1));
+    CYBOZU_TEST_EQUAL(stat.getSecToOverflow(), -1);
+    CYBOZU_TEST_ASSERT(!stat.isAtRisk(riskSec));
+
+    // Steady writes at 100 pb/sec converge to the rate.
+    uint64_t lsid = 1000;
+    for (size_t i = 2; i < 1000; i++) {
+        lsid += 100;
+        stat.update(lsid, 100, 100000, t0 + Sec(i));
+    }
+    CYBOZU_TEST_NEAR(stat.getPbPerSec(), 100.0, 1.0);
+    const int64_t sec = stat.getSecToOverflow();
+    CYBOZU_TEST_ASSERT(990 <= sec && sec <= 1010);
+    CYBOZU_TEST_ASSERT(!stat.isAtRisk(riskSec));
+    CYBOZU_TEST_ASSERT(stat.isAtRisk(1200));
+    CYBOZU_TEST_ASSERT(stat.getPriority(1200) >= URGENT_TASK_PRIORITY);
+
+    // Less free space means higher priority.
+    stat.update(lsid + 100, 50000, 100000, t0 + Sec(1000));
+    const int p0 = stat.getPriority(riskSec);
+    CYBOZU_TEST_ASSERT(p0 >= URGENT_TASK_PRIORITY);
+    stat.update(lsid + 200, 90000, 100000, t0 + Sec(1001));
+    const int p1 = stat.getPriority(riskSec);
+    CYBOZU_TEST_ASSERT(p1 > p0);
+
+    // High usage is a risk even without writes.
+    LogFillStat stat2;
+    stat2.update(1000, 95000, 100000, t0);
+    CYBOZU_TEST_EQUAL(stat2.getSecToOverflow(), -1);
+    CYBOZU_TEST_ASSERT(stat2.isAtRisk(riskSec));
+    stat2.update(1000, 100000, 100000, t0 + Sec(1));
+    CYBOZU_TEST_EQUAL(stat2.getSecToOverflow(), 0);
+    CYBOZU_TEST_EQUAL(stat2.getPriority(riskSec), URGENT_TASK_PRIORITY + 1000);
+
+    // Reset of the log.
+    stat2.update(10, 0, 100000, t0 + Sec(2));
+    CYBOZU_TEST_EQUAL(stat2.getPbPerSec(), 0.0);
+    CYBOZU_TEST_ASSERT(!stat2.isAtRisk(riskSec));
+}
@@ -0,0 +1,100 @@
+#include "cybozu/test.hpp"
+#include "read_ahead.hpp"
+#include "constant.hpp"
+
+using namespace walb;
+
+/**
+ * A device that serves up to `parallel` IOs at once with a fixed latency per IO
+ * plus transfer time, and whose bandwidth is limited.
+ */
+struct Device
+{
+    size_t parallel;
+    double latencyUs;
+    double bytesPerUs;
+
+    double getBytesPerUs(size_t ioSize, size_t windowSize) const {
+        const size_t qd = std::max<size_t>(windowSize / ioSize, 1);
+        const double ioUs = latencyUs + ioSize / bytesPerUs;
+        return std::min(std::min(qd, parallel) * ioSize / ioUs, bytesPerUs);
+    }
+};
+
+/**
+ * @isStalled the reader always waits for IOs if true, or never waits.
+ */
+double simulate(ReadAheadTuner &tuner, const Device &dev, size_t nrIos, bool isStalled,
+                size_t maxWindowSize, size_t maxIoSize)
+{
+    ReadAheadTuner::TimePoint now = ReadAheadTuner::Clock::now();
+    double bytesPerUs = 0;
+    for (size_t i = 0; i < nrIos; i++) {
+        const size_t ioSize = tuner.ioSize();
+        const size_t windowSize = tuner.windowSize();
+        CYBOZU_TEST_ASSERT(ioSize <= maxIoSize);
+        CYBOZU_TEST_ASSERT(windowSize <= maxWindowSize);
+        CYBOZU_TEST_ASSERT(ioSize <= windowSize);
+        bytesPerUs = dev.getBytesPerUs(ioSize, windowSize);
+        const uint64_t us = std::max<uint64_t>(ioSize / bytesPerUs, 1);
+        tuner.submitted(windowSize / ioSize, now);
+        now += std::chrono::microseconds(us);
+        tuner.completed(ioSize, us * windowSize / ioSize, isStalled ? us : 0, now);
+    }
+    return bytesPerUs;
+}
+
+CYBOZU_TEST_AUTO(readAheadTunerInit)
+{
+    ReadAheadTuner t0(16 * MEBI, MEBI, 512);
+    CYBOZU_TEST_EQUAL(t0.ioSize(), ReadAheadTuner::INITIAL_IO_SIZE);
+    CYBOZU_TEST_EQUAL(t0.windowSize(), ReadAheadTuner::INITIAL_WINDOW_SIZE);
+
+    ReadAheadTuner t1(MEBI, 32 * KIBI, 4096);
+    CYBOZU_TEST_EQUAL(t1.ioSize(), 32 * KIBI);
+    CYBOZU_TEST_EQUAL(t1.windowSize(), MEBI);
+    CYBOZU_TEST_EQUAL(ReadAheadTuner::getMaxQueueDepth(MEBI, 32 * KIBI, 4096), 34);
+
+    CYBOZU_TEST_EXCEPTION(ReadAheadTuner(MEBI, 1000, 512), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(ReadAheadTuner(MEBI, 0, 512), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(readAheadTunerGrow)
+{
+    const size_t maxWindowSize = 64 * MEBI, maxIoSize = MEBI;
+    // A fast device that needs deep queues.
+    const Device dev{256, 1000, 16000};
+    ReadAheadTuner tuner(maxWindowSize, maxIoSize, 512);
+    const double bw0 = dev.getBytesPerUs(tuner.ioSize(), tuner.windowSize());
+    const double bw1 = simulate(tuner, dev, 200000, true, maxWindowSize, maxIoSize);
+    CYBOZU_TEST_ASSERT(bw1 > bw0 * 3);
+    CYBOZU_TEST_ASSERT(tuner.windowSize() > ReadAheadTuner::INITIAL_WINDOW_SIZE);
+
+    const ReadAheadStat stat = tuner.getStat();
+    CYBOZU_TEST_EQUAL(stat.ioNr, 200000);
+    CYBOZU_TEST_EQUAL(stat.ioSize, tuner.ioSize());
+    CYBOZU_TEST_EQUAL(stat.windowSize, tuner.windowSize());
+    CYBOZU_TEST_ASSERT(stat.getAvgQueueDepth() > 0);
+}
+
+CYBOZU_TEST_AUTO(readAheadTunerSaturated)
+{
+    const size_t maxWindowSize = 64 * MEBI, maxIoSize = MEBI;
+    // A slow device that is saturated with the initial sizes.
+    const Device dev{1, 100, 100};
+    ReadAheadTuner tuner(maxWindowSize, maxIoSize, 512);
+    simulate(tuner, dev, 100000, true, maxWindowSize, maxIoSize);
+    // A step that does not improve the throughput must be undone.
+    CYBOZU_TEST_ASSERT(tuner.windowSize() <= 2 * ReadAheadTuner::INITIAL_WINDOW_SIZE);
+}
+
+CYBOZU_TEST_AUTO(readAheadTunerNoStall)
+{
+    const size_t maxWindowSize = 64 * MEBI, maxIoSize = MEBI;
+    const Device dev{256, 1000, 16000};
+    ReadAheadTuner tuner(maxWindowSize, maxIoSize, 512);
+    simulate(tuner, dev, 100000, false, maxWindowSize, maxIoSize);
+    // The consumer is the bottleneck.
+    CYBOZU_TEST_EQUAL(tuner.ioSize(), ReadAheadTuner::INITIAL_IO_SIZE);
+    CYBOZU_TEST_EQUAL(tuner.windowSize(), ReadAheadTuner::INITIAL_WINDOW_SIZE);
+}
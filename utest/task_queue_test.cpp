@@ -64,3 +64,59 @@ CYBOZU_TEST_AUTO(taskQueue)
     CYBOZU_TEST_EQUAL(task, "bbb");
     CYBOZU_TEST_ASSERT(!tq.pop(task));
 }
+
+CYBOZU_TEST_AUTO(taskQueuePriority)
+{
+    walb::TaskQueue<Task> tq;
+    Task task;
+
+    tq.push("aaa");
+    tq.push("bbb", 0, 2);
+    tq.push("ccc", 0, 1);
+    tq.push("ddd", 0, 2);
+    CYBOZU_TEST_EQUAL(tq.getPriority("bbb"), 2);
+    CYBOZU_TEST_EQUAL(tq.getPriority("eee"), 0);
+
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "bbb");
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "ddd");
+
+    // Only urgent tasks.
+    CYBOZU_TEST_ASSERT(tq.pop(task, 0, walb::URGENT_TASK_PRIORITY));
+    CYBOZU_TEST_EQUAL(task, "ccc");
+    CYBOZU_TEST_ASSERT(!tq.pop(task, 0, walb::URGENT_TASK_PRIORITY));
+
+    // Push of an existing task updates its priority.
+    tq.push("bbb");
+    tq.push("aaa", 0, 3);
+    CYBOZU_TEST_ASSERT(tq.pop(task, 0, walb::URGENT_TASK_PRIORITY));
+    CYBOZU_TEST_EQUAL(task, "aaa");
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "bbb");
+
+    // Delayed tasks are not popped even if urgent.
+    tq.push("aaa");
+    tq.pushForce("bbb", 10, 5);
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "aaa");
+    CYBOZU_TEST_ASSERT(!tq.pop(task));
+    walb::util::sleepMs(20);
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "bbb");
+
+    // Idle tasks are popped after the others.
+    tq.push("aaa", 0, walb::IDLE_TASK_PRIORITY);
+    CYBOZU_TEST_ASSERT(!tq.hasReadyTask(0));
+    tq.push("bbb");
+    tq.pushForce("ccc", 10);
+    CYBOZU_TEST_ASSERT(tq.hasReadyTask(0));
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "bbb");
+    CYBOZU_TEST_ASSERT(!tq.hasReadyTask(0));
+    CYBOZU_TEST_ASSERT(tq.hasReadyTask(walb::IDLE_TASK_PRIORITY));
+    CYBOZU_TEST_ASSERT(tq.pop(task));
+    CYBOZU_TEST_EQUAL(task, "aaa");
+    walb::util::sleepMs(20);
+    CYBOZU_TEST_ASSERT(tq.hasReadyTask(0));
+}
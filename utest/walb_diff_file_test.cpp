@@ -227,6 +227,76 @@ CYBOZU_TEST_AUTO(RandomSortedDiffFile)
     testRandomDiffFile(::WALB_DIFF_CMPR_ZSTD, nr);
 }
 
+void verifySortedDiffSeek(SortedDiffReader &reader, const std::vector<DiffRecord> &recV, uint64_t addr)
+{
+    reader.seek(addr);
+    auto it = std::find_if(recV.cbegin(), recV.cend(), [&](const DiffRecord &rec) { return rec.endIoAddress() > addr; });
+    DiffRecord rec;
+    AlignedArray buf;
+    if (it == recV.cend()) {
+        CYBOZU_TEST_ASSERT(!reader.readDiff(rec, buf));
+        return;
+    }
+    CYBOZU_TEST_ASSERT(reader.readDiff(rec, buf));
+    CYBOZU_TEST_EQUAL(rec.io_address, it->io_address);
+    CYBOZU_TEST_EQUAL(rec.io_blocks, it->io_blocks);
+}
+
+CYBOZU_TEST_AUTO(SortedDiffFileIndex)
+{
+    const size_t nrIos = 1000;
+    cybozu::TmpFile tmpFile(".");
+    std::vector<DiffRecord> recV(nrIos);
+    {
+        SortedDiffWriter writer(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        size_t i = 0;
+        for (const Sio& sio : generateSioList(nrIos, true)) {
+            AlignedArray data;
+            sio.copyTo(recV[i], data);
+            writer.compressAndWriteDiff(recV[i], data.data(), ::WALB_DIFF_CMPR_NONE);
+            i++;
+        }
+        writer.close();
+    }
+    std::vector<uint64_t> addrV = {0, recV.back().endIoAddress(), recV.back().endIoAddress() + 1};
+    for (size_t i = 0; i < 20; i++) {
+        const DiffRecord &rec = recV[g_rand() % nrIos];
+        addrV.push_back(rec.io_address + g_rand() % rec.io_blocks);
+    }
+    uint64_t indexOffset;
+    {
+        // Seek forward and backward with the index.
+        SortedDiffReader reader(tmpFile.path());
+        DiffFileHeader header;
+        reader.readHeader(header);
+        CYBOZU_TEST_ASSERT(reader.hasIndex());
+        for (uint64_t addr : addrV) verifySortedDiffSeek(reader, recV, addr);
+        std::sort(addrV.begin(), addrV.end());
+        for (uint64_t addr : addrV) verifySortedDiffSeek(reader, recV, addr);
+
+        cybozu::util::File file(tmpFile.path(), O_RDONLY);
+        SortedDiffIndexSuper super;
+        std::vector<SortedDiffIndexRecord> idxV;
+        CYBOZU_TEST_ASSERT(readSortedDiffIndex(file, super, idxV));
+        CYBOZU_TEST_EQUAL(super.getStat().normNr + super.getStat().zeroNr + super.getStat().discNr, nrIos);
+        size_t nrRecs = 0;
+        for (const SortedDiffIndexRecord &idx : idxV) nrRecs += idx.n_records;
+        CYBOZU_TEST_EQUAL(nrRecs, nrIos);
+        indexOffset = super.index_offset;
+    }
+    // Files without the index are still readable and seekable forward.
+    CYBOZU_TEST_EQUAL(::truncate(tmpFile.path().c_str(), indexOffset), 0);
+    for (uint64_t addr : addrV) {
+        SortedDiffReader reader(tmpFile.path());
+        DiffFileHeader header;
+        reader.readHeader(header);
+        CYBOZU_TEST_ASSERT(!reader.hasIndex());
+        verifySortedDiffSeek(reader, recV, addr);
+    }
+}
+
 CYBOZU_TEST_AUTO(RandomIndexedDiffFile)
 {
     size_t nr = 100;
@@ -237,3 +307,119 @@ CYBOZU_TEST_AUTO(RandomIndexedDiffFile)
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_LZ4, nr);
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, nr);
 }
+
+/**
+ * IOs consist of a few kinds of blocks.
+ */
+void testDedupIndexedDiffFile(size_t nrIos, size_t maxDedupNr)
+{
+    const size_t len = 2048;
+    const uint32_t blkLb = DIFF_DEDUP_BLOCK_SIZE / LBS;
+    std::vector<AlignedArray> blkV(4);
+    for (AlignedArray &blk : blkV) {
+        blk.resize(DIFF_DEDUP_BLOCK_SIZE);
+        g_rand.fill(blk.data(), blk.size());
+    }
+    cybozu::TmpFile tmpFile0("."), tmpFile1(".");
+    TmpDisk disk0(len), disk1(len);
+    uint64_t dedupLb;
+    DiffStatistics stat0, stat1;
+    {
+        IndexedDiffWriter writer, writer1; // writer1 does not deduplicate.
+        writer.setFd(tmpFile0.fd());
+        writer.setDedup(maxDedupNr);
+        writer1.setFd(tmpFile1.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        writer1.writeHeader(header);
+        for (size_t i = 0; i < nrIos; i++) {
+            const uint32_t ioBlocks = (g_rand() % 8 + 1) * blkLb + g_rand() % 2 * (g_rand() % blkLb);
+            const uint64_t ioAddr = g_rand() % (len - ioBlocks);
+            IndexedDiffRecord rec;
+            rec.init();
+            rec.io_address = ioAddr;
+            rec.io_blocks = ioBlocks;
+            rec.orig_blocks = ioBlocks;
+            rec.data_size = ioBlocks * LBS;
+            AlignedArray data(ioBlocks * LBS);
+            for (size_t off = 0; off < data.size(); off += DIFF_DEDUP_BLOCK_SIZE) {
+                const AlignedArray &blk = blkV[g_rand() % blkV.size()];
+                ::memcpy(data.data() + off, blk.data(), std::min<size_t>(data.size() - off, blk.size()));
+            }
+            disk0.writeDiff(rec, data);
+            writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_NONE);
+            writer1.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_NONE);
+        }
+        dedupLb = writer.getDedupLb();
+        writer.finalize();
+        writer1.finalize();
+        stat0 = writer.getStat();
+        stat1 = writer1.getStat();
+    }
+    CYBOZU_TEST_EQUAL(stat0.normLb, stat1.normLb);
+    CYBOZU_TEST_EQUAL(stat0.dataSize, stat1.dataSize);
+    disk1.apply(tmpFile0.path());
+    disk0.verifyEquals(disk1);
+    if (maxDedupNr == 0) {
+        CYBOZU_TEST_EQUAL(dedupLb, 0);
+    } else {
+        CYBOZU_TEST_ASSERT(dedupLb > 0);
+    }
+}
+
+CYBOZU_TEST_AUTO(DedupIndexedDiffFile)
+{
+    testDedupIndexedDiffFile(100, 0);
+    testDedupIndexedDiffFile(100, 1);
+    testDedupIndexedDiffFile(100, 16);
+}
+
+CYBOZU_TEST_AUTO(VerifyIndexedDiffFile)
+{
+    cybozu::TmpFile tmpFile(".");
+    {
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        IndexedDiffRecord rec = makeIrec(0, 8, DiffRecType::NORMAL);
+        rec.orig_blocks = 8;
+        rec.data_size = 8 * LBS;
+        AlignedArray data(8 * LBS);
+        writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_NONE);
+        writer.finalize();
+    }
+    IndexedDiffRecord rec;
+    {
+        IndexedDiffReader reader;
+        IndexedDiffCache cache;
+        reader.setFile(cybozu::util::File(tmpFile.fd()), cache);
+        CYBOZU_TEST_ASSERT(reader.readDiffRecord(rec, true));
+        reader.verifyIo(rec);
+    }
+    // Corrupt the IO data.
+    cybozu::util::File file(tmpFile.fd());
+    file.pwrite("x", 1, rec.data_offset);
+    {
+        IndexedDiffReader reader;
+        IndexedDiffCache cache;
+        reader.setFile(cybozu::util::File(tmpFile.fd()), cache);
+        CYBOZU_TEST_ASSERT(reader.readDiffRecord(rec, true));
+        CYBOZU_TEST_EXCEPTION(reader.verifyIo(rec), cybozu::Exception);
+    }
+}
+
+CYBOZU_TEST_AUTO(AbortedIndexedDiffFile)
+{
+    cybozu::TmpFile tmpFile(".");
+    {
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        writer.abort();
+    }
+    IndexedDiffReader reader;
+    IndexedDiffCache cache;
+    CYBOZU_TEST_EXCEPTION(reader.setFile(cybozu::util::File(tmpFile.fd()), cache), cybozu::Exception);
+}
@@ -365,3 +365,398 @@ CYBOZU_TEST_AUTO(wdiffMergeRandom)
         testMerge2(len, recipe);
     }
 }
+
+CYBOZU_TEST_AUTO(addrTournamentTree)
+{
+    const size_t n = 37;
+    AddrTournamentTree tree;
+    tree.init(n);
+    CYBOZU_TEST_EQUAL(tree.min(), UINT64_MAX);
+    CYBOZU_TEST_EQUAL(tree.findNext(0, UINT64_MAX), AddrTournamentTree::npos);
+
+    std::vector<uint64_t> v(n, UINT64_MAX);
+    for (size_t i = 0; i < 1000; i++) {
+        const size_t idx = g_rand() % n;
+        const uint64_t addr = (g_rand() % 10 == 0) ? UINT64_MAX : g_rand() % 100;
+        v[idx] = addr;
+        tree.update(idx, addr);
+        CYBOZU_TEST_EQUAL(tree.min(), *std::min_element(v.begin(), v.end()));
+        const size_t j = g_rand() % (n + 1);
+        uint64_t minBefore = UINT64_MAX;
+        for (size_t k = 0; k < j; k++) minBefore = std::min(minBefore, v[k]);
+        CYBOZU_TEST_EQUAL(tree.minBefore(j), minBefore);
+        const uint64_t limit = g_rand() % 100;
+        size_t k = 0;
+        for (size_t x = tree.findNext(0, limit); x != AddrTournamentTree::npos; x = tree.findNext(x + 1, limit)) {
+            while (k < x) CYBOZU_TEST_ASSERT(v[k++] >= limit);
+            CYBOZU_TEST_ASSERT(v[k++] < limit);
+        }
+        while (k < n) CYBOZU_TEST_ASSERT(v[k++] >= limit);
+    }
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeMany)
+{
+    /*
+     * Many small wdiffs like the ones a proxy receives.
+     */
+    const size_t len = 4096;
+    const size_t diffNr = 300;
+    Recipe recipe;
+    for (size_t j = 0; j < diffNr; j++) {
+        recipe.emplace_back();
+        const size_t ioNr = g_rand() % 4 + 1;
+        for (size_t k = 0; k < ioNr; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    testMerge2(len, recipe);
+}
+
+std::vector<DiffRecord> readDiffRecords(const std::string &path)
+{
+    SortedDiffReader reader(path);
+    DiffFileHeader header;
+    reader.readHeader(header);
+    std::vector<DiffRecord> recV;
+    DiffRecord rec;
+    AlignedArray buf;
+    while (reader.readDiff(rec, buf)) recV.push_back(rec);
+    return recV;
+}
+
+/**
+ * Make a sorted wdiff with compressible normal IOs.
+ */
+void makeCompressedWdiff(TmpDiffFile &file, const std::vector<MetaIo> &mioV)
+{
+    SortedDiffWriter writer(file.fd());
+    DiffFileHeader header;
+    writer.writeHeader(header);
+    for (const MetaIo &mio : mioV) {
+        Sio sio;
+        sio.setRandomly(mio.addr, mio.len, DiffRecType::NORMAL);
+        for (size_t i = 0; i < sio.data.size(); i++) {
+            sio.data[i] = char(g_rand() % 4);
+        }
+        DiffRecord rec;
+        AlignedArray data;
+        sio.copyTo(rec, data);
+        writer.compressAndWriteDiff(rec, data.data(), ::WALB_DIFF_CMPR_ZSTD);
+    }
+    writer.close();
+}
+
+CYBOZU_TEST_AUTO(wdiffMergePassThrough)
+{
+    /*
+     * addr   0123456789012345678901234
+     * diff1    XXXX                XXXX
+     * diff0  XXXX      XXXX
+     */
+    const Recipe recipe = {{{0, 4}, {10, 4}}, {{2, 4}, {20, 4}}};
+    const size_t len = 30;
+    TmpDiffFileVec d(recipe.size());
+    for (size_t i = 0; i < recipe.size(); i++) {
+        makeCompressedWdiff(d[i], recipe[i]);
+    }
+    verifyMergedDiff(len, d);
+
+    const DiffRecord isolated[] = {
+        readDiffRecords(d[0].path())[1], readDiffRecords(d[1].path())[1]
+    };
+    for (const DiffRecord &rec : isolated) {
+        CYBOZU_TEST_ASSERT(rec.isCompressed());
+    }
+    for (bool keepCompressed : {true, false}) {
+        DiffMerger merger;
+        merger.setKeepCompressed(keepCompressed);
+        for (TmpDiffFile &f : d) merger.addWdiff(f.path());
+        merger.prepare();
+        DiffRecIo recIo;
+        size_t nr = 0;
+        while (merger.getAndRemove(recIo)) {
+            const DiffRecord &rec = recIo.record();
+            CYBOZU_TEST_ASSERT(recIo.isValid());
+            nr++;
+            if (rec.io_address < 10) {
+                CYBOZU_TEST_ASSERT(!rec.isCompressed());
+                continue;
+            }
+            const DiffRecord &orig = isolated[rec.io_address == 10 ? 0 : 1];
+            CYBOZU_TEST_EQUAL(rec.io_address, orig.io_address);
+            if (keepCompressed) {
+                CYBOZU_TEST_EQUAL(rec.compression_type, orig.compression_type);
+                CYBOZU_TEST_EQUAL(rec.data_size, orig.data_size);
+                CYBOZU_TEST_EQUAL(rec.checksum, orig.checksum);
+                CYBOZU_TEST_ASSERT(recIo.isValid(true));
+            } else {
+                CYBOZU_TEST_ASSERT(!rec.isCompressed());
+            }
+        }
+        CYBOZU_TEST_EQUAL(nr, 4);
+    }
+}
+
+void verifyAddrRangeMerge(size_t len, TmpDiffFileVec &d, const std::vector<uint64_t> &addrV)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+    for (size_t i = 0; i + 1 < addrV.size(); i++) {
+        DiffMerger merger;
+        merger.setMaxCacheSize(4 * MEBI);
+        merger.setAddrRange(addrV[i], addrV[i + 1]);
+        for (size_t j = 0; j < d.size(); j++) {
+            merger.addWdiff(d[j].path());
+        }
+        merger.prepare();
+        DiffRecIo recIo;
+        while (merger.getAndRemove(recIo)) {
+            const DiffRecord &rec = recIo.record();
+            CYBOZU_TEST_ASSERT(addrV[i] <= rec.io_address);
+            CYBOZU_TEST_ASSERT(rec.endIoAddress() <= addrV[i + 1]);
+            disk1.writeDiff(rec, recIo.io());
+        }
+    }
+    disk0.verifyEquals(disk1);
+}
+
+void verifyShardedMergedDiff(size_t len, TmpDiffFileVec &d, size_t maxShardNr, size_t prefetchThreadNr = 0)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+    TmpDiffFile merged;
+    ShardedDiffMerger merger;
+    for (size_t i = 0; i < d.size(); i++) {
+        merger.addWdiff(d[i].path());
+    }
+    merger.setPrefetch(prefetchThreadNr);
+    merger.prepare(maxShardNr);
+    CYBOZU_TEST_ASSERT(merger.getShardNr() <= maxShardNr);
+    CYBOZU_TEST_ASSERT(merger.mergeToFd(merged.fd(), CompressOpt(), "."));
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+
+    // The output has the pack index, and the statistics in it are the same as the output.
+    SortedDiffReader reader(merged.path());
+    DiffFileHeader header;
+    reader.readHeader(header);
+    CYBOZU_TEST_ASSERT(reader.hasIndex());
+    ShardedDiffMerger merger2;
+    merger2.addWdiff(merged.path());
+    merger2.prepare(maxShardNr);
+    CYBOZU_TEST_EQUAL(merger2.statIn().normNr, merger.statOut().normNr);
+    CYBOZU_TEST_EQUAL(merger2.statIn().normLb, merger.statOut().normLb);
+    CYBOZU_TEST_EQUAL(merger2.statIn().discLb, merger.statOut().discLb);
+    CYBOZU_TEST_EQUAL(merger2.statIn().dataSize, merger.statOut().dataSize);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeSharded)
+{
+    const size_t len = 512;
+    const size_t ioNr = 32;
+    const size_t diffNr = 8;
+    for (size_t i = 0; i < 5; i++) {
+        Recipe recipe;
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe.emplace_back();
+            for (size_t k = 0; k < ioNr; k++) {
+                const uint64_t ioAddr = g_rand() % len;
+                const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+                recipe.back().push_back({ioAddr, ioBlocks});
+            }
+        }
+        SioListVec slv = generateSioListVec(recipe);
+        TmpDiffFileVec d0(diffNr), d1(diffNr);
+        makeSortedWdiffs2(d0, slv);
+        makeIndexedWdiffs(d1, slv);
+        for (TmpDiffFileVec *d : {&d0, &d1}) {
+            verifyAddrRangeMerge(len, *d, {0, 100, 101, 250, UINT64_MAX});
+            for (size_t shardNr : {1, 2, 3, 8}) {
+                verifyShardedMergedDiff(len, *d, shardNr);
+            }
+            verifyShardedMergedDiff(len, *d, 3, 2);
+        }
+    }
+}
+
+void verifyPrefetchedMergedDiff(size_t len, TmpDiffFileVec &d, size_t threadNr, size_t packNr)
+{
+    TmpDisk disk0(len), disk1(len), disk2(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    TmpDiffFile merged;
+    DiffMerger merger1;
+    merger1.setPrefetch(threadNr, packNr);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger1.addWdiff(d[i].path());
+    }
+    merger1.mergeToFd(merged.fd());
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+
+    DiffMerger merger2;
+    merger2.setPrefetch(threadNr, packNr);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger2.addWdiff(d[i].path());
+    }
+    merger2.prepare();
+    DiffRecIo recIo;
+    while (merger2.getAndRemove(recIo)) {
+        CYBOZU_TEST_ASSERT(!recIo.record().isCompressed());
+        disk2.writeDiff(recIo.record(), recIo.io());
+    }
+    disk0.verifyEquals(disk2);
+    CYBOZU_TEST_EQUAL(merger1.statIn().wdiffNr, d.size());
+    CYBOZU_TEST_EQUAL(merger1.statIn().normNr, merger2.statIn().normNr);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergePrefetch)
+{
+    /*
+     * Each wdiff consists of several packs.
+     */
+    const size_t len = 8192;
+    const size_t ioNr = 400;
+    const size_t diffNr = 6;
+    for (size_t i = 0; i < 3; i++) {
+        Recipe recipe;
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe.emplace_back();
+            for (size_t k = 0; k < ioNr; k++) {
+                const uint64_t ioAddr = g_rand() % len;
+                const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+                recipe.back().push_back({ioAddr, ioBlocks});
+            }
+        }
+        SioListVec slv = generateSioListVec(recipe);
+        TmpDiffFileVec d0(diffNr), d1(diffNr);
+        makeSortedWdiffs2(d0, slv);
+        makeIndexedWdiffs(d1, slv);
+        // Indexed wdiffs are not prefetched, but they can be mixed.
+        TmpDiffFileVec d2(diffNr);
+        for (size_t j = 0; j < diffNr; j++) {
+            if (j % 2 == 0) makeSortedWdiff2(d2[j], slv[j]);
+            else makeIndexedWdiff(d2[j], slv[j]);
+        }
+        for (TmpDiffFileVec *d : {&d0, &d1, &d2}) {
+            verifyPrefetchedMergedDiff(len, *d, 1, 1);
+            verifyPrefetchedMergedDiff(len, *d, 4, 2);
+        }
+    }
+}
+
+void verifySpilledMergedDiff(size_t len, TmpDiffFileVec &d, size_t memBudget, bool mustSpill)
+{
+    TmpDisk disk0(len), disk1(len), disk2(len);
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    TmpDiffFile merged;
+    DiffMerger merger1;
+    merger1.setMemoryBudget(memBudget, ".");
+    for (size_t i = 0; i < d.size(); i++) {
+        merger1.addWdiff(d[i].path());
+    }
+    merger1.mergeToFd(merged.fd());
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+    if (mustSpill) CYBOZU_TEST_ASSERT(merger1.getSpillNr() > 0);
+    CYBOZU_TEST_EQUAL(merger1.statIn().wdiffNr, d.size());
+
+    DiffMerger merger2(0);
+    merger2.setMemoryBudget(memBudget, ".");
+    for (size_t i = 0; i < d.size(); i++) {
+        merger2.addWdiff(d[i].path());
+    }
+    merger2.prepare();
+    DiffRecIo recIo;
+    while (merger2.getAndRemove(recIo)) {
+        CYBOZU_TEST_ASSERT(!recIo.record().isCompressed());
+        disk2.writeDiff(recIo.record(), recIo.io());
+    }
+    disk0.verifyEquals(disk2);
+    CYBOZU_TEST_EQUAL(merger1.statIn().normNr, merger2.statIn().normNr);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeSpill)
+{
+    const size_t len = 4096;
+    const size_t ioNr = 200;
+    const size_t diffNr = 7;
+    for (size_t i = 0; i < 3; i++) {
+        Recipe recipe;
+        for (size_t j = 0; j < diffNr; j++) {
+            recipe.emplace_back();
+            for (size_t k = 0; k < ioNr; k++) {
+                const uint64_t ioAddr = g_rand() % len;
+                const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+                recipe.back().push_back({ioAddr, ioBlocks});
+            }
+        }
+        SioListVec slv = generateSioListVec(recipe);
+        TmpDiffFileVec d0(diffNr), d1(diffNr);
+        makeSortedWdiffs2(d0, slv);
+        makeIndexedWdiffs(d1, slv);
+        for (TmpDiffFileVec *d : {&d0, &d1}) {
+            verifySpilledMergedDiff(len, *d, 1, true);
+            verifySpilledMergedDiff(len, *d, 64 * KIBI, false);
+        }
+    }
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeDedup)
+{
+    const size_t len = 4096;
+    const size_t ioNr = 50;
+    const size_t diffNr = 3;
+    std::vector<AlignedArray> blkV(4);
+    for (AlignedArray &blk : blkV) {
+        blk.resize(DIFF_DEDUP_BLOCK_SIZE);
+        g_rand.fill(blk.data(), blk.size());
+    }
+    Recipe recipe;
+    for (size_t i = 0; i < diffNr; i++) {
+        recipe.emplace_back();
+        for (size_t j = 0; j < ioNr; j++) {
+            const uint64_t ioAddr = g_rand() % (len - 64);
+            const uint32_t ioBlocks = g_rand() % 64 + 1;
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    for (SioList &sl : slv) {
+        for (Sio &sio : sl) {
+            for (size_t off = 0; off < sio.data.size(); off += DIFF_DEDUP_BLOCK_SIZE) {
+                const AlignedArray &blk = blkV[g_rand() % blkV.size()];
+                ::memcpy(sio.data.data() + off, blk.data(), std::min<size_t>(sio.data.size() - off, blk.size()));
+            }
+        }
+    }
+    TmpDiffFileVec d0(diffNr), d1(diffNr);
+    makeSortedWdiffs2(d0, slv);
+    makeIndexedWdiffs(d1, slv);
+    for (TmpDiffFileVec *d : {&d0, &d1}) {
+        TmpDisk disk0(len), disk1(len);
+        for (TmpDiffFile &f : *d) disk0.apply(f.path());
+        TmpDiffFileVec merged(1);
+        {
+            DiffMerger merger;
+            for (TmpDiffFile &f : *d) merger.addWdiff(f.path());
+            CYBOZU_TEST_ASSERT(merger.mergeToIndexedFd(merged[0].fd(), 16) > 0);
+        }
+        disk1.apply(merged[0].path());
+        disk0.verifyEquals(disk1);
+        // Merging it again expands the references.
+        verifyMergedDiff(len, merged);
+    }
+}
@@ -0,0 +1,123 @@
+#include "cybozu/test.hpp"
+#include "walb_log_coalescer.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+const uint32_t pbs = 512;
+const uint32_t salt = 123;
+const uint64_t diskLb = 64;
+
+using Disk = std::vector<char>;
+
+struct Io {
+    uint64_t offset;
+    uint16_t size;
+};
+
+AlignedArray makeData(uint16_t sizeLb, cybozu::util::Random<uint32_t> &rand)
+{
+    AlignedArray data(sizeLb * LBS, false);
+    rand.fill(data.data(), data.size());
+    return data;
+}
+
+/**
+ * Discard IOs are applied as zero-filled.
+ */
+void apply(Disk &disk, const LogPackHeader &packH, const std::vector<AlignedArray> &ioV)
+{
+    for (size_t i = 0; i < packH.nRecords(); i++) {
+        const WlogRecord &rec = packH.record(i);
+        if (rec.isPadding()) continue;
+        char *p = &disk[rec.offset * LBS];
+        const size_t size = rec.ioSizeLb() * LBS;
+        if (rec.isDiscard()) {
+            ::memset(p, 0, size);
+            continue;
+        }
+        CYBOZU_TEST_EQUAL(ioV[i].size(), size);
+        CYBOZU_TEST_EQUAL(cybozu::util::calcChecksum(ioV[i].data(), size, salt), rec.checksum);
+        ::memcpy(p, ioV[i].data(), size);
+    }
+}
+
+/**
+ * The coalesced size is not checked if expectedCoalescedPb is uint64_t(-1).
+ */
+void testCoalesce(const std::vector<std::vector<Io> > &packV, uint64_t expectedCoalescedPb = uint64_t(-1))
+{
+    cybozu::util::Random<uint32_t> rand;
+    Disk disk0(diskLb * LBS), disk1(diskLb * LBS);
+    WlogCoalescer coalescer;
+    uint64_t lsid = 100;
+    uint64_t totalPb = 0;
+    for (const std::vector<Io> &ios : packV) {
+        LogPackHeader packH(pbs, salt);
+        packH.init(lsid);
+        std::vector<AlignedArray> ioV;
+        for (const Io &io : ios) {
+            CYBOZU_TEST_ASSERT(packH.addNormalIo(io.offset, io.size));
+            AlignedArray data = makeData(io.size, rand);
+            packH.record(packH.nRecords() - 1).checksum =
+                cybozu::util::calcChecksum(data.data(), data.size(), salt);
+            ioV.push_back(std::move(data));
+        }
+        packH.updateChecksum();
+        apply(disk0, packH, ioV);
+        totalPb += 1 + packH.totalIoSize();
+        coalescer.push(packH, std::move(ioV));
+        lsid = packH.nextLogpackLsid();
+    }
+    CYBOZU_TEST_EQUAL(coalescer.getBufferedPb(), totalPb);
+
+    uint64_t nextLsid = 100;
+    size_t nrPacks = 0;
+    coalescer.flush([&](const LogPackHeader &packH, const std::vector<AlignedArray> &ioV) {
+            CYBOZU_TEST_ASSERT(packH.isValid(true));
+            CYBOZU_TEST_EQUAL(packH.logpackLsid(), nextLsid);
+            nextLsid = packH.nextLogpackLsid();
+            apply(disk1, packH, ioV);
+            nrPacks++;
+        });
+    CYBOZU_TEST_EQUAL(nrPacks, packV.size());
+    CYBOZU_TEST_EQUAL(nextLsid, lsid);
+    CYBOZU_TEST_ASSERT(coalescer.empty());
+    CYBOZU_TEST_EQUAL(coalescer.getBufferedPb(), 0);
+    if (expectedCoalescedPb != uint64_t(-1)) {
+        CYBOZU_TEST_EQUAL(coalescer.getCoalescedPb(), expectedCoalescedPb);
+    }
+    CYBOZU_TEST_ASSERT(disk0 == disk1);
+}
+
+CYBOZU_TEST_AUTO(coalesceSimple)
+{
+    // Not overlapped.
+    testCoalesce({{{0, 4}, {8, 4}}}, 0);
+    // Overwritten in the same pack.
+    testCoalesce({{{0, 4}, {0, 4}}}, 4);
+    // Overwritten in a later pack.
+    testCoalesce({{{0, 4}, {8, 4}}, {{8, 4}}}, 4);
+    // Covered by multiple IOs.
+    testCoalesce({{{2, 4}}, {{0, 3}}, {{3, 8}}}, 4);
+    // Partially overwritten.
+    testCoalesce({{{0, 4}}, {{2, 4}}}, 0);
+    // Hot spot.
+    testCoalesce({{{0, 1}, {0, 1}}, {{0, 1}, {5, 1}}, {{0, 1}}}, 3);
+}
+
+CYBOZU_TEST_AUTO(coalesceRandom)
+{
+    cybozu::util::Random<uint32_t> rand;
+    for (size_t i = 0; i < 100; i++) {
+        std::vector<std::vector<Io> > packV(rand() % 5 + 1);
+        for (std::vector<Io> &ios : packV) {
+            ios.resize(rand() % 5 + 1);
+            for (Io &io : ios) {
+                io.size = rand() % 8 + 1;
+                io.offset = rand() % (diskLb - io.size + 1);
+            }
+        }
+        testCoalesce(packV);
+    }
+}
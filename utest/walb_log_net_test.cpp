@@ -0,0 +1,255 @@
+#include "cybozu/test.hpp"
+#include "walb_log_net.hpp"
+#include "walb_diff_converter.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+const uint32_t pbs = 512;
+const uint32_t salt = 123;
+const size_t frameSize = 4096; // for batched streams.
+
+using FrameV = std::vector<CompressedData>;
+
+/**
+ * Make frames as WlogSender sends them.
+ * Half of each IO is zero-filled to be compressed.
+ */
+FrameV makeFrames(size_t nrPacks, bool isBatched, cybozu::util::Random<uint32_t> &rand)
+{
+    std::vector<std::string> bufV;
+    uint64_t lsid = 100;
+    for (size_t i = 0; i < nrPacks; i++) {
+        LogPackHeader packH(pbs, salt);
+        packH.init(lsid);
+        std::vector<std::string> ioV;
+        const size_t nrIos = rand() % 8 + 1;
+        for (size_t j = 0; j < nrIos; j++) {
+            const uint16_t sizeLb = rand() % 16 + 1;
+            const uint64_t offset = rand() % 1024;
+            if (rand() % 8 == 0) {
+                CYBOZU_TEST_ASSERT(packH.addDiscardIo(offset, sizeLb));
+                continue;
+            }
+            CYBOZU_TEST_ASSERT(packH.addNormalIo(offset, sizeLb));
+            std::string data(sizeLb * LBS, '\0');
+            rand.fill(&data[0], data.size() / 2);
+            packH.record(packH.nRecords() - 1).checksum =
+                cybozu::util::calcChecksum(data.data(), data.size(), salt);
+            ioV.push_back(std::move(data));
+        }
+        packH.updateChecksum();
+        bufV.emplace_back((const char *)packH.rawData(), pbs);
+        for (std::string &data : ioV) bufV.push_back(std::move(data));
+        lsid = packH.nextLogpackLsid();
+    }
+
+    FrameV frameV;
+    auto pushFrame = [&](const void *data, size_t size) {
+        CompressedData cd;
+        cd.compressFrom(data, size);
+        frameV.push_back(std::move(cd));
+    };
+    if (!isBatched) {
+        for (const std::string &buf : bufV) pushFrame(buf.data(), buf.size());
+        return frameV;
+    }
+    std::string batch;
+    for (const std::string &buf : bufV) batch += buf;
+    for (size_t off = 0; off < batch.size(); off += frameSize) {
+        pushFrame(&batch[off], std::min(frameSize, batch.size() - off));
+    }
+    return frameV;
+}
+
+WlogReceiver::FrameSource makeSource(const FrameV &frameV, bool doUncompress)
+{
+    std::shared_ptr<size_t> idx = std::make_shared<size_t>(0);
+    return [&frameV, idx, doUncompress](CompressedData &cd) {
+        if (*idx == frameV.size()) return false;
+        cd = frameV[(*idx)++];
+        if (doUncompress) cd.uncompress();
+        return true;
+    };
+}
+
+std::string readFile(const cybozu::TmpFile &tmpFile)
+{
+    std::string buf;
+    cybozu::util::readAllFromFile(tmpFile.path(), buf);
+    return buf;
+}
+
+void convertSequentially(const FrameV &frameV, bool isBatched, IndexedDiffWriter &writer)
+{
+    WlogReceiver receiver(makeSource(frameV, true), pbs, salt, isBatched);
+    LogPackHeader packH(pbs, salt);
+    while (receiver.popHeader(packH)) {
+        AlignedArray data;
+        for (size_t i = 0; i < packH.nRecords(); i++) {
+            const WlogRecord &lrec = packH.record(i);
+            receiver.popIo(lrec, data);
+            IndexedDiffRecord drec;
+            if (convertLogToDiff(lrec, data.data(), drec)) {
+                writer.compressAndWriteDiff(drec, data.data());
+            }
+        }
+    }
+}
+
+/**
+ * RETURN:
+ *   the wdiff file image.
+ */
+template <typename Convert>
+std::string makeDiff(size_t maxDedupNr, Convert convert)
+{
+    cybozu::TmpFile tmpFile(".");
+    IndexedDiffWriter writer;
+    writer.setFd(tmpFile.fd());
+    writer.setDedup(maxDedupNr);
+    DiffFileHeader header;
+    header.type = WALB_DIFF_TYPE_INDEXED;
+    writer.writeHeader(header);
+    convert(writer);
+    writer.finalize();
+    return readFile(tmpFile);
+}
+
+void testPipeline(bool isBatched, size_t maxDedupNr)
+{
+    cybozu::util::Random<uint32_t> rand;
+    const FrameV frameV = makeFrames(100, isBatched, rand);
+    const std::string expected = makeDiff(maxDedupNr, [&](IndexedDiffWriter &writer) {
+            convertSequentially(frameV, isBatched, writer);
+        });
+    for (size_t nrThreads : {1, 4}) {
+        const std::string diff = makeDiff(maxDedupNr, [&](IndexedDiffWriter &writer) {
+                CYBOZU_TEST_ASSERT(recvWlogAndWriteDiffInPipeline(
+                                       makeSource(frameV, false), writer, pbs, salt,
+                                       isBatched, nrThreads, []() { return false; }));
+            });
+        CYBOZU_TEST_ASSERT(diff == expected);
+    }
+}
+
+CYBOZU_TEST_AUTO(wlogDiffPipeline)
+{
+    testPipeline(false, 0);
+    testPipeline(true, 0);
+    testPipeline(false, 64);
+}
+
+CYBOZU_TEST_AUTO(wlogDiffPipelineError)
+{
+    cybozu::util::Random<uint32_t> rand;
+    FrameV frameV = makeFrames(100, false, rand);
+    // Break IO data of a middle frame.
+    AlignedArray data;
+    size_t i = frameV.size() / 2;
+    for (;; i++) {
+        frameV[i].getUncompressed(data);
+        if (data.size() != pbs) break; // not a logpack header.
+    }
+    data[0] ^= 1;
+    frameV[i].setUncompressed(std::move(data));
+
+    cybozu::TmpFile tmpFile(".");
+    IndexedDiffWriter writer;
+    writer.setFd(tmpFile.fd());
+    DiffFileHeader header;
+    writer.writeHeader(header);
+    CYBOZU_TEST_EXCEPTION(recvWlogAndWriteDiffInPipeline(
+                              makeSource(frameV, false), writer, pbs, salt,
+                              false, 2, []() { return false; }), cybozu::Exception);
+    writer.abort();
+}
+
+CYBOZU_TEST_AUTO(wlogDiffPipelineStop)
+{
+    cybozu::util::Random<uint32_t> rand;
+    const FrameV frameV = makeFrames(100, false, rand);
+    size_t n = 0;
+    cybozu::TmpFile tmpFile(".");
+    IndexedDiffWriter writer;
+    writer.setFd(tmpFile.fd());
+    DiffFileHeader header;
+    writer.writeHeader(header);
+    CYBOZU_TEST_ASSERT(!recvWlogAndWriteDiffInPipeline(
+                           makeSource(frameV, false), writer, pbs, salt,
+                           false, 2, [&]() { return ++n > 10; }));
+    writer.abort();
+}
+
+void verifyWlogTransferOptEqual(const WlogTransferOpt &a, const WlogTransferOpt &b)
+{
+    CYBOZU_TEST_EQUAL(int(a.cmprType), int(b.cmprType));
+    CYBOZU_TEST_EQUAL(int(a.cmprLevel), int(b.cmprLevel));
+    CYBOZU_TEST_EQUAL(a.batchKb, b.batchKb);
+    CYBOZU_TEST_EQUAL(a.maxChunks, b.maxChunks);
+    CYBOZU_TEST_EQUAL(a.isOffload, b.isOffload);
+}
+
+CYBOZU_TEST_AUTO(wlogTransferOpt)
+{
+    WlogTransferOpt opt;
+    opt.cmprType = ::WALB_DIFF_CMPR_ZSTD;
+    opt.cmprLevel = 3;
+    opt.batchKb = 256;
+    opt.maxChunks = 4;
+    opt.isOffload = true;
+    opt.maxDedupNr = 1000;
+    const uint64_t next = 12345; // a field following the options.
+
+    /*
+     * Version 1 peers exchange no options,
+     * so old storages and proxies talk with new ones as before.
+     */
+    std::string s;
+    {
+        cybozu::StringOutputStream os(s);
+        opt.saveRequest(os, 1);
+        opt.saveReply(os, 1);
+        CYBOZU_TEST_ASSERT(s.empty());
+        cybozu::save(os, next);
+    }
+    {
+        cybozu::StringInputStream is(s);
+        WlogTransferOpt req = opt, rep = opt;
+        req.loadRequest(is, 1);
+        rep.loadReply(is, 1);
+        verifyWlogTransferOptEqual(req, WlogTransferOpt());
+        verifyWlogTransferOptEqual(rep, WlogTransferOpt());
+        CYBOZU_TEST_EQUAL(int(req.cmprType), ::WALB_DIFF_CMPR_SNAPPY);
+        CYBOZU_TEST_EQUAL(req.batchKb, 0u);
+        CYBOZU_TEST_EQUAL(req.maxChunks, 1u);
+        CYBOZU_TEST_ASSERT(!req.isOffload);
+        CYBOZU_TEST_EQUAL(rep.maxDedupNr, 0u);
+        uint64_t v;
+        cybozu::load(v, is);
+        CYBOZU_TEST_EQUAL(v, next);
+    }
+
+    /* Version 2 peers exchange them. */
+    s.clear();
+    {
+        cybozu::StringOutputStream os(s);
+        opt.saveRequest(os, 2);
+        opt.saveReply(os, 2);
+        cybozu::save(os, next);
+    }
+    {
+        cybozu::StringInputStream is(s);
+        WlogTransferOpt req, rep;
+        req.loadRequest(is, 2);
+        rep.loadReply(is, 2);
+        verifyWlogTransferOptEqual(req, opt);
+        verifyWlogTransferOptEqual(rep, opt);
+        CYBOZU_TEST_EQUAL(req.maxDedupNr, 0u);
+        CYBOZU_TEST_EQUAL(rep.maxDedupNr, opt.maxDedupNr);
+        uint64_t v;
+        cybozu::load(v, is);
+        CYBOZU_TEST_EQUAL(v, next);
+    }
+}
@@ -3,6 +3,9 @@
 #include "wdiff_data.hpp"
 #include "file_path.hpp"
 #include "for_test.hpp"
+#include "walb_diff_file.hpp"
+#include "zstd_dict.hpp"
+#include "cybozu/xorshift.hpp"
 
 CYBOZU_TEST_AUTO(consolidate)
 {
@@ -109,3 +112,100 @@ CYBOZU_TEST_AUTO(notCongiguous)
     std::vector<walb::MetaDiff> v3 = diffFiles.getDiffListToSend(1, SIZE_MAX);
     CYBOZU_TEST_EQUAL(v3.size(), 0);
 }
+
+walb::ZstdDictPtr trainZstdDictOnce(cybozu::XorShift &rand)
+{
+    std::vector<std::string> phraseV(256);
+    for (std::string &phrase : phraseV) {
+        phrase.resize(48);
+        for (char &c : phrase) c = rand() % 256;
+    }
+    walb::ZstdDictTrainer trainer(16 * 1024);
+    while (!trainer.isFull()) {
+        std::string s;
+        while (s.size() < 4096) {
+            s += phraseV[rand() % phraseV.size()];
+            s += char(rand() % 256);
+        }
+        s.resize(4096);
+        trainer.add(s.data(), s.size());
+    }
+    return trainer.train();
+}
+
+/*
+ * Training may fail depending on the samples, so retry it.
+ */
+walb::ZstdDictPtr trainZstdDict(cybozu::XorShift &rand)
+{
+    walb::ZstdDictPtr dict;
+    for (size_t i = 0; i < 10 && !dict; i++) {
+        dict = trainZstdDictOnce(rand);
+    }
+    return dict;
+}
+
+void createDiffFileWithDict(const walb::WalbDiffFiles &diffFiles, walb::MetaDiff &diff, uint32_t dictId)
+{
+    cybozu::FilePath fp = diffFiles.dirPath()
+        + cybozu::FilePath(walb::createDiffFileName(diff));
+    cybozu::util::File file(fp.str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    walb::writeDiffFileHeader(file, cybozu::Uuid(), dictId);
+    walb::writeDiffEofPack(file);
+    file.close();
+}
+
+CYBOZU_TEST_AUTO(gcZstdDicts)
+{
+    cybozu::FilePath fp("test_wdiff_files_dir2");
+    TestDirectory testDir(fp.str(), true);
+    cybozu::XorShift rand;
+
+    walb::MetaDiffManager mgr;
+    walb::WalbDiffFiles diffFiles(mgr, fp.str());
+    walb::MetaDiff diff;
+
+    // Retrain twice. The wdiffs before retraining do not use dictionaries.
+    setDiff(diff, 0, 1, false); diffFiles.add(diff); createDiffFileWithDict(diffFiles, diff, 0);
+    const walb::ZstdDictPtr dict0 = trainZstdDict(rand);
+    const walb::ZstdDictPtr dict1 = trainZstdDict(rand);
+    CYBOZU_TEST_ASSERT(dict0 && dict1);
+    if (!dict0 || !dict1) return;
+    CYBOZU_TEST_ASSERT(dict0->getId() != dict1->getId());
+    const uint32_t id0 = dict0->getId(), id1 = dict1->getId();
+    for (const walb::ZstdDictPtr &dict : {dict0, dict1}) {
+        walb::getZstdDictRegistry().add(dict);
+        walb::saveZstdDict(fp.str(), *dict);
+    }
+    setDiff(diff, 1, 2, false); diffFiles.add(diff); createDiffFileWithDict(diffFiles, diff, id0);
+    setDiff(diff, 2, 3, false); diffFiles.add(diff); createDiffFileWithDict(diffFiles, diff, id0);
+    setDiff(diff, 3, 4, false); diffFiles.add(diff); createDiffFileWithDict(diffFiles, diff, id1);
+
+    // All the dictionaries are in use.
+    CYBOZU_TEST_ASSERT(diffFiles.gcZstdDicts().empty());
+    CYBOZU_TEST_ASSERT(walb::existsZstdDict(fp.str(), id0));
+    CYBOZU_TEST_ASSERT(walb::existsZstdDict(fp.str(), id1));
+
+    // Apply the old wdiffs.
+    diffFiles.removeBeforeGid(3);
+
+    // Dictionaries being received are kept.
+    CYBOZU_TEST_ASSERT(diffFiles.gcZstdDicts({id0}).empty());
+    CYBOZU_TEST_ASSERT(walb::existsZstdDict(fp.str(), id0));
+
+    const std::vector<uint32_t> idV = diffFiles.gcZstdDicts();
+    CYBOZU_TEST_EQUAL(idV.size(), 1);
+    CYBOZU_TEST_EQUAL(idV[0], id0);
+    CYBOZU_TEST_ASSERT(!walb::existsZstdDict(fp.str(), id0));
+    CYBOZU_TEST_ASSERT(walb::existsZstdDict(fp.str(), id1));
+    CYBOZU_TEST_EQUAL(walb::loadZstdDicts(fp.str()).size(), 1);
+
+    walb::getZstdDictRegistry().remove(id0);
+    CYBOZU_TEST_ASSERT(!walb::getZstdDictRegistry().get(id0));
+    CYBOZU_TEST_EQUAL(walb::getZstdDictRegistry().get(id1), dict1);
+    CYBOZU_TEST_ASSERT(dict0->data().size() > 0); // holders can still use it.
+
+    diffFiles.removeBeforeGid(4);
+    CYBOZU_TEST_EQUAL(diffFiles.gcZstdDicts().size(), 1);
+    CYBOZU_TEST_ASSERT(!walb::existsZstdDict(fp.str(), id1));
+}